@@ -0,0 +1,135 @@
+/*
+ * autoupdater_status - Shows the state of every updater on this host
+ *
+ * Reads the shared-memory status boards published by updaters that called
+ * enable_status_board(). Nothing is sent to the updating processes.
+ *
+ * Usage:
+ *   autoupdater_status [--watch SECONDS] [--clean]
+ *
+ *   --watch    Redraw every SECONDS until interrupted
+ *   --clean    Remove segments left behind by processes that no longer exist
+ */
+
+#include "includes/StatusBoard.cpp"
+
+#include <thread>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+
+static void print_usage()
+{
+    cerr << "Usage: autoupdater_status [--watch SECONDS] [--clean]" << endl;
+}
+
+static string format_bytes(int64_t bytes)
+{
+    ostringstream out;
+    out << fixed << setprecision(1);
+    if (bytes >= 1 << 30) out << bytes / double(1 << 30) << "G";
+    else if (bytes >= 1 << 20) out << bytes / double(1 << 20) << "M";
+    else if (bytes >= 1 << 10) out << bytes / double(1 << 10) << "K";
+    else out << bytes << "B";
+    return out.str();
+}
+
+static string format_age(int64_t unix_seconds)
+{
+    if (unix_seconds == 0)
+    {
+        return "never";
+    }
+    int64_t now = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+    int64_t age = max<int64_t>(0, now - unix_seconds);
+    if (age < 120) return to_string(age) + "s ago";
+    if (age < 7200) return to_string(age / 60) + "m ago";
+    return to_string(age / 3600) + "h ago";
+}
+
+static void print_statuses(const vector<UpdateStatus>& statuses)
+{
+    cout << left
+         << setw(8) << "PID" << setw(28) << "REPOSITORY" << setw(13) << "PHASE"
+         << setw(20) << "PROGRESS" << setw(11) << "RATE" << setw(12) << "CHECKED"
+         << setw(14) << "LATEST" << "LAST ERROR" << endl;
+
+    for (const UpdateStatus& status : statuses)
+    {
+        string progress = "-";
+        if (status.bytes_total > 0)
+        {
+            progress = format_bytes(status.bytes_downloaded) + "/" + format_bytes(status.bytes_total) +
+                " " + to_string(status.bytes_downloaded * 100 / status.bytes_total) + "%";
+        }
+        string rate = status.bytes_per_second > 0 ? format_bytes(static_cast<int64_t>(status.bytes_per_second)) + "/s" : "-";
+        string pid = to_string(status.pid) + (status.alive ? "" : "*");
+
+        cout << setw(8) << pid << setw(28) << status.repository << setw(13) << phase_name(status.phase)
+             << setw(20) << progress << setw(11) << rate << setw(12) << format_age(status.last_check)
+             << setw(14) << (status.latest_tag.empty() ? "-" : status.latest_tag)
+             << status.last_error << endl;
+    }
+
+    if (any_of(statuses.begin(), statuses.end(), [](const UpdateStatus& status) { return !status.alive; }))
+    {
+        cout << "* process no longer running (remove with --clean)" << endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    long watch_seconds = 0;
+    bool clean = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--clean") clean = true;
+        else if (arg == "--watch" && i + 1 < argc) watch_seconds = stol(argv[++i]);
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (clean)
+    {
+        for (const UpdateStatus& status : StatusBoard::read_all())
+        {
+            if (!status.alive && StatusBoard::remove(status.segment))
+            {
+                cout << "Removed " << status.segment << " (pid " << status.pid << ")" << endl;
+            }
+        }
+        return 0;
+    }
+
+    do
+    {
+        vector<UpdateStatus> statuses = StatusBoard::read_all();
+        sort(statuses.begin(), statuses.end(), [](const UpdateStatus& a, const UpdateStatus& b)
+        {
+            return a.pid != b.pid ? a.pid < b.pid : a.segment < b.segment;
+        });
+
+        if (watch_seconds > 0)
+        {
+            cout << "\033[H\033[2J";
+        }
+        if (statuses.empty())
+        {
+            cout << "No updaters are publishing status" << endl;
+        }
+        else
+        {
+            print_statuses(statuses);
+        }
+        this_thread::sleep_for(chrono::seconds(watch_seconds));
+    } while (watch_seconds > 0);
+
+    return 0;
+}
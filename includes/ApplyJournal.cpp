@@ -0,0 +1,561 @@
+/*
+ * ApplyJournal - Crash-consistent replacement of the installed executable
+ *
+ * Features:
+ * - Write-ahead journal beside the executable, one checksummed record per step
+ * - The executable is never removed: the new file is prepared beside it and renamed over it
+ * - fsync ordering on the files and their directory, batched where a crash is harmless
+ * - Recovery that completes or rolls back an interrupted apply, one stat() when there is none
+ * - Apply at process exit: only the final rename and an fsync run on the exit path
+ * - A prepared journal can also be left for the next start (see StartupApply)
+ * - Backup and copied-from staging file are dropped from the page cache once synced
+ * - Copies stay in the kernel with copy_file_range(), also from an in-memory stage (see MemoryStage)
+ *
+ * Steps: "begin" (journal durable) -> backup and new file written and synced
+ * -> "prepared" -> rename over the executable -> journal removed. Recovery
+ * rolls back before "prepared" and completes after it. Linux/macOS only.
+ */
+
+#pragma once
+
+#include "UpdatePlanner.cpp"
+#include "InstallWatcher.cpp"
+#include "PageCache.cpp"
+#include "MemoryStage.cpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <atomic>
+#include <memory>
+#include <filesystem>
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+enum class RecoveryAction
+{
+    None,           // No interrupted apply (or one is still running)
+    RolledBack,     // The previous executable stays installed
+    Completed       // The new executable is installed
+};
+
+class ApplyJournal
+{
+    public:
+        /*
+        * @param executable: Installed path of the executable to replace
+        */
+        explicit ApplyJournal(const string& executable)
+            : executable(executable)
+        {
+            fs::path path(executable);
+            string name = path.filename().string();
+            directory = path.parent_path().string();
+            journal_path = (path.parent_path() / ("." + name + ".autoupdater-journal")).string();
+            backup_path = (path.parent_path() / ("." + name + ".autoupdater-backup")).string();
+            incoming_path = (path.parent_path() / ("." + name + ".autoupdater-new")).string();
+        }
+
+        ~ApplyJournal()
+        {
+            #ifndef _WIN32
+            if (journal_fd >= 0)
+            {
+                close(journal_fd);
+            }
+            if (directory_fd >= 0)
+            {
+                close(directory_fd);
+            }
+            #endif
+        }
+
+        ApplyJournal(const ApplyJournal&) = delete;
+        ApplyJournal& operator=(const ApplyJournal&) = delete;
+
+        const string& backup() const
+        {
+            return backup_path;
+        }
+
+        /*
+        * Replaces the executable with a verified file
+        *
+        * @param staged: Verified new executable, moved if on the same filesystem, copied otherwise
+        * @param tag: Release tag, recorded on the new file before it is installed
+        * @param digest: SHA-256 of the new file (for recovery to report)
+        * @param error: Set on failure
+        *
+        * On failure the previous executable is still installed
+        */
+        bool install(const string& staged, const string& tag, const string& digest, string& error)
+        {
+            return prepare(staged, tag, digest, error) && commit(error);
+        }
+
+        /*
+        * Does everything but the final rename: journal, backup, and the new file synced beside the executable
+        *
+        * Parameters as for install(). From here on, recovery completes the update
+        */
+        bool prepare(const string& staged, const string& tag, const string& digest, string& error)
+        {
+            #ifdef _WIN32
+            error = "not supported on Windows";
+            return false;
+            #else
+            error_code ec;
+            uint64_t size = fs::file_size(staged, ec);
+            if (ec)
+            {
+                error = "cannot read " + staged;
+                return false;
+            }
+            if (!begin(tag, digest, size, error))
+            {
+                return false;
+            }
+
+            // Backup and new file, both beside the executable so renames stay atomic
+            bool prepared = (reflink_file(executable, backup_path) || copy_contents(executable, backup_path)) &&
+                sync_file(backup_path);
+            if (!prepared)
+            {
+                error = "cannot back up " + executable;
+            }
+            else
+            {
+                // Only read again by a rollback
+                PageCache::evict(backup_path);
+                if (rename(staged.c_str(), incoming_path.c_str()) != 0)
+                {
+                    // Staged on another filesystem: the copy is all that is read again
+                    prepared = copy_contents(staged, incoming_path);
+                    PageCache::evict(staged);
+                }
+                if (!prepared)
+                {
+                    error = "cannot copy " + staged + " next to " + executable;
+                }
+                else if (!sync_file(incoming_path))
+                {
+                    error = "cannot sync " + incoming_path;
+                    prepared = false;
+                }
+            }
+            if (prepared)
+            {
+                chmod(incoming_path.c_str(), 0755);
+                InstallWatcher::tag_executable(incoming_path, tag);
+                prepared = sync_directory(directory) && append("prepared");
+                if (!prepared)
+                {
+                    error = "cannot sync " + directory;
+                }
+            }
+            if (!prepared)
+            {
+                roll_back();
+            }
+            return prepared;
+            #endif
+        }
+
+        // Renames the prepared file over the executable
+        bool commit(string& error)
+        {
+            #ifdef _WIN32
+            error = "not supported on Windows";
+            return false;
+            #else
+            if (rename(incoming_path.c_str(), executable.c_str()) != 0)
+            {
+                error = string("cannot rename over ") + executable + ": " + strerror(errno);
+                roll_back();
+                return false;
+            }
+            sync_directory(directory);
+            finish();
+            return true;
+            #endif
+        }
+
+        // Rolls back a prepared journal instead of committing it
+        void cancel()
+        {
+            #ifndef _WIN32
+            if (journal_fd >= 0)
+            {
+                roll_back();
+            }
+            #endif
+        }
+
+        /*
+        * Commits a prepared journal when the process exits
+        *
+        * Runs from atexit(), and from SIGINT, SIGTERM and SIGHUP where they still
+        * have their default action. Either way the exit path only does a rename,
+        * an fsync of the pre-opened directory and a few unlinks, all of which are
+        * async-signal-safe. If the process dies otherwise, the next startup's
+        * recovery completes the update. Replaces (and rolls back) a pending one.
+        * Forked children inherit the handlers but never commit: only this process does
+        */
+        static void commit_at_exit(unique_ptr<ApplyJournal> journal)
+        {
+            #ifndef _WIN32
+            journal->directory_fd = open(journal->directory.empty() ? "." : journal->directory.c_str(),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            journal->exit_owner = getpid();
+            cancel_commit_at_exit();
+            pending_exit.store(journal.release());
+
+            static bool registered = false;
+            if (!registered)
+            {
+                registered = true;
+                atexit(commit_pending);
+                for (int signal_number : { SIGINT, SIGTERM, SIGHUP })
+                {
+                    struct sigaction current;
+                    if (sigaction(signal_number, nullptr, &current) == 0 && current.sa_handler == SIG_DFL)
+                    {
+                        struct sigaction action = {};
+                        action.sa_handler = commit_on_signal;
+                        action.sa_flags = SA_RESETHAND;
+                        sigemptyset(&action.sa_mask);
+                        sigaction(signal_number, &action, nullptr);
+                    }
+                }
+            }
+            #else
+            (void)journal;
+            #endif
+        }
+
+        // Rolls back a commit waiting for the process to exit. Returns false if there was none
+        static bool cancel_commit_at_exit()
+        {
+            #ifndef _WIN32
+            ApplyJournal* journal = pending_exit.exchange(nullptr);
+            if (journal)
+            {
+                journal->roll_back();
+                delete journal;
+                return true;
+            }
+            #endif
+            return false;
+        }
+
+        /*
+        * Completes or rolls back an apply that was interrupted by a crash
+        *
+        * @param tag: Set to the release tag of the interrupted apply
+        * @param digest: Set to the SHA-256 of the new file when completed
+        *
+        * Meant for every startup: without a journal this is a single failed open()
+        */
+        RecoveryAction recover(string& tag, string& digest)
+        {
+            #ifdef _WIN32
+            (void)tag;
+            (void)digest;
+            return RecoveryAction::None;
+            #else
+            journal_fd = open(journal_path.c_str(), O_RDWR | O_CLOEXEC);
+            if (journal_fd < 0)
+            {
+                return RecoveryAction::None;
+            }
+            // Held by an apply that is still running
+            if (flock(journal_fd, LOCK_EX | LOCK_NB) != 0)
+            {
+                close(journal_fd);
+                journal_fd = -1;
+                return RecoveryAction::None;
+            }
+
+            vector<vector<string>> records = read_records();
+            uint64_t size = 0;
+            bool prepared = false;
+            for (const vector<string>& record : records)
+            {
+                if (record.empty())
+                {
+                    continue;
+                }
+                if (record[0] == "begin" && record.size() == 4)
+                {
+                    tag = record[1];
+                    digest = record[2];
+                    size = strtoull(record[3].c_str(), nullptr, 10);
+                }
+                prepared = prepared || record[0] == "prepared";
+            }
+
+            struct stat info;
+            bool installed = stat(executable.c_str(), &info) == 0;
+            if (prepared && access(incoming_path.c_str(), F_OK) == 0)
+            {
+                // Crashed between "prepared" and the rename: the new file is complete and synced
+                prepared = rename(incoming_path.c_str(), executable.c_str()) == 0;
+                installed = installed || prepared;
+            }
+            else if (prepared && installed && static_cast<uint64_t>(info.st_size) != size)
+            {
+                prepared = false;
+            }
+
+            if (!installed && access(backup_path.c_str(), F_OK) == 0)
+            {
+                rename(backup_path.c_str(), executable.c_str());
+                prepared = false;
+            }
+            if (prepared)
+            {
+                sync_directory(directory);
+                finish();
+                return RecoveryAction::Completed;
+            }
+            digest.clear();
+            roll_back();
+            return RecoveryAction::RolledBack;
+            #endif
+        }
+
+    private:
+        string executable;
+        string directory;
+        string journal_path;
+        string backup_path;
+        string incoming_path;
+        int journal_fd = -1;
+        int directory_fd = -1;
+        #ifndef _WIN32
+        pid_t exit_owner = 0;           // Process that registered the commit at exit
+        #endif
+
+        // Prepared journal to commit at exit, never freed once the handlers may run
+        static inline atomic<ApplyJournal*> pending_exit{ nullptr };
+
+        #ifndef _WIN32
+        static void commit_pending()
+        {
+            // A forked child (e.g. a helper that exits before exec) must not install the parent's update
+            ApplyJournal* journal = pending_exit.load();
+            if (!journal || journal->exit_owner != getpid())
+            {
+                return;
+            }
+            journal = pending_exit.exchange(nullptr);
+            if (journal && rename(journal->incoming_path.c_str(), journal->executable.c_str()) == 0)
+            {
+                if (journal->directory_fd >= 0)
+                {
+                    fsync(journal->directory_fd);
+                }
+                journal->finish();
+            }
+        }
+
+        static void commit_on_signal(int signal_number)
+        {
+            int saved_errno = errno;
+            commit_pending();
+            errno = saved_errno;
+
+            // The handler was reset to the default action: terminate as the signal intended
+            raise(signal_number);
+        }
+
+        /*
+        * Creates the journal with its "begin" record and makes it durable
+        *
+        * The journal is written under a temporary name, locked, then linked into
+        * place: recovery never sees a journal without a record, and link() fails
+        * if another apply is running
+        */
+        bool begin(const string& tag, const string& digest, uint64_t size, string& error)
+        {
+            string temporary = journal_path + "." + to_string(getpid());
+            journal_fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (journal_fd < 0)
+            {
+                error = string("cannot create journal: ") + strerror(errno);
+                return false;
+            }
+            flock(journal_fd, LOCK_EX);
+            bool ok = append("begin\t" + tag + "\t" + digest + "\t" + to_string(size)) &&
+                link(temporary.c_str(), journal_path.c_str()) == 0;
+            int link_error = errno;
+            unlink(temporary.c_str());
+            if (!ok)
+            {
+                error = link_error == EEXIST
+                    ? "another update is being applied, or an interrupted one needs recovery"
+                    : string("cannot create journal: ") + strerror(link_error);
+                close(journal_fd);
+                journal_fd = -1;
+                return false;
+            }
+
+            // Leftovers of an apply that was rolled back without a journal
+            unlink(incoming_path.c_str());
+            unlink(backup_path.c_str());
+            return sync_directory(directory);
+        }
+
+        // Appends one record ("<fields>\t<crc32>") and waits until it is on disk
+        bool append(const string& record)
+        {
+            char checksum[16];
+            snprintf(checksum, sizeof(checksum), "%08lx",
+                crc32(0, reinterpret_cast<const Bytef*>(record.data()), static_cast<uInt>(record.size())));
+            string line = record + "\t" + checksum + "\n";
+            return write(journal_fd, line.data(), line.size()) == static_cast<ssize_t>(line.size()) &&
+                sync_descriptor(journal_fd);
+        }
+
+        // Records with a valid checksum, up to the first torn or corrupt one
+        vector<vector<string>> read_records()
+        {
+            string data;
+            char buffer[4096];
+            ssize_t n;
+            lseek(journal_fd, 0, SEEK_SET);
+            while ((n = read(journal_fd, buffer, sizeof(buffer))) > 0)
+            {
+                data.append(buffer, static_cast<size_t>(n));
+            }
+
+            vector<vector<string>> records;
+            istringstream lines(data);
+            string line;
+            while (getline(lines, line) && !lines.eof())
+            {
+                size_t tab = line.rfind('\t');
+                if (tab == string::npos)
+                {
+                    break;
+                }
+                char checksum[16];
+                snprintf(checksum, sizeof(checksum), "%08lx",
+                    crc32(0, reinterpret_cast<const Bytef*>(line.data()), static_cast<uInt>(tab)));
+                if (line.compare(tab + 1, string::npos, checksum) != 0)
+                {
+                    break;
+                }
+                vector<string> fields;
+                istringstream parts(line.substr(0, tab));
+                string field;
+                while (getline(parts, field, '\t'))
+                {
+                    fields.push_back(field);
+                }
+                records.push_back(fields);
+            }
+            return records;
+        }
+
+        // Removes the journal, the backup is no longer needed. No sync: replaying a finished journal is harmless
+        void finish()
+        {
+            unlink(backup_path.c_str());
+            unlink(incoming_path.c_str());
+            unlink(journal_path.c_str());
+            close(journal_fd);
+            journal_fd = -1;
+        }
+
+        void roll_back()
+        {
+            unlink(incoming_path.c_str());
+            unlink(backup_path.c_str());
+            sync_directory(directory);
+            unlink(journal_path.c_str());
+            close(journal_fd);
+            journal_fd = -1;
+        }
+
+        // Copies a file with its permissions, which the backup of an executable needs
+        static bool copy_contents(const string& source, const string& destination)
+        {
+            #ifdef __linux__
+            int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat info;
+            if (in >= 0 && fstat(in, &info) == 0)
+            {
+                int out = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, info.st_mode & 07777);
+                bool copied = out >= 0 && MemoryStage::copy_fd(in, out, static_cast<uint64_t>(info.st_size)) &&
+                    fchmod(out, info.st_mode & 07777) == 0;
+                if (out >= 0)
+                {
+                    close(out);
+                }
+                close(in);
+                return copied;
+            }
+            if (in >= 0)
+            {
+                close(in);
+            }
+            #endif
+            error_code ec;
+            fs::copy_file(source, destination, fs::copy_options::overwrite_existing, ec);
+            return !ec;
+        }
+
+        static bool sync_file(const string& path)
+        {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                return false;
+            }
+            bool ok = sync_descriptor(fd);
+            close(fd);
+            return ok;
+        }
+
+        // Waits until a file's data is on the storage. macOS's fsync() stops at the drive's cache, F_FULLFSYNC flushes it
+        static bool sync_descriptor(int fd)
+        {
+            #ifdef __APPLE__
+            if (fcntl(fd, F_FULLFSYNC) == 0)
+            {
+                return true;
+            }
+            #endif
+            return fsync(fd) == 0;
+        }
+
+        // Makes creations, renames and removals in a directory durable
+        static bool sync_directory(const string& path)
+        {
+            int fd = open(path.empty() ? "." : path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                return false;
+            }
+            bool ok = fsync(fd) == 0;
+            close(fd);
+            return ok;
+        }
+        #endif
+};
@@ -0,0 +1,308 @@
+/*
+ * ApplyScheduler - Defers applying updates until the host is quiet
+ *
+ * Features:
+ * - Reads CPU and IO pressure stall information (/proc/pressure/cpu, /proc/pressure/io)
+ * - Consults an application load probe (e.g. in-flight requests)
+ * - Restricts applies to cron-style maintenance windows
+ * - Forces the apply after a maximum deferral, but never during a load peak
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ctime>
+#include <thread>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <stdexcept>
+
+
+using namespace std;
+
+/*
+* Recurring window in cron syntax: "minute hour day-of-month month day-of-week"
+*
+* Fields accept "*", numbers, ranges ("1-5"), lists ("1,3") and steps ("*\/15").
+* The window opens at every matching minute (local time) and stays open for duration.
+* Example: MaintenanceWindow("0 2 * * 1-5", chrono::hours(2)) is 02:00-04:00 on weekdays
+*/
+class MaintenanceWindow
+{
+    public:
+        MaintenanceWindow(const string& cron_expression, chrono::minutes duration)
+            : duration(duration)
+        {
+            istringstream fields(cron_expression);
+            string field;
+            const int ranges[5][2] = { {0, 59}, {0, 23}, {1, 31}, {1, 12}, {0, 7} };
+            for (int i = 0; i < 5; i++)
+            {
+                if (!(fields >> field))
+                {
+                    throw invalid_argument("Cron expression needs 5 fields: " + cron_expression);
+                }
+                allowed[i] = parse_field(field, ranges[i][0], ranges[i][1]);
+            }
+            // Sunday is both 0 and 7
+            if (allowed[4][7])
+            {
+                allowed[4][0] = true;
+            }
+        }
+
+        // True if some window start within the last duration covers the given time
+        bool contains(chrono::system_clock::time_point time) const
+        {
+            auto start = chrono::time_point_cast<chrono::minutes>(time);
+            for (chrono::minutes back{0}; back < max(duration, chrono::minutes(1)); back++)
+            {
+                if (matches(start - back))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        chrono::minutes duration;
+        vector<bool> allowed[5];
+
+        static vector<bool> parse_field(const string& field, int low, int high)
+        {
+            vector<bool> values(high + 1, false);
+            istringstream parts(field);
+            string part;
+            while (getline(parts, part, ','))
+            {
+                int step = 1;
+                size_t slash = part.find('/');
+                if (slash != string::npos)
+                {
+                    step = stoi(part.substr(slash + 1));
+                    part = part.substr(0, slash);
+                }
+
+                int first = low, last = high;
+                if (part != "*")
+                {
+                    size_t dash = part.find('-');
+                    first = stoi(part.substr(0, dash));
+                    last = dash == string::npos ? (slash == string::npos ? first : high) : stoi(part.substr(dash + 1));
+                }
+                if (first < low || last > high || first > last || step < 1)
+                {
+                    throw invalid_argument("Cron field out of range: " + field);
+                }
+                for (int value = first; value <= last; value += step)
+                {
+                    values[value] = true;
+                }
+            }
+            return values;
+        }
+
+        bool matches(chrono::system_clock::time_point time) const
+        {
+            time_t seconds = chrono::system_clock::to_time_t(time);
+            tm local;
+            #ifdef _WIN32
+            localtime_s(&local, &seconds);
+            #else
+            localtime_r(&seconds, &local);
+            #endif
+            return allowed[0][local.tm_min] && allowed[1][local.tm_hour] && allowed[2][local.tm_mday] &&
+                allowed[3][local.tm_mon + 1] && allowed[4][local.tm_wday];
+        }
+};
+
+/*
+* When an update may be applied
+*
+* Pressure values are PSI "some avg10" percentages: the share of the last 10
+* seconds in which at least one task was stalled on CPU or IO.
+*/
+struct ApplyPolicy
+{
+    // Quiet: every input below these for quiet_period
+    double max_cpu_pressure = 10.0;
+    double max_io_pressure = 10.0;
+    double max_load = 0;                    // Limit for load_probe
+    chrono::seconds quiet_period{60};
+
+    // Peak: above any of these the apply never happens, not even after max_deferral
+    double peak_cpu_pressure = 40.0;
+    double peak_io_pressure = 40.0;
+    double peak_load = 0;                   // 0 = no peak limit for load_probe
+
+    // Application load signal, e.g. in-flight requests (optional)
+    function<double()> load_probe;
+
+    // Applies only happen inside one of these windows, if any are set
+    vector<MaintenanceWindow> windows;
+
+    // After this long, apply at the first moment that is not a peak
+    chrono::seconds max_deferral{24 * 3600};
+
+    // How often conditions are sampled while waiting
+    chrono::seconds check_interval{5};
+};
+
+// Snapshot of the inputs the scheduler decides on
+struct HostLoad
+{
+    double cpu_pressure = 0;    // -1 if PSI is unavailable
+    double io_pressure = 0;     // -1 if PSI is unavailable
+    double load = 0;            // load_probe result, 0 without a probe
+};
+
+class ApplyScheduler
+{
+    public:
+        explicit ApplyScheduler(const ApplyPolicy& policy)
+            : policy(policy)
+        {
+        }
+
+        // Reads the "some avg10" value of a PSI file. Returns -1 if unavailable
+        static double read_pressure(const string& path)
+        {
+            ifstream file(path);
+            string line;
+            while (getline(file, line))
+            {
+                size_t avg10 = line.find("avg10=");
+                if (line.compare(0, 5, "some ") == 0 && avg10 != string::npos)
+                {
+                    return strtod(line.c_str() + avg10 + 6, nullptr);
+                }
+            }
+            return -1;
+        }
+
+        HostLoad sample() const
+        {
+            HostLoad load;
+            load.cpu_pressure = read_pressure("/proc/pressure/cpu");
+            load.io_pressure = read_pressure("/proc/pressure/io");
+            load.load = policy.load_probe ? policy.load_probe() : 0;
+            return load;
+        }
+
+        bool is_peak(const HostLoad& load) const
+        {
+            return load.cpu_pressure > policy.peak_cpu_pressure ||
+                load.io_pressure > policy.peak_io_pressure ||
+                (policy.load_probe && policy.peak_load > 0 && load.load > policy.peak_load);
+        }
+
+        bool is_quiet(const HostLoad& load) const
+        {
+            return load.cpu_pressure <= policy.max_cpu_pressure &&
+                load.io_pressure <= policy.max_io_pressure &&
+                (!policy.load_probe || load.load <= policy.max_load);
+        }
+
+        bool in_window(chrono::system_clock::time_point now) const
+        {
+            if (policy.windows.empty())
+            {
+                return true;
+            }
+            for (const MaintenanceWindow& window : policy.windows)
+            {
+                if (window.contains(now))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /*
+        * Blocks until the update may be applied
+        *
+        * @param deferred_since: When the update became ready, for the max_deferral deadline
+        * @param cancelled: Polled between samples, return true to stop waiting
+        * @param on_wait: Called with the reason whenever the apply is deferred
+        *
+        * Returns false if cancelled
+        */
+        bool wait(chrono::steady_clock::time_point deferred_since,
+                function<bool()> cancelled,
+                function<void(const string&)> on_wait)
+        {
+            auto quiet_since = chrono::steady_clock::time_point::max();
+            string last_state;
+            while (!cancelled || !cancelled())
+            {
+                auto now = chrono::steady_clock::now();
+                HostLoad load = sample();
+                bool overdue = now - deferred_since >= policy.max_deferral;
+
+                string reason;
+                if (is_peak(load))
+                {
+                    reason = "host is at a load peak (" + describe(load) + ")";
+                    quiet_since = chrono::steady_clock::time_point::max();
+                }
+                else if (overdue)
+                {
+                    return true;
+                }
+                else if (!in_window(chrono::system_clock::now()))
+                {
+                    reason = "outside maintenance windows";
+                    // The quiet period has to pass inside a window, not straddle its opening
+                    quiet_since = chrono::steady_clock::time_point::max();
+                }
+                else if (!is_quiet(load))
+                {
+                    reason = "host is busy (" + describe(load) + ")";
+                    quiet_since = chrono::steady_clock::time_point::max();
+                }
+                else
+                {
+                    quiet_since = min(quiet_since, now);
+                    if (now - quiet_since >= policy.quiet_period)
+                    {
+                        return true;
+                    }
+                    reason = "waiting for a quiet period";
+                }
+
+                // Report changes of state, not every new sample
+                string state = reason.substr(0, reason.find(" ("));
+                if (on_wait && state != last_state)
+                {
+                    on_wait(reason);
+                }
+                last_state = state;
+
+                // Wake up at the deadline if it comes before the next sample
+                chrono::steady_clock::duration sleep = policy.check_interval;
+                if (!overdue)
+                {
+                    sleep = min(sleep, deferred_since + policy.max_deferral - now);
+                }
+                this_thread::sleep_for(sleep);
+            }
+            return false;
+        }
+
+    private:
+        ApplyPolicy policy;
+
+        static string describe(const HostLoad& load)
+        {
+            ostringstream text;
+            text.precision(3);
+            text << "cpu " << load.cpu_pressure << "%, io " << load.io_pressure << "%, load " << load.load;
+            return text.str();
+        }
+};
@@ -0,0 +1,1543 @@
+/*
+ * ArchiveStream - Extracts release archives while they download
+ *
+ * Features:
+ * - tar, tar.gz and zip with zlib; tar.zst when built with AUTOUPDATER_WITH_ZSTD
+ * - Entries are written into the staging tree as the bytes arrive, the archive never touches the disk
+ * - Entries identical to the installed file are never written: the install links the installed one
+ * - Extraction runs on its own thread behind a bounded queue, overlapping the download
+ *
+ * Memory stays bounded by the queue, one decompression buffer and the
+ * decoder's window, whatever the size of the archive. Entry names are
+ * confined to the staging tree: absolute paths and ".." are rejected, as
+ * are symlinks with such targets and entries below a symlink the archive
+ * created. The staging tree is only walked one component at a time from a
+ * directory descriptor, without following symlinks. gzip and zstd streams
+ * can only be decoded in order, so the parallelism is between download,
+ * decompression and disk.
+ */
+
+#pragma once
+
+#include "UpdatePlanner.cpp"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+#include <zlib.h>
+
+#ifdef AUTOUPDATER_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+enum class ArchiveFormat
+{
+    Unknown,
+    Tar,
+    TarGzip,
+    TarZstd,
+    Zip
+};
+
+// Archive format by file name, Unknown for anything that is not an archive
+inline ArchiveFormat archive_format(const string& name)
+{
+    auto ends_with = [&](const string& suffix)
+    {
+        return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    if (ends_with(".tar.gz") || ends_with(".tgz"))
+    {
+        return ArchiveFormat::TarGzip;
+    }
+    if (ends_with(".tar.zst") || ends_with(".tzst"))
+    {
+        return ArchiveFormat::TarZstd;
+    }
+    if (ends_with(".tar"))
+    {
+        return ArchiveFormat::Tar;
+    }
+    if (ends_with(".zip"))
+    {
+        return ArchiveFormat::Zip;
+    }
+    return ArchiveFormat::Unknown;
+}
+
+struct ExtractionStats
+{
+    size_t files = 0;               // Regular files in the archive
+    size_t unchanged = 0;           // Identical to the installed file, not written
+    uint64_t written_bytes = 0;
+    uint64_t unchanged_bytes = 0;
+};
+
+class ArchiveExtractor
+{
+    public:
+        /*
+        * @param format: Format of the archive
+        * @param destination: Staging tree to extract into, must exist
+        * @param installed: Installed tree that entries are compared with, empty for none
+        * @param strip_components: Leading path components removed from entry names (like tar's option)
+        */
+        ArchiveExtractor(ArchiveFormat format, const string& destination, const string& installed, int strip_components = 0)
+            : format(format),
+            destination(destination),
+            installed(installed),
+            strip_components(strip_components),
+            output(output_size, '\0')
+        {
+            memset(&gzip, 0, sizeof(gzip));
+            memset(&deflate, 0, sizeof(deflate));
+            if (format == ArchiveFormat::TarGzip && inflateInit2(&gzip, 15 + 16) == Z_OK)
+            {
+                gzip_ready = true;
+            }
+            if (format == ArchiveFormat::Zip && inflateInit2(&deflate, -15) == Z_OK)
+            {
+                deflate_ready = true;
+            }
+            #ifdef AUTOUPDATER_WITH_ZSTD
+            if (format == ArchiveFormat::TarZstd)
+            {
+                zstd = ZSTD_createDStream();
+            }
+            #endif
+        }
+
+        ~ArchiveExtractor()
+        {
+            close_files();
+            if (gzip_ready)
+            {
+                inflateEnd(&gzip);
+            }
+            if (deflate_ready)
+            {
+                inflateEnd(&deflate);
+            }
+            #ifdef AUTOUPDATER_WITH_ZSTD
+            if (zstd)
+            {
+                ZSTD_freeDStream(zstd);
+            }
+            #endif
+        }
+
+        ArchiveExtractor(const ArchiveExtractor&) = delete;
+        ArchiveExtractor& operator=(const ArchiveExtractor&) = delete;
+
+        // Consumes the next bytes of the archive. Returns false once extraction failed
+        bool feed(const char* data, size_t size)
+        {
+            if (!error_message.empty())
+            {
+                return false;
+            }
+            switch (format)
+            {
+                case ArchiveFormat::Tar:
+                case ArchiveFormat::Zip:
+                    return parse(data, size);
+                case ArchiveFormat::TarGzip:
+                    return gunzip(data, size);
+                case ArchiveFormat::TarZstd:
+                    return unzstd(data, size);
+                case ArchiveFormat::Unknown:
+                    break;
+            }
+            return fail("unknown archive format");
+        }
+
+        // Called after the last byte: checks that the archive was complete
+        bool finish()
+        {
+            if (!error_message.empty())
+            {
+                return false;
+            }
+            if ((format == ArchiveFormat::TarGzip && !gzip_ended) || (format == ArchiveFormat::TarZstd && !zstd_ended))
+            {
+                return fail("compressed stream is truncated");
+            }
+            bool complete = format == ArchiveFormat::Zip ? zip_state == ZipState::End :
+                (tar_state == TarState::End || (tar_state == TarState::Header && header.empty() && seen_entry));
+            return complete || fail("archive is truncated");
+        }
+
+        const string& error() const
+        {
+            return error_message;
+        }
+
+        const ExtractionStats& stats() const
+        {
+            return counters;
+        }
+
+        // Files written into the staging tree, to be synced before they are installed
+        const vector<string>& written() const
+        {
+            return written_files;
+        }
+
+    private:
+        static constexpr size_t output_size = 128 * 1024;
+        static constexpr size_t compare_size = 64 * 1024;
+        static constexpr uint64_t max_meta_size = 1024 * 1024;     // Pax and long-name records are held in memory
+
+        enum class TarState { Header, Data, Padding, End };
+        enum class TarMeta { None, Pax, LongName, LongLink, Ignore };
+        enum class ZipState { Signature, LocalHeader, LocalVariable, Stored, Deflated, DescriptorStart, Descriptor, CentralHeader, CentralVariable, End };
+
+        // Regular file being extracted
+        struct Entry
+        {
+            string path;                // Relative to the trees
+            int64_t size = -1;          // -1 if only known at the end (zip data descriptors)
+            mode_t mode = 0;            // 0 if the archive has none yet (zip)
+            int fd = -1;                // Staged file, once the content differs from the installed one
+            int installed_fd = -1;      // Installed file while the content still matches
+            uint64_t installed_size = 0;
+            uint64_t offset = 0;
+            bool ignored = false;       // Stripped away by strip_components
+        };
+
+        ArchiveFormat format;
+        string destination;
+        string installed;
+        int strip_components;
+        string error_message;
+        ExtractionStats counters;
+        vector<string> written_files;
+
+        // Decompression
+        string output;
+        z_stream gzip;
+        bool gzip_ready = false;
+        bool gzip_ended = false;
+        bool zstd_ended = false;
+        #ifdef AUTOUPDATER_WITH_ZSTD
+        ZSTD_DStream* zstd = nullptr;
+        #endif
+
+        // Container parsing
+        string header;
+        Entry entry;
+        bool seen_entry = false;
+        TarState tar_state = TarState::Header;
+        TarMeta tar_meta = TarMeta::None;
+        uint64_t remaining = 0;
+        uint64_t padding = 0;
+        string meta;
+        string pending_path;
+        string pending_link;
+        int64_t pending_size = -1;
+
+        ZipState zip_state = ZipState::Signature;
+        z_stream deflate;
+        bool deflate_ready = false;
+        size_t header_size = 0;
+        uint16_t zip_flags = 0;
+        uint16_t zip_method = 0;
+        uint32_t zip_crc = 0;
+        uint32_t running_crc = 0;
+        bool zip64 = false;
+        uint16_t central_version = 0;
+        uint32_t central_attributes = 0;
+        unordered_map<string, bool> zip_entries;    // Path -> written (false: identical to the installed file)
+        unordered_set<string> symlinks;             // Paths of the symlinks created from the archive
+
+        bool fail(const string& message)
+        {
+            if (error_message.empty())
+            {
+                error_message = message;
+            }
+            close_files();
+            return false;
+        }
+
+        void close_files()
+        {
+            #ifndef _WIN32
+            if (entry.fd >= 0)
+            {
+                close(entry.fd);
+                entry.fd = -1;
+            }
+            if (entry.installed_fd >= 0)
+            {
+                close(entry.installed_fd);
+                entry.installed_fd = -1;
+            }
+            #endif
+        }
+
+        // Accumulates header bytes until `want` are there. Returns false while more are needed
+        bool take(const char*& data, size_t& size, size_t want)
+        {
+            size_t n = min(size, want - min(want, header.size()));
+            header.append(data, n);
+            data += n;
+            size -= n;
+            return header.size() >= want;
+        }
+
+        static uint32_t le16(const string& bytes, size_t at)
+        {
+            return static_cast<unsigned char>(bytes[at]) | (static_cast<unsigned char>(bytes[at + 1]) << 8);
+        }
+
+        static uint32_t le32(const string& bytes, size_t at)
+        {
+            return le16(bytes, at) | (le16(bytes, at + 2) << 16);
+        }
+
+        static uint64_t le64(const string& bytes, size_t at)
+        {
+            return le32(bytes, at) | (static_cast<uint64_t>(le32(bytes, at + 4)) << 32);
+        }
+
+        // ---- Decompression ----
+
+        bool gunzip(const char* data, size_t size)
+        {
+            if (!gzip_ready)
+            {
+                return fail("cannot initialize zlib");
+            }
+            gzip.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            gzip.avail_in = static_cast<uInt>(size);
+            do
+            {
+                // Concatenated gzip members form one stream
+                if (gzip_ended)
+                {
+                    if (gzip.avail_in == 0)
+                    {
+                        break;
+                    }
+                    inflateReset(&gzip);
+                    gzip_ended = false;
+                }
+                gzip.next_out = reinterpret_cast<Bytef*>(&output[0]);
+                gzip.avail_out = static_cast<uInt>(output.size());
+                uInt before = gzip.avail_in;
+                int result = inflate(&gzip, Z_NO_FLUSH);
+                if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+                {
+                    return fail("corrupt gzip stream");
+                }
+                size_t produced = output.size() - gzip.avail_out;
+                if (produced > 0 && !parse(output.data(), produced))
+                {
+                    return false;
+                }
+                gzip_ended = result == Z_STREAM_END;
+                if (produced == 0 && gzip.avail_in == before && !gzip_ended)
+                {
+                    break;
+                }
+            } while (gzip.avail_in > 0 || gzip.avail_out == 0);
+            return true;
+        }
+
+        bool unzstd(const char* data, size_t size)
+        {
+            #ifdef AUTOUPDATER_WITH_ZSTD
+            if (!zstd)
+            {
+                return fail("cannot initialize zstd");
+            }
+            ZSTD_inBuffer in = { data, size, 0 };
+            bool full = false;
+            while (in.pos < in.size || full)
+            {
+                ZSTD_outBuffer out = { &output[0], output.size(), 0 };
+                size_t result = ZSTD_decompressStream(zstd, &out, &in);
+                if (ZSTD_isError(result))
+                {
+                    return fail(string("corrupt zstd stream: ") + ZSTD_getErrorName(result));
+                }
+                zstd_ended = result == 0;
+                if (out.pos > 0 && !parse(output.data(), out.pos))
+                {
+                    return false;
+                }
+                full = out.pos == out.size;
+            }
+            return true;
+            #else
+            (void)data;
+            (void)size;
+            return fail("tar.zst needs a build with AUTOUPDATER_WITH_ZSTD (and -lzstd)");
+            #endif
+        }
+
+        bool parse(const char* data, size_t size)
+        {
+            return format == ArchiveFormat::Zip ? parse_zip(data, size) : parse_tar(data, size);
+        }
+
+        // ---- tar (ustar, pax and GNU long names) ----
+
+        bool parse_tar(const char* data, size_t size)
+        {
+            while (size > 0 && error_message.empty())
+            {
+                if (tar_state == TarState::End)
+                {
+                    // Zero blocks and padding after the end marker
+                    return true;
+                }
+                if (tar_state == TarState::Header)
+                {
+                    if (!take(data, size, 512))
+                    {
+                        return true;
+                    }
+                    bool ok = tar_header();
+                    header.clear();
+                    if (!ok)
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+                if (tar_state == TarState::Padding)
+                {
+                    size_t n = static_cast<size_t>(min<uint64_t>(size, padding));
+                    data += n;
+                    size -= n;
+                    padding -= n;
+                    if (padding == 0)
+                    {
+                        tar_state = TarState::Header;
+                    }
+                    continue;
+                }
+
+                size_t n = static_cast<size_t>(min<uint64_t>(size, remaining));
+                if (tar_meta == TarMeta::None)
+                {
+                    if (!entry_data(data, n))
+                    {
+                        return false;
+                    }
+                }
+                else if (tar_meta != TarMeta::Ignore)
+                {
+                    meta.append(data, n);
+                }
+                data += n;
+                size -= n;
+                remaining -= n;
+                if (remaining == 0 && !tar_entry_done())
+                {
+                    return false;
+                }
+            }
+            return error_message.empty();
+        }
+
+        static uint64_t tar_number(const string& block, size_t at, size_t length)
+        {
+            // Base-256 for values that do not fit in octal
+            if (static_cast<unsigned char>(block[at]) & 0x80)
+            {
+                uint64_t value = static_cast<unsigned char>(block[at]) & 0x7f;
+                for (size_t i = 1; i < length; i++)
+                {
+                    value = (value << 8) | static_cast<unsigned char>(block[at + i]);
+                }
+                return value;
+            }
+            uint64_t value = 0;
+            for (size_t i = 0; i < length; i++)
+            {
+                char c = block[at + i];
+                if (c >= '0' && c <= '7')
+                {
+                    value = value * 8 + static_cast<uint64_t>(c - '0');
+                }
+                else if (c != ' ' || value != 0)
+                {
+                    break;
+                }
+            }
+            return value;
+        }
+
+        static string tar_string(const string& block, size_t at, size_t length)
+        {
+            string value = block.substr(at, length);
+            return value.substr(0, value.find('\0'));
+        }
+
+        bool tar_header()
+        {
+            if (all_of(header.begin(), header.end(), [](char c) { return c == '\0'; }))
+            {
+                tar_state = TarState::End;
+                return true;
+            }
+
+            uint64_t sum = 0;
+            for (size_t i = 0; i < 512; i++)
+            {
+                sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+            }
+            if (sum != tar_number(header, 148, 8))
+            {
+                return fail("corrupt tar header");
+            }
+            seen_entry = true;
+
+            string name = tar_string(header, 0, 100);
+            if (header.compare(257, 5, "ustar") == 0 && header[345] != '\0')
+            {
+                name = tar_string(header, 345, 155) + "/" + name;
+            }
+            char type = header[156];
+            mode_t mode = static_cast<mode_t>(tar_number(header, 100, 8) & 07777);
+            uint64_t size = tar_number(header, 124, 12);
+            string link = tar_string(header, 157, 100);
+
+            // Extended headers describe the entry that follows
+            tar_meta = TarMeta::None;
+            if (type == 'x' || type == 'g' || type == 'L' || type == 'K')
+            {
+                tar_meta = type == 'x' ? TarMeta::Pax : type == 'L' ? TarMeta::LongName :
+                    type == 'K' ? TarMeta::LongLink : TarMeta::Ignore;
+                meta.clear();
+                if (tar_meta != TarMeta::Ignore && size > max_meta_size)
+                {
+                    return fail("oversized tar extended header");
+                }
+            }
+            else
+            {
+                if (!pending_path.empty())
+                {
+                    name = pending_path;
+                }
+                if (!pending_link.empty())
+                {
+                    link = pending_link;
+                }
+                if (pending_size >= 0)
+                {
+                    size = static_cast<uint64_t>(pending_size);
+                }
+                pending_path.clear();
+                pending_link.clear();
+                pending_size = -1;
+
+                bool ok = true;
+                if (type == '0' || type == '\0' || type == '7')
+                {
+                    ok = open_entry(name, static_cast<int64_t>(size), mode == 0 ? 0644 : mode);
+                }
+                else
+                {
+                    if (type == '5')
+                    {
+                        ok = make_directory(name, mode);
+                    }
+                    else if (type == '2')
+                    {
+                        ok = make_symlink(name, link);
+                    }
+                    else if (type == '1')
+                    {
+                        ok = make_hard_link(name, link);
+                    }
+                    // Devices, FIFOs and anything else carry no file
+                    tar_meta = TarMeta::Ignore;
+                }
+                if (!ok)
+                {
+                    return false;
+                }
+            }
+
+            remaining = size;
+            padding = (512 - size % 512) % 512;
+            tar_state = TarState::Data;
+            return remaining > 0 || tar_entry_done();
+        }
+
+        bool tar_entry_done()
+        {
+            tar_state = padding > 0 ? TarState::Padding : TarState::Header;
+            switch (tar_meta)
+            {
+                case TarMeta::None:
+                    return close_entry();
+                case TarMeta::LongName:
+                    pending_path = meta.substr(0, meta.find('\0'));
+                    break;
+                case TarMeta::LongLink:
+                    pending_link = meta.substr(0, meta.find('\0'));
+                    break;
+                case TarMeta::Pax:
+                    parse_pax();
+                    break;
+                case TarMeta::Ignore:
+                    break;
+            }
+            return true;
+        }
+
+        // "<length> <key>=<value>\n" records
+        void parse_pax()
+        {
+            size_t at = 0;
+            while (at < meta.size())
+            {
+                size_t space = meta.find(' ', at);
+                if (space == string::npos)
+                {
+                    break;
+                }
+                size_t length = strtoull(meta.c_str() + at, nullptr, 10);
+                if (length == 0 || at + length > meta.size())
+                {
+                    break;
+                }
+                string record = meta.substr(space + 1, at + length - space - 2);
+                size_t equals = record.find('=');
+                if (equals != string::npos)
+                {
+                    string key = record.substr(0, equals);
+                    string value = record.substr(equals + 1);
+                    if (key == "path")
+                    {
+                        pending_path = value;
+                    }
+                    else if (key == "linkpath")
+                    {
+                        pending_link = value;
+                    }
+                    else if (key == "size")
+                    {
+                        pending_size = static_cast<int64_t>(strtoull(value.c_str(), nullptr, 10));
+                    }
+                }
+                at += length;
+            }
+        }
+
+        // ---- zip (local headers in order, modes from the central directory) ----
+
+        bool parse_zip(const char* data, size_t size)
+        {
+            while (size > 0 && error_message.empty())
+            {
+                switch (zip_state)
+                {
+                    case ZipState::End:
+                        return true;
+
+                    case ZipState::Signature:
+                    {
+                        if (!take(data, size, 4))
+                        {
+                            return true;
+                        }
+                        uint32_t signature = le32(header, 0);
+                        header.clear();
+                        if (signature == 0x04034b50)
+                        {
+                            zip_state = ZipState::LocalHeader;
+                        }
+                        else if (signature == 0x02014b50)
+                        {
+                            zip_state = ZipState::CentralHeader;
+                        }
+                        else if (seen_entry)
+                        {
+                            // End of central directory records: nothing left to extract
+                            zip_state = ZipState::End;
+                        }
+                        else
+                        {
+                            return fail("not a zip archive");
+                        }
+                        break;
+                    }
+
+                    case ZipState::LocalHeader:
+                        if (!take(data, size, 26))
+                        {
+                            return true;
+                        }
+                        zip_flags = static_cast<uint16_t>(le16(header, 2));
+                        zip_method = static_cast<uint16_t>(le16(header, 4));
+                        zip_crc = le32(header, 10);
+                        remaining = le32(header, 14);
+                        pending_size = le32(header, 18);
+                        header_size = le16(header, 22) + le16(header, 24);
+                        meta = header;
+                        header.clear();
+                        zip_state = ZipState::LocalVariable;
+                        if (header_size > 0)
+                        {
+                            break;
+                        }
+                        // Fall through for entries without name and extra field
+                        [[fallthrough]];
+
+                    case ZipState::LocalVariable:
+                        if (!take(data, size, header_size))
+                        {
+                            return true;
+                        }
+                        if (!zip_local_entry())
+                        {
+                            return false;
+                        }
+                        header.clear();
+                        break;
+
+                    case ZipState::Stored:
+                    {
+                        size_t n = static_cast<size_t>(min<uint64_t>(size, remaining));
+                        running_crc = static_cast<uint32_t>(crc32(running_crc, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(n)));
+                        if (!entry_data(data, n))
+                        {
+                            return false;
+                        }
+                        data += n;
+                        size -= n;
+                        remaining -= n;
+                        if (remaining == 0 && !zip_data_done())
+                        {
+                            return false;
+                        }
+                        break;
+                    }
+
+                    case ZipState::Deflated:
+                    {
+                        deflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+                        deflate.avail_in = static_cast<uInt>(size);
+                        int result = Z_OK;
+                        while (result == Z_OK && (deflate.avail_in > 0 || deflate.avail_out == 0))
+                        {
+                            deflate.next_out = reinterpret_cast<Bytef*>(&output[0]);
+                            deflate.avail_out = static_cast<uInt>(output.size());
+                            result = inflate(&deflate, Z_NO_FLUSH);
+                            if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+                            {
+                                return fail("corrupt deflate data in zip entry");
+                            }
+                            size_t produced = output.size() - deflate.avail_out;
+                            running_crc = static_cast<uint32_t>(crc32(running_crc, reinterpret_cast<const Bytef*>(output.data()), static_cast<uInt>(produced)));
+                            if (produced > 0 && !entry_data(output.data(), produced))
+                            {
+                                return false;
+                            }
+                            if (result == Z_BUF_ERROR)
+                            {
+                                break;
+                            }
+                        }
+                        // Whatever inflate did not consume belongs to the next record
+                        size_t consumed = size - deflate.avail_in;
+                        data += consumed;
+                        size -= consumed;
+                        if (result == Z_STREAM_END && !zip_data_done())
+                        {
+                            return false;
+                        }
+                        break;
+                    }
+
+                    case ZipState::DescriptorStart:
+                        // The descriptor signature is optional
+                        if (!take(data, size, 4))
+                        {
+                            return true;
+                        }
+                        if (le32(header, 0) == 0x08074b50)
+                        {
+                            header.clear();
+                        }
+                        zip_state = ZipState::Descriptor;
+                        break;
+
+                    case ZipState::Descriptor:
+                        if (!take(data, size, zip64 ? 20 : 12))
+                        {
+                            return true;
+                        }
+                        zip_crc = le32(header, 0);
+                        header.clear();
+                        if (!zip_entry_done())
+                        {
+                            return false;
+                        }
+                        break;
+
+                    case ZipState::CentralHeader:
+                        if (!take(data, size, 42))
+                        {
+                            return true;
+                        }
+                        central_version = static_cast<uint16_t>(le16(header, 0));
+                        central_attributes = le32(header, 34);
+                        header_size = le16(header, 24) + le16(header, 26) + le16(header, 28);
+                        meta = header;
+                        header.clear();
+                        zip_state = ZipState::CentralVariable;
+                        break;
+
+                    case ZipState::CentralVariable:
+                        if (!take(data, size, header_size))
+                        {
+                            return true;
+                        }
+                        if (!zip_central_entry(header.substr(0, le16(meta, 24))))
+                        {
+                            return false;
+                        }
+                        header.clear();
+                        zip_state = ZipState::Signature;
+                        break;
+                }
+            }
+            return error_message.empty();
+        }
+
+        bool zip_local_entry()
+        {
+            seen_entry = true;
+            size_t name_length = le16(meta, 22);
+            string name = header.substr(0, name_length);
+
+            // Zip64: the real sizes are in the extra field
+            zip64 = false;
+            size_t at = name_length;
+            while (at + 4 <= header.size())
+            {
+                uint32_t id = le16(header, at);
+                uint32_t length = le16(header, at + 2);
+                if (id == 0x0001)
+                {
+                    zip64 = true;
+                    size_t field = at + 4;
+                    if (pending_size == 0xffffffff && field + 8 <= header.size())
+                    {
+                        pending_size = static_cast<int64_t>(le64(header, field));
+                        field += 8;
+                    }
+                    if (remaining == 0xffffffff && field + 8 <= header.size())
+                    {
+                        remaining = le64(header, field);
+                    }
+                }
+                at += 4 + length;
+            }
+
+            bool described = zip_flags & 0x08;
+            if (!name.empty() && name.back() == '/')
+            {
+                zip_state = described ? ZipState::DescriptorStart : ZipState::Signature;
+                return make_directory(name, 0);
+            }
+            if (zip_method != 0 && zip_method != 8)
+            {
+                return fail("unsupported compression method " + to_string(zip_method) + " for " + name);
+            }
+            if (zip_method == 0 && described)
+            {
+                return fail("stored entry with a data descriptor cannot be streamed: " + name);
+            }
+            if (!open_entry(name, described ? -1 : pending_size, 0))
+            {
+                return false;
+            }
+
+            running_crc = static_cast<uint32_t>(crc32(0, nullptr, 0));
+            if (zip_method == 8)
+            {
+                inflateReset(&deflate);
+                deflate.avail_out = 1;
+                zip_state = ZipState::Deflated;
+                return true;
+            }
+            zip_state = ZipState::Stored;
+            return remaining > 0 || zip_data_done();
+        }
+
+        bool zip_data_done()
+        {
+            if (zip_flags & 0x08)
+            {
+                zip_state = ZipState::DescriptorStart;
+                return true;
+            }
+            return zip_entry_done();
+        }
+
+        bool zip_entry_done()
+        {
+            zip_state = ZipState::Signature;
+            if (entry.path.empty() && !entry.ignored)
+            {
+                // Directory
+                return true;
+            }
+            if (running_crc != zip_crc)
+            {
+                return fail("CRC mismatch in " + entry.path);
+            }
+            string path = entry.path;
+            bool ignored = entry.ignored;
+            uint64_t before = counters.unchanged;
+            if (!close_entry())
+            {
+                return false;
+            }
+            if (!ignored)
+            {
+                zip_entries[path] = counters.unchanged == before;
+            }
+            return true;
+        }
+
+        // The central directory holds the Unix modes the local headers lack
+        bool zip_central_entry(const string& name)
+        {
+            string path;
+            if (!entry_path(name, path) || (central_version >> 8) != 3)
+            {
+                return error_message.empty();
+            }
+            mode_t mode = static_cast<mode_t>(central_attributes >> 16);
+            auto found = zip_entries.find(path);
+            if (found == zip_entries.end() || mode == 0)
+            {
+                return true;
+            }
+
+            string staged = destination + "/" + path;
+            if (S_ISLNK(mode))
+            {
+                // Symlinks are stored as files holding the target
+                int fd = found->second ? open_staged(path, O_RDONLY, false)
+                    : open((installed + "/" + path).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+                char buffer[4096];
+                ssize_t n = fd >= 0 ? read(fd, buffer, sizeof(buffer)) : -1;
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                string target(buffer, static_cast<size_t>(max<ssize_t>(n, 0)));
+                remove_staged(path);
+                written_files.erase(remove(written_files.begin(), written_files.end(), staged), written_files.end());
+                return make_symlink(name, target);
+            }
+            if (!found->second)
+            {
+                // Identical content, but the mode changed: clone the installed file
+                struct stat info;
+                if (lstat((installed + "/" + path).c_str(), &info) == 0 && (info.st_mode & 07777) == (mode & 07777))
+                {
+                    return true;
+                }
+                if (!materialize(path, mode & 07777))
+                {
+                    return fail("cannot clone " + staged);
+                }
+                counters.unchanged--;
+                counters.unchanged_bytes -= static_cast<uint64_t>(info.st_size);
+                found->second = true;
+                return true;
+            }
+            int fd = open_staged(path, O_RDONLY, false);
+            bool changed = fd >= 0 && fchmod(fd, mode & 07777) == 0;
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return changed || fail("cannot set the mode of " + staged + ": " + strerror(errno));
+        }
+
+        // ---- Writing entries ----
+
+        /*
+        * Relative path of an entry inside the trees
+        *
+        * Returns false for entries to skip; sets the error for names that would escape the tree
+        */
+        bool entry_path(const string& name, string& path)
+        {
+            if (name.empty() || name[0] == '/' || name.find('\\') != string::npos)
+            {
+                if (!name.empty())
+                {
+                    fail("unsafe entry name: " + name);
+                }
+                return false;
+            }
+            vector<string> parts;
+            size_t start = 0;
+            while (start <= name.size())
+            {
+                size_t slash = name.find('/', start);
+                string part = name.substr(start, slash == string::npos ? string::npos : slash - start);
+                if (part == "..")
+                {
+                    fail("unsafe entry name: " + name);
+                    return false;
+                }
+                if (!part.empty() && part != ".")
+                {
+                    parts.push_back(part);
+                }
+                if (slash == string::npos)
+                {
+                    break;
+                }
+                start = slash + 1;
+            }
+            if (parts.size() <= static_cast<size_t>(strip_components))
+            {
+                return false;
+            }
+            path.clear();
+            for (size_t i = static_cast<size_t>(strip_components); i < parts.size(); i++)
+            {
+                path += (path.empty() ? "" : "/") + parts[i];
+                // Nothing is written at or below a symlink from the archive, so no link can redirect an entry
+                if (symlinks.count(path) != 0)
+                {
+                    fail("entry goes through a symlink: " + name);
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /*
+        * Directory holding an entry of the staging tree, as a descriptor
+        *
+        * Walks one component at a time from the staging root with O_NOFOLLOW,
+        * so no symlink on disk is ever followed, and creates missing directories
+        * if asked. A path ending in "/" yields the directory itself and an empty
+        * leaf. Returns -1 with errno set on failure
+        */
+        int staged_parent(const string& path, string& leaf, bool create)
+        {
+            int dir = open(destination.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            size_t start = 0;
+            while (dir >= 0)
+            {
+                size_t slash = path.find('/', start);
+                if (slash == string::npos)
+                {
+                    leaf = path.substr(start);
+                    return dir;
+                }
+                string part = path.substr(start, slash - start);
+                int next = openat(dir, part.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (next < 0 && errno == ENOENT && create && mkdirat(dir, part.c_str(), 0755) == 0)
+                {
+                    next = openat(dir, part.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                }
+                int saved_errno = errno;
+                close(dir);
+                errno = saved_errno;
+                dir = next;
+                start = slash + 1;
+            }
+            return -1;
+        }
+
+        // Opens a file of the staging tree without following symlinks (flags as for open())
+        int open_staged(const string& path, int flags, bool create_parents)
+        {
+            string leaf;
+            int dir = staged_parent(path, leaf, create_parents);
+            if (dir < 0)
+            {
+                return -1;
+            }
+            int fd = openat(dir, leaf.c_str(), flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+            int saved_errno = errno;
+            close(dir);
+            errno = saved_errno;
+            return fd;
+        }
+
+        // Removes a file or symlink from the staging tree, if there is one
+        void remove_staged(const string& path)
+        {
+            string leaf;
+            int dir = staged_parent(path, leaf, false);
+            if (dir >= 0)
+            {
+                unlinkat(dir, leaf.c_str(), 0);
+                close(dir);
+            }
+        }
+
+        bool open_entry(const string& name, int64_t size, mode_t mode)
+        {
+            entry = Entry();
+            counters.files++;
+            if (!entry_path(name, entry.path))
+            {
+                entry.ignored = true;
+                return error_message.empty();
+            }
+            entry.size = size;
+            entry.mode = mode;
+
+            // A later entry of the same name replaces an earlier one
+            remove_staged(entry.path);
+
+            // Compare with the installed file as the bytes arrive, nothing is written while they match
+            if (!installed.empty())
+            {
+                string current = installed + "/" + entry.path;
+                struct stat info;
+                if (lstat(current.c_str(), &info) == 0 && S_ISREG(info.st_mode) &&
+                    (size < 0 || static_cast<uint64_t>(info.st_size) == static_cast<uint64_t>(size)))
+                {
+                    entry.installed_fd = open(current.c_str(), O_RDONLY | O_CLOEXEC);
+                    entry.installed_size = static_cast<uint64_t>(info.st_size);
+                }
+            }
+            return entry.installed_fd >= 0 || start_writing();
+        }
+
+        bool entry_data(const char* data, size_t size)
+        {
+            if (entry.ignored || size == 0)
+            {
+                return true;
+            }
+            if (entry.installed_fd >= 0)
+            {
+                if (matches_installed(data, size))
+                {
+                    entry.offset += size;
+                    return true;
+                }
+                if (!start_writing())
+                {
+                    return false;
+                }
+            }
+            while (size > 0)
+            {
+                ssize_t n = write(entry.fd, data, size);
+                if (n <= 0)
+                {
+                    return fail("cannot write " + entry.path + ": " + strerror(errno));
+                }
+                data += n;
+                size -= static_cast<size_t>(n);
+                entry.offset += static_cast<uint64_t>(n);
+                counters.written_bytes += static_cast<uint64_t>(n);
+            }
+            return true;
+        }
+
+        bool matches_installed(const char* data, size_t size)
+        {
+            char buffer[compare_size];
+            uint64_t offset = entry.offset;
+            while (size > 0)
+            {
+                size_t want = min(size, compare_size);
+                ssize_t n = pread(entry.installed_fd, buffer, want, static_cast<off_t>(offset));
+                if (n != static_cast<ssize_t>(want) || memcmp(buffer, data, want) != 0)
+                {
+                    return false;
+                }
+                data += want;
+                size -= want;
+                offset += want;
+            }
+            return true;
+        }
+
+        // Opens the staged file, starting with the prefix that matched the installed file
+        bool start_writing()
+        {
+            entry.fd = open_staged(entry.path, O_WRONLY | O_CREAT | O_TRUNC, true);
+            if (entry.fd < 0)
+            {
+                return fail("cannot create " + destination + "/" + entry.path + ": " + strerror(errno));
+            }
+            if (entry.installed_fd >= 0)
+            {
+                bool copied = copy_prefix(entry.installed_fd, entry.fd, entry.offset);
+                close(entry.installed_fd);
+                entry.installed_fd = -1;
+                if (!copied)
+                {
+                    return fail("cannot copy " + entry.path + " from the installed tree");
+                }
+                counters.written_bytes += entry.offset;
+            }
+            return true;
+        }
+
+        static bool copy_prefix(int from, int to, uint64_t length)
+        {
+            off_t in = 0;
+            #ifdef __linux__
+            // In the kernel, and shared extents on filesystems that support it
+            while (static_cast<uint64_t>(in) < length)
+            {
+                ssize_t n = copy_file_range(from, &in, to, nullptr, static_cast<size_t>(length - static_cast<uint64_t>(in)), 0);
+                if (n <= 0)
+                {
+                    break;
+                }
+            }
+            #endif
+            char buffer[compare_size];
+            while (static_cast<uint64_t>(in) < length)
+            {
+                ssize_t n = pread(from, buffer, static_cast<size_t>(min<uint64_t>(sizeof(buffer), length - static_cast<uint64_t>(in))), in);
+                if (n <= 0 || write(to, buffer, static_cast<size_t>(n)) != n)
+                {
+                    return false;
+                }
+                in += n;
+            }
+            return true;
+        }
+
+        bool close_entry()
+        {
+            if (entry.ignored)
+            {
+                entry = Entry();
+                return true;
+            }
+            string staged = destination + "/" + entry.path;
+            if (entry.installed_fd >= 0)
+            {
+                if (entry.offset == entry.installed_size)
+                {
+                    struct stat info;
+                    bool same_mode = entry.mode == 0 ||
+                        (fstat(entry.installed_fd, &info) == 0 && (info.st_mode & 07777) == entry.mode);
+                    close(entry.installed_fd);
+                    entry.installed_fd = -1;
+                    if (same_mode)
+                    {
+                        // Left out of the staging tree, the install links the installed file
+                        counters.unchanged++;
+                        counters.unchanged_bytes += entry.offset;
+                        entry = Entry();
+                        return true;
+                    }
+                    bool ok = materialize(entry.path, entry.mode);
+                    entry = Entry();
+                    return ok || fail("cannot clone " + staged);
+                }
+                if (!start_writing())
+                {
+                    return false;
+                }
+            }
+            fchmod(entry.fd, entry.mode == 0 ? 0644 : entry.mode);
+            close(entry.fd);
+            entry.fd = -1;
+            written_files.push_back(staged);
+            entry = Entry();
+            return true;
+        }
+
+        // Staged copy of an installed file, cloned where the filesystem can. mode 0 keeps the installed mode
+        bool materialize(const string& path, mode_t mode)
+        {
+            int in = open((installed + "/" + path).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            struct stat info;
+            if (in < 0 || fstat(in, &info) != 0 || !S_ISREG(info.st_mode))
+            {
+                if (in >= 0)
+                {
+                    close(in);
+                }
+                return false;
+            }
+            int out = open_staged(path, O_WRONLY | O_CREAT | O_TRUNC, true);
+            bool copied = out >= 0;
+            if (copied)
+            {
+                bool cloned = false;
+                #ifdef __linux__
+                cloned = ioctl(out, FICLONE, in) == 0;
+                #endif
+                copied = (cloned || copy_prefix(in, out, static_cast<uint64_t>(info.st_size))) &&
+                    fchmod(out, mode != 0 ? mode : (info.st_mode & 07777)) == 0;
+                close(out);
+            }
+            close(in);
+            if (copied)
+            {
+                written_files.push_back(destination + "/" + path);
+            }
+            return copied;
+        }
+
+        bool make_directory(const string& name, mode_t mode)
+        {
+            entry = Entry();
+            string path;
+            if (!entry_path(name, path))
+            {
+                return error_message.empty();
+            }
+            string leaf;
+            int dir = staged_parent(path + "/", leaf, true);
+            if (dir < 0)
+            {
+                return fail("cannot create " + destination + "/" + path + ": " + strerror(errno));
+            }
+            if (mode != 0)
+            {
+                fchmod(dir, mode);
+            }
+            close(dir);
+            return true;
+        }
+
+        /*
+        * Relative targets that only descend: no "..", not absolute
+        *
+        * Counting ".." against the link's depth is not enough, because the
+        * components it climbs over may be symlinks themselves (a/l -> ..,
+        * b/m -> ../a/l/..). A target without ".." stays below its directory
+        */
+        static bool safe_link_target(const string& target)
+        {
+            if (target.empty() || target[0] == '/' || target.find('\\') != string::npos)
+            {
+                return false;
+            }
+            size_t start = 0;
+            while (start <= target.size())
+            {
+                size_t slash = target.find('/', start);
+                if (target.compare(start, slash == string::npos ? string::npos : slash - start, "..") == 0)
+                {
+                    return false;
+                }
+                if (slash == string::npos)
+                {
+                    break;
+                }
+                start = slash + 1;
+            }
+            return true;
+        }
+
+        bool make_symlink(const string& name, const string& target)
+        {
+            string path;
+            if (!entry_path(name, path))
+            {
+                return error_message.empty();
+            }
+            if (!safe_link_target(target))
+            {
+                return fail("unsafe symlink target: " + name + " -> " + target);
+            }
+            string leaf;
+            int dir = staged_parent(path, leaf, true);
+            bool created = dir >= 0 && (unlinkat(dir, leaf.c_str(), 0) == 0 || errno == ENOENT) &&
+                symlinkat(target.c_str(), dir, leaf.c_str()) == 0;
+            int saved_errno = errno;
+            if (dir >= 0)
+            {
+                close(dir);
+            }
+            if (!created)
+            {
+                return fail("cannot create symlink " + destination + "/" + path + ": " + strerror(saved_errno));
+            }
+            symlinks.insert(path);
+            return true;
+        }
+
+        bool make_hard_link(const string& name, const string& target)
+        {
+            string path;
+            string source;
+            if (!entry_path(name, path) || !entry_path(target, source))
+            {
+                return error_message.empty();
+            }
+            remove_staged(path);
+            string leaf, source_leaf;
+            int source_dir = staged_parent(source, source_leaf, false);
+            struct stat info;
+            bool staged = source_dir >= 0 && fstatat(source_dir, source_leaf.c_str(), &info, AT_SYMLINK_NOFOLLOW) == 0;
+            // The target was identical to the installed file and not staged
+            bool found = staged || (!installed.empty() && materialize(source, 0));
+            if (found && source_dir < 0)
+            {
+                source_dir = staged_parent(source, source_leaf, false);
+            }
+            int dir = found && source_dir >= 0 ? staged_parent(path, leaf, true) : -1;
+            bool linked = dir >= 0 && linkat(source_dir, source_leaf.c_str(), dir, leaf.c_str(), 0) == 0;
+            int saved_errno = errno;
+            for (int fd : { source_dir, dir })
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+            if (!found)
+            {
+                return fail("hard link to a missing entry: " + name + " -> " + target);
+            }
+            return linked || fail("cannot link " + destination + "/" + path + ": " + strerror(saved_errno));
+        }
+};
+
+class ArchivePipeline
+{
+    public:
+        /*
+        * Runs an extractor on its own thread, fed through a bounded queue
+        *
+        * @param extractor: Consumes the archive bytes
+        * @param max_blocks: Blocks queued before push() waits (memory bound)
+        */
+        ArchivePipeline(ArchiveExtractor& extractor, size_t max_blocks = 8)
+            : extractor(extractor),
+            max_blocks(max(max_blocks, static_cast<size_t>(1)))
+        {
+            filling.reserve(block_size);
+            worker = thread(&ArchivePipeline::run, this);
+        }
+
+        ~ArchivePipeline()
+        {
+            finish();
+        }
+
+        ArchivePipeline(const ArchivePipeline&) = delete;
+        ArchivePipeline& operator=(const ArchivePipeline&) = delete;
+
+        // Queues archive bytes, waiting while the queue is full. Returns false once extraction failed
+        bool push(const char* data, size_t size)
+        {
+            filling.append(data, size);
+            if (filling.size() >= block_size)
+            {
+                enqueue();
+            }
+            return !failed;
+        }
+
+        // Hands over the rest and waits for the extractor. Returns false if extraction failed
+        bool finish()
+        {
+            if (worker.joinable())
+            {
+                if (!filling.empty())
+                {
+                    enqueue();
+                }
+                {
+                    lock_guard<mutex> guard(lock);
+                    closed = true;
+                }
+                ready.notify_one();
+                worker.join();
+                if (!failed && !extractor.finish())
+                {
+                    failed = true;
+                }
+            }
+            return !failed;
+        }
+
+    private:
+        static constexpr size_t block_size = 256 * 1024;
+
+        ArchiveExtractor& extractor;
+        size_t max_blocks;
+        mutex lock;
+        condition_variable ready;
+        condition_variable space;
+        deque<string> queue;
+        string filling;
+        bool closed = false;
+        atomic<bool> failed{false};
+        thread worker;
+
+        void enqueue()
+        {
+            unique_lock<mutex> guard(lock);
+            space.wait(guard, [this]() { return queue.size() < max_blocks || failed; });
+            if (!failed)
+            {
+                queue.push_back(move(filling));
+            }
+            filling = string();
+            filling.reserve(block_size);
+            guard.unlock();
+            ready.notify_one();
+        }
+
+        void run()
+        {
+            while (true)
+            {
+                string block;
+                {
+                    unique_lock<mutex> guard(lock);
+                    ready.wait(guard, [this]() { return closed || !queue.empty(); });
+                    if (queue.empty())
+                    {
+                        return;
+                    }
+                    block = move(queue.front());
+                    queue.pop_front();
+                }
+                space.notify_one();
+                if (!failed && !extractor.feed(block.data(), block.size()))
+                {
+                    failed = true;
+                    space.notify_all();
+                }
+            }
+        }
+};
@@ -0,0 +1,683 @@
+/*
+ * AssetBundle - Releases that ship as several assets installed together
+ *
+ * Features:
+ * - Downloads all assets of a release concurrently, largest first
+ * - One bandwidth budget shared by all downloads
+ * - Each asset verified against its published SHA-256 as it streams in
+ * - Code (the executable, shared libraries) is only installed with a published SHA-256
+ * - All-or-nothing install: the new directory is built beside the live one and swapped in
+ *
+ * The downloaded assets are moved into a new directory, which is then
+ * completed with hard links of the current files, so files that are not
+ * release assets (local config, caches) carry over. Extracted archives
+ * (ArchiveStream) are installed the same way. It is exchanged with the live
+ * directory in one renameat2(RENAME_EXCHANGE) on Linux; elsewhere two
+ * renames. The previous version stays beside it for rollback.
+ */
+
+#pragma once
+
+#include "Sha256.cpp"
+#include "InstallWatcher.cpp"
+#include "TlsSettings.cpp"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <algorithm>
+#include <filesystem>
+#include <curl/curl.h>
+#include <openssl/evp.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// One release asset of a bundle
+struct BundleAsset
+{
+    string name;                // Release asset name
+    string target;              // File name in the install directory
+    string url;
+    curl_off_t size = 0;
+    string digest;              // Published SHA-256, empty if the release has none
+    string file;                // Downloaded and verified file
+};
+
+class BundleDownloader
+{
+    public:
+        /*
+        * @param max_parallel: Downloads in flight at once
+        * @param max_bytes_per_second: Combined rate of all downloads (0 = unlimited)
+        */
+        BundleDownloader(size_t max_parallel, curl_off_t max_bytes_per_second)
+            : max_parallel(max(max_parallel, static_cast<size_t>(1))),
+            bandwidth_budget(max_bytes_per_second)
+        {
+        }
+
+        // Called with (bytes done, total bytes) of the whole bundle while downloading
+        void set_progress_callback(function<void(curl_off_t, curl_off_t)> callback)
+        {
+            progress = callback;
+        }
+
+        /*
+        * Downloads every asset into directory/<name> and checks its size and digest
+        *
+        * The largest assets start first, so the smallest ones fill in behind
+        * them and the last download to finish is a short one. Stops at the first
+        * asset that fails: the bundle is only useful complete.
+        * Returns false and sets error on failure, after removing partial files
+        */
+        bool download(vector<BundleAsset>& assets, const string& directory, string& error)
+        {
+            deque<Transfer> transfers;
+            total_bytes = 0;
+            for (size_t i = 0; i < assets.size(); i++)
+            {
+                Transfer transfer;
+                transfer.asset = &assets[i];
+                transfer.path = (fs::path(directory) / assets[i].name).string();
+                transfers.push_back(move(transfer));
+                total_bytes += assets[i].size;
+            }
+            stable_sort(transfers.begin(), transfers.end(), [](const Transfer& a, const Transfer& b)
+            {
+                return a.asset->size > b.asset->size;
+            });
+
+            CURLM* multi = curl_multi_init();
+            if (!multi)
+            {
+                error = "Failed to initialize curl";
+                return false;
+            }
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+            size_t next = 0;
+            size_t running = 0;
+            bandwidth_tokens = static_cast<double>(bandwidth_budget);
+            last_refill = chrono::steady_clock::now();
+            error.clear();
+
+            start_pending(multi, transfers, next, running, error);
+            while (error.empty() && (running > 0 || next < transfers.size()))
+            {
+                int still_running = 0;
+                if (curl_multi_perform(multi, &still_running) != CURLM_OK)
+                {
+                    error = "curl_multi_perform failed";
+                    break;
+                }
+
+                CURLMsg* msg;
+                int queued;
+                while (error.empty() && (msg = curl_multi_info_read(multi, &queued)))
+                {
+                    if (msg->msg != CURLMSG_DONE)
+                    {
+                        continue;
+                    }
+                    Transfer* transfer = nullptr;
+                    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char**>(&transfer));
+                    CURLcode result = msg->data.result;
+                    finish(multi, *transfer);
+                    running--;
+                    if (!verify(*transfer, result, error))
+                    {
+                        break;
+                    }
+                    transfer->asset->file = transfer->path;
+                }
+
+                if (!error.empty())
+                {
+                    break;
+                }
+                start_pending(multi, transfers, next, running, error);
+                refill_bandwidth(transfers);
+                report_progress(transfers);
+
+                if (running > 0)
+                {
+                    curl_multi_poll(multi, nullptr, 0, bandwidth_budget > 0 ? 10 : 100, nullptr);
+                }
+            }
+
+            for (Transfer& transfer : transfers)
+            {
+                finish(multi, transfer);
+                if (!error.empty())
+                {
+                    error_code ec;
+                    fs::remove(transfer.path, ec);
+                    transfer.asset->file.clear();
+                }
+            }
+            curl_multi_cleanup(multi);
+            return error.empty();
+        }
+
+        // Whether an asset name is code the application runs or loads (executables, shared libraries)
+        static bool code_name(const string& name)
+        {
+            string extension = fs::path(name).extension().string();
+            return extension == ".so" || extension == ".dylib" || extension == ".dll" || extension == ".exe" ||
+                name.find(".so.") != string::npos;
+        }
+
+        // Whether a file starts like code: ELF, Mach-O, PE or a script with a #! line
+        static bool code_content(const string& path)
+        {
+            unsigned char magic[4] = {};
+            FILE* fp = fopen(path.c_str(), "rb");
+            size_t n = fp ? fread(magic, 1, sizeof(magic), fp) : 0;
+            if (fp)
+            {
+                fclose(fp);
+            }
+            uint32_t word = static_cast<uint32_t>(magic[0]) << 24 | static_cast<uint32_t>(magic[1]) << 16 |
+                static_cast<uint32_t>(magic[2]) << 8 | magic[3];
+            return (n >= 2 && ((magic[0] == 'M' && magic[1] == 'Z') || (magic[0] == '#' && magic[1] == '!'))) ||
+                (n == 4 && (word == 0x7f454c46 || word == 0xfeedface || word == 0xfeedfacf ||
+                    word == 0xcefaedfe || word == 0xcffaedfe || word == 0xcafebabe));
+        }
+
+    private:
+        struct Transfer
+        {
+            BundleAsset* asset = nullptr;
+            BundleDownloader* owner = nullptr;
+            string path;
+            FILE* fp = nullptr;
+            CURL* easy = nullptr;
+            EVP_MD_CTX* hash = nullptr;
+            string digest;
+            curl_off_t received = 0;
+            bool paused = false;
+        };
+
+        size_t max_parallel;
+        curl_off_t bandwidth_budget;
+        double bandwidth_tokens = 0;
+        chrono::time_point<chrono::steady_clock> last_refill;
+        curl_off_t total_bytes = 0;
+        function<void(curl_off_t, curl_off_t)> progress;
+
+        // Writes to the file and the running hash, pausing while the shared bucket is empty
+        static size_t write_callback(void* contents, size_t size, size_t nmemb, void* userp)
+        {
+            Transfer* transfer = static_cast<Transfer*>(userp);
+            BundleDownloader* self = transfer->owner;
+            size_t total = size * nmemb;
+            if (self->bandwidth_budget > 0)
+            {
+                if (self->bandwidth_tokens <= 0)
+                {
+                    transfer->paused = true;
+                    return CURL_WRITEFUNC_PAUSE;
+                }
+                self->bandwidth_tokens -= static_cast<double>(total);
+            }
+            EVP_DigestUpdate(transfer->hash, contents, total);
+            transfer->received += static_cast<curl_off_t>(total);
+            return fwrite(contents, 1, total, transfer->fp);
+        }
+
+        void start_pending(CURLM* multi, deque<Transfer>& transfers, size_t& next, size_t& running, string& error)
+        {
+            while (running < max_parallel && next < transfers.size())
+            {
+                Transfer& transfer = transfers[next++];
+                transfer.owner = this;
+                #ifdef _WIN32
+                if (fopen_s(&transfer.fp, transfer.path.c_str(), "wb") != 0)
+                {
+                    transfer.fp = nullptr;
+                }
+                #else
+                transfer.fp = fopen(transfer.path.c_str(), "wb");
+                #endif
+                transfer.easy = curl_easy_init();
+                transfer.hash = EVP_MD_CTX_new();
+                if (!transfer.fp || !transfer.easy || !transfer.hash)
+                {
+                    error = "Failed to start download of " + transfer.asset->name;
+                    return;
+                }
+                EVP_DigestInit_ex(transfer.hash, EVP_sha256(), nullptr);
+
+                curl_easy_setopt(transfer.easy, CURLOPT_URL, transfer.asset->url.c_str());
+                curl_easy_setopt(transfer.easy, CURLOPT_WRITEFUNCTION, write_callback);
+                curl_easy_setopt(transfer.easy, CURLOPT_WRITEDATA, &transfer);
+                curl_easy_setopt(transfer.easy, CURLOPT_PRIVATE, &transfer);
+                curl_easy_setopt(transfer.easy, CURLOPT_FOLLOWLOCATION, 1L);
+                curl_easy_setopt(transfer.easy, CURLOPT_FAILONERROR, 1L);
+                curl_easy_setopt(transfer.easy, CURLOPT_PIPEWAIT, 1L);
+                TlsSettings::apply(transfer.easy);
+                curl_easy_setopt(transfer.easy, CURLOPT_USERAGENT, "AutoUpdater/1.0");
+                curl_multi_add_handle(multi, transfer.easy);
+                running++;
+            }
+        }
+
+        // Refills the shared bucket and resumes paused downloads, the ones with the most left to fetch first
+        void refill_bandwidth(deque<Transfer>& transfers)
+        {
+            if (bandwidth_budget <= 0)
+            {
+                return;
+            }
+            auto now = chrono::steady_clock::now();
+            double elapsed = chrono::duration<double>(now - last_refill).count();
+            last_refill = now;
+            bandwidth_tokens = min(bandwidth_tokens + elapsed * bandwidth_budget, static_cast<double>(bandwidth_budget));
+
+            vector<Transfer*> paused;
+            for (Transfer& transfer : transfers)
+            {
+                if (transfer.paused && transfer.easy)
+                {
+                    paused.push_back(&transfer);
+                }
+            }
+            sort(paused.begin(), paused.end(), [](const Transfer* a, const Transfer* b)
+            {
+                return a->asset->size - a->received > b->asset->size - b->received;
+            });
+            for (Transfer* transfer : paused)
+            {
+                if (bandwidth_tokens <= 0)
+                {
+                    break;
+                }
+                transfer->paused = false;
+                curl_easy_pause(transfer->easy, CURLPAUSE_CONT);
+            }
+        }
+
+        void report_progress(const deque<Transfer>& transfers)
+        {
+            if (!progress)
+            {
+                return;
+            }
+            curl_off_t done = 0;
+            for (const Transfer& transfer : transfers)
+            {
+                done += transfer.received;
+            }
+            progress(done, total_bytes);
+        }
+
+        bool verify(Transfer& transfer, CURLcode result, string& error)
+        {
+            const BundleAsset& asset = *transfer.asset;
+            if (result != CURLE_OK)
+            {
+                error = asset.name + ": " + curl_easy_strerror(result);
+                return false;
+            }
+            if (asset.size > 0 && transfer.received != asset.size)
+            {
+                error = asset.name + ": expected " + to_string(asset.size) + " bytes, got " + to_string(transfer.received);
+                return false;
+            }
+            if (!asset.digest.empty() && transfer.digest != asset.digest)
+            {
+                error = asset.name + ": checksum mismatch (expected " + asset.digest + ", got " + transfer.digest + ")";
+                return false;
+            }
+            // Names can hide code: an unverified asset that is code is refused whatever it is called
+            if (asset.digest.empty() && code_content(transfer.path))
+            {
+                error = asset.name + ": executable code without a published SHA-256";
+                return false;
+            }
+            return true;
+        }
+
+        void finish(CURLM* multi, Transfer& transfer)
+        {
+            if (transfer.easy)
+            {
+                curl_multi_remove_handle(multi, transfer.easy);
+                curl_easy_cleanup(transfer.easy);
+                transfer.easy = nullptr;
+            }
+            if (transfer.fp)
+            {
+                fclose(transfer.fp);
+                transfer.fp = nullptr;
+            }
+            if (transfer.hash)
+            {
+                unsigned char digest[EVP_MAX_MD_SIZE];
+                unsigned int digest_length = 0;
+                EVP_DigestFinal_ex(transfer.hash, digest, &digest_length);
+                EVP_MD_CTX_free(transfer.hash);
+                transfer.hash = nullptr;
+                transfer.digest = to_hex(digest, digest_length);
+            }
+        }
+};
+
+class BundleInstaller
+{
+    public:
+        /*
+        * @param directory: Install directory, replaced as a whole. Its parent must be writable
+        */
+        explicit BundleInstaller(const string& directory)
+        {
+            fs::path path(directory);
+            if (!path.has_filename())
+            {
+                path = path.parent_path();
+            }
+            string name = path.filename().string();
+            live_path = path.string();
+            incoming_path = (path.parent_path() / ("." + name + ".autoupdater-new")).string();
+            previous_path = (path.parent_path() / ("." + name + ".autoupdater-previous")).string();
+        }
+
+        // Where the replaced version is kept until the next install
+        const string& previous() const
+        {
+            return previous_path;
+        }
+
+        // Directory that install_prepared() swaps in, filled by the caller after prepare()
+        const string& incoming() const
+        {
+            return incoming_path;
+        }
+
+        /*
+        * Starts an empty incoming directory beside the live one
+        *
+        * @param error: Set on failure
+        */
+        bool prepare(string& error)
+        {
+            #ifdef _WIN32
+            error = "not supported on Windows";
+            return false;
+            #else
+            // Leftover of an install that did not finish
+            error_code ec;
+            fs::remove_all(incoming_path, ec);
+
+            struct stat info;
+            if (stat(live_path.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+            {
+                error = live_path + " is not a directory";
+                return false;
+            }
+            if (mkdir(incoming_path.c_str(), info.st_mode & 07777) != 0)
+            {
+                error = "cannot create " + incoming_path + ": " + strerror(errno);
+                return false;
+            }
+            return true;
+            #endif
+        }
+
+        /*
+        * Installs verified assets together, or leaves the live directory untouched
+        *
+        * @param assets: Downloaded assets, moved (copied across filesystems) to directory/<target>
+        * @param executable: Target of the executable, tagged with the release for install watchers
+        * @param tag: Release tag
+        * @param error: Set on failure
+        */
+        bool install(const vector<BundleAsset>& assets, const string& executable, const string& tag, string& error)
+        {
+            #ifdef _WIN32
+            (void)assets;
+            (void)executable;
+            (void)tag;
+            error = "not supported on Windows";
+            return false;
+            #else
+            if (!prepare(error))
+            {
+                return false;
+            }
+
+            error_code ec;
+            vector<string> written;
+            for (const BundleAsset& asset : assets)
+            {
+                fs::path destination = fs::path(incoming_path) / asset.target;
+                struct stat old_info;
+                bool replaced = lstat((fs::path(live_path) / asset.target).string().c_str(), &old_info) == 0 && S_ISREG(old_info.st_mode);
+                fs::create_directories(destination.parent_path(), ec);
+                fs::remove(destination, ec);
+                if (rename(asset.file.c_str(), destination.string().c_str()) != 0 &&
+                    !fs::copy_file(asset.file, destination, fs::copy_options::overwrite_existing, ec))
+                {
+                    error = "cannot place " + asset.name + " in " + incoming_path;
+                    fs::remove_all(incoming_path, ec);
+                    return false;
+                }
+                mode_t mode = replaced ? (old_info.st_mode & 07777) : 0644;
+                chmod(destination.string().c_str(), asset.target == executable ? (mode | 0755) : mode);
+                written.push_back(destination.string());
+            }
+            return install_prepared(written, executable, tag, error);
+            #endif
+        }
+
+        /*
+        * Completes the incoming directory with the live files it lacks and swaps it in
+        *
+        * @param written: Files the caller placed in the incoming directory, synced here
+        * @param executable: Path of the executable relative to the directory, tagged with the release
+        * @param tag: Release tag
+        * @param error: Set on failure; the live directory is then untouched
+        */
+        bool install_prepared(const vector<string>& written, const string& executable, const string& tag, string& error)
+        {
+            #ifdef _WIN32
+            (void)written;
+            (void)executable;
+            (void)tag;
+            error = "not supported on Windows";
+            return false;
+            #else
+            error_code ec;
+            vector<string> directories;
+            if (!clone_tree(live_path, incoming_path, directories, error))
+            {
+                fs::remove_all(incoming_path, ec);
+                return false;
+            }
+
+            for (const string& file : written)
+            {
+                if (!sync_path(file, O_RDONLY))
+                {
+                    error = "cannot sync " + file;
+                    fs::remove_all(incoming_path, ec);
+                    return false;
+                }
+                directories.push_back(fs::path(file).parent_path().string());
+            }
+
+            string staged_executable = (fs::path(incoming_path) / executable).string();
+            struct stat info;
+            if (stat(staged_executable.c_str(), &info) == 0 && !(info.st_mode & S_IXUSR))
+            {
+                chmod(staged_executable.c_str(), (info.st_mode & 07777) | 0755);
+            }
+            InstallWatcher::tag_executable(staged_executable, tag);
+
+            // Every directory entry created above has to be durable before the swap
+            sort(directories.begin(), directories.end());
+            directories.erase(unique(directories.begin(), directories.end()), directories.end());
+            for (const string& directory : directories)
+            {
+                sync_path(directory, O_RDONLY | O_DIRECTORY);
+            }
+
+            if (!swap_in(error))
+            {
+                fs::remove_all(incoming_path, ec);
+                return false;
+            }
+
+            // The old version now sits at the incoming path
+            fs::remove_all(previous_path, ec);
+            rename(incoming_path.c_str(), previous_path.c_str());
+            sync_path(fs::path(live_path).parent_path().string(), O_RDONLY | O_DIRECTORY);
+            return true;
+            #endif
+        }
+
+    private:
+        string live_path;
+        string incoming_path;
+        string previous_path;
+
+        #ifndef _WIN32
+        /*
+        * Adds the entries of the tree at source that destination lacks, with hard links for regular files
+        *
+        * Links cost no I/O and keep files that the release does not ship. Files
+        * that cannot be linked (e.g. owned by another user) are copied. Entries
+        * already in destination win, with everything below them
+        */
+        static bool clone_tree(const string& source, const string& destination, vector<string>& directories, string& error)
+        {
+            struct stat info;
+            if (stat(source.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+            {
+                error = source + " is not a directory";
+                return false;
+            }
+            if (mkdir(destination.c_str(), info.st_mode & 07777) != 0 && errno != EEXIST)
+            {
+                error = "cannot create " + destination + ": " + strerror(errno);
+                return false;
+            }
+            directories.push_back(destination);
+
+            error_code ec;
+            for (fs::recursive_directory_iterator it(source, ec), end; !ec && it != end; it.increment(ec))
+            {
+                fs::path target = fs::path(destination) / fs::relative(it->path(), source, ec);
+                string from = it->path().string();
+                struct stat entry;
+                if (lstat(from.c_str(), &entry) != 0)
+                {
+                    continue;
+                }
+                struct stat existing;
+                if (lstat(target.string().c_str(), &existing) == 0)
+                {
+                    if (!S_ISDIR(existing.st_mode) || !S_ISDIR(entry.st_mode))
+                    {
+                        it.disable_recursion_pending();
+                    }
+                    else
+                    {
+                        directories.push_back(target.string());
+                    }
+                    continue;
+                }
+                bool ok = true;
+                if (S_ISDIR(entry.st_mode))
+                {
+                    ok = mkdir(target.string().c_str(), entry.st_mode & 07777) == 0;
+                    directories.push_back(target.string());
+                }
+                else if (S_ISLNK(entry.st_mode))
+                {
+                    fs::copy_symlink(from, target, ec);
+                    ok = !ec;
+                }
+                else if (S_ISREG(entry.st_mode))
+                {
+                    ok = link(from.c_str(), target.string().c_str()) == 0 ||
+                        (fs::copy_file(from, target, ec) && sync_path(target.string(), O_RDONLY));
+                }
+                if (!ok)
+                {
+                    error = "cannot copy " + from + " to " + target.string();
+                    return false;
+                }
+            }
+            if (ec)
+            {
+                error = "cannot read " + source + ": " + ec.message();
+                return false;
+            }
+            return true;
+        }
+
+        // Exchanges the incoming and live directories
+        bool swap_in(string& error)
+        {
+            #if defined(__linux__) && defined(SYS_renameat2)
+            if (syscall(SYS_renameat2, AT_FDCWD, incoming_path.c_str(), AT_FDCWD, live_path.c_str(), RENAME_EXCHANGE) == 0)
+            {
+                return true;
+            }
+            if (errno != EINVAL && errno != ENOSYS)
+            {
+                error = string("cannot swap in ") + incoming_path + ": " + strerror(errno);
+                return false;
+            }
+            #endif
+
+            // No atomic exchange on this system or filesystem: the live path is missing between the renames
+            string moved_aside = incoming_path + ".old";
+            error_code ec;
+            fs::remove_all(moved_aside, ec);
+            if (rename(live_path.c_str(), moved_aside.c_str()) != 0)
+            {
+                error = string("cannot move ") + live_path + " aside: " + strerror(errno);
+                return false;
+            }
+            if (rename(incoming_path.c_str(), live_path.c_str()) != 0)
+            {
+                error = string("cannot swap in ") + incoming_path + ": " + strerror(errno);
+                rename(moved_aside.c_str(), live_path.c_str());
+                return false;
+            }
+            return rename(moved_aside.c_str(), incoming_path.c_str()) == 0;
+        }
+
+        static bool sync_path(const string& path, int flags)
+        {
+            int fd = open(path.c_str(), flags | O_CLOEXEC);
+            if (fd < 0)
+            {
+                return false;
+            }
+            bool ok = fsync(fd) == 0;
+            close(fd);
+            return ok;
+        }
+        #endif
+};
@@ -9,10 +9,13 @@
  * - Cross-platform (Windows/Linux/macOS)
  */
 
+#pragma once
 
 #include <iostream>
 #include <string>
 #include <vector>
+#include <map>
+#include <tuple>
 #include <curl/curl.h>
 #include <sstream>
 #include <chrono>
@@ -21,6 +24,34 @@
 #include <iomanip>
 #include <regex>
 #include <json/json.h>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <zlib.h>
+
+#include "RateLimiter.cpp"
+#include "TlsSettings.cpp"
+#include "Mirrors.cpp"
+#include "SegmentedDownload.cpp"
+#include "PeerCache.cpp"
+#include "WebhookListener.cpp"
+#include "StatusBoard.cpp"
+#include "InstallWatcher.cpp"
+#include "ApplyScheduler.cpp"
+#include "LowImpact.cpp"
+#include "RollingRestart.cpp"
+#include "Rollout.cpp"
+#include "UpdatePlanner.cpp"
+#include "ContentValidators.cpp"
+#include "Fingerprint.cpp"
+#include "PageCache.cpp"
+#include "ApplyJournal.cpp"
+#include "AssetBundle.cpp"
+#include "ArchiveStream.cpp"
+#include "DataAsset.cpp"
+#include "PluginHost.cpp"
+#include "MemoryStage.cpp"
 
 
 #define _CRT_SECURE_NO_WARNINGS
@@ -42,6 +73,83 @@ static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* use
     return size * nmemb;
 }
 
+// Clears the options of a request that point into its stack frame, on every way out of it
+struct RequestOptionsScope
+{
+    CURL* curl;
+
+    ~RequestOptionsScope()
+    {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+    }
+};
+
+// Destination of a download, inspected by content validators before it is written
+struct DownloadSink
+{
+    FILE* fp = nullptr;
+    CURL* curl = nullptr;
+    ContentSniffer* sniffer = nullptr;
+    bool typed = false;
+};
+
+// Callback function for CURL to write data to a file, aborting if a validator rejects it
+static size_t DownloadCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    DownloadSink* sink = static_cast<DownloadSink*>(userp);
+    size_t bytes = size * nmemb;
+    // Exceptions must not unwind through libcurl; returning 0 aborts the transfer instead
+    try
+    {
+        if (sink->sniffer && !sink->sniffer->settled())
+        {
+            if (!sink->typed)
+            {
+                char* type = nullptr;
+                curl_easy_getinfo(sink->curl, CURLINFO_CONTENT_TYPE, &type);
+                sink->sniffer->set_content_type(type ? type : "");
+                sink->typed = true;
+            }
+            if (!sink->sniffer->feed(static_cast<const char*>(contents), bytes))
+            {
+                return 0;
+            }
+        }
+    }
+    catch (...)
+    {
+        return 0;
+    }
+    return fwrite(contents, 1, bytes, sink->fp);
+}
+
+// Archive on its way to the extractor, hashed as it arrives
+struct ArchiveSink
+{
+    ArchivePipeline* pipeline = nullptr;
+    EVP_MD_CTX* hash = nullptr;
+};
+
+// Callback function for CURL to stream an archive into the extraction pipeline, aborting once it fails
+static size_t ArchiveCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    ArchiveSink* sink = static_cast<ArchiveSink*>(userp);
+    size_t bytes = size * nmemb;
+    EVP_DigestUpdate(sink->hash, contents, bytes);
+    try
+    {
+        return sink->pipeline->push(static_cast<const char*>(contents), bytes) ? bytes : 0;
+    }
+    catch (...)
+    {
+        return 0;
+    }
+}
+
 class AutoUpdater
 {
     public:
@@ -65,13 +173,16 @@ class AutoUpdater
             asset_name(asset_name),
             verbose(verbose),
             curl(nullptr),
-            initialized(false)
+            initialized(false),
+            rate_limit(make_unique<RateLimitBudget>(""))
         {
             if (!initCurl()) 
             {
                 throw runtime_error("Failed to initialize curl");
             }
             log("Ready. Current release date: " + current_release_date);
+            staged_run();
+            recover_interrupted_update();
         }
         
         // Prevent default construction
@@ -79,541 +190,2720 @@ class AutoUpdater
 
         // Destructor - cleans up CURL resources
         ~AutoUpdater() {
-            if (curl)
+            // Stop background triggers before tearing down the state they use
+            webhook_listener.reset();
+            install_watcher.reset();
+            discard_staged_update();
+            cleanupCurl();
+            if (api_headers)
             {
-                curl_easy_cleanup(curl);
+                curl_slist_free_all(api_headers);
             }
         }
 
         /*
-        * Main update function - applies updates
+        * Authenticates GitHub API requests with a token from an environment variable
         * 
-        * Workflow:
-        * 1. Downloads the update
-        * 2. Creates backup
-        * 3. Replaces executable
+        * @param variable: Name of the environment variable holding the token
+        * 
+        * Returns false if the variable is unset or empty
         */
-        bool update()
+        bool set_auth_token_from_env(const string& variable = "GITHUB_TOKEN")
         {
-            if (release_url.empty())
+            string token = load_token_from_env(variable);
+            if (token.empty())
             {
-                log("Please run is_update_available() first");
+                log("Environment variable " + variable + " is not set");
                 return false;
             }
+            set_auth_token(token);
+            log("Using API token from " + variable);
+            return true;
+        }
 
-            // Create temp directory for downloads
-            string tmp_path = create_temp_directory();
-            if (tmp_path.empty())
+        /*
+        * Authenticates GitHub API requests with a token read from a file
+        * 
+        * @param path: File whose first line is the token
+        * 
+        * Returns false if the file is missing or empty
+        */
+        bool set_auth_token_from_file(const string& path)
+        {
+            string token = load_token_from_file(path);
+            if (token.empty())
             {
-                log("Got empty tmp path");
+                log("Could not read API token from " + path);
                 return false;
             }
+            set_auth_token(token);
+            log("Using API token from " + path);
+            return true;
+        }
 
-            // Download the update file
-            string downloaded_file = download_update(tmp_path, release_url);
-            if (downloaded_file.empty())
+        /*
+        * Verifies servers against a CA bundle instead of the system certificate store
+        * 
+        * @param path: PEM file, or directory of hashed certificates
+        * 
+        * Applies to every transfer in the process. Verification cannot be turned off
+        */
+        void set_ca_bundle(const string& path)
+        {
+            TlsSettings::set_ca_bundle(path);
+            if (curl)
             {
-                log("Could not download release");
-                fs::remove_all(tmp_path);
-                return false;
+                TlsSettings::apply(curl);
             }
+            log("Verifying servers against " + path);
+        }
 
-            // Get current executable path (platform-specific)
-            fs::path current_exe;
-            try
+        /*
+        * Sends release API requests to another server with the same URL shape as GitHub,
+        * e.g. a release cache daemon ("http://127.0.0.1:8080")
+        */
+        void set_api_base(const string& url)
+        {
+            api_base = url;
+            while (!api_base.empty() && api_base.back() == '/')
             {
-                current_exe = fs::canonical("/proc/self/exe"); // Linux
+                api_base.pop_back();
             }
-            catch (...)
+        }
+
+        /*
+        * Downloads release assets from mirrors instead of only github.com
+        * 
+        * @param mirror_base_urls: Base URLs that serve the same paths as github.com,
+        *                          e.g. "https://mirror.dc1.example/github"
+        * 
+        * The origin stays as the last resort. Mirrors are probed concurrently before
+        * each download and ranked by RTT and their historical throughput
+        */
+        void set_mirrors(const vector<string>& mirror_base_urls)
+        {
+            mirrors = mirror_base_urls;
+        }
+
+        /*
+        * Sets when download_update() gives up on a source and continues from another one
+        * 
+        * @param min_bytes_per_second: Throughput considered collapsed
+        * @param window_seconds: How long throughput has to stay below the limit
+        */
+        void set_failover_threshold(long min_bytes_per_second, long window_seconds)
+        {
+            failover_min_speed = min_bytes_per_second;
+            failover_window_seconds = window_seconds;
+        }
+
+        /*
+        * Splits each download across all healthy mirrors (and github.com)
+        * 
+        * Byte ranges are sized by each source's throughput, and faster sources
+        * take over the remaining work of slower ones. Falls back to a single
+        * source if fewer than two are reachable or the release size is unknown
+        */
+        void set_multi_source(bool enabled)
+        {
+            multi_source = enabled;
+        }
+
+        /*
+        * Registers a callback fired when a new release is staged and ready to commit
+        * 
+        * @param callback: Receives the tag of the staged release. May run on a
+        *                  background thread (webhook listener)
+        */
+        void set_update_ready_callback(function<void(const string&)> callback)
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            update_ready_callback = callback;
+        }
+
+        /*
+        * Listens for GitHub "release" webhooks instead of polling
+        * 
+        * @param port: Port to listen on
+        * @param secret: Webhook secret used to verify X-Hub-Signature-256
+        * @param path: URL path the webhook (or an internal relay) posts to
+        * 
+        * A verified "published" or "released" event for this repository runs the
+        * check and stages the update right away, then fires the update-ready callback
+        */
+        bool start_webhook_listener(uint16_t port, const string& secret, const string& path = "/webhook")
+        {
+            webhook_listener = make_unique<WebhookListener>(port, secret, path,
+                github_repo_owner + "/" + github_repo_name, verbose);
+            bool started = webhook_listener->start([this]()
             {
-                #ifdef _WIN32
-                    char path[MAX_PATH];
-                    GetModuleFileNameA(NULL, path, MAX_PATH);
-                    current_exe = fs::path(path);
-                #else
-                    log("Could not determine current executable path");
-                    fs::remove_all(tmp_path);
-                    return false;
-                #endif
+                lock_guard<recursive_mutex> guard(operation_lock);
+                if (is_update_available())
+                {
+                    stage_update();
+                }
+            });
+            if (!started)
+            {
+                log("Could not start webhook listener on port " + to_string(port));
+                webhook_listener.reset();
             }
+            return started;
+        }
 
-            // Create backup before replacing
-            fs::path backup_path = fs::path(tmp_path) / (current_exe.filename().string() + ".bak");
-            try
+        /*
+        * Completes or rolls back an update that was interrupted while being applied
+        * 
+        * A crash between the steps of commit_update() leaves a journal beside the
+        * executable. Recovery installs the new file if it was fully written, and
+        * otherwise keeps the previous executable and removes the leftovers.
+        * Called by the constructor; without a journal it costs one failed open().
+        * Returns true if the new executable was installed (restart to run it)
+        */
+        bool recover_interrupted_update()
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            error_code ec;
+            fs::path current_exe = fs::canonical("/proc/self/exe", ec);
+            if (ec)
             {
-                log("Creating backup of current executeble at " + tmp_path + "/" + (current_exe.filename().string() + ".bak"));
-                fs::copy_file(current_exe, backup_path, fs::copy_options::overwrite_existing);
+                return false;
             }
-            catch (...)
+
+            string tag, digest;
+            ApplyJournal journal(current_exe.string());
+            switch (journal.recover(tag, digest))
             {
-                log("Failed to create backup of current executable");
-                fs::remove_all(tmp_path);
-                return false;
+                case RecoveryAction::None:
+                    return false;
+                case RecoveryAction::RolledBack:
+                    log("Rolled back interrupted update to " + (tag.empty() ? string("unknown release") : tag));
+                    return false;
+                case RecoveryAction::Completed:
+                    FingerprintCache().remember(current_exe.string(), digest);
+                    log("Completed interrupted update to " + tag);
+                    return true;
             }
+            return false;
+        }
 
-            // Replace current executable
-            try
+        /*
+        * Watches the executable for an update installed by another process
+        * 
+        * When a sibling process running the same binary commits an update, this
+        * process notices right away: is_binary_stale() turns true and the
+        * update-ready callback fires with the installed tag, without any network
+        * request. Linux only
+        */
+        bool start_install_watcher()
+        {
+            // Destroying a watcher joins its thread, whose callback may be waiting for
+            // operation_lock, so a replaced watcher is only destroyed after the lock is released
+            unique_ptr<InstallWatcher> replaced;
+            bool started = false;
             {
-                #ifdef _WIN32
-                    // Windows needs special handling
-                    MoveFileExA(downloaded_file.c_str(), current_exe.string().c_str(), 
-                            MOVEFILE_DELAY_UNTIL_REBOOT | MOVEFILE_REPLACE_EXISTING);
-                    log("Update scheduled for next restart");
-                #else
-                    // Linux/macOS - attempt direct replacement
-                    log("Attempting to replace current executable");
-                    
-                    // First close curl handles
-                    if (curl)
-                    {
-                        curl_easy_cleanup(curl);
-                        curl = nullptr;
-                    }
-                    
-                    // Get file size before replacement for verification
-                    auto orig_size = fs::file_size(current_exe);
-                    auto tar_size = fs::file_size(downloaded_file);
-                    log("Current executable size: " + to_string(orig_size) + " bytes");
-                    log("Downloaded file size: " + to_string(tar_size) + " bytes");
-
-                    // Make the correct file permissions
-                    fs::permissions(downloaded_file, 
-                                fs::perms::owner_all | 
-                                fs::perms::group_read |
-                                fs::perms::others_read);
-
-                    // Remove original executable
-                    fs::remove(current_exe);
-                    
-                    // Copy the downloaded file to original executable's location
-                    fs::copy(downloaded_file, current_exe);
-
-                    // Verify after copy
-                    auto new_size = fs::file_size(current_exe);
-
-                    if (new_size == tar_size)
+                lock_guard<recursive_mutex> guard(operation_lock);
+                error_code ec;
+                fs::path current_exe = fs::canonical("/proc/self/exe", ec);
+                if (ec)
+                {
+                    log("Could not determine current executable path");
+                    return false;
+                }
+
+                replaced = move(install_watcher);
+                install_watcher = make_unique<InstallWatcher>(current_exe.string());
+                started = install_watcher->start([this](const string& tag)
+                {
+                    lock_guard<recursive_mutex> guard(operation_lock);
+                    if (installed_here)
                     {
-                        log("Replacement successful");
+                        return;
                     }
-                    else
+                    log("Executable was replaced by another process" + (tag.empty() ? string() : " with " + tag));
+                    discard_staged_update();
+                    set_phase(UpdatePhase::Applied);
+                    if (update_ready_callback)
                     {
-                        log("Replacement failed - size mismatch. Restoring backup");
-                        fs::copy(backup_path, current_exe, fs::copy_options::overwrite_existing);
+                        update_ready_callback(tag);
                     }
-                #endif
-            }
-            catch (const exception& e)
-            {
-                log(string("Replacement failed: ") + e.what());
-                
-                // Attempt to restore backup
-                try
-                {
-                    fs::copy(backup_path, current_exe, fs::copy_options::overwrite_existing);
-                    log("Restored from backup");
-                }
-                catch (...)
+                });
+                if (!started)
                 {
-                    log("Critical: Failed to restore from backup!");
+                    log("Could not watch " + current_exe.string() + " for updates");
+                    install_watcher.reset();
                 }
-                
-                fs::remove_all(tmp_path);
-                return false;
             }
+            replaced.reset();
+            return started;
+        }
 
-            // Clean up (except on Windows where we need to keep files for reboot)
-            #ifndef _WIN32
-                fs::remove_all(tmp_path);
-            #endif
-
-            return true;
+        /*
+        * True if the executable on disk is newer than the running one, because this
+        * or another process installed an update. Restart to run the new version
+        */
+        bool is_binary_stale() const
+        {
+            return install_watcher && install_watcher->is_stale();
         }
 
         /*
-        * Checks if a newer release is available on GitHub
+        * Joins a group of identical worker processes that restart a few at a time
         * 
-        * Compares published dates and finds matching asset
+        * @param group: Name shared by all workers of the service on this host
+        * @param max_parallel: Workers allowed to restart at once
+        * @param capacity_floor: Healthy workers that must remain during the rollout
+        * 
+        * The worker counts as starting until report_healthy() is called
         */
-        bool is_update_available()
+        bool enable_rolling_restart(const string& group, int max_parallel, int capacity_floor)
         {
-            log("Checking for updates");
-            if (!initialized && !initCurl())
-            {
-                return false;
-            }
-
-            // Get latest release info from GitHub API
-            string url = "https://api.github.com/repos/" + github_repo_owner + "/" + github_repo_name + "/releases/latest";
-            string response;
-            
-            // Set curl options
-            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L); // Fix for SSL cert issue
-            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L); // Fix for SSL cert issue
-            curl_easy_setopt(curl, CURLOPT_USERAGENT, "AutoUpdater/1.0");
-            
-            CURLcode res = curl_easy_perform(curl);
-            if (res != CURLE_OK)
+            lock_guard<recursive_mutex> guard(operation_lock);
+            restart_coordinator = make_unique<RestartCoordinator>(group, max_parallel, capacity_floor);
+            if (!restart_coordinator->join())
             {
-                log(string("Curl failed: ") + curl_easy_strerror(res));
+                log("Could not join restart group " + group);
+                restart_coordinator.reset();
                 return false;
             }
+            log("Joined restart group " + group);
+            return true;
+        }
 
-            // Parse JSON response
-            istringstream iss(response);
-            Json::Value root;
-            Json::CharReaderBuilder builder;
-            string errors;
-            bool parsingSuccessful = Json::parseFromStream(builder, iss, &root, &errors);
-
-            if (!parsingSuccessful)
-            {
-                log("Failed to parse json from github api: " + errors);
-                log("Github API response: " + response);
-                return false;
-            }
-            
-            if (root.isMember("message") && root["message"].asString() == "Not Found")
+        // Tells the restart group this worker is serving, so the next one may restart
+        void report_healthy()
+        {
+            if (restart_coordinator)
             {
-                log("Repository not found");
-                log("Github API response: " + response);
-                return false;
+                restart_coordinator->report_healthy();
             }
+        }
 
-            // Get the published date
-            if (!root.isMember("published_at"))
+        /*
+        * Restarts into the installed executable once the restart group allows it
+        * 
+        * @param argv: Arguments for the new process (usually main's argv)
+        * @param drain: Called right before the restart to finish in-flight work
+        * 
+        * Blocks until fewer than max_parallel workers are restarting and enough
+        * others are healthy. Only returns on failure
+        */
+        bool restart_when_allowed(char** argv, function<void()> drain = nullptr)
+        {
+            if (!restart_coordinator)
             {
-                log("No published_at field in response");
-                log("Github API response: " + response);
+                log("Please run enable_rolling_restart() first");
                 return false;
             }
-
-            // Extract just the date part (first 10 chars of ISO string)
-            string latest_full_date = root["published_at"].asString();
-            string latest_date = latest_full_date.substr(0, 10);  // "2025-06-08"
-
-            // Compare dates
-            bool is_newer = latest_date > current_release_date;
-
-            auto [assets, tag_name, asset_ids] = parse_github_api_response(response);
-
-            log("Current release date: " + current_release_date);
-            log("Latest release date: " + latest_date);
-
-            log(string("Latest tag ") + tag_name);
-            log("Assets:");
-
-            // Print the results
-            if (verbose)
+            log("Waiting for a restart slot");
+            restart_coordinator->restart(argv, [this, &drain]()
             {
-                for (const auto& [name, url] : assets)
+                log("Restarting into the installed executable");
+                if (drain)
                 {
-                    cout << "    " << name << " (id: " << asset_ids[name] << ") => " << url << endl;
+                    drain();
                 }
-            }
+            });
+            log_error("Restart failed");
+            return false;
+        }
 
-            // Find the asset with the matching name
-            if (assets.find(asset_name) != assets.end())
-            {
-                log("Selected asset: " + asset_name);
-                release_url = assets[asset_name];
-            }
-            else
+        /*
+        * Shares verified release assets with other hosts on the LAN
+        * 
+        * @param store_dir: Content-addressed store of verified assets (kept across restarts)
+        * @param port: Port to serve the store on
+        * @param peers: Static list of peers ("host:port")
+        * @param discovery_dir: Shared directory where peers register themselves (optional)
+        * 
+        * Downloads try the store and then the peers before the origin. Every copy
+        * is checked against the SHA-256 digest GitHub publishes with the release
+        */
+        bool enable_peer_mode(const string& store_dir,
+                            uint16_t port,
+                            const vector<string>& peers = {},
+                            const string& discovery_dir = "")
+        {
+            peer_cache = make_unique<PeerCache>(store_dir, port, verbose);
+            for (const string& peer : peers)
             {
-                log("Could not find asset with name: " + asset_name);
-                return false;
+                peer_cache->add_peer(peer);
             }
-
-            if (is_newer)
+            if (!discovery_dir.empty())
             {
-                log("Newer release available");
-                return true;
+                peer_cache->set_discovery_dir(discovery_dir);
             }
-            else
+            if (!peer_cache->start())
             {
-                log("No newer releases found");
+                log("Could not start peer mode");
+                peer_cache.reset();
                 return false;
             }
+            return true;
         }
 
-    private:
-        CURL* curl;
-        bool verbose;
-        string release_url;
-        bool initialized;
+        /*
+        * Publishes this updater's state to a shared-memory status board
+        * 
+        * Phase, download progress and rate, last check, latest tag and last error
+        * become readable by other processes (see autoupdater_status.cpp) without
+        * any IPC round-trip. Returns false if shared memory is unavailable
+        */
+        bool enable_status_board()
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            status_board = make_unique<StatusBoard>(github_repo_owner + "/" + github_repo_name);
+            if (!status_board->ok())
+            {
+                log("Could not create status board segment");
+                status_board.reset();
+                return false;
+            }
+            log("Publishing status to " + status_board->segment_name());
+            return true;
+        }
+
+        /*
+        * Inspects downloads as they arrive and aborts them on the first rejection
+        * 
+        * @param validator: e.g. elf_validator() to require an executable that runs
+        *                   on this host, or a custom check of the first bytes
+        * 
+        * An HTML page check is installed by default
+        */
+        void add_content_validator(const ContentValidator& validator)
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            content_validators.push_back(validator);
+        }
+
+        // Removes all content validators, including the default HTML page check
+        void clear_content_validators()
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            content_validators.clear();
+        }
+
+        /*
+        * Sets how long is_update_available() may wait for a slot in the
+        * host-wide rate-limit budget before giving up
+        */
+        void set_max_rate_limit_wait(chrono::milliseconds max_wait)
+        {
+            max_rate_limit_wait = max_wait;
+        }
+
+        /*
+        * Rolls new releases out to a growing share of the fleet
+        * 
+        * Each host hashes its id (machine-id by default) with the release tag into
+        * a bucket and is_update_available() only reports the release once the
+        * percentage, ramp or wave schedule covers that bucket
+        */
+        void set_rollout_policy(const RolloutPolicy& policy, const string& host_id = "")
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            rollout = make_unique<Rollout>(policy);
+            if (!host_id.empty())
+            {
+                rollout->set_host_id(host_id);
+            }
+        }
+
+        /*
+        * Runs downloads in the background without hurting the application
+        * 
+        * The download and verification run on a dedicated thread with idle I/O
+        * priority and SCHED_IDLE (or nice 19), optionally in a cgroup v2 sub-group
+        * with a CPU limit. With a latency probe, the download rate is lowered
+        * while the application's latency is above target and raised again after
+        */
+        void set_low_impact_mode(const LowImpactOptions& options)
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            low_impact = make_unique<LowImpactMode>(options);
+        }
+
+        /*
+        * Defers applying updates until the host is quiet
+        * 
+        * With a policy set, update() waits for low CPU/IO pressure and application
+        * load, inside the maintenance windows, before committing. After
+        * max_deferral it commits at the first moment that is not a load peak
+        */
+        void set_apply_policy(const ApplyPolicy& policy)
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            apply_scheduler = make_shared<ApplyScheduler>(policy);
+        }
+
+        /*
+        * Ships the executable together with other release assets, installed as one unit
+        * 
+        * @param assets: Names of the other release assets (shared libraries, data, schemas)
+        * @param install_dir: Directory replaced as a whole on install, the executable's directory if empty
+        * @param max_bytes_per_second: Combined download rate of all assets (0 = unlimited)
+        * @param max_parallel: Assets downloaded at once
+        * 
+        * Every release must contain all of them. They are installed under their
+        * asset names, the executable (asset_name) at its current path.
+        * Linux/macOS; not combined with apply-on-exit or apply-on-next-start
+        */
+        bool set_bundle(const vector<string>& assets, const string& install_dir = "",
+            curl_off_t max_bytes_per_second = 0, size_t max_parallel = 4)
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            if (!set_install_dir(install_dir))
+            {
+                return false;
+            }
+
+            bundle_assets = assets;
+            archive_kind = ArchiveFormat::Unknown;
+            bundle_rate = max_bytes_per_second;
+            bundle_parallel = max_parallel;
+            bundle_release.clear();
+            discard_staged_update();
+            log("Bundle of " + to_string(assets.size() + 1) + " assets installed in " + bundle_dir);
+            return true;
+        }
+
+        /*
+        * Treats the release asset (asset_name) as an archive of the install directory
+        * 
+        * @param install_dir: Directory the archive is extracted over, the executable's directory if empty
+        * @param strip_components: Leading path components removed from entry names
+        * 
+        * The archive (.tar, .tar.gz, .tgz, .zip; .tar.zst with AUTOUPDATER_WITH_ZSTD)
+        * is extracted while it downloads, straight into a staging tree beside the
+        * install directory. Entries identical to the installed files are not
+        * written but linked, and files the archive lacks carry over. The staging
+        * tree is swapped in as a whole like a bundle, on Linux/macOS; not combined
+        * with apply-on-exit or apply-on-next-start
+        */
+        bool set_archive(const string& install_dir = "", int strip_components = 0)
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            ArchiveFormat format = archive_format(asset_name);
+            if (format == ArchiveFormat::Unknown)
+            {
+                log_error(asset_name + " is not a supported archive");
+                return false;
+            }
+            if (!set_install_dir(install_dir))
+            {
+                return false;
+            }
+
+            bundle_assets.clear();
+            bundle_release.clear();
+            archive_kind = format;
+            archive_strip = strip_components;
+            discard_staged_update();
+            log("Release archive " + asset_name + " extracted into " + bundle_dir);
+            return true;
+        }
+
+        /*
+        * Keeps a data file (model, lookup table) up to date inside the running process
+        * 
+        * @param name: Release asset name
+        * @param path: Local copy, next to the executable if empty
+        * 
+        * Returns the handle readers take snapshots from. update_data_assets()
+        * downloads and verifies a changed asset, renames it over path, maps it
+        * and swaps it in; readers holding the old version keep it until they let go
+        */
+        shared_ptr<DataAsset> track_data_asset(const string& name, const string& path = "")
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            string local = path;
+            if (local.empty())
+            {
+                error_code ec;
+                fs::path current_exe = fs::canonical("/proc/self/exe", ec);
+                local = ((ec ? fs::current_path(ec) : current_exe.parent_path()) / name).string();
+            }
+            for (const shared_ptr<DataAsset>& asset : data_assets)
+            {
+                if (asset->name() == name)
+                {
+                    return asset;
+                }
+            }
+            data_assets.push_back(make_shared<DataAsset>(name, local));
+            log("Tracking data asset " + name + " at " + local);
+            return data_assets.back();
+        }
+
+        /*
+        * Downloads the data assets that changed in the release found by is_update_available() and swaps them in
+        * 
+        * Independent of the executable: no restart. Returns false if any asset failed, the others are still updated
+        */
+        bool update_data_assets()
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            bool ok = true;
+            for (const BundleAsset& release : data_release)
+            {
+                shared_ptr<DataAsset> asset;
+                for (const shared_ptr<DataAsset>& tracked : data_assets)
+                {
+                    if (tracked->name() == release.name)
+                    {
+                        asset = tracked;
+                    }
+                }
+                string version = release.digest.empty() ? release_tag : release.digest;
+                {
+                    DataAsset::Snapshot current = asset->snapshot();
+                    if (current && (current->version() == version ||
+                        (!release.digest.empty() && FingerprintCache().digest(asset->path()) == release.digest)))
+                    {
+                        continue;
+                    }
+                }
+
+                // Downloaded beside the file, so that it can be renamed over it
+                fs::path target(asset->path());
+                string downloaded = download_update(target.parent_path().string(), release.url,
+                    "." + target.filename().string() + ".autoupdater-new", release.size, release.digest, false);
+                if (downloaded.empty())
+                {
+                    log_error("Could not download data asset " + release.name);
+                    ok = false;
+                    continue;
+                }
+                DataAsset::record_version(downloaded, version);
+                #ifndef _WIN32
+                int fd = open(downloaded.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd >= 0)
+                {
+                    fsync(fd);
+                    close(fd);
+                }
+                #endif
+                error_code ec;
+                fs::rename(downloaded, target, ec);
+                if (ec)
+                {
+                    log_error("Could not replace " + target.string() + ": " + ec.message());
+                    fs::remove(downloaded, ec);
+                    ok = false;
+                    continue;
+                }
+                if (!release.digest.empty())
+                {
+                    FingerprintCache().remember(target.string(), release.digest);
+                }
+
+                string error;
+                if (!asset->reload(version, error))
+                {
+                    log_error("Could not load data asset " + release.name + ": " + error);
+                    ok = false;
+                    continue;
+                }
+                log("Data asset " + release.name + " swapped in" +
+                    (asset->retired_versions() > 0 ? ", " + to_string(asset->retired_versions()) + " older versions still in use" : ""));
+            }
+            return ok;
+        }
+
+        /*
+        * Keeps a shared-library plugin of the host up to date without restarting
+        * 
+        * @param name: Release asset name
+        * @param path: Library path, next to the executable if empty
+        * @param table_symbol: Exported symbol of the plugin's function table
+        * @param quiescent_period: How long a replaced library stays loaded after its last snapshot
+        * 
+        * Returns the handle callers take snapshots of the function table from.
+        * update_plugins() loads a changed library from a versioned file beside
+        * path, runs the module's state-transfer hook and switches to it
+        */
+        shared_ptr<PluginModule> track_plugin(const string& name, const string& path, const string& table_symbol,
+            chrono::milliseconds quiescent_period = chrono::seconds(5))
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            for (const shared_ptr<PluginModule>& plugin : plugins)
+            {
+                if (plugin->name() == name)
+                {
+                    return plugin;
+                }
+            }
+            string local = path;
+            if (local.empty())
+            {
+                error_code ec;
+                fs::path current_exe = fs::canonical("/proc/self/exe", ec);
+                local = ((ec ? fs::current_path(ec) : current_exe.parent_path()) / name).string();
+            }
+            plugins.push_back(make_shared<PluginModule>(name, local, table_symbol, quiescent_period));
+            if (!plugins.back()->error().empty())
+            {
+                log_error("Plugin " + name + " not loaded: " + plugins.back()->error());
+            }
+            log("Tracking plugin " + name + " at " + local);
+            return plugins.back();
+        }
+
+        /*
+        * Downloads the plugins that changed in the release found by is_update_available() and switches to them
+        * 
+        * Each new build is saved as <name>-<tag>-<digest>.so beside the old one
+        * and loaded while the old one keeps running. Once it is live, the
+        * original path is replaced with it for the next start. Returns false if
+        * any plugin failed, the others are still updated
+        */
+        bool update_plugins()
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            collect_plugins();
+            bool ok = true;
+            for (const BundleAsset& release : plugin_release)
+            {
+                shared_ptr<PluginModule> plugin;
+                for (const shared_ptr<PluginModule>& tracked : plugins)
+                {
+                    if (tracked->name() == release.name)
+                    {
+                        plugin = tracked;
+                    }
+                }
+                // is_update_available() only queues plugins with a published digest
+                string version = release.digest;
+                {
+                    PluginModule::Snapshot running = plugin->snapshot();
+                    if (running && (running->version() == version || FingerprintCache().digest(running->path()) == version))
+                    {
+                        continue;
+                    }
+                }
+
+                // A new file per version: dlopen() would return the loaded library for a known path
+                fs::path target(plugin->path());
+                string label;
+                for (char c : release_tag + "-" + release.digest.substr(0, 8))
+                {
+                    label += (isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '-') ? c : '_';
+                }
+                fs::path versioned = target.parent_path() / (target.stem().string() + "-" + label + target.extension().string());
+                string downloaded = download_update(target.parent_path().string(), release.url,
+                    "." + target.filename().string() + ".autoupdater-new", release.size, release.digest, false);
+                error_code ec;
+                if (downloaded.empty())
+                {
+                    log_error("Could not download plugin " + release.name);
+                    ok = false;
+                    continue;
+                }
+                fs::file_status status = fs::status(target, ec);
+                if (fs::exists(status))
+                {
+                    fs::permissions(downloaded, status.permissions(), ec);
+                }
+                fs::rename(downloaded, versioned, ec);
+                if (ec)
+                {
+                    log_error("Could not save " + versioned.string() + ": " + ec.message());
+                    fs::remove(downloaded, ec);
+                    ok = false;
+                    continue;
+                }
+
+                string error;
+                if (!plugin->reload(versioned.string(), version, error))
+                {
+                    log_error("Could not switch plugin " + release.name + ": " + error);
+                    fs::remove(versioned, ec);
+                    ok = false;
+                    continue;
+                }
+
+                // The next start loads the new build from the usual path
+                string link_path = target.string() + ".autoupdater-link";
+                fs::remove(link_path, ec);
+                fs::create_hard_link(versioned, link_path, ec);
+                if (!ec)
+                {
+                    fs::rename(link_path, target, ec);
+                }
+                if (ec)
+                {
+                    log_error("Plugin " + release.name + " is live, but " + target.string() + " still has the old build: " + ec.message());
+                }
+                else if (!release.digest.empty())
+                {
+                    FingerprintCache().remember(target.string(), release.digest);
+                }
+                log("Plugin " + release.name + " switched to " + versioned.filename().string());
+            }
+            return ok;
+        }
+
+        /*
+        * Predicts what stage_update() and commit_update() will cost, without downloading
+        * 
+        * Uses the metadata of the release found by is_update_available(), the
+        * staged update and peer store, the filesystems involved and the throughput
+        * measured by earlier downloads. stage_update() follows the chosen strategy
+        */
+        UpdatePlan plan()
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            PlanInputs inputs;
+            inputs.release_tag = release_tag;
+            inputs.asset_url = release_url;
+            inputs.asset_size = release_size;
+            inputs.compressed_url = compressed_url;
+            inputs.compressed_size = compressed_size;
+            if (!bundle_release.empty())
+            {
+                // Bundles are downloaded uncompressed, all assets count
+                inputs.asset_size = 0;
+                for (const BundleAsset& asset : bundle_release)
+                {
+                    inputs.asset_size += asset.size;
+                }
+                inputs.compressed_url.clear();
+            }
+            inputs.staged = !staged_file.empty() && staged_url == release_url;
+            inputs.cached = peer_cache && !release_digest.empty() && peer_cache->has(release_digest);
+
+            // Best throughput measured for the origin or any mirror
+            if (!release_url.empty())
+            {
+                MirrorStats stats;
+                inputs.throughput = stats.throughput(MirrorSelector::host_of(release_url));
+                for (const string& mirror : mirrors)
+                {
+                    inputs.throughput = max(inputs.throughput, stats.throughput(MirrorSelector::host_of(mirror)));
+                }
+            }
+
+            error_code ec;
+            fs::path current_exe = fs::canonical("/proc/self/exe", ec);
+            fs::path temp_dir = fs::temp_directory_path(ec);
+            if (!current_exe.empty() && !temp_dir.empty())
+            {
+                inputs.executable_size = static_cast<int64_t>(fs::file_size(current_exe, ec));
+                inputs.same_filesystem = same_filesystem(temp_dir.string(), current_exe.parent_path().string());
+                inputs.reflink = supports_reflink(current_exe.parent_path().string());
+            }
+
+            UpdatePlan result = UpdatePlanner::estimate(inputs);
+            log(string("Plan: ") + strategy_name(result.strategy) + ", " + to_string(result.transfer_bytes / 1024) +
+                "KB to transfer, " + to_string((result.disk_read_bytes + result.disk_write_bytes) / 1024) +
+                "KB disk I/O, about " + to_string(result.predicted_duration.count()) + "ms");
+            return result;
+        }
+
+        /*
+        * Main update function - applies updates
+        * 
+        * Workflow:
+        * 1. Downloads the update (stage_update)
+        * 2. Waits for a quiet moment if an apply policy is set (commit_when_quiet)
+        * 3. Creates backup
+        * 4. Replaces executable (commit_update)
+        * 
+        * In apply-on-exit and apply-on-next-start modes, steps 3 and 4 are
+        * prepared and only the final rename is left for later
+        */
+        bool update()
+        {
+            {
+                lock_guard<recursive_mutex> guard(operation_lock);
+                if (is_binary_stale())
+                {
+                    log("Update already installed by another process, restart to apply it");
+                    return true;
+                }
+                bool deferred = (apply_on_exit || apply_on_next_start) && bundle_assets.empty() &&
+                    archive_kind == ArchiveFormat::Unknown;
+                if (deferred && !deferred_url.empty() && deferred_url == release_url)
+                {
+                    log("Update already prepared, waiting to be applied");
+                    return true;
+                }
+                if (!stage_update())
+                {
+                    return false;
+                }
+                if (deferred)
+                {
+                    return prepare_deferred_apply();
+                }
+            }
+            return commit_when_quiet();
+        }
+
+        /*
+        * Leaves the running process untouched: update() only downloads and prepares
+        * 
+        * The new executable is installed when the process exits normally or on
+        * SIGINT/SIGTERM/SIGHUP (if the application has no handler of its own),
+        * which costs a rename and an fsync. If the process is killed instead, the
+        * next start completes the update. Linux/macOS; Windows already applies at reboot
+        */
+        void set_apply_on_exit(bool enabled)
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            apply_on_exit = enabled;
+            if (!enabled && ApplyJournal::cancel_commit_at_exit())
+            {
+                deferred_url.clear();
+                log("Cancelled the update waiting for exit");
+            }
+        }
+
+        /*
+        * Leaves the running process untouched: update() only downloads and prepares
+        * 
+        * The prepared update stays beside the executable and is installed by
+        * StartupApply::run() at the start of main() on the next launch, which then
+        * re-executes the new build. Without it, the constructor installs it and it
+        * runs from the launch after. Apply-on-exit takes precedence if both are set
+        */
+        void set_apply_on_next_start(bool enabled)
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            apply_on_next_start = enabled;
+            if (!enabled && next_start_journal)
+            {
+                next_start_journal->cancel();
+                next_start_journal.reset();
+                deferred_url.clear();
+                log("Cancelled the update waiting for the next start");
+            }
+        }
+
+        /*
+        * Stages the executable in a sealed in-memory file instead of the temp directory
+        * 
+        * Nothing is written to disk by stage_update(). run_staged() starts the
+        * new version straight from memory for a test run; update() and
+        * commit_update() persist it as usual, copying it from memory with
+        * copy_file_range(). Bundles and archives are still staged on disk.
+        * Linux only, elsewhere updates are staged on disk
+        */
+        void set_memory_staging(bool enabled)
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            memory_staging = enabled;
+        }
+
+        /*
+        * Commits the staged update once the apply policy allows it
+        * 
+        * Blocks while the host is busy, outside maintenance windows or at a load
+        * peak. Other operations (e.g. webhook triggers) keep running meanwhile.
+        * Commits right away without an apply policy
+        */
+        bool commit_when_quiet()
+        {
+            unique_lock<recursive_mutex> guard(operation_lock);
+            if (apply_scheduler && !staged_file.empty())
+            {
+                set_phase(UpdatePhase::Deferred);
+                shared_ptr<ApplyScheduler> scheduler = apply_scheduler;
+                auto deferred_since = chrono::steady_clock::now();
+                guard.unlock();
+
+                // A sibling process installing the update ends the wait too
+                scheduler->wait(deferred_since, [this]() { return is_binary_stale(); }, [this](const string& reason)
+                {
+                    log("Deferring update: " + reason);
+                });
+                guard.lock();
+                if (is_binary_stale())
+                {
+                    log("Update already installed by another process, restart to apply it");
+                    discard_staged_update();
+                    return true;
+                }
+                log("Host is quiet, applying update");
+            }
+            return commit_update();
+        }
+
+        // Prepares the staged update and leaves the final rename to the process exit or the next start
+        bool prepare_deferred_apply()
+        {
+            #ifdef _WIN32
+            return commit_update();
+            #else
+            lock_guard<recursive_mutex> guard(operation_lock);
+            error_code ec;
+            fs::path current_exe = fs::canonical("/proc/self/exe", ec);
+            if (ec)
+            {
+                log_error("Could not determine current executable path");
+                discard_staged_update();
+                return false;
+            }
+
+            // A release prepared earlier holds the journal
+            ApplyJournal::cancel_commit_at_exit();
+            if (next_start_journal)
+            {
+                next_start_journal->cancel();
+                next_start_journal.reset();
+            }
+            deferred_url.clear();
+
+            auto journal = make_unique<ApplyJournal>(current_exe.string());
+            string error;
+            if (!journal->prepare(staged_file, release_tag, staged_digest, error))
+            {
+                log_error("Could not prepare update: " + error);
+                discard_staged_update();
+                return false;
+            }
+            if (apply_on_exit)
+            {
+                installed_here = true;
+                ApplyJournal::commit_at_exit(move(journal));
+                log("Update to " + release_tag + " will be applied when the process exits");
+            }
+            else
+            {
+                // Keeping the journal open and locked stops other instances from installing it meanwhile
+                next_start_journal = move(journal);
+                log("Update to " + release_tag + " will be applied at the next start");
+            }
+            deferred_url = release_url;
+            discard_staged_update();
+            return true;
+            #endif
+        }
+
+        /*
+        * Downloads and verifies the update without applying it
+        * 
+        * Calls the update-ready callback once the release is staged.
+        * Staging the same release again is a no-op
+        */
+        bool stage_update()
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            if (release_url.empty())
+            {
+                log("Please run is_update_available() first");
+                return false;
+            }
+
+            if (!staged_file.empty() && staged_url == release_url)
+            {
+                log("Release already staged at " + staged_file);
+                return true;
+            }
+            discard_staged_update();
+
+            // A single executable can be staged in memory instead of the temp directory
+            string tmp_path;
+            if (memory_staging && bundle_release.empty() && archive_kind == ArchiveFormat::Unknown)
+            {
+                string error;
+                memory_stage = MemoryStage::create(asset_name, error);
+                if (!memory_stage)
+                {
+                    log("Staging on disk, " + error);
+                }
+            }
+            if (!memory_stage)
+            {
+                // Create temp directory for downloads
+                tmp_path = create_temp_directory();
+                if (tmp_path.empty())
+                {
+                    log("Got empty tmp path");
+                    return false;
+                }
+            }
+
+            // Download the update file, compressed if that is cheaper
+            bool compressed = !memory_stage && plan().strategy == UpdateStrategy::Compressed;
+            auto download = [&]()
+            {
+                if (!bundle_release.empty())
+                {
+                    return download_bundle(tmp_path);
+                }
+                if (archive_kind != ArchiveFormat::Unknown)
+                {
+                    return download_archive();
+                }
+                if (memory_stage)
+                {
+                    // Written through /proc/self/fd, then sealed so that nothing changes it after verification
+                    fs::path memory_path = memory_stage->path();
+                    string file = download_update(memory_path.parent_path().string(), release_url,
+                        memory_path.filename().string(), release_size, release_digest, true);
+                    string error;
+                    if (!file.empty() && !memory_stage->seal(error))
+                    {
+                        log_error(error);
+                        file.clear();
+                    }
+                    return file;
+                }
+                if (!compressed)
+                {
+                    return download_update(tmp_path, release_url, asset_name, release_size, release_digest, true);
+                }
+                string archive = download_update(tmp_path, compressed_url, asset_name + ".gz", compressed_size, compressed_digest, false);
+                return archive.empty() ? archive : decompress_update(archive, (fs::path(tmp_path) / asset_name).string());
+            };
+
+            string downloaded_file;
+            if (low_impact)
+            {
+                // Priorities are per thread, so use one that can keep them
+                thread worker([&]()
+                {
+                    log("Low-impact download: " + low_impact->lower_current_thread());
+                    downloaded_file = download();
+                });
+                worker.join();
+            }
+            else
+            {
+                downloaded_file = download();
+            }
+            if (downloaded_file.empty())
+            {
+                log_error("Could not download release");
+                if (!tmp_path.empty())
+                {
+                    fs::remove_all(tmp_path);
+                }
+                memory_stage.reset();
+                return false;
+            }
+
+            staged_dir = tmp_path;
+            staged_file = downloaded_file;
+            staged_url = release_url;
+            staged_digest = release_digest;
+            log(memory_stage ? "Update staged in memory, nothing written to disk" : "Update staged at " + staged_file);
+
+            // The apply may be deferred for hours, keep the download out of the page cache meanwhile
+            PageCache::evict(staged_file);
+            set_phase(UpdatePhase::Staged);
+
+            if (update_ready_callback)
+            {
+                update_ready_callback(release_tag);
+            }
+            return true;
+        }
+
+        /*
+        * Replaces the current executable with the staged update
+        */
+        bool commit_update()
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            if (staged_file.empty())
+            {
+                log("Nothing staged, please run stage_update() first");
+                return false;
+            }
+            if (!staged_bundle.empty() || !staged_tree.empty())
+            {
+                return commit_bundle();
+            }
+            string tmp_path = staged_dir;
+            string downloaded_file = staged_file;
+            set_phase(UpdatePhase::Applying);
+
+            // Get current executable path (platform-specific)
+            fs::path current_exe;
+            try
+            {
+                current_exe = fs::canonical("/proc/self/exe"); // Linux
+            }
+            catch (...)
+            {
+                #ifdef _WIN32
+                    char path[MAX_PATH];
+                    GetModuleFileNameA(NULL, path, MAX_PATH);
+                    current_exe = fs::path(path);
+                #else
+                    log_error("Could not determine current executable path");
+                    discard_staged_update();
+                    return false;
+                #endif
+            }
+
+            #ifdef _WIN32
+            // Create backup before replacing
+            fs::path backup_path = fs::path(tmp_path) / (current_exe.filename().string() + ".bak");
+            try
+            {
+                log("Creating backup of current executeble at " + tmp_path + "/" + (current_exe.filename().string() + ".bak"));
+                fs::copy_file(current_exe, backup_path, fs::copy_options::overwrite_existing);
+            }
+            catch (...)
+            {
+                log_error("Failed to create backup of current executable");
+                discard_staged_update();
+                return false;
+            }
+
+            // Replace current executable
+            try
+            {
+                // Windows needs special handling
+                MoveFileExA(downloaded_file.c_str(), current_exe.string().c_str(), 
+                        MOVEFILE_DELAY_UNTIL_REBOOT | MOVEFILE_REPLACE_EXISTING);
+                log("Update scheduled for next restart");
+            }
+            catch (const exception& e)
+            {
+                log_error(string("Replacement failed: ") + e.what());
+                
+                // Attempt to restore backup
+                try
+                {
+                    fs::copy(backup_path, current_exe, fs::copy_options::overwrite_existing);
+                    log("Restored from backup");
+                }
+                catch (...)
+                {
+                    log("Critical: Failed to restore from backup!");
+                }
+                
+                discard_staged_update();
+                return false;
+            }
+            #else
+            // Linux/macOS - journaled replacement, an interrupted one is finished by recover_interrupted_update()
+            log("Attempting to replace current executable");
+
+            // First close curl handles
+            cleanupCurl();
+
+            error_code ec;
+            log("Current executable size: " + to_string(fs::file_size(current_exe, ec)) + " bytes");
+            log("Downloaded file size: " + to_string(fs::file_size(downloaded_file, ec)) + " bytes");
+
+            // Our own install watcher should not report this as someone else's
+            installed_here = true;
+
+            // What the running build touched is what the new one will need first
+            vector<ResidentRange> profile = PageCache::record_profile(current_exe.string());
+
+            ApplyJournal journal(current_exe.string());
+            log("Creating backup of current executable at " + journal.backup());
+            string error;
+            if (!journal.install(downloaded_file, release_tag, staged_digest, error))
+            {
+                installed_here = false;
+                log_error("Replacement failed: " + error);
+                discard_staged_update();
+                return false;
+            }
+
+            // The next check compares against the verified digest without hashing the file
+            FingerprintCache().remember(current_exe.string(), staged_digest);
+            log("Replacement successful");
+
+            uint64_t prefetched = PageCache::warm(current_exe.string(), profile);
+            if (prefetched > 0)
+            {
+                log("Prefetching " + to_string(prefetched / 1024) + "KB of the new executable" +
+                    (profile.empty() ? "" : " (pages the previous build used)"));
+            }
+            #endif
+
+            // Clean up (except on Windows where we need to keep files for reboot)
+            #ifndef _WIN32
+            if (!tmp_path.empty())
+            {
+                fs::remove_all(tmp_path);
+            }
+            #endif
+            staged_file.clear();
+            staged_dir.clear();
+            memory_stage.reset();
+            set_phase(UpdatePhase::Applied);
+
+            return true;
+        }
+
+        /*
+        * Replaces the running process with the update staged in memory, with the same arguments
+        * 
+        * The installed executable stays untouched: the new version runs from
+        * the sealed memfd and calls persist_running_update() once it is
+        * satisfied with itself. If it fails instead, the next start runs the
+        * previous version. Needs set_memory_staging() and stage_update().
+        * Returns only on failure
+        */
+        bool run_staged(char* argv[])
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            if (!memory_stage)
+            {
+                log("Nothing staged in memory, please run stage_update() with memory staging first");
+                return false;
+            }
+            #ifdef __linux__
+            // The digest lets the new process check that it runs exactly this file
+            string error;
+            if (!memory_stage->seal(error))
+            {
+                log_error("Could not run the staged update: " + error);
+                return false;
+            }
+            string digest = staged_digest.empty() ? sha256_file(memory_stage->path()) : staged_digest;
+
+            // A test run starting the next test run keeps the original target
+            string target = staged_run().target;
+            if (target.empty())
+            {
+                error_code ec;
+                target = fs::canonical("/proc/self/exe", ec).string();
+                if (ec)
+                {
+                    log_error("Could not determine current executable path");
+                    return false;
+                }
+            }
+            setenv(install_target_variable, target.c_str(), 1);
+            setenv(install_tag_variable, release_tag.c_str(), 1);
+            setenv(install_digest_variable, digest.c_str(), 1);
+            log("Running " + release_tag + " from memory, " + target + " stays untouched");
+
+            memory_stage->exec(argv, environ, error);
+            unsetenv(install_target_variable);
+            unsetenv(install_tag_variable);
+            unsetenv(install_digest_variable);
+            log_error("Could not run the staged update: " + error);
+            #else
+            (void)argv;
+            #endif
+            return false;
+        }
+
+        /*
+        * Writes the running version to disk, in a process started by run_staged()
+        * 
+        * Installs /proc/self/exe (the memfd) over the executable that
+        * run_staged() was called from, through the apply journal. Call it when
+        * the test run has proven itself, at any later point. Returns false
+        * (doing nothing) in a process that was not started from memory, and
+        * refuses unless the running file is a sealed memfd with the digest
+        * run_staged() recorded
+        */
+        bool persist_running_update()
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            #ifdef __linux__
+            StagedRun& run = staged_run();
+            if (run.target.empty() || run.persisted)
+            {
+                log(run.persisted ? "The running update is already persisted" : "Not running an update from memory, nothing to persist");
+                return false;
+            }
+            if (run.digest.empty())
+            {
+                log_error("No digest for the running update, not persisting it");
+                return false;
+            }
+
+            // Sealed: the bytes hashed below are the bytes installed
+            int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+            struct stat info;
+            int required = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+            int seals = fd >= 0 ? fcntl(fd, F_GET_SEALS) : -1;
+            if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || seals < 0 || (seals & required) != required)
+            {
+                log_error("The running executable is not a sealed in-memory file, not persisting it");
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                return false;
+            }
+            string running = "/proc/self/fd/" + to_string(fd);
+            string actual = sha256_file(running);
+            if (actual != run.digest)
+            {
+                log_error("The running executable has sha256 " + actual + ", expected " + run.digest + ", not persisting it");
+                close(fd);
+                return false;
+            }
+
+            ApplyJournal journal(run.target);
+            string error;
+            bool installed = journal.install(running, run.tag, run.digest, error);
+            close(fd);
+            if (!installed)
+            {
+                log_error("Could not persist the running update: " + error);
+                return false;
+            }
+            run.persisted = true;
+            FingerprintCache().remember(run.target, run.digest);
+            log("Persisted " + (run.tag.empty() ? string("the running update") : run.tag) + " to " + run.target);
+            return true;
+            #else
+            return false;
+            #endif
+        }
+
+        /*
+        * Checks if a newer release is available on GitHub
+        * 
+        * Compares published dates and finds matching asset
+        */
+        bool is_update_available()
+        {
+            lock_guard<recursive_mutex> guard(operation_lock);
+            log("Checking for updates");
+            set_phase(UpdatePhase::Checking);
+            collect_plugins();
+            if (!initialized && !initCurl())
+            {
+                return false;
+            }
+
+            // Wait for our turn in the shared GitHub budget. A cache daemon or other local base does not spend it
+            bool github_api = MirrorSelector::host_of(api_base) == "api.github.com";
+            chrono::milliseconds wait{0};
+            if (github_api && !rate_limit->acquire(max_rate_limit_wait, wait))
+            {
+                log_error("Rate limit budget exhausted, next request allowed in " + to_string(wait.count() / 1000) + "s");
+                return false;
+            }
+            if (wait.count() > 0)
+            {
+                log("Pacing API requests, waiting " + to_string(wait.count()) + "ms");
+                this_thread::sleep_for(wait);
+            }
+
+            // Get latest release info from GitHub API
+            string url = api_base + "/repos/" + github_repo_owner + "/" + github_repo_name + "/releases/latest";
+            string response;
+            rate_limit_headers.clear();
+            
+            // Set curl options, the ones pointing at locals are cleared when this returns
+            RequestOptionsScope request_scope{ curl };
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, RateLimitHeaders::header_callback);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &rate_limit_headers);
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, TlsSettings::may_authenticate(url) ? api_headers : nullptr);
+            curl_easy_setopt(curl, CURLOPT_FAILONERROR, 0L);     // Rate-limit responses are handled below
+            TlsSettings::apply(curl);
+            curl_easy_setopt(curl, CURLOPT_USERAGENT, "AutoUpdater/1.0");
+            
+            CURLcode res = curl_easy_perform(curl);
+            if (res != CURLE_OK)
+            {
+                log_error(string("Curl failed: ") + curl_easy_strerror(res));
+                return false;
+            }
+
+            long http_code = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+            if (github_api)
+            {
+                rate_limit->record(http_code, rate_limit_headers);
+            }
+            if (http_code == 403 || http_code == 429)
+            {
+                log_error("Github API rate limit hit (HTTP " + to_string(http_code) + ")");
+                log("Rate limit remaining: " + to_string(rate_limit_headers.remaining) +
+                    ", resets at " + format_time(static_cast<time_t>(rate_limit_headers.reset)));
+                return false;
+            }
+
+            // Parse JSON response
+            istringstream iss(response);
+            Json::Value root;
+            Json::CharReaderBuilder builder;
+            string errors;
+            bool parsingSuccessful = Json::parseFromStream(builder, iss, &root, &errors);
+
+            if (!parsingSuccessful)
+            {
+                log_error("Failed to parse json from github api: " + errors);
+                log("Github API response: " + response);
+                return false;
+            }
+            
+            if (root.isMember("message") && root["message"].asString() == "Not Found")
+            {
+                log_error("Repository not found");
+                log("Github API response: " + response);
+                return false;
+            }
+
+            // Get the published date
+            if (!root.isMember("published_at"))
+            {
+                log_error("No published_at field in response");
+                log("Github API response: " + response);
+                return false;
+            }
+
+            // Extract just the date part (first 10 chars of ISO string)
+            string latest_full_date = root["published_at"].asString();
+            string latest_date = latest_full_date.substr(0, 10);  // "2025-06-08"
+
+            // Compare dates
+            bool is_newer = latest_date > current_release_date;
+
+            auto [assets, tag_name, asset_ids] = parse_github_api_response(response);
+            release_tag = tag_name;
+
+            // Staged rollout: wait until the release reaches this host's bucket
+            bool held_back = false;
+            if (is_newer && rollout)
+            {
+                auto published = chrono::system_clock::from_time_t(parse_iso8601(latest_full_date));
+                double bucket = rollout->bucket(tag_name);
+                double coverage = rollout->coverage(tag_name, published, chrono::system_clock::now());
+                if (bucket >= coverage)
+                {
+                    ostringstream message;
+                    message << fixed << setprecision(2) << "Release " << tag_name << " is rolled out to "
+                        << coverage << "% of hosts, this host is at " << bucket << "%";
+                    log(message.str());
+                    is_newer = false;
+                    held_back = true;
+                }
+            }
+
+            log("Current release date: " + current_release_date);
+            log("Latest release date: " + latest_date);
+
+            log(string("Latest tag ") + tag_name);
+            log("Assets:");
+
+            // Print the results
+            if (verbose)
+            {
+                for (const auto& [name, url] : assets)
+                {
+                    cout << "    " << name << " (id: " << asset_ids[name] << ") => " << url << endl;
+                }
+            }
+
+            // Find the asset with the matching name
+            if (assets.find(asset_name) != assets.end())
+            {
+                log("Selected asset: " + asset_name);
+                release_url = assets[asset_name];
+                release_size = 0;
+                release_digest.clear();
+                compressed_url.clear();
+                compressed_size = 0;
+                compressed_digest.clear();
+                for (const Json::Value& asset : root["assets"])
+                {
+                    string name = asset.get("name", "").asString();
+                    if (name == asset_name)
+                    {
+                        release_size = asset.get("size", 0).asInt64();
+                        release_digest = parse_sha256_digest(asset.get("digest", "").asString());
+                    }
+                    else if (name == asset_name + ".gz")
+                    {
+                        // Gzip variant, only used when plan() finds it cheaper
+                        compressed_url = asset.get("browser_download_url", "").asString();
+                        compressed_size = asset.get("size", 0).asInt64();
+                        compressed_digest = parse_sha256_digest(asset.get("digest", "").asString());
+                    }
+                }
+            }
+            else
+            {
+                log_error("Could not find asset with name: " + asset_name);
+                return false;
+            }
+
+            // The other assets of a bundle, all of which have to be present
+            bundle_release.clear();
+            if (!bundle_assets.empty())
+            {
+                bundle_release.push_back({ asset_name, bundle_executable, release_url, release_size, release_digest, "" });
+                for (const string& name : bundle_assets)
+                {
+                    for (const Json::Value& asset : root["assets"])
+                    {
+                        if (asset.get("name", "").asString() == name)
+                        {
+                            bundle_release.push_back({ name, name, asset.get("browser_download_url", "").asString(),
+                                asset.get("size", 0).asInt64(), parse_sha256_digest(asset.get("digest", "").asString()), "" });
+                        }
+                    }
+                    if (bundle_release.back().name != name)
+                    {
+                        log_error("Release " + tag_name + " is missing bundle asset " + name);
+                        bundle_release.clear();
+                        return false;
+                    }
+                }
+                // A swapped library runs with the application's rights just like the executable
+                for (const BundleAsset& asset : bundle_release)
+                {
+                    if (asset.digest.empty() && (&asset == &bundle_release.front() || BundleDownloader::code_name(asset.name)))
+                    {
+                        log_error("Release " + tag_name + " publishes no SHA-256 for " + asset.name +
+                            ", executable code in a bundle is only installed verified");
+                        bundle_release.clear();
+                        return false;
+                    }
+                }
+            }
+
+            // Data assets and plugins are swapped in by update_data_assets() and update_plugins(), whatever the executable does.
+            // A release the rollout holds back from this host is held back as a whole
+            data_release.clear();
+            plugin_release.clear();
+            if (!held_back)
+            {
+                for (const shared_ptr<DataAsset>& tracked : data_assets)
+                {
+                    if (!find_release_asset(root, tracked->name(), tracked->path(), data_release))
+                    {
+                        log("Release " + tag_name + " has no data asset " + tracked->name());
+                    }
+                }
+                for (const shared_ptr<PluginModule>& tracked : plugins)
+                {
+                    if (!find_release_asset(root, tracked->name(), tracked->path(), plugin_release))
+                    {
+                        log("Release " + tag_name + " has no plugin " + tracked->name());
+                    }
+                    else if (plugin_release.back().digest.empty())
+                    {
+                        // A plugin is loaded into the running process, just like a library in a bundle
+                        log_error("Release " + tag_name + " publishes no SHA-256 for " + tracked->name() +
+                            ", executable code in a plugin is only installed verified");
+                        plugin_release.pop_back();
+                    }
+                }
+            }
+
+            // Re-tagged or re-published builds: identical bytes need no download or restart
+            if (is_newer && !bundle_release.empty())
+            {
+                if (bundle_installed())
+                {
+                    log("Release " + tag_name + " has the same content as the installed bundle");
+                    is_newer = false;
+                }
+            }
+            else if (is_newer && !release_digest.empty() && archive_kind == ArchiveFormat::Unknown)
+            {
+                error_code ec;
+                fs::path current_exe = fs::canonical("/proc/self/exe", ec);
+                if (!current_exe.empty() && FingerprintCache().digest(current_exe.string()) == release_digest)
+                {
+                    log("Release " + tag_name + " has the same content as the installed executable");
+                    is_newer = false;
+                }
+            }
+
+            if (status_board)
+            {
+                status_board->set_check(tag_name, is_newer ? UpdatePhase::Available : UpdatePhase::UpToDate);
+            }
+
+            if (is_newer)
+            {
+                log("Newer release available");
+                return true;
+            }
+            else
+            {
+                log("No newer releases found");
+                return false;
+            }
+        }
+
+    private:
+        CURL* curl;
+        bool verbose;
+        string release_url;
+        bool initialized;
         string current_release_date;
         string github_repo_owner;
         string github_repo_name;
         string asset_name;
 
-        // Progress tracking
-        chrono::time_point<chrono::steady_clock> last_progress_update;
-        static constexpr chrono::milliseconds progress_update_interval{100};
+        // API authentication and rate limiting
+        string api_base = "https://api.github.com";
+        curl_slist* api_headers = nullptr;
+        unique_ptr<RateLimitBudget> rate_limit;
+        RateLimitHeaders rate_limit_headers;
+        chrono::milliseconds max_rate_limit_wait{30000};
+
+        // Release mirrors
+        vector<string> mirrors;
+        bool multi_source = false;
+
+        // Staged update waiting for commit_update()
+        recursive_mutex operation_lock;
+        string release_tag;
+        string staged_dir;
+        string staged_file;
+        string staged_url;
+        string staged_digest;
+
+        // Executable staged in a sealed memfd instead of the temp directory
+        bool memory_staging = false;
+        unique_ptr<MemoryStage> memory_stage;
+        static constexpr const char* install_target_variable = "AUTOUPDATER_INSTALL_TARGET";
+        static constexpr const char* install_tag_variable = "AUTOUPDATER_INSTALL_TAG";
+        static constexpr const char* install_digest_variable = "AUTOUPDATER_INSTALL_DIGEST";
+
+        // What run_staged() passed to this process
+        struct StagedRun
+        {
+            string target;
+            string tag;
+            string digest;
+            bool persisted = false;
+        };
+
+        /*
+        * Takes the run_staged() variables out of the environment, once per process
+        *
+        * Runs from the constructor, so that processes the application starts
+        * later do not inherit them and take themselves for a staged run
+        */
+        static StagedRun& staged_run()
+        {
+            static StagedRun run = []()
+            {
+                StagedRun result;
+                #ifdef __linux__
+                for (auto [name, value] : { make_pair(install_target_variable, &result.target),
+                    make_pair(install_tag_variable, &result.tag), make_pair(install_digest_variable, &result.digest) })
+                {
+                    const char* found = getenv(name);
+                    if (found)
+                    {
+                        *value = found;
+                        unsetenv(name);
+                    }
+                }
+                #endif
+                return result;
+            }();
+            return run;
+        }
+
+        // Assets installed together with the executable
+        vector<string> bundle_assets;
+        string bundle_dir;
+        string bundle_executable;
+        curl_off_t bundle_rate = 0;
+        size_t bundle_parallel = 4;
+        vector<BundleAsset> bundle_release;
+        vector<BundleAsset> staged_bundle;
+
+        // Data files swapped in while the process runs
+        vector<shared_ptr<DataAsset>> data_assets;
+        vector<BundleAsset> data_release;
+
+        // Shared-library plugins switched while the process runs
+        vector<shared_ptr<PluginModule>> plugins;
+        vector<BundleAsset> plugin_release;
+
+        // Release archive extracted into the install directory
+        ArchiveFormat archive_kind = ArchiveFormat::Unknown;
+        int archive_strip = 0;
+        string staged_tree;
+        vector<string> staged_written;
+
+        // Apply-on-exit and apply-on-next-start modes
+        bool apply_on_exit = false;
+        bool apply_on_next_start = false;
+        string deferred_url;
+        unique_ptr<ApplyJournal> next_start_journal;
+        function<void(const string&)> update_ready_callback;
+        unique_ptr<WebhookListener> webhook_listener;
+
+        // Release verification and LAN peer distribution
+        string release_digest;
+        unique_ptr<PeerCache> peer_cache;
+
+        // Shared-memory status for external monitoring
+        unique_ptr<StatusBoard> status_board;
+        curl_off_t status_offset = 0;
+
+        // Detection of updates installed by sibling processes
+        unique_ptr<InstallWatcher> install_watcher;
+        bool installed_here = false;
+
+        // Load-aware apply policy
+        shared_ptr<ApplyScheduler> apply_scheduler;
+
+        // Low-impact background downloads
+        unique_ptr<LowImpactMode> low_impact;
+        unique_ptr<BandwidthController> bandwidth;
+
+        // Rolling restarts across worker processes
+        unique_ptr<RestartCoordinator> restart_coordinator;
+
+        // Staged rollout across the fleet
+        unique_ptr<Rollout> rollout;
+
+        // Checks of the first bytes of each download
+        vector<ContentValidator> content_validators{ html_page_validator() };
+        curl_off_t release_size = 0;
+        string compressed_url;
+        curl_off_t compressed_size = 0;
+        string compressed_digest;
+        chrono::milliseconds mirror_probe_timeout{2000};
+        long failover_min_speed = 16 * 1024;
+        long failover_window_seconds = 10;
+        static constexpr curl_off_t min_throughput_sample = 64 * 1024;
+
+        // Progress tracking
+        chrono::time_point<chrono::steady_clock> last_progress_update;
+        static constexpr chrono::milliseconds progress_update_interval{100};
+
+        /*
+        * Progress callback for CURL - shows download progress bar
+        */
+        static int progress_callback(void* clientp, 
+                                curl_off_t dltotal, 
+                                curl_off_t dlnow, 
+                                curl_off_t ultotal, 
+                                curl_off_t ulnow)
+        {
+            AutoUpdater* self = static_cast<AutoUpdater*>(clientp);
+            if (self && self->bandwidth && self->bandwidth->sample(dlnow))
+            {
+                curl_easy_setopt(self->curl, CURLOPT_MAX_RECV_SPEED_LARGE, self->bandwidth->limit());
+                if (self->verbose)
+                {
+                    self->finish_progress_bar();
+                }
+                self->log("Download rate limit now " +
+                    (self->bandwidth->limit() > 0 ? to_string(self->bandwidth->limit() / 1024) + "KB/s" : string("off")));
+            }
+            if (self && self->status_board && dltotal > 0)
+            {
+                self->status_board->set_progress(self->status_offset + dlnow, self->status_offset + dltotal);
+            }
+            if (self && self->verbose && dltotal > 0) {
+                const int bar_width = 50;
+                float progress = static_cast<float>(dlnow) / dltotal;
+                int pos = static_cast<int>(bar_width * progress);
+
+                cout << "\r[";
+                for (int i = 0; i < bar_width; ++i)
+                {
+                    if (i < pos) cout << "=";
+                    else if (i == pos) cout << ">";
+                    else cout << " ";
+                }
+                cout << "] " << static_cast<int>(progress * 100.0) << "% "
+                    << dlnow/1024 << "KB/" << dltotal/1024 << "KB";
+                cout.flush();
+            }
+            return 0;
+        }
+
+        void update_progress_bar(curl_off_t dlnow, curl_off_t dltotal)
+        {
+            auto now = chrono::steady_clock::now();
+            if (now - last_progress_update < progress_update_interval)
+            {
+                return;
+            }
+            last_progress_update = now;
+
+            const int bar_width = 50;
+            float progress = static_cast<float>(dlnow) / dltotal;
+            int pos = static_cast<int>(bar_width * progress);
+
+            cout << "\r[";
+            for (int i = 0; i < bar_width; ++i) {
+                if (i < pos) cout << "=";
+                else if (i == pos) cout << ">";
+                else cout << " ";
+            }
+            cout << "] " << static_cast<int>(progress * 100.0) << "% "
+                << dlnow/1024 << "KB/" << dltotal/1024 << "KB";
+            cout.flush();
+        }
+
+        // Clear line
+        void finish_progress_bar()
+        {
+            cout << "\r" << string(100, ' ') << "\r";
+            cout.flush();
+        }
+
+        // Helper to parse ISO 8601 dates
+        time_t parse_iso8601(const string& datetime_str)
+        {
+            tm tm = {};
+            istringstream ss(datetime_str);
+            ss >> get_time(&tm, "%Y-%m-%dT%H:%M:%SZ");
+            return timegm(&tm);  // UTC time
+        }
+
+        // Helper to format time for logging
+        string format_time(time_t time) {
+            tm tm_info;
+            #ifdef _MSC_VER
+                gmtime_s(&tm_info, &time);
+            #else
+                tm_info = *gmtime(&time);
+            #endif
+            char buffer[26];
+            strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm_info);
+            return string(buffer);
+        }
+        
+        // Helper to move the status board to a new phase
+        void set_phase(UpdatePhase phase)
+        {
+            if (status_board)
+            {
+                status_board->set_phase(phase);
+            }
+        }
+
+        // Helper to log an error and publish it as the last error
+        void log_error(const string& message)
+        {
+            log(message);
+            if (status_board)
+            {
+                status_board->set_error(message);
+            }
+        }
+
+        // Helper to drop a staged update and its temp directory
+        void discard_staged_update()
+        {
+            if (!staged_dir.empty())
+            {
+                error_code ec;
+                fs::remove_all(staged_dir, ec);
+            }
+            staged_dir.clear();
+            staged_file.clear();
+            staged_url.clear();
+            staged_digest.clear();
+            staged_bundle.clear();
+            if (!staged_tree.empty())
+            {
+                error_code ec;
+                fs::remove_all(staged_tree, ec);
+            }
+            staged_tree.clear();
+            staged_written.clear();
+            memory_stage.reset();
+        }
+
+        // Helper to install a token and switch to its rate-limit budget
+        void set_auth_token(const string& token)
+        {
+            if (api_headers)
+            {
+                curl_slist_free_all(api_headers);
+            }
+            api_headers = curl_slist_append(nullptr, ("Authorization: Bearer " + token).c_str());
+            api_headers = curl_slist_append(api_headers, "Accept: application/vnd.github+json");
+            rate_limit = make_unique<RateLimitBudget>(token);
+        }
+
+        // Helper to initialize CURL
+        bool initCurl()
+        {
+            curl = curl_easy_init();
+            if (!curl)
+            {
+                if (verbose) cerr << "Failed to initialize CURL" << endl;
+                return false;
+            }
+            TlsSettings::apply(curl);
+            initialized = true;
+            return true;
+        }
+
+        // Helper function to clean up CURL, safe to call again (the destructor does)
+        void cleanupCurl()
+        {
+            if (curl)
+            {
+                curl_easy_cleanup(curl);
+                curl = nullptr;
+            }
+            initialized = false;
+        }
+
+        string create_temp_directory()
+        {
+            error_code ec;
+            
+            // Get system temp directory
+            fs::path temp_dir = fs::temp_directory_path(ec);
+            if (ec)
+            {
+                log("Failed to get temp directory: " + ec.message());
+                return "";
+            }
+            
+            // Create unique directory name
+            auto now = chrono::system_clock::now();
+            auto timestamp = chrono::duration_cast<chrono::milliseconds>(
+                now.time_since_epoch()).count();
+            
+            temp_dir /= "autoupdater_" + to_string(timestamp);
+            
+            // Create the directory
+            if (!fs::create_directory(temp_dir, ec))
+            {
+                log("Failed to create temp directory: " + ec.message());
+                return "";
+            }
+            
+            return temp_dir.string();
+        }
+
+        tuple<map<string, string>, string, map<string, int>> parse_github_api_response(const string& jsonResponse)
+        {
+            map<string, string> assets;  // name -> download_url
+            map<string, int> asset_ids;  // name -> id
+            string tag_name;             // latest version
+            
+            Json::Value root;
+            Json::CharReaderBuilder builder;
+            Json::CharReader* reader = builder.newCharReader();
+            
+            string errors;
+            bool parsingSuccessful = reader->parse(
+                jsonResponse.c_str(),
+                jsonResponse.c_str() + jsonResponse.size(),
+                &root,
+                &errors
+            );
+            
+            delete reader;
+            
+            if (!parsingSuccessful)
+            {
+                log("Failed to parse JSON: " + errors);
+                return make_tuple(assets, tag_name, asset_ids);
+            }
+            
+            // Get tag_name if it exists
+            if (root.isMember("tag_name"))
+            {
+                tag_name = root["tag_name"].asString();
+            }
+            
+            // Check if "assets" exists and is an array
+            if (root.isMember("assets") && root["assets"].isArray())
+            {
+                const Json::Value& assetsArray = root["assets"];
+                
+                for (const Json::Value& asset : assetsArray) {
+                    if (asset.isMember("name") && asset.isMember("browser_download_url") && asset.isMember("id"))
+                    {
+                        string name = asset["name"].asString();
+                        string url = asset["browser_download_url"].asString();
+                        int id = asset["id"].asInt();
+                        
+                        assets[name] = url;
+                        asset_ids[name] = id;
+                    }
+                }
+            }
+            
+            return make_tuple(assets, tag_name, asset_ids);
+        }
+
+        // Download the update, verified against expected_digest if known and inspected by the content validators if requested
+        string download_update(string destination_dir,
+                            string download_url,
+                            const string& file_name,
+                            curl_off_t expected_size,
+                            const string& expected_digest,
+                            bool inspect_content)
+        {
+            if (!initialized && !initCurl())
+            {
+                return "";
+            }
+            
+            if (download_url.empty())
+            {
+                log("No download URL available");
+                return "";
+            }
+            
+            // Create proper file path inside the temp directory
+            fs::path file_path = fs::path(destination_dir) / file_name;
+
+            // Peers on the LAN (or our own store) may already have the verified asset
+            if (peer_cache && !expected_digest.empty())
+            {
+                if (peer_cache->fetch(expected_digest, file_path.string()))
+                {
+                    log("Latest release fetched from peer cache");
+                    return file_path.string();
+                }
+                log("No peer has the release, downloading from origin");
+            }
+            else if (peer_cache)
+            {
+                // Without a trusted digest, nothing a peer sends could be verified
+                log("Release publishes no digest, downloading from origin instead of LAN peers");
+            }
+            
+            # ifdef _WIN32
+            FILE* fp = nullptr;
+            if (fopen_s(&fp, file_path.string().c_str(), "wb") != 0 || !fp)
+            {
+                log("Failed to open file for writing: " + file_path.string());
+                return "";
+            }
+            #else
+            FILE* fp = fopen(file_path.string().c_str(), "wb");
+            if (!fp)
+            {
+                log("Failed to open file for writing: " + file_path.string());
+                return "";
+            }
+            #endif
+            
+            // Reject wrong content after the first bytes instead of after the whole file
+            unique_ptr<ContentSniffer> sniffer;
+            if (inspect_content && !content_validators.empty())
+            {
+                sniffer = make_unique<ContentSniffer>(content_validators);
+            }
+            DownloadSink sink;
+            sink.fp = fp;
+            sink.curl = curl;
+            sink.sniffer = sniffer.get();
+
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, DownloadCallback);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);  // Important for GitHub redirects
+            curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);     // Fail on HTTP errors
+
+            // Add progress callback if verbose, publishing status or adapting the rate
+            if (verbose || status_board || low_impact)
+            {
+                curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+                curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+                curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+            }
+
+            // Pick the download source: the origin, or the best mirror
+            vector<MirrorCandidate> candidates;
+            if (mirrors.empty())
+            {
+                MirrorCandidate origin;
+                origin.url = download_url;
+                origin.healthy = true;
+                candidates.push_back(origin);
+            }
+            else
+            {
+                log("Probing " + to_string(mirrors.size()) + " mirrors");
+                candidates = MirrorSelector::probe(download_url, mirrors, expected_size, mirror_probe_timeout);
+                for (const MirrorCandidate& candidate : candidates)
+                {
+                    log("    " + MirrorSelector::host_of(candidate.url) + (candidate.healthy ? "" : " (unreachable)") +
+                        " rtt " + to_string(static_cast<int>(candidate.rtt_ms)) + "ms" +
+                        ", throughput " + to_string(static_cast<long long>(candidate.throughput / 1024)) + "KB/s");
+                }
+            }
+
+            log("Saving to: " + file_path.string());
+            set_phase(UpdatePhase::Downloading);
+
+            MirrorStats stats;
+            CURLcode res = CURLE_COULDNT_CONNECT;
+
+            // Low-impact mode paces a single transfer to the application's latency
+            if (low_impact)
+            {
+                bandwidth = make_unique<BandwidthController>(low_impact->settings());
+                curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, bandwidth->limit());
+            }
+
+            // Fetch different byte ranges from all healthy sources at once
+            if (multi_source && !low_impact && expected_size > 0 &&
+                download_segmented(candidates, file_path.string(), expected_size, stats))
+            {
+                // Segments arrive out of order, so the validators run on the finished file
+                res = CURLE_OK;
+                candidates.clear();
+                if (sniffer && !sniffer->check_file(file_path.string()))
+                {
+                    res = CURLE_WRITE_ERROR;
+                }
+            }
+
+            for (size_t i = 0; i < candidates.size(); i++)
+            {
+                const MirrorCandidate& candidate = candidates[i];
+                if (!candidate.healthy && i + 1 < candidates.size())
+                {
+                    continue;
+                }
+
+                // Continue from where the previous source stopped
+                fflush(fp);
+                curl_off_t offset = static_cast<curl_off_t>(ftell(fp));
+                bool has_fallback = i + 1 < candidates.size();
+
+                curl_easy_setopt(curl, CURLOPT_URL, candidate.url.c_str());
+                curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, offset);
+                status_offset = offset;
+                sink.typed = false;
+
+                // Abort on throughput collapse only if there is somewhere to fail over to
+                curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, has_fallback ? failover_min_speed : 0L);
+                curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, has_fallback ? failover_window_seconds : 0L);
+
+                if (offset > 0)
+                {
+                    log("Resuming download from: " + candidate.url + " at byte " + to_string(offset));
+                }
+                else
+                {
+                    log("Downloading update from: " + candidate.url);
+                }
+
+                auto started = chrono::steady_clock::now();
+                res = curl_easy_perform(curl);
+                double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+                if (verbose)
+                {
+                    finish_progress_bar();
+                }
+
+                // Learn the throughput of this host for future selections
+                curl_off_t received = 0;
+                curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+                if (received >= min_throughput_sample && elapsed > 0)
+                {
+                    stats.record(MirrorSelector::host_of(candidate.url), received / elapsed);
+                }
+
+                if (res == CURLE_RANGE_ERROR)
+                {
+                    // Source cannot resume, start over from the beginning
+                    log("Source does not support resuming, restarting download");
+                    fclose(fp);
+                    #ifdef _WIN32
+                    if (fopen_s(&fp, file_path.string().c_str(), "wb") != 0)
+                    {
+                        fp = nullptr;
+                    }
+                    #else
+                    fp = fopen(file_path.string().c_str(), "wb");
+                    #endif
+                    if (!fp)
+                    {
+                        log("Failed to open file for writing: " + file_path.string());
+                        break;
+                    }
+                    sink.fp = fp;
+                    if (sniffer)
+                    {
+                        sniffer->reset();
+                    }
+                    i--;
+                    continue;
+                }
+
+                // Content that fails a validator is wrong on every source
+                if (res == CURLE_OK || !has_fallback || (sniffer && !sniffer->rejection().empty()))
+                {
+                    break;
+                }
+                log(string("Source failed: ") + curl_easy_strerror(res) + ", failing over");
+            }
+
+            curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(0));
+            curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 0L);
+            curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 0L);
+            curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, static_cast<curl_off_t>(0));
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+            bandwidth.reset();
+            if (fp)
+            {
+                fclose(fp);
+            }
+
+            // Validators still waiting for data decide on the complete file
+            error_code ec;
+            if (res == CURLE_OK && sniffer && !sniffer->finish())
+            {
+                res = CURLE_WRITE_ERROR;
+            }
+            if (sniffer && !sniffer->rejection().empty())
+            {
+                curl_off_t received = 0;
+                curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+                log_error("Download rejected after " + to_string(received / 1024) + "KB: " + sniffer->rejection());
+                fs::remove(file_path, ec);
+                return "";
+            }
+            
+            if (res != CURLE_OK) {
+                log_error(string("Download failed: ") + curl_easy_strerror(res));
+                fs::remove(file_path, ec);
+                return "";
+            }
+
+            // Verify download size
+            auto file_size = fs::file_size(file_path, ec);
+            if (ec || file_size == 0) {
+                log_error("Downloaded file is empty or inaccessible");
+                fs::remove(file_path, ec);
+                return "";
+            }
+
+            // Verify against the digest published with the release
+            if (!expected_digest.empty())
+            {
+                set_phase(UpdatePhase::Verifying);
+                string actual = sha256_file(file_path.string());
+                if (actual != expected_digest)
+                {
+                    log_error("Checksum mismatch: expected sha256 " + expected_digest + ", got " + actual);
+                    fs::remove(file_path, ec);
+                    return "";
+                }
+                log("Checksum verified: sha256 " + expected_digest);
+
+                if (peer_cache)
+                {
+                    peer_cache->publish(file_path.string(), expected_digest);
+                }
+            }
+            
+            log("Latest release downloaded successfully");
+            return file_path.string();
+        }
+
+        /*
+        * Downloads all assets of the bundle into tmp_path and checks the executable's content
+        * 
+        * Returns the path of the executable, empty string on failure
+        */
+        string download_bundle(const string& tmp_path)
+        {
+            vector<BundleAsset> assets = bundle_release;
+            curl_off_t total = 0;
+            for (const BundleAsset& asset : assets)
+            {
+                total += asset.size;
+            }
+            log("Downloading " + to_string(assets.size()) + " bundle assets (" + to_string(total / 1024) + "KB), " +
+                to_string(bundle_parallel) + " at a time" +
+                (bundle_rate > 0 ? ", up to " + to_string(bundle_rate / 1024) + "KB/s" : ""));
+
+            BundleDownloader downloader(bundle_parallel, bundle_rate);
+            downloader.set_progress_callback([this](curl_off_t done, curl_off_t size)
+            {
+                if (status_board && size > 0)
+                {
+                    status_board->set_progress(done, size);
+                }
+                if (verbose && size > 0)
+                {
+                    update_progress_bar(done, size);
+                }
+            });
+            string error;
+            bool ok = downloader.download(assets, tmp_path, error);
+            if (verbose)
+            {
+                finish_progress_bar();
+            }
+            if (!ok)
+            {
+                log_error("Bundle download failed: " + error);
+                return "";
+            }
+
+            const string& executable = assets.front().file;
+            ContentSniffer sniffer(content_validators);
+            if (!content_validators.empty() && !sniffer.check_file(executable))
+            {
+                log_error("Download rejected: " + sniffer.rejection());
+                return "";
+            }
+            for (const BundleAsset& asset : assets)
+            {
+                log(asset.name + (asset.digest.empty() ? ": no published digest" : ": checksum verified"));
+            }
+            staged_bundle = assets;
+            return executable;
+        }
+
+        // Installs the staged bundle by replacing the install directory
+        bool commit_bundle()
+        {
+            #ifdef _WIN32
+            log_error("Bundles are not supported on Windows");
+            discard_staged_update();
+            return false;
+            #else
+            set_phase(UpdatePhase::Applying);
+            cleanupCurl();
+            fs::path executable = fs::path(bundle_dir) / bundle_executable;
+
+            installed_here = true;
+            vector<ResidentRange> profile = PageCache::record_profile(executable.string());
+
+            BundleInstaller installer(bundle_dir);
+            string error;
+            bool installed;
+            if (!staged_tree.empty())
+            {
+                log("Installing " + to_string(staged_written.size()) + " extracted files into " + bundle_dir);
+                installed = installer.install_prepared(staged_written, bundle_executable, release_tag, error);
+                staged_tree.clear();
+            }
+            else
+            {
+                log("Installing " + to_string(staged_bundle.size()) + " assets into " + bundle_dir);
+                installed = installer.install(staged_bundle, bundle_executable, release_tag, error);
+            }
+            if (!installed)
+            {
+                installed_here = false;
+                log_error("Bundle install failed: " + error);
+                discard_staged_update();
+                return false;
+            }
+            for (const BundleAsset& asset : staged_bundle)
+            {
+                FingerprintCache().remember((fs::path(bundle_dir) / asset.target).string(), asset.digest);
+            }
+            log("Installed into " + bundle_dir + ", previous version kept at " + installer.previous());
+
+            uint64_t prefetched = PageCache::warm(executable.string(), profile);
+            if (prefetched > 0)
+            {
+                log("Prefetching " + to_string(prefetched / 1024) + "KB of the new executable");
+            }
+            discard_staged_update();
+            set_phase(UpdatePhase::Applied);
+            return true;
+            #endif
+        }
 
         /*
-        * Progress callback for CURL - shows download progress bar
+        * Downloads the release archive and extracts it into the staging tree as it arrives
+        * 
+        * The transfer thread hashes the archive and queues it, a second thread
+        * decompresses and writes the entries. Returns the path of the staged
+        * executable, empty string on failure
         */
-        static int progress_callback(void* clientp, 
-                                curl_off_t dltotal, 
-                                curl_off_t dlnow, 
-                                curl_off_t ultotal, 
-                                curl_off_t ulnow)
+        string download_archive()
         {
-            AutoUpdater* self = static_cast<AutoUpdater*>(clientp);
-            if (self && self->verbose && dltotal > 0) {
-                const int bar_width = 50;
-                float progress = static_cast<float>(dlnow) / dltotal;
-                int pos = static_cast<int>(bar_width * progress);
+            #ifdef _WIN32
+            log_error("Archives are not supported on Windows");
+            return "";
+            #else
+            if (!initialized && !initCurl())
+            {
+                return "";
+            }
+            BundleInstaller installer(bundle_dir);
+            string error;
+            if (!installer.prepare(error))
+            {
+                log_error("Cannot stage the archive: " + error);
+                return "";
+            }
 
-                cout << "\r[";
-                for (int i = 0; i < bar_width; ++i)
-                {
-                    if (i < pos) cout << "=";
-                    else if (i == pos) cout << ">";
-                    else cout << " ";
-                }
-                cout << "] " << static_cast<int>(progress * 100.0) << "% "
-                    << dlnow/1024 << "KB/" << dltotal/1024 << "KB";
-                cout.flush();
+            ArchiveExtractor extractor(archive_kind, installer.incoming(), bundle_dir, archive_strip);
+            ArchivePipeline pipeline(extractor);
+            ArchiveSink sink;
+            sink.pipeline = &pipeline;
+            sink.hash = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(sink.hash, EVP_sha256(), nullptr);
+
+            curl_easy_setopt(curl, CURLOPT_URL, release_url.c_str());
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, ArchiveCallback);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+            if (verbose || status_board || low_impact)
+            {
+                curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+                curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+                curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+            }
+            if (low_impact)
+            {
+                bandwidth = make_unique<BandwidthController>(low_impact->settings());
+                curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, bandwidth->limit());
             }
-            return 0;
-        }
 
-        void update_progress_bar(curl_off_t dlnow, curl_off_t dltotal)
-        {
-            auto now = chrono::steady_clock::now();
-            if (now - last_progress_update < progress_update_interval)
+            log("Downloading and extracting " + release_url + " into " + installer.incoming());
+            set_phase(UpdatePhase::Downloading);
+            status_offset = 0;
+            auto started = chrono::steady_clock::now();
+            CURLcode res = curl_easy_perform(curl);
+            if (verbose)
             {
-                return;
+                finish_progress_bar();
             }
-            last_progress_update = now;
+            curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, static_cast<curl_off_t>(0));
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+            bandwidth.reset();
 
-            const int bar_width = 50;
-            float progress = static_cast<float>(dlnow) / dltotal;
-            int pos = static_cast<int>(bar_width * progress);
+            bool extracted = pipeline.finish();
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int digest_length = 0;
+            EVP_DigestFinal_ex(sink.hash, digest, &digest_length);
+            EVP_MD_CTX_free(sink.hash);
+            string actual = to_hex(digest, digest_length);
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
 
-            cout << "\r[";
-            for (int i = 0; i < bar_width; ++i) {
-                if (i < pos) cout << "=";
-                else if (i == pos) cout << ">";
-                else cout << " ";
+            error_code ec;
+            if (!extracted || res != CURLE_OK)
+            {
+                log_error(!extracted ? "Extraction failed: " + extractor.error() : string("Download failed: ") + curl_easy_strerror(res));
+                fs::remove_all(installer.incoming(), ec);
+                return "";
             }
-            cout << "] " << static_cast<int>(progress * 100.0) << "% "
-                << dlnow/1024 << "KB/" << dltotal/1024 << "KB";
-            cout.flush();
+            if (!release_digest.empty())
+            {
+                set_phase(UpdatePhase::Verifying);
+                if (actual != release_digest)
+                {
+                    log_error("Checksum mismatch: expected sha256 " + release_digest + ", got " + actual);
+                    fs::remove_all(installer.incoming(), ec);
+                    return "";
+                }
+                log("Checksum verified: sha256 " + release_digest);
+            }
+
+            const ExtractionStats& stats = extractor.stats();
+            log("Extracted " + to_string(stats.files) + " files in " + to_string(static_cast<int>(elapsed * 1000)) + "ms: " +
+                to_string(stats.files - stats.unchanged) + " written (" + to_string(stats.written_bytes / 1024) + "KB), " +
+                to_string(stats.unchanged) + " unchanged (" + to_string(stats.unchanged_bytes / 1024) + "KB)");
+
+            // An unchanged executable is not in the staging tree, and was checked when it was installed
+            string executable = (fs::path(installer.incoming()) / bundle_executable).string();
+            ContentSniffer sniffer(content_validators);
+            if (!content_validators.empty() && fs::exists(executable, ec) && !sniffer.check_file(executable))
+            {
+                log_error("Download rejected: " + sniffer.rejection());
+                fs::remove_all(installer.incoming(), ec);
+                return "";
+            }
+            staged_tree = installer.incoming();
+            staged_written = extractor.written();
+            return executable;
+            #endif
         }
 
-        // Clear line
-        void finish_progress_bar()
+        // Appends the release asset called name to found. Returns false if the release has none
+        static bool find_release_asset(const Json::Value& root, const string& name, const string& target, vector<BundleAsset>& found)
         {
-            cout << "\r" << string(100, ' ') << "\r";
-            cout.flush();
+            for (const Json::Value& asset : root["assets"])
+            {
+                if (asset.get("name", "").asString() == name)
+                {
+                    found.push_back({ name, target, asset.get("browser_download_url", "").asString(),
+                        asset.get("size", 0).asInt64(), parse_sha256_digest(asset.get("digest", "").asString()), "" });
+                    return true;
+                }
+            }
+            return false;
         }
 
-        // Helper to parse ISO 8601 dates
-        time_t parse_iso8601(const string& datetime_str)
+        // Closes replaced plugin libraries whose quiescent period is over, once per check cycle
+        void collect_plugins()
         {
-            tm tm = {};
-            istringstream ss(datetime_str);
-            ss >> get_time(&tm, "%Y-%m-%dT%H:%M:%SZ");
-            return timegm(&tm);  // UTC time
+            size_t waiting = 0;
+            for (const shared_ptr<PluginModule>& plugin : plugins)
+            {
+                waiting += plugin->collect();
+            }
+            if (waiting > 0)
+            {
+                log(to_string(waiting) + " replaced plugin libraries still loaded");
+            }
         }
 
-        // Helper to format time for logging
-        string format_time(time_t time) {
-            tm tm_info;
-            #ifdef _MSC_VER
-                gmtime_s(&tm_info, &time);
-            #else
-                tm_info = *gmtime(&time);
-            #endif
-            char buffer[26];
-            strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm_info);
-            return string(buffer);
-        }
-        
-        // Helper to initialize CURL
-        bool initCurl()
+        // Resolves the directory installed as a whole and the executable's path inside it
+        bool set_install_dir(const string& install_dir)
         {
-            curl = curl_easy_init();
-            if (!curl)
+            error_code ec;
+            fs::path current_exe = fs::canonical("/proc/self/exe", ec);
+            if (ec)
             {
-                if (verbose) cerr << "Failed to initialize CURL" << endl;
+                log_error("Could not determine current executable path");
                 return false;
             }
-            initialized = true;
+            fs::path directory = install_dir.empty() ? current_exe.parent_path() : fs::canonical(install_dir, ec);
+            fs::path executable = fs::relative(current_exe, directory, ec);
+            if (ec || executable.empty() || *executable.begin() == "..")
+            {
+                log_error("The executable is not inside " + directory.string());
+                return false;
+            }
+            bundle_dir = directory.string();
+            bundle_executable = executable.string();
             return true;
         }
 
-        // Helper function to clean up CURL
-        void cleanupCurl()
+        // True if every asset of the release matches the installed file
+        bool bundle_installed()
         {
-            if (initialized)
+            FingerprintCache fingerprints;
+            for (const BundleAsset& asset : bundle_release)
             {
-                curl_easy_cleanup(curl);
-                initialized = false;
+                if (asset.digest.empty() || fingerprints.digest((fs::path(bundle_dir) / asset.target).string()) != asset.digest)
+                {
+                    return false;
+                }
             }
+            return true;
         }
 
-        string create_temp_directory()
+        // Decompresses a downloaded .gz asset and verifies the result. Returns the asset path or empty string
+        string decompress_update(const string& archive, const string& destination)
         {
-            error_code ec;
-            
-            // Get system temp directory
-            fs::path temp_dir = fs::temp_directory_path(ec);
-            if (ec)
+            log("Decompressing " + fs::path(archive).filename().string());
+            gzFile in = gzopen(archive.c_str(), "rb");
+            FILE* out = in ? fopen(destination.c_str(), "wb") : nullptr;
+            bool ok = in && out;
+
+            // The validators judge the decompressed asset, not the archive
+            unique_ptr<ContentSniffer> sniffer;
+            if (!content_validators.empty())
             {
-                log("Failed to get temp directory: " + ec.message());
-                return "";
+                sniffer = make_unique<ContentSniffer>(content_validators);
             }
-            
-            // Create unique directory name
-            auto now = chrono::system_clock::now();
-            auto timestamp = chrono::duration_cast<chrono::milliseconds>(
-                now.time_since_epoch()).count();
-            
-            temp_dir /= "autoupdater_" + to_string(timestamp);
-            
-            // Create the directory
-            if (!fs::create_directory(temp_dir, ec))
+
+            string buffer(1 << 20, '\0');
+            int n = 0;
+            while (ok && (n = gzread(in, &buffer[0], static_cast<unsigned>(buffer.size()))) > 0)
             {
-                log("Failed to create temp directory: " + ec.message());
-                return "";
+                ok = (!sniffer || sniffer->feed(buffer.data(), static_cast<size_t>(n))) &&
+                    fwrite(buffer.data(), 1, static_cast<size_t>(n), out) == static_cast<size_t>(n);
             }
-            
-            return temp_dir.string();
-        }
-
-        tuple<map<string, string>, string, map<string, int>> parse_github_api_response(const string& jsonResponse)
-        {
-            map<string, string> assets;  // name -> download_url
-            map<string, int> asset_ids;  // name -> id
-            string tag_name;             // latest version
-            
-            Json::Value root;
-            Json::CharReaderBuilder builder;
-            Json::CharReader* reader = builder.newCharReader();
-            
-            string errors;
-            bool parsingSuccessful = reader->parse(
-                jsonResponse.c_str(),
-                jsonResponse.c_str() + jsonResponse.size(),
-                &root,
-                &errors
-            );
-            
-            delete reader;
-            
-            if (!parsingSuccessful)
+            ok = ok && n == 0 && (!sniffer || sniffer->finish());
+            if (sniffer && !sniffer->rejection().empty())
             {
-                log("Failed to parse JSON: " + errors);
-                return make_tuple(assets, tag_name, asset_ids);
+                log_error("Decompressed asset rejected: " + sniffer->rejection());
             }
-            
-            // Get tag_name if it exists
-            if (root.isMember("tag_name"))
+            if (out)
             {
-                tag_name = root["tag_name"].asString();
+                ok = fclose(out) == 0 && ok;
             }
-            
-            // Check if "assets" exists and is an array
-            if (root.isMember("assets") && root["assets"].isArray())
+            if (in)
             {
-                const Json::Value& assetsArray = root["assets"];
-                
-                for (const Json::Value& asset : assetsArray) {
-                    if (asset.isMember("name") && asset.isMember("browser_download_url") && asset.isMember("id"))
-                    {
-                        string name = asset["name"].asString();
-                        string url = asset["browser_download_url"].asString();
-                        int id = asset["id"].asInt();
-                        
-                        assets[name] = url;
-                        asset_ids[name] = id;
-                    }
-                }
+                gzclose(in);
             }
-            
-            return make_tuple(assets, tag_name, asset_ids);
-        }
 
-        // Download the update
-        string download_update(string destination_dir, string download_url)
-        {
-            if (!initialized && !initCurl())
+            error_code ec;
+            fs::remove(archive, ec);
+            if (ok && !release_digest.empty() && sha256_file(destination) != release_digest)
             {
-                return "";
+                log_error("Checksum mismatch after decompression");
+                ok = false;
             }
-            
-            if (download_url.empty())
+            if (!ok)
             {
-                log("No download URL available");
+                log_error("Failed to decompress " + archive);
+                fs::remove(destination, ec);
                 return "";
             }
-            
-            // Create proper file path inside the temp directory
-            fs::path file_path = fs::path(destination_dir) / asset_name;
-            
-            # ifdef _WIN32
-            FILE* fp = nullptr;
-            if (fopen_s(&fp, file_path.string().c_str(), "wb") != 0 || !fp)
+            return destination;
+        }
+
+        // Downloads one file from all healthy candidates in parallel. Returns false to fall back to a single source
+        bool download_segmented(const vector<MirrorCandidate>& candidates,
+                                const string& file_path,
+                                curl_off_t total_size,
+                                MirrorStats& stats)
+        {
+            vector<SegmentSource> sources;
+            for (const MirrorCandidate& candidate : candidates)
             {
-                log("Failed to open file for writing: " + file_path.string());
-                return "";
+                if (candidate.healthy)
+                {
+                    SegmentSource source;
+                    source.url = candidate.url;
+                    source.throughput = candidate.throughput;
+                    sources.push_back(source);
+                }
             }
-            #else
-            FILE* fp = fopen(file_path.string().c_str(), "wb");
-            if (!fp)
+            if (sources.size() < 2)
             {
-                log("Failed to open file for writing: " + file_path.string());
-                return "";
+                return false;
             }
-            #endif
-            
-            curl_easy_setopt(curl, CURLOPT_URL, download_url.c_str());
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);  // Important for GitHub redirects
-            curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);     // Fail on HTTP errors
 
-            // Add progress callback if verbose
-            if (verbose)
+            log("Downloading from " + to_string(sources.size()) + " sources in parallel");
+            SegmentedDownloader downloader(sources, total_size);
+            if (verbose || status_board)
             {
-                curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
-                curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
-                curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+                downloader.set_progress_callback([this](curl_off_t done, curl_off_t total)
+                {
+                    if (status_board)
+                    {
+                        status_board->set_progress(done, total);
+                    }
+                    if (verbose)
+                    {
+                        update_progress_bar(done, total);
+                    }
+                });
             }
-            
-            log("Downloading update from: " + download_url);
-            log("Saving to: " + file_path.string());
-            
-            CURLcode res = curl_easy_perform(curl);
-            fclose(fp);
 
+            string error;
+            bool ok = downloader.download(file_path, error);
             if (verbose)
             {
                 finish_progress_bar();
             }
-            
-            if (res != CURLE_OK) {
-                log(string("Download failed: ") + curl_easy_strerror(res));
-                fs::remove(file_path);
-                return "";
+
+            for (const SegmentSource& source : downloader.sources())
+            {
+                log("    " + MirrorSelector::host_of(source.url) + ": " + to_string(source.downloaded / 1024) + "KB at " +
+                    to_string(static_cast<long long>(source.throughput / 1024)) + "KB/s" + (source.dead ? " (failed)" : ""));
+                if (source.downloaded >= min_throughput_sample)
+                {
+                    stats.record(MirrorSelector::host_of(source.url), source.throughput);
+                }
             }
 
-            // Verify download size
-            error_code ec;
-            auto file_size = fs::file_size(file_path, ec);
-            if (ec || file_size == 0) {
-                log("Downloaded file is empty or inaccessible");
-                fs::remove(file_path);
-                return "";
+            if (!ok)
+            {
+                log("Parallel download failed: " + error + ", falling back to a single source");
+                error_code ec;
+                fs::resize_file(file_path, 0, ec);
             }
-            
-            log("Latest release downloaded successfully");
-            return file_path.string();
+            return ok;
         }
 
         void log(string log_string)
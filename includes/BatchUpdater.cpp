@@ -0,0 +1,652 @@
+/*
+ * BatchUpdater - Checks many GitHub repositories for updates at once
+ *
+ * Features:
+ * - Checks any number of (owner, repo, asset) targets concurrently
+ * - Multiplexes requests over a shared HTTP/2 connection pool
+ * - Global limit on the number of in-flight transfers
+ * - Downloads needed assets under a shared memory and bandwidth budget
+ * - Shares the host-wide GitHub API rate-limit budget with AutoUpdater
+ */
+
+#pragma once
+
+#include "AutoUpdater.cpp"
+
+#include <algorithm>
+#include <deque>
+
+
+// Single (owner, repo, asset) entry checked by BatchUpdater
+struct BatchTarget
+{
+    string github_repo_owner;
+    string github_repo_name;
+    string current_release_date;
+    string asset_name;
+};
+
+// Outcome of checking (and optionally downloading) a single target
+struct BatchResult
+{
+    BatchTarget target;
+    bool checked = false;
+    bool update_available = false;
+    string latest_tag;
+    string latest_date;
+    string download_url;
+    string downloaded_file;
+    string error;
+};
+
+class BatchUpdater
+{
+    public:
+        /*
+        * Constructor - Initializes the shared connection pool
+        *
+        * @param max_concurrency: Maximum number of transfers in flight at once
+        * @param verbose: Enable detailed logging
+        */
+        BatchUpdater(size_t max_concurrency, bool verbose)
+            : max_concurrency(max(max_concurrency, static_cast<size_t>(1))),
+            verbose(verbose),
+            multi(nullptr),
+            share(nullptr),
+            rate_limit(make_unique<RateLimitBudget>(""))
+        {
+            multi = curl_multi_init();
+            share = curl_share_init();
+            if (!multi || !share)
+            {
+                throw runtime_error("Failed to initialize curl");
+            }
+
+            // One multiplexed connection pool for all targets
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+            curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(this->max_concurrency));
+            curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, max_host_connections);
+
+            // Share DNS and TLS sessions between all easy handles
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+            log("Ready. Max concurrency: " + to_string(this->max_concurrency));
+        }
+
+        // Prevent default construction and copying
+        BatchUpdater() = delete;
+        BatchUpdater(const BatchUpdater&) = delete;
+        BatchUpdater& operator=(const BatchUpdater&) = delete;
+
+        // Destructor - cleans up CURL resources
+        ~BatchUpdater()
+        {
+            if (multi)
+            {
+                curl_multi_cleanup(multi);
+            }
+            if (share)
+            {
+                curl_share_cleanup(share);
+            }
+            if (api_headers)
+            {
+                curl_slist_free_all(api_headers);
+            }
+        }
+
+        /*
+        * Authenticates GitHub API requests with a token from an environment variable
+        *
+        * Returns false if the variable is unset or empty
+        */
+        bool set_auth_token_from_env(const string& variable = "GITHUB_TOKEN")
+        {
+            return set_auth_token(load_token_from_env(variable));
+        }
+
+        /*
+        * Authenticates GitHub API requests with a token read from a file
+        *
+        * Returns false if the file is missing or empty
+        */
+        bool set_auth_token_from_file(const string& path)
+        {
+            return set_auth_token(load_token_from_file(path));
+        }
+
+        /*
+        * Verifies servers against a CA bundle instead of the system certificate store
+        *
+        * @param path: PEM file, or directory of hashed certificates. Applies to every transfer in the process
+        */
+        void set_ca_bundle(const string& path)
+        {
+            TlsSettings::set_ca_bundle(path);
+        }
+
+        /*
+        * Sends release API requests to another server with the same URL shape as GitHub,
+        * e.g. a release cache daemon ("http://127.0.0.1:8080")
+        */
+        void set_api_base(const string& url)
+        {
+            api_base = url;
+            while (!api_base.empty() && api_base.back() == '/')
+            {
+                api_base.pop_back();
+            }
+        }
+
+        /*
+        * Sets how long a check may wait for a slot in the host-wide
+        * rate-limit budget before it is reported as rate limited
+        */
+        void set_max_rate_limit_wait(chrono::milliseconds max_wait)
+        {
+            max_rate_limit_wait = max_wait;
+        }
+
+        /*
+        * Adds a target to the batch
+        *
+        * @param github_repo_owner: Owner of the GitHub repository
+        * @param github_repo_name: Name of the GitHub repository
+        * @param current_release_date: Current version date (YYYY-MM-DD)
+        * @param asset_name: Name of the asset to download
+        */
+        void add(const string& github_repo_owner,
+                const string& github_repo_name,
+                const string& current_release_date,
+                const string& asset_name)
+        {
+            BatchResult result;
+            result.target = {github_repo_owner, github_repo_name, current_release_date, asset_name};
+            batch.push_back(result);
+        }
+
+        /*
+        * Sets the shared budget for download_all()
+        *
+        * @param max_memory_bytes: Upper bound for transfer buffers of all downloads together (0 = unlimited)
+        * @param max_bytes_per_second: Combined download rate of all downloads (0 = unlimited)
+        */
+        void set_download_budget(size_t max_memory_bytes, curl_off_t max_bytes_per_second)
+        {
+            memory_budget = max_memory_bytes;
+            bandwidth_budget = max_bytes_per_second;
+        }
+
+        /*
+        * Checks all targets concurrently
+        *
+        * Returns the number of targets with an update available
+        */
+        size_t check_all()
+        {
+            log("Checking " + to_string(batch.size()) + " targets for updates");
+
+            deque<Transfer> transfers;
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                // Forget the outcome of any previous check
+                BatchTarget target = batch[i].target;
+                batch[i] = BatchResult();
+                batch[i].target = target;
+
+                Transfer transfer;
+                transfer.index = i;
+                transfer.url = api_base + "/repos/" + target.github_repo_owner + "/" + target.github_repo_name + "/releases/latest";
+                transfers.push_back(transfer);
+            }
+
+            run(transfers, max_concurrency);
+
+            size_t available = 0;
+            for (Transfer& transfer : transfers)
+            {
+                BatchResult& result = batch[transfer.index];
+                if (transfer.result != CURLE_OK)
+                {
+                    if (result.error.empty())
+                    {
+                        result.error = string("Curl failed: ") + curl_easy_strerror(transfer.result);
+                    }
+                    continue;
+                }
+                if (parse_release(transfer, result) && result.update_available)
+                {
+                    available++;
+                }
+            }
+
+            log(to_string(available) + " of " + to_string(batch.size()) + " targets have an update available");
+            return available;
+        }
+
+        /*
+        * Downloads the assets of all targets with an update available
+        *
+        * Files are saved as <destination_dir>/<owner>/<repo>/<asset>.
+        * Returns the number of successful downloads
+        */
+        size_t download_all(const string& destination_dir)
+        {
+            deque<Transfer> transfers;
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                BatchResult& result = batch[i];
+                if (!result.update_available || result.download_url.empty())
+                {
+                    continue;
+                }
+
+                fs::path dir = fs::path(destination_dir) / result.target.github_repo_owner / result.target.github_repo_name;
+                error_code ec;
+                fs::create_directories(dir, ec);
+                if (ec)
+                {
+                    result.error = "Failed to create directory: " + ec.message();
+                    continue;
+                }
+
+                Transfer transfer;
+                transfer.index = i;
+                transfer.url = result.download_url;
+                transfer.file_path = (dir / result.target.asset_name).string();
+                transfers.push_back(transfer);
+            }
+
+            // The memory budget caps how many transfer buffers exist at the same time
+            size_t concurrency = max_concurrency;
+            if (memory_budget > 0)
+            {
+                concurrency = min(concurrency, max(memory_budget / download_buffer_size, static_cast<size_t>(1)));
+            }
+
+            log("Downloading " + to_string(transfers.size()) + " assets, " + to_string(concurrency) + " at a time");
+            run(transfers, concurrency);
+
+            size_t downloaded = 0;
+            for (Transfer& transfer : transfers)
+            {
+                BatchResult& result = batch[transfer.index];
+                error_code ec;
+                if (transfer.result != CURLE_OK)
+                {
+                    result.error = string("Download failed: ") + curl_easy_strerror(transfer.result);
+                    fs::remove(transfer.file_path, ec);
+                    continue;
+                }
+                if (fs::file_size(transfer.file_path, ec) == 0 || ec)
+                {
+                    result.error = "Downloaded file is empty or inaccessible";
+                    fs::remove(transfer.file_path, ec);
+                    continue;
+                }
+                result.downloaded_file = transfer.file_path;
+                downloaded++;
+            }
+
+            log(to_string(downloaded) + " assets downloaded successfully");
+            return downloaded;
+        }
+
+        // Results of the last check_all() / download_all()
+        const vector<BatchResult>& results() const
+        {
+            return batch;
+        }
+
+    private:
+        // State of a single in-flight request
+        struct Transfer
+        {
+            BatchUpdater* owner = nullptr;
+            size_t index = 0;
+            string url;
+            string file_path;
+            string response;
+            FILE* fp = nullptr;
+            CURL* easy = nullptr;
+            bool paused = false;
+            CURLcode result = CURLE_OK;
+            long http_code = 0;
+            RateLimitHeaders rate_limit_headers;
+            chrono::time_point<chrono::steady_clock> not_before;
+            bool scheduled = false;
+        };
+
+        static constexpr long max_host_connections = 4;
+        static constexpr size_t download_buffer_size = 256 * 1024;
+
+        size_t max_concurrency;
+        bool verbose;
+        CURLM* multi;
+        CURLSH* share;
+        vector<BatchResult> batch;
+
+        // API authentication and rate limiting
+        string api_base = "https://api.github.com";
+        curl_slist* api_headers = nullptr;
+        unique_ptr<RateLimitBudget> rate_limit;
+        chrono::milliseconds max_rate_limit_wait{30000};
+
+        // Shared download budget
+        size_t memory_budget = 0;
+        curl_off_t bandwidth_budget = 0;
+        double bandwidth_tokens = 0;
+        chrono::time_point<chrono::steady_clock> last_refill;
+
+        bool set_auth_token(const string& token)
+        {
+            if (token.empty())
+            {
+                log("Could not load API token");
+                return false;
+            }
+            if (api_headers)
+            {
+                curl_slist_free_all(api_headers);
+            }
+            api_headers = curl_slist_append(nullptr, ("Authorization: Bearer " + token).c_str());
+            api_headers = curl_slist_append(api_headers, "Accept: application/vnd.github+json");
+            rate_limit = make_unique<RateLimitBudget>(token);
+            return true;
+        }
+
+        // Write callback for both API responses (in memory) and downloads (to file)
+        static size_t write_callback(void* contents, size_t size, size_t nmemb, void* userp)
+        {
+            Transfer* transfer = static_cast<Transfer*>(userp);
+            size_t total = size * nmemb;
+
+            if (!transfer->fp)
+            {
+                transfer->response.append(static_cast<char*>(contents), total);
+                return total;
+            }
+
+            // Pause until the shared bucket has tokens again
+            BatchUpdater* self = transfer->owner;
+            if (self->bandwidth_budget > 0)
+            {
+                if (self->bandwidth_tokens <= 0)
+                {
+                    transfer->paused = true;
+                    return CURL_WRITEFUNC_PAUSE;
+                }
+                self->bandwidth_tokens -= static_cast<double>(total);
+            }
+
+            return fwrite(contents, 1, total, transfer->fp);
+        }
+
+        CURL* create_handle(Transfer& transfer)
+        {
+            CURL* easy = curl_easy_init();
+            if (!easy)
+            {
+                return nullptr;
+            }
+
+            curl_easy_setopt(easy, CURLOPT_URL, transfer.url.c_str());
+            curl_easy_setopt(easy, CURLOPT_SHARE, share);
+            curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+            curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);  // Prefer multiplexing over opening new connections
+            curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_callback);
+            curl_easy_setopt(easy, CURLOPT_WRITEDATA, &transfer);
+            curl_easy_setopt(easy, CURLOPT_PRIVATE, &transfer);
+            TlsSettings::apply(easy);
+            curl_easy_setopt(easy, CURLOPT_USERAGENT, "AutoUpdater/1.0");
+            curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+
+            if (transfer.fp)
+            {
+                curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
+                curl_easy_setopt(easy, CURLOPT_BUFFERSIZE, static_cast<long>(download_buffer_size));
+            }
+            else
+            {
+                curl_easy_setopt(easy, CURLOPT_HTTPHEADER, TlsSettings::may_authenticate(transfer.url) ? api_headers : nullptr);
+                curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, RateLimitHeaders::header_callback);
+                curl_easy_setopt(easy, CURLOPT_HEADERDATA, &transfer.rate_limit_headers);
+            }
+
+            return easy;
+        }
+
+        // Adds queued transfers to the multi handle until the concurrency limit is reached
+        void start_pending(deque<Transfer>& transfers, size_t& next, size_t& running, size_t concurrency)
+        {
+            while (running < concurrency && next < transfers.size())
+            {
+                Transfer& transfer = transfers[next];
+                transfer.owner = this;
+
+                // API requests take a slot in the host-wide rate-limit budget
+                if (transfer.file_path.empty())
+                {
+                    auto now = chrono::steady_clock::now();
+                    if (!transfer.scheduled)
+                    {
+                        chrono::milliseconds wait;
+                        if (!rate_limit->acquire(max_rate_limit_wait, wait))
+                        {
+                            transfer.result = CURLE_OPERATION_TIMEDOUT;
+                            batch[transfer.index].error = "Rate limit budget exhausted, next request allowed in " +
+                                to_string(wait.count() / 1000) + "s";
+                            next++;
+                            continue;
+                        }
+                        transfer.scheduled = true;
+                        transfer.not_before = now + wait;
+                    }
+
+                    // Slots are handed out in order, so later transfers have to wait too
+                    if (transfer.not_before > now)
+                    {
+                        break;
+                    }
+                }
+                next++;
+
+                if (!transfer.file_path.empty())
+                {
+                    #ifdef _WIN32
+                    if (fopen_s(&transfer.fp, transfer.file_path.c_str(), "wb") != 0)
+                    {
+                        transfer.fp = nullptr;
+                    }
+                    #else
+                    transfer.fp = fopen(transfer.file_path.c_str(), "wb");
+                    #endif
+                    if (!transfer.fp)
+                    {
+                        log("Failed to open file for writing: " + transfer.file_path);
+                        transfer.result = CURLE_WRITE_ERROR;
+                        continue;
+                    }
+                }
+
+                transfer.easy = create_handle(transfer);
+                if (!transfer.easy)
+                {
+                    transfer.result = CURLE_FAILED_INIT;
+                    continue;
+                }
+
+                curl_multi_add_handle(multi, transfer.easy);
+                running++;
+            }
+        }
+
+        // Refills the shared bandwidth bucket and resumes paused downloads
+        void refill_bandwidth(deque<Transfer>& transfers)
+        {
+            if (bandwidth_budget <= 0)
+            {
+                return;
+            }
+
+            auto now = chrono::steady_clock::now();
+            double elapsed = chrono::duration<double>(now - last_refill).count();
+            last_refill = now;
+            bandwidth_tokens = min(bandwidth_tokens + elapsed * bandwidth_budget, static_cast<double>(bandwidth_budget));
+
+            for (Transfer& transfer : transfers)
+            {
+                if (transfer.paused && transfer.easy && bandwidth_tokens > 0)
+                {
+                    transfer.paused = false;
+                    curl_easy_pause(transfer.easy, CURLPAUSE_CONT);
+                }
+            }
+        }
+
+        // Drives all transfers to completion with at most `concurrency` in flight
+        void run(deque<Transfer>& transfers, size_t concurrency)
+        {
+            size_t next = 0;
+            size_t running = 0;
+            bandwidth_tokens = static_cast<double>(bandwidth_budget);
+            last_refill = chrono::steady_clock::now();
+
+            start_pending(transfers, next, running, concurrency);
+            while (running > 0 || next < transfers.size())
+            {
+                int still_running = 0;
+                CURLMcode mc = curl_multi_perform(multi, &still_running);
+                if (mc != CURLM_OK)
+                {
+                    log(string("curl_multi_perform failed: ") + curl_multi_strerror(mc));
+                    break;
+                }
+
+                CURLMsg* msg;
+                int queued;
+                while ((msg = curl_multi_info_read(multi, &queued)))
+                {
+                    if (msg->msg != CURLMSG_DONE)
+                    {
+                        continue;
+                    }
+
+                    Transfer* transfer = nullptr;
+                    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char**>(&transfer));
+                    transfer->result = msg->data.result;
+                    curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &transfer->http_code);
+                    if (transfer->file_path.empty() && transfer->result == CURLE_OK)
+                    {
+                        rate_limit->record(transfer->http_code, transfer->rate_limit_headers);
+                    }
+                    finish(*transfer);
+                    running--;
+                }
+
+                start_pending(transfers, next, running, concurrency);
+                refill_bandwidth(transfers);
+
+                if (running > 0 || next < transfers.size())
+                {
+                    curl_multi_poll(multi, nullptr, 0, bandwidth_budget > 0 ? 10 : 100, nullptr);
+                }
+            }
+
+            // Only reached early on multi errors
+            for (Transfer& transfer : transfers)
+            {
+                if (transfer.easy)
+                {
+                    transfer.result = CURLE_FAILED_INIT;
+                    finish(transfer);
+                }
+            }
+        }
+
+        void finish(Transfer& transfer)
+        {
+            curl_multi_remove_handle(multi, transfer.easy);
+            curl_easy_cleanup(transfer.easy);
+            transfer.easy = nullptr;
+            if (transfer.fp)
+            {
+                fclose(transfer.fp);
+                transfer.fp = nullptr;
+            }
+        }
+
+        // Fills in the result of a target from its GitHub API response
+        bool parse_release(const Transfer& transfer, BatchResult& result)
+        {
+            const BatchTarget& target = result.target;
+
+            Json::Value root;
+            Json::CharReaderBuilder builder;
+            unique_ptr<Json::CharReader> reader(builder.newCharReader());
+            string errors;
+            const string& response = transfer.response;
+            if (!reader->parse(response.c_str(), response.c_str() + response.size(), &root, &errors))
+            {
+                result.error = "Failed to parse json from github api: " + errors;
+                return false;
+            }
+
+            if (transfer.http_code != 200 || !root.isMember("published_at"))
+            {
+                result.error = "Github API returned " + to_string(transfer.http_code);
+                if (root.isMember("message"))
+                {
+                    result.error += ": " + root["message"].asString();
+                }
+                return false;
+            }
+
+            result.checked = true;
+            result.latest_date = root["published_at"].asString().substr(0, 10);
+            result.latest_tag = root.get("tag_name", "").asString();
+
+            if (root.isMember("assets") && root["assets"].isArray())
+            {
+                for (const Json::Value& asset : root["assets"])
+                {
+                    if (asset.get("name", "").asString() == target.asset_name)
+                    {
+                        result.download_url = asset.get("browser_download_url", "").asString();
+                    }
+                }
+            }
+
+            if (result.download_url.empty())
+            {
+                result.error = "Could not find asset with name: " + target.asset_name;
+                return false;
+            }
+
+            result.update_available = result.latest_date > target.current_release_date;
+            log(target.github_repo_owner + "/" + target.github_repo_name + ": latest " + result.latest_tag +
+                " (" + result.latest_date + ")" + (result.update_available ? ", update available" : ", up to date"));
+            return true;
+        }
+
+        void log(string log_string)
+        {
+            if (!verbose)
+            {
+                return;
+            }
+
+            auto now = chrono::system_clock::now();
+            auto now_time = chrono::system_clock::to_time_t(now);
+
+            tm local_time;
+            #ifdef _WIN32
+            localtime_s(&local_time, &now_time);
+            #else
+            localtime_r(&now_time, &local_time);
+            #endif
+
+            cout << "BatchUpdater at " << put_time(&local_time, "%H:%M:%S") << ": " << log_string << endl;
+        }
+};
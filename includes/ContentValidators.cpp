@@ -0,0 +1,780 @@
+/*
+ * ContentValidators - Inspects a download while it arrives and aborts it early
+ *
+ * Features:
+ * - Rejects HTML error and login pages served in place of the asset
+ * - ELF checks: magic, class, byte order and e_machine of the running executable
+ * - Program interpreter (PT_INTERP) as expected and present on this host
+ * - Shared libraries (DT_NEEDED) resolvable on this host
+ * - Pluggable: any function of the bytes seen so far can veto the download
+ *
+ * Most verdicts need only the first few KB. The library check waits for the
+ * dynamic section, which linkers usually place towards the end of the file.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+#include <curl/curl.h>
+
+#ifdef __linux__
+#include <link.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+enum class Verdict
+{
+    NeedMore,       // Cannot decide yet
+    Accept,
+    Reject
+};
+
+// What a validator sees of the transfer
+struct ContentChunk
+{
+    string_view head;           // Start of the file, up to ContentSniffer::head_limit bytes
+    curl_off_t offset = 0;      // Position of data in the file
+    string_view data;           // Bytes that just arrived
+    bool complete = false;      // Nothing follows, undecided validators must decide now
+    string content_type;        // Content-Type of the response, if any
+};
+
+struct ContentValidator
+{
+    string name;
+
+    // Sets reason when rejecting
+    function<Verdict(const ContentChunk& chunk, string& reason)> inspect;
+
+    // Forgets per-transfer state, called before each new download (optional)
+    function<void()> reset;
+};
+
+/*
+* Feeds a download through validators and remembers the first rejection
+*
+* Once every validator has decided, feeding costs nothing.
+*/
+class ContentSniffer
+{
+    public:
+        static constexpr size_t head_limit = 1024 * 1024;
+
+        explicit ContentSniffer(const vector<ContentValidator>& validators)
+            : validators(validators)
+        {
+            reset();
+        }
+
+        // Starts over at offset 0
+        void reset()
+        {
+            head.clear();
+            offset = 0;
+            reason.clear();
+            verdicts.assign(validators.size(), Verdict::NeedMore);
+            for (ContentValidator& validator : validators)
+            {
+                if (validator.reset)
+                {
+                    validator.reset();
+                }
+            }
+        }
+
+        void set_content_type(const string& type)
+        {
+            content_type = type;
+        }
+
+        // Feeds the next bytes of the file. Returns false once a validator rejects it
+        bool feed(const char* data, size_t size)
+        {
+            return inspect(string_view(data, size), false);
+        }
+
+        // Marks the end of the file. Returns false if a validator rejects it
+        bool finish()
+        {
+            return inspect(string_view(), true);
+        }
+
+        // True once every validator has accepted or one has rejected
+        bool settled() const
+        {
+            return !reason.empty() ||
+                all_of(verdicts.begin(), verdicts.end(), [](Verdict v) { return v != Verdict::NeedMore; });
+        }
+
+        // "<validator>: <reason>" of the rejection, empty if none
+        const string& rejection() const
+        {
+            return reason;
+        }
+
+        // Runs the validators over a file that is already on disk
+        bool check_file(const string& path)
+        {
+            reset();
+            ifstream file(path, ios::binary);
+            string buffer(64 * 1024, '\0');
+            while (!settled() && file)
+            {
+                file.read(&buffer[0], static_cast<streamsize>(buffer.size()));
+                if (file.gcount() > 0 && !feed(buffer.data(), static_cast<size_t>(file.gcount())))
+                {
+                    return false;
+                }
+            }
+            return settled() ? reason.empty() : finish();
+        }
+
+    private:
+        vector<ContentValidator> validators;
+        vector<Verdict> verdicts;
+        string head;
+        curl_off_t offset = 0;
+        string content_type;
+        string reason;
+
+        bool inspect(string_view data, bool complete)
+        {
+            if (!reason.empty())
+            {
+                return false;
+            }
+            if (settled())
+            {
+                offset += static_cast<curl_off_t>(data.size());
+                return true;
+            }
+
+            if (offset < static_cast<curl_off_t>(head_limit) && offset == static_cast<curl_off_t>(head.size()))
+            {
+                head.append(data.data(), min(data.size(), head_limit - head.size()));
+            }
+
+            ContentChunk chunk;
+            chunk.head = head;
+            chunk.offset = offset;
+            chunk.data = data;
+            chunk.complete = complete;
+            chunk.content_type = content_type;
+            offset += static_cast<curl_off_t>(data.size());
+
+            for (size_t i = 0; i < validators.size(); i++)
+            {
+                if (verdicts[i] != Verdict::NeedMore)
+                {
+                    continue;
+                }
+                string why;
+                try
+                {
+                    verdicts[i] = validators[i].inspect(chunk, why);
+                }
+                catch (const exception& e)
+                {
+                    // A validator that cannot cope with the bytes vetoes them
+                    why = string("cannot inspect the file: ") + e.what();
+                    verdicts[i] = Verdict::Reject;
+                }
+                if (verdicts[i] == Verdict::Reject)
+                {
+                    reason = validators[i].name + ": " + why;
+                    return false;
+                }
+                if (complete && verdicts[i] == Verdict::NeedMore)
+                {
+                    verdicts[i] = Verdict::Accept;
+                }
+            }
+            return true;
+        }
+};
+
+// Rejects responses that are HTML pages (proxy errors, captive portals, login pages)
+inline ContentValidator html_page_validator()
+{
+    ContentValidator validator;
+    validator.name = "html";
+    validator.inspect = [](const ContentChunk& chunk, string& reason)
+    {
+        if (chunk.content_type.compare(0, 9, "text/html") == 0)
+        {
+            reason = "server sent a web page (Content-Type " + chunk.content_type + ")";
+            return Verdict::Reject;
+        }
+
+        // Skip a byte order mark and leading whitespace
+        size_t start = chunk.head.compare(0, 3, "\xEF\xBB\xBF") == 0 ? 3 : 0;
+        while (start < chunk.head.size() && isspace(static_cast<unsigned char>(chunk.head[start])))
+        {
+            start++;
+        }
+        if (start == chunk.head.size())
+        {
+            return chunk.complete ? Verdict::Accept : Verdict::NeedMore;
+        }
+        if (chunk.head[start] != '<')
+        {
+            return Verdict::Accept;
+        }
+
+        string opening;
+        for (size_t i = start; i < chunk.head.size() && opening.size() < 256; i++)
+        {
+            opening += static_cast<char>(tolower(static_cast<unsigned char>(chunk.head[i])));
+        }
+        for (const char* tag : { "<!doctype html", "<html", "<head", "<body", "<title" })
+        {
+            if (opening.compare(0, strlen(tag), tag) == 0)
+            {
+                reason = "server sent a web page instead of the asset";
+                return Verdict::Reject;
+            }
+        }
+        if (opening.compare(0, 5, "<?xml") == 0 && opening.find("<html") != string::npos)
+        {
+            reason = "server sent a web page instead of the asset";
+            return Verdict::Reject;
+        }
+        return opening.size() < 256 && !chunk.complete ? Verdict::NeedMore : Verdict::Accept;
+    };
+    return validator;
+}
+
+// What an ELF download must match. Defaults describe the running executable
+struct ElfRequirements
+{
+    bool match_host = true;             // Class, byte order and e_machine of /proc/self/exe
+    uint16_t machine = 0;               // Required e_machine when not matching the host (0 = any)
+
+    bool check_interpreter = true;      // PT_INTERP must exist on this host
+    string interpreter;                 // Required PT_INTERP path (empty = any)
+
+    bool check_libraries = true;        // Every DT_NEEDED library must be resolvable here
+    string origin;                      // $ORIGIN for RUNPATH (default: directory of the running executable)
+};
+
+/*
+* Reads ELF files piece by piece, in either class and byte order
+*/
+class ElfImage
+{
+    public:
+        static constexpr uint32_t pt_load = 1;
+        static constexpr uint32_t pt_dynamic = 2;
+        static constexpr uint32_t pt_interp = 3;
+        static constexpr uint64_t dt_null = 0;
+        static constexpr uint64_t dt_needed = 1;
+        static constexpr uint64_t dt_strtab = 5;
+        static constexpr uint64_t dt_strsz = 10;
+        static constexpr uint64_t dt_rpath = 15;
+        static constexpr uint64_t dt_runpath = 29;
+
+        // Largest dynamic section accepted. Real ones hold a few dozen 16 byte entries
+        static constexpr uint64_t max_dynamic_size = 1024 * 1024;
+
+        struct Identity
+        {
+            uint8_t elf_class = 0;      // 1 = 32 bit, 2 = 64 bit
+            uint8_t byte_order = 0;     // 1 = little endian, 2 = big endian
+            uint16_t machine = 0;
+
+            bool operator==(const Identity& other) const
+            {
+                return elf_class == other.elf_class && byte_order == other.byte_order && machine == other.machine;
+            }
+        };
+
+        struct Segment
+        {
+            uint32_t type;
+            uint64_t offset;
+            uint64_t vaddr;
+            uint64_t filesz;
+        };
+
+        static bool has_magic(string_view data)
+        {
+            return data.size() >= 4 && data.compare(0, 4, "\x7f" "ELF") == 0;
+        }
+
+        // Parses the identity from the first 20 bytes. Returns false if they are not an ELF header
+        static bool identify(string_view data, Identity& identity)
+        {
+            if (data.size() < 20 || !has_magic(data) ||
+                (data[4] != 1 && data[4] != 2) || (data[5] != 1 && data[5] != 2))
+            {
+                return false;
+            }
+            identity.elf_class = static_cast<uint8_t>(data[4]);
+            identity.byte_order = static_cast<uint8_t>(data[5]);
+            identity.machine = static_cast<uint16_t>(read(data, 18, 2, identity.byte_order == 1));
+            return true;
+        }
+
+        // Identity of an ELF file on disk
+        static bool identify_file(const string& path, Identity& identity)
+        {
+            char header[20];
+            ifstream file(path, ios::binary);
+            return file.read(header, sizeof(header)) && identify(string_view(header, sizeof(header)), identity);
+        }
+
+        /*
+        * Parses the program headers out of the start of the file
+        *
+        * Returns false while the header table is not complete in head
+        */
+        static bool segments(string_view head, const Identity& identity, vector<Segment>& result)
+        {
+            bool wide = identity.elf_class == 2;
+            bool little = identity.byte_order == 1;
+            if (head.size() < (wide ? 64u : 52u))
+            {
+                return false;
+            }
+            uint64_t table = read(head, wide ? 32 : 28, wide ? 8 : 4, little);
+            uint64_t entry_size = read(head, wide ? 54 : 42, 2, little);
+            uint64_t count = read(head, wide ? 56 : 44, 2, little);
+            if (entry_size < (wide ? 56u : 32u) || !within(head, table, entry_size * count))
+            {
+                return false;
+            }
+
+            result.clear();
+            for (uint64_t i = 0; i < count; i++)
+            {
+                size_t at = static_cast<size_t>(table + i * entry_size);
+                Segment segment;
+                segment.type = static_cast<uint32_t>(read(head, at, 4, little));
+                segment.offset = read(head, at + (wide ? 8 : 4), wide ? 8 : 4, little);
+                segment.vaddr = read(head, at + (wide ? 16 : 8), wide ? 8 : 4, little);
+                segment.filesz = read(head, at + (wide ? 32 : 16), wide ? 8 : 4, little);
+                result.push_back(segment);
+            }
+            return true;
+        }
+
+        // Program headers of an ELF file on disk (headers within its first 64KB)
+        static bool segments_of_file(const string& path, vector<Segment>& result)
+        {
+            string head(64 * 1024, '\0');
+            ifstream file(path, ios::binary);
+            file.read(&head[0], static_cast<streamsize>(head.size()));
+            head.resize(static_cast<size_t>(file.gcount()));
+            Identity identity;
+            return identify(head, identity) && segments(head, identity, result);
+        }
+
+        // File offset of a virtual address, or UINT64_MAX if no loaded segment covers it
+        static uint64_t file_offset(const vector<Segment>& segments, uint64_t vaddr)
+        {
+            for (const Segment& segment : segments)
+            {
+                if (segment.type == pt_load && vaddr >= segment.vaddr && vaddr - segment.vaddr < segment.filesz)
+                {
+                    return segment.offset + (vaddr - segment.vaddr);
+                }
+            }
+            return UINT64_MAX;
+        }
+
+        // Whether length bytes at offset lie inside data. Header values are untrusted, so no sums that could wrap
+        static bool within(string_view data, uint64_t offset, uint64_t length)
+        {
+            return offset <= data.size() && length <= data.size() - offset;
+        }
+
+        static uint64_t read(string_view data, size_t at, size_t bytes, bool little)
+        {
+            uint64_t value = 0;
+            for (size_t i = 0; i < bytes; i++)
+            {
+                uint64_t byte = static_cast<unsigned char>(data[at + i]);
+                value |= byte << (8 * (little ? i : bytes - 1 - i));
+            }
+            return value;
+        }
+};
+
+#ifdef __linux__
+/*
+* Decides whether the dynamic loader of this host would find a library
+*
+* Follows the loader's order: DT_RPATH, LD_LIBRARY_PATH, DT_RUNPATH,
+* /etc/ld.so.cache, then the default and already loaded library directories.
+* A candidate only counts if its ELF identity matches the program's.
+*/
+class LibraryResolver
+{
+    public:
+        static bool resolvable(const string& library,
+                            const ElfImage::Identity& identity,
+                            const vector<string>& rpath,
+                            const vector<string>& runpath)
+        {
+            if (library.find('/') != string::npos)
+            {
+                return matches(library, identity);
+            }
+
+            vector<string> directories = runpath.empty() ? rpath : vector<string>();
+            const char* environment = getenv("LD_LIBRARY_PATH");
+            for (const string& directory : split(environment ? environment : "", ':'))
+            {
+                directories.push_back(directory);
+            }
+            directories.insert(directories.end(), runpath.begin(), runpath.end());
+            for (const string& directory : directories)
+            {
+                if (matches((fs::path(directory) / library).string(), identity))
+                {
+                    return true;
+                }
+            }
+
+            const auto& cache = ld_cache();
+            auto range = cache.equal_range(library);
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (matches(it->second, identity))
+                {
+                    return true;
+                }
+            }
+
+            for (const string& directory : default_directories())
+            {
+                if (matches((fs::path(directory) / library).string(), identity))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static vector<string> split(const string& list, char separator)
+        {
+            vector<string> parts;
+            istringstream stream(list);
+            string part;
+            while (getline(stream, part, separator))
+            {
+                if (!part.empty())
+                {
+                    parts.push_back(part);
+                }
+            }
+            return parts;
+        }
+
+    private:
+        static bool matches(const string& path, const ElfImage::Identity& identity)
+        {
+            ElfImage::Identity found;
+            return ElfImage::identify_file(path, found) && found == identity;
+        }
+
+        // Library names and paths from the glibc loader cache ("glibc-ld.so.cache1.1" format)
+        static const multimap<string, string>& ld_cache()
+        {
+            static const multimap<string, string> entries = []()
+            {
+                multimap<string, string> result;
+                ifstream file("/etc/ld.so.cache", ios::binary);
+                string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+                // Older caches put the new format after a legacy table
+                const string magic = "glibc-ld.so.cache1.1";
+                size_t base = data.find(magic);
+                const size_t header_size = 48, entry_size = 24;
+                if (base == string::npos || data.size() < base + header_size)
+                {
+                    return result;
+                }
+                string_view view(data);
+                uint64_t count = ElfImage::read(view, base + 20, 4, true);
+                for (uint64_t i = 0; i < count; i++)
+                {
+                    size_t at = base + header_size + static_cast<size_t>(i) * entry_size;
+                    if (at + entry_size > data.size())
+                    {
+                        break;
+                    }
+                    size_t key = base + static_cast<size_t>(ElfImage::read(view, at + 4, 4, true));
+                    size_t value = base + static_cast<size_t>(ElfImage::read(view, at + 8, 4, true));
+                    if (key < data.size() && value < data.size())
+                    {
+                        result.emplace(string(data.c_str() + key), string(data.c_str() + value));
+                    }
+                }
+                return result;
+            }();
+            return entries;
+        }
+
+        // Standard directories plus those of the libraries this process has loaded
+        static const vector<string>& default_directories()
+        {
+            static const vector<string> directories = []()
+            {
+                vector<string> result = { "/lib", "/usr/lib", "/lib64", "/usr/lib64", "/usr/local/lib" };
+                dl_iterate_phdr([](dl_phdr_info* info, size_t, void* data)
+                {
+                    auto* list = static_cast<vector<string>*>(data);
+                    if (info->dlpi_name && info->dlpi_name[0] == '/')
+                    {
+                        string directory = fs::path(info->dlpi_name).parent_path().string();
+                        if (find(list->begin(), list->end(), directory) == list->end())
+                        {
+                            list->push_back(directory);
+                        }
+                    }
+                    return 0;
+                }, &result);
+                return result;
+            }();
+            return directories;
+        }
+};
+#endif
+
+/*
+* Checks that a download is an ELF executable that can run on this host
+*
+* Rejects on the first mismatch: magic, class/byte order/e_machine, interpreter,
+* then unresolvable libraries once the dynamic section has arrived.
+*/
+inline ContentValidator elf_validator(ElfRequirements requirements = ElfRequirements())
+{
+    struct Scan
+    {
+        bool header_checked = false;
+        ElfImage::Identity identity;
+        vector<ElfImage::Segment> segments;
+        bool dynamic_pending = false;
+        uint64_t dynamic_offset = 0;
+        string dynamic;
+    };
+    auto scan = make_shared<Scan>();
+
+    ElfImage::Identity host;
+    bool know_host = false;
+    #ifdef __linux__
+    know_host = requirements.match_host && ElfImage::identify_file("/proc/self/exe", host);
+    if (requirements.origin.empty())
+    {
+        error_code ec;
+        requirements.origin = fs::read_symlink("/proc/self/exe", ec).parent_path().string();
+    }
+    #else
+    // Interpreter and libraries describe Linux hosts only
+    requirements.check_interpreter = false;
+    requirements.check_libraries = false;
+    #endif
+
+    ContentValidator validator;
+    validator.name = "elf";
+    validator.reset = [scan]()
+    {
+        *scan = Scan();
+    };
+    validator.inspect = [scan, requirements, host, know_host](const ContentChunk& chunk, string& reason)
+    {
+        Scan& state = *scan;
+        if (!state.header_checked)
+        {
+            if (chunk.head.size() < 4 && !chunk.complete)
+            {
+                return Verdict::NeedMore;
+            }
+            if (!ElfImage::has_magic(chunk.head))
+            {
+                reason = "not an ELF executable";
+                return Verdict::Reject;
+            }
+            if (!ElfImage::identify(chunk.head, state.identity) ||
+                !ElfImage::segments(chunk.head, state.identity, state.segments))
+            {
+                if (chunk.complete || chunk.head.size() >= ContentSniffer::head_limit)
+                {
+                    reason = "truncated or malformed ELF header";
+                    return Verdict::Reject;
+                }
+                return Verdict::NeedMore;
+            }
+            state.header_checked = true;
+
+            if (know_host && !(state.identity == host))
+            {
+                reason = "built for machine " + to_string(state.identity.machine) + " (" +
+                    (state.identity.elf_class == 2 ? "64" : "32") + " bit), this host is " +
+                    to_string(host.machine) + " (" + (host.elf_class == 2 ? "64" : "32") + " bit)";
+                return Verdict::Reject;
+            }
+            if (!know_host && requirements.machine != 0 && state.identity.machine != requirements.machine)
+            {
+                reason = "built for machine " + to_string(state.identity.machine) +
+                    ", expected " + to_string(requirements.machine);
+                return Verdict::Reject;
+            }
+
+            for (const ElfImage::Segment& segment : state.segments)
+            {
+                if (segment.type == ElfImage::pt_interp && requirements.check_interpreter)
+                {
+                    // The interpreter string sits right after the headers
+                    if (!ElfImage::within(chunk.head, segment.offset, segment.filesz))
+                    {
+                        continue;
+                    }
+                    string interpreter(chunk.head.substr(static_cast<size_t>(segment.offset), static_cast<size_t>(segment.filesz)));
+                    interpreter.resize(min(interpreter.size(), interpreter.find('\0')));
+                    if (!requirements.interpreter.empty() && interpreter != requirements.interpreter)
+                    {
+                        reason = "interpreter is " + interpreter + ", expected " + requirements.interpreter;
+                        return Verdict::Reject;
+                    }
+                    if (!fs::exists(interpreter))
+                    {
+                        reason = "interpreter " + interpreter + " does not exist on this host";
+                        return Verdict::Reject;
+                    }
+                }
+                if (segment.type == ElfImage::pt_dynamic && requirements.check_libraries && segment.filesz > 0)
+                {
+                    // The buffer is sized by the header, so a forged size must not become the allocation
+                    if (segment.filesz > ElfImage::max_dynamic_size || segment.offset > UINT64_MAX - segment.filesz)
+                    {
+                        reason = "malformed dynamic section (" + to_string(segment.filesz) + " bytes at " +
+                            to_string(segment.offset) + ")";
+                        return Verdict::Reject;
+                    }
+                    state.dynamic_pending = true;
+                    state.dynamic_offset = segment.offset;
+                    state.dynamic.assign(static_cast<size_t>(segment.filesz), '\0');
+                }
+            }
+            if (!state.dynamic_pending)
+            {
+                return Verdict::Accept;
+            }
+        }
+
+        // Collect the dynamic section from the head and the chunks streaming past
+        uint64_t dynamic_end = state.dynamic_offset + state.dynamic.size();
+        auto collect = [&state, dynamic_end](string_view bytes, uint64_t begin)
+        {
+            uint64_t from = max(begin, state.dynamic_offset);
+            uint64_t to = min<uint64_t>(begin + bytes.size(), dynamic_end);
+            if (from < to)
+            {
+                memcpy(&state.dynamic[static_cast<size_t>(from - state.dynamic_offset)],
+                    bytes.data() + (from - begin), static_cast<size_t>(to - from));
+            }
+        };
+        collect(chunk.head, 0);
+        collect(chunk.data, static_cast<uint64_t>(chunk.offset));
+        if (static_cast<uint64_t>(chunk.offset) + chunk.data.size() < dynamic_end && chunk.head.size() < dynamic_end)
+        {
+            if (chunk.complete)
+            {
+                reason = "file ends inside the dynamic section";
+                return Verdict::Reject;
+            }
+            return Verdict::NeedMore;
+        }
+
+        #ifdef __linux__
+        bool wide = state.identity.elf_class == 2;
+        bool little = state.identity.byte_order == 1;
+        size_t entry = wide ? 16 : 8;
+        uint64_t strtab = 0, strsz = 0;
+        vector<uint64_t> needed, rpath, runpath;
+        for (size_t at = 0; at + entry <= state.dynamic.size(); at += entry)
+        {
+            uint64_t tag = ElfImage::read(state.dynamic, at, entry / 2, little);
+            uint64_t value = ElfImage::read(state.dynamic, at + entry / 2, entry / 2, little);
+            if (tag == ElfImage::dt_null) break;
+            if (tag == ElfImage::dt_needed) needed.push_back(value);
+            else if (tag == ElfImage::dt_strtab) strtab = value;
+            else if (tag == ElfImage::dt_strsz) strsz = value;
+            else if (tag == ElfImage::dt_rpath) rpath.push_back(value);
+            else if (tag == ElfImage::dt_runpath) runpath.push_back(value);
+        }
+
+        // Linkers put .dynstr in the first segment; if the head misses it, the check is skipped
+        uint64_t strings = ElfImage::file_offset(state.segments, strtab);
+        if (needed.empty() || strings == UINT64_MAX || !ElfImage::within(chunk.head, strings, strsz))
+        {
+            return Verdict::Accept;
+        }
+        string_view table = chunk.head.substr(static_cast<size_t>(strings), static_cast<size_t>(strsz));
+        auto string_at = [&table](uint64_t index)
+        {
+            string_view rest = index < table.size() ? table.substr(static_cast<size_t>(index)) : string_view();
+            return string(rest.substr(0, rest.find('\0')));
+        };
+        auto search_path = [&](const vector<uint64_t>& indices)
+        {
+            vector<string> directories;
+            for (uint64_t index : indices)
+            {
+                for (string directory : LibraryResolver::split(string_at(index), ':'))
+                {
+                    for (const string origin : { "$ORIGIN", "${ORIGIN}" })
+                    {
+                        size_t at = directory.find(origin);
+                        if (at != string::npos)
+                        {
+                            directory.replace(at, origin.size(), requirements.origin);
+                        }
+                    }
+                    directories.push_back(directory);
+                }
+            }
+            return directories;
+        };
+
+        vector<string> missing;
+        for (uint64_t index : needed)
+        {
+            string library = string_at(index);
+            if (!library.empty() &&
+                !LibraryResolver::resolvable(library, state.identity, search_path(rpath), search_path(runpath)))
+            {
+                missing.push_back(library);
+            }
+        }
+        if (!missing.empty())
+        {
+            reason = "missing libraries on this host:";
+            for (const string& library : missing)
+            {
+                reason += " " + library;
+            }
+            return Verdict::Reject;
+        }
+        #endif
+        return Verdict::Accept;
+    };
+    return validator;
+}
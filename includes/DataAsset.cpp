@@ -0,0 +1,247 @@
+/*
+ * DataAsset - Data files (models, lookup tables) replaced under running readers
+ *
+ * Features:
+ * - The file is mapped read-only and published through an RcuCell
+ * - Reader threads get a consistent snapshot without locks, valid for as long as they hold it
+ * - A new version is mapped and swapped in with one atomic exchange
+ * - The old mapping is unmapped when its last reader lets go
+ *
+ * The file is replaced by renaming the verified download over it, so an
+ * existing mapping keeps the old inode and never sees a partial file. The
+ * version label goes with the file as an extended attribute (Linux), so a
+ * restarted process knows which release it has.
+ * Windows reads the file into memory instead of mapping it.
+ */
+
+#pragma once
+
+#include "Rcu.cpp"
+
+#include <string>
+#include <memory>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <iterator>
+#include <string_view>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Read-only mapping of one version of a data file
+class MappedFile
+{
+    public:
+        /*
+        * Maps a file
+        *
+        * @param path: File to map
+        * @param version: Label of this version (digest or release tag)
+        * @param error: Set on failure
+        *
+        * Returns nullptr on failure
+        */
+        static unique_ptr<MappedFile> open(const string& path, const string& version, string& error)
+        {
+            unique_ptr<MappedFile> file(new MappedFile());
+            file->file_version = version;
+            #ifdef _WIN32
+            ifstream in(path, ios::binary);
+            if (!in)
+            {
+                error = "cannot open " + path;
+                return nullptr;
+            }
+            file->contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+            file->bytes = file->contents.data();
+            file->length = file->contents.size();
+            #else
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0)
+            {
+                error = "cannot open " + path + ": " + strerror(errno);
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                return nullptr;
+            }
+            file->length = static_cast<size_t>(info.st_size);
+            if (file->length > 0)
+            {
+                void* mapping = mmap(nullptr, file->length, PROT_READ, MAP_SHARED, fd, 0);
+                if (mapping == MAP_FAILED)
+                {
+                    error = "cannot map " + path + ": " + strerror(errno);
+                    close(fd);
+                    return nullptr;
+                }
+                file->bytes = static_cast<const char*>(mapping);
+            }
+            // The mapping keeps the inode alive, the descriptor is not needed
+            close(fd);
+            #endif
+            return file;
+        }
+
+        ~MappedFile()
+        {
+            #ifndef _WIN32
+            if (bytes && length > 0)
+            {
+                munmap(const_cast<char*>(bytes), length);
+            }
+            #endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* data() const
+        {
+            return bytes;
+        }
+
+        size_t size() const
+        {
+            return length;
+        }
+
+        string_view view() const
+        {
+            return string_view(bytes, length);
+        }
+
+        const string& version() const
+        {
+            return file_version;
+        }
+
+    private:
+        MappedFile() = default;
+
+        const char* bytes = nullptr;
+        size_t length = 0;
+        string file_version;
+        #ifdef _WIN32
+        string contents;
+        #endif
+};
+
+class DataAsset
+{
+    public:
+        using Snapshot = RcuCell<MappedFile>::Snapshot;
+
+        /*
+        * @param name: Release asset name
+        * @param path: Local file, mapped right away if it exists, with the version recorded on it
+        */
+        DataAsset(const string& name, const string& path)
+            : asset_name(name),
+            asset_path(path)
+        {
+            string error;
+            error_code ec;
+            if (fs::exists(path, ec))
+            {
+                reload(recorded_version(path), error);
+            }
+        }
+
+        // Records the version label on a file before it is renamed into place
+        static void record_version(const string& path, const string& version)
+        {
+            #ifdef __linux__
+            if (!version.empty())
+            {
+                setxattr(path.c_str(), version_attribute, version.data(), version.size(), 0);
+            }
+            #else
+            (void)path;
+            (void)version;
+            #endif
+        }
+
+        // Version label recorded on a file, empty if none
+        static string recorded_version(const string& path)
+        {
+            #ifdef __linux__
+            char buffer[256];
+            ssize_t length = getxattr(path.c_str(), version_attribute, buffer, sizeof(buffer));
+            if (length > 0)
+            {
+                return string(buffer, static_cast<size_t>(length));
+            }
+            #else
+            (void)path;
+            #endif
+            return "";
+        }
+
+        const string& name() const
+        {
+            return asset_name;
+        }
+
+        const string& path() const
+        {
+            return asset_path;
+        }
+
+        /*
+        * Current version of the file, empty if it was never loaded. Lock-free, for hot paths
+        *
+        * The bytes stay mapped and unchanged until the snapshot is released,
+        * even if a newer version is published meanwhile
+        */
+        Snapshot snapshot() const
+        {
+            return versions.read();
+        }
+
+        /*
+        * Maps the file at path() again and publishes it
+        *
+        * @param version: Label of the new version
+        * @param error: Set on failure, the current version then stays
+        */
+        bool reload(const string& version, string& error)
+        {
+            unique_ptr<MappedFile> file = MappedFile::open(asset_path, version, error);
+            if (!file)
+            {
+                return false;
+            }
+            versions.publish(move(file));
+            return true;
+        }
+
+        // Replaced versions still mapped because a reader holds them
+        size_t retired_versions() const
+        {
+            return versions.retired_versions();
+        }
+
+    private:
+        static constexpr const char* version_attribute = "user.autoupdater.version";
+
+        string asset_name;
+        string asset_path;
+        RcuCell<MappedFile> versions;
+};
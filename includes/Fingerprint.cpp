@@ -0,0 +1,217 @@
+/*
+ * Fingerprint - Remembers the SHA-256 of installed files by their stat identity
+ *
+ * Features:
+ * - Keyed by device, inode, size, mtime and ctime: a hit costs one stat()
+ * - Shared by the user's updaters through a private state file (see StateFiles)
+ * - Seeded at install time, so a fresh install never needs hashing
+ *
+ * The digest is compared with the one GitHub publishes for release assets,
+ * which is a plain SHA-256 of the whole file. Its blocks have to be hashed in
+ * order, so a miss costs one sequential pass; the cache makes that rare.
+ * A digest read from the cache is trusted, so only the user may write it.
+ */
+
+#pragma once
+
+#include "Sha256.cpp"
+#include "StateFiles.cpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <algorithm>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+class FingerprintCache
+{
+    public:
+        FingerprintCache()
+            : cache_path(StateFiles::path("fingerprints"))
+        {
+        }
+
+        /*
+        * SHA-256 of a file as lowercase hex, hashed only if the file changed since last time
+        *
+        * Returns empty string if the file cannot be read
+        */
+        string digest(const string& path)
+        {
+            Entry current;
+            if (!identify(path, current))
+            {
+                return "";
+            }
+
+            string known;
+            with_entries([&](vector<Entry>& entries)
+            {
+                for (const Entry& entry : entries)
+                {
+                    if (entry.path == current.path && entry.same_file(current))
+                    {
+                        known = entry.sha256;
+                    }
+                }
+                return false;
+            });
+            if (!known.empty())
+            {
+                return known;
+            }
+
+            // Only trust the result if the file did not change while being hashed
+            current.sha256 = sha256_file(path);
+            Entry after;
+            if (current.sha256.empty() || !identify(path, after) || !after.same_file(current))
+            {
+                return current.sha256;
+            }
+            store(current);
+            return current.sha256;
+        }
+
+        // Records the digest of a file whose content is known, e.g. right after installing a verified asset
+        void remember(const string& path, const string& sha256)
+        {
+            Entry entry;
+            if (!sha256.empty() && identify(path, entry))
+            {
+                entry.sha256 = sha256;
+                store(entry);
+            }
+        }
+
+    private:
+        static constexpr size_t max_entries = 64;
+
+        struct Entry
+        {
+            uint64_t device = 0;
+            uint64_t inode = 0;
+            uint64_t size = 0;
+            int64_t mtime_ns = 0;
+            int64_t ctime_ns = 0;
+            string sha256;
+            string path;
+
+            bool same_file(const Entry& other) const
+            {
+                return device == other.device && inode == other.inode && size == other.size &&
+                    mtime_ns == other.mtime_ns && ctime_ns == other.ctime_ns;
+            }
+        };
+
+        string cache_path;
+
+        static bool identify(const string& path, Entry& entry)
+        {
+            error_code ec;
+            entry.path = fs::absolute(path, ec).string();
+            #ifdef _WIN32
+            // No inode numbers: the size and write time have to do
+            entry.size = fs::file_size(path, ec);
+            if (ec)
+            {
+                return false;
+            }
+            entry.mtime_ns = fs::last_write_time(path, ec).time_since_epoch().count();
+            return !ec;
+            #else
+            struct stat info;
+            if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+            {
+                return false;
+            }
+            entry.device = static_cast<uint64_t>(info.st_dev);
+            entry.inode = static_cast<uint64_t>(info.st_ino);
+            entry.size = static_cast<uint64_t>(info.st_size);
+            #ifdef __APPLE__
+            entry.mtime_ns = info.st_mtimespec.tv_sec * 1000000000LL + info.st_mtimespec.tv_nsec;
+            entry.ctime_ns = info.st_ctimespec.tv_sec * 1000000000LL + info.st_ctimespec.tv_nsec;
+            #else
+            entry.mtime_ns = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+            entry.ctime_ns = info.st_ctim.tv_sec * 1000000000LL + info.st_ctim.tv_nsec;
+            #endif
+            return true;
+            #endif
+        }
+
+        // Replaces the entry for the same path, keeping the newest max_entries
+        void store(const Entry& entry)
+        {
+            with_entries([&](vector<Entry>& entries)
+            {
+                entries.erase(remove_if(entries.begin(), entries.end(),
+                    [&](const Entry& other) { return other.path == entry.path; }), entries.end());
+                entries.push_back(entry);
+                if (entries.size() > max_entries)
+                {
+                    entries.erase(entries.begin(), entries.end() - max_entries);
+                }
+                return true;
+            });
+        }
+
+        // Runs `fn` on the entries while holding the user's lock, saving them if it returns true
+        template <typename Fn>
+        void with_entries(Fn fn)
+        {
+            vector<Entry> entries;
+            #ifndef _WIN32
+            // Without a private cache file every check hashes, which is slow but safe
+            int fd = StateFiles::open(cache_path, O_RDWR | O_CREAT);
+            if (fd < 0)
+            {
+                fn(entries);
+                return;
+            }
+            flock(fd, LOCK_EX);
+            istringstream in(StateFiles::read_all(fd));
+            #else
+            ifstream in(cache_path);
+            #endif
+
+            // "device inode size mtime_ns ctime_ns sha256 path" per line, oldest first
+            Entry entry;
+            while (in >> entry.device >> entry.inode >> entry.size >> entry.mtime_ns >> entry.ctime_ns >> entry.sha256 &&
+                getline(in >> ws, entry.path))
+            {
+                entries.push_back(entry);
+            }
+
+            if (fn(entries))
+            {
+                ostringstream out;
+                for (const Entry& entry : entries)
+                {
+                    out << entry.device << " " << entry.inode << " " << entry.size << " " << entry.mtime_ns << " "
+                        << entry.ctime_ns << " " << entry.sha256 << " " << entry.path << "\n";
+                }
+                #ifndef _WIN32
+                StateFiles::replace_all(fd, out.str());
+                #else
+                ofstream(cache_path, ios::trunc) << out.str();
+                #endif
+            }
+
+            #ifndef _WIN32
+            flock(fd, LOCK_UN);
+            close(fd);
+            #endif
+        }
+};
@@ -0,0 +1,469 @@
+/*
+ * HttpServer - Minimal embedded HTTP/1.1 server
+ *
+ * Features:
+ * - Listens on a TCP port (0 picks a free one)
+ * - One thread per connection, with a connection limit
+ * - Serves in-memory bodies or whole files via sendfile()
+ *
+ * Only meant for the updater's small local endpoints (peer cache, release
+ * cache, webhooks), not for general-purpose serving. The host process's
+ * signal dispositions are left alone: a client that went away never
+ * raises SIGPIPE outside the server's own threads. Linux/macOS only.
+ */
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <sstream>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#endif
+
+
+using namespace std;
+
+struct HttpRequest
+{
+    string method;
+    string path;                    // Without the query string
+    string query;
+    map<string, string> headers;    // Lowercase names
+    string body;
+    string remote_address;
+};
+
+struct HttpResponse
+{
+    int status = 200;
+    string content_type = "application/octet-stream";
+    map<string, string> headers;
+    string body;
+    string file_path;               // If set, the file is sent instead of body
+
+    static HttpResponse text(int status, const string& body)
+    {
+        HttpResponse response;
+        response.status = status;
+        response.content_type = "text/plain";
+        response.body = body;
+        return response;
+    }
+};
+
+class HttpServer
+{
+    public:
+        using Handler = function<HttpResponse(const HttpRequest&)>;
+
+        /*
+        * @param port: TCP port to listen on (0 = any free port)
+        * @param handler: Called for every request, possibly from several threads at once
+        * @param bind_address: Address to listen on
+        */
+        HttpServer(uint16_t port, Handler handler, const string& bind_address = "0.0.0.0")
+            : requested_port(port),
+            bind_address(bind_address),
+            handler(handler)
+        {
+        }
+
+        HttpServer(const HttpServer&) = delete;
+        HttpServer& operator=(const HttpServer&) = delete;
+
+        ~HttpServer()
+        {
+            stop();
+        }
+
+        // Starts listening in a background thread. Returns false if the port cannot be bound
+        bool start()
+        {
+            #ifdef _WIN32
+            return false;
+            #else
+            if (running)
+            {
+                return true;
+            }
+
+            #ifdef SOCK_CLOEXEC
+            listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            #else
+            listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+            #endif
+            if (listen_fd < 0)
+            {
+                return false;
+            }
+
+            int on = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(requested_port);
+            if (inet_pton(AF_INET, bind_address.c_str(), &address.sin_addr) != 1 ||
+                ::bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+                listen(listen_fd, 128) != 0)
+            {
+                close(listen_fd);
+                listen_fd = -1;
+                return false;
+            }
+
+            socklen_t length = sizeof(address);
+            getsockname(listen_fd, reinterpret_cast<sockaddr*>(&address), &length);
+            bound_port = ntohs(address.sin_port);
+
+            running = true;
+            accept_thread = thread(&HttpServer::accept_loop, this);
+            return true;
+            #endif
+        }
+
+        // Stops accepting and waits for in-flight requests to finish
+        void stop()
+        {
+            #ifndef _WIN32
+            if (!running)
+            {
+                return;
+            }
+            running = false;
+            shutdown(listen_fd, SHUT_RDWR);
+            if (accept_thread.joinable())
+            {
+                accept_thread.join();
+            }
+            close(listen_fd);
+            listen_fd = -1;
+            while (connections > 0)
+            {
+                this_thread::sleep_for(chrono::milliseconds(10));
+            }
+            #endif
+        }
+
+        // Port actually bound (useful with port 0)
+        uint16_t port() const
+        {
+            return bound_port;
+        }
+
+        void set_max_connections(int limit)
+        {
+            max_connections = limit;
+        }
+
+    private:
+        static constexpr size_t max_header_bytes = 64 * 1024;
+        static constexpr size_t max_body_bytes = 16 * 1024 * 1024;
+        static constexpr int io_timeout_ms = 10000;
+        static constexpr int poll_slice_ms = 200;
+
+        uint16_t requested_port;
+        uint16_t bound_port = 0;
+        string bind_address;
+        Handler handler;
+        int listen_fd = -1;
+        atomic<bool> running{false};
+        atomic<int> connections{0};
+        int max_connections = 256;
+        thread accept_thread;
+
+        #ifndef _WIN32
+        void accept_loop()
+        {
+            #ifdef __linux__
+            // sendfile() has no MSG_NOSIGNAL. Connection threads inherit this mask, so
+            // a SIGPIPE it raises stays pending in that thread instead of killing the process
+            sigset_t pipe_signal;
+            sigemptyset(&pipe_signal);
+            sigaddset(&pipe_signal, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+            #endif
+
+            while (running)
+            {
+                sockaddr_in peer = {};
+                socklen_t length = sizeof(peer);
+                #ifdef __linux__
+                int fd = accept4(listen_fd, reinterpret_cast<sockaddr*>(&peer), &length, SOCK_CLOEXEC);
+                #else
+                int fd = accept(listen_fd, reinterpret_cast<sockaddr*>(&peer), &length);
+                #endif
+                if (fd < 0)
+                {
+                    if (!running)
+                    {
+                        break;
+                    }
+                    continue;
+                }
+
+                #ifdef SO_NOSIGPIPE
+                int on = 1;
+                setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+                #endif
+
+                char address[INET_ADDRSTRLEN] = "";
+                inet_ntop(AF_INET, &peer.sin_addr, address, sizeof(address));
+
+                if (connections >= max_connections)
+                {
+                    send_response(fd, HttpResponse::text(503, "Too many connections\n"), false);
+                    close(fd);
+                    continue;
+                }
+
+                connections++;
+                thread([this, fd, remote = string(address)]()
+                {
+                    handle_connection(fd, remote);
+                    close(fd);
+                    connections--;
+                }).detach();
+            }
+        }
+
+        // Waits for data in short slices so stop() does not hang on idle keep-alive connections
+        bool wait_readable(int fd)
+        {
+            for (int waited = 0; running && waited < io_timeout_ms; waited += poll_slice_ms)
+            {
+                pollfd pfd = {fd, POLLIN, 0};
+                int ready = poll(&pfd, 1, poll_slice_ms);
+                if (ready != 0)
+                {
+                    return ready > 0;
+                }
+            }
+            return false;
+        }
+
+        void handle_connection(int fd, const string& remote)
+        {
+            string buffer;
+            char chunk[8192];
+
+            // Keep-alive: serve requests until the client closes or asks to close
+            while (running)
+            {
+                size_t header_end;
+                while ((header_end = buffer.find("\r\n\r\n")) == string::npos)
+                {
+                    if (buffer.size() > max_header_bytes || !wait_readable(fd))
+                    {
+                        return;
+                    }
+                    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                    if (n <= 0)
+                    {
+                        return;
+                    }
+                    buffer.append(chunk, static_cast<size_t>(n));
+                }
+
+                HttpRequest request;
+                request.remote_address = remote;
+                istringstream head(buffer.substr(0, header_end));
+                string line, version;
+                getline(head, line);
+                istringstream request_line(line);
+                request_line >> request.method >> request.path >> version;
+
+                size_t question = request.path.find('?');
+                if (question != string::npos)
+                {
+                    request.query = request.path.substr(question + 1);
+                    request.path = request.path.substr(0, question);
+                }
+
+                while (getline(head, line))
+                {
+                    size_t colon = line.find(':');
+                    if (colon == string::npos)
+                    {
+                        continue;
+                    }
+                    string name = line.substr(0, colon);
+                    transform(name.begin(), name.end(), name.begin(), ::tolower);
+                    string value = line.substr(colon + 1);
+                    value.erase(0, value.find_first_not_of(" \t"));
+                    while (!value.empty() && (value.back() == '\r' || value.back() == ' '))
+                    {
+                        value.pop_back();
+                    }
+                    request.headers[name] = value;
+                }
+                buffer.erase(0, header_end + 4);
+
+                size_t content_length = 0;
+                if (request.headers.count("content-length"))
+                {
+                    content_length = strtoull(request.headers["content-length"].c_str(), nullptr, 10);
+                }
+                if (content_length > max_body_bytes)
+                {
+                    send_response(fd, HttpResponse::text(413, "Request body too large\n"), false);
+                    return;
+                }
+                while (buffer.size() < content_length)
+                {
+                    if (!wait_readable(fd))
+                    {
+                        return;
+                    }
+                    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                    if (n <= 0)
+                    {
+                        return;
+                    }
+                    buffer.append(chunk, static_cast<size_t>(n));
+                }
+                request.body = buffer.substr(0, content_length);
+                buffer.erase(0, content_length);
+
+                bool keep_alive = version == "HTTP/1.1" && request.headers["connection"] != "close";
+                HttpResponse response = handler(request);
+                if (request.method == "HEAD")
+                {
+                    response.body.clear();
+                }
+                if (!send_response(fd, response, keep_alive, request.method == "HEAD") || !keep_alive)
+                {
+                    return;
+                }
+            }
+        }
+
+        static bool send_all(int fd, const char* data, size_t length)
+        {
+            while (length > 0)
+            {
+                #ifdef MSG_NOSIGNAL
+                ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+                #else
+                ssize_t n = send(fd, data, length, 0);
+                #endif
+                if (n <= 0)
+                {
+                    return false;
+                }
+                data += n;
+                length -= static_cast<size_t>(n);
+            }
+            return true;
+        }
+
+        static const char* reason(int status)
+        {
+            switch (status)
+            {
+                case 200: return "OK";
+                case 204: return "No Content";
+                case 206: return "Partial Content";
+                case 400: return "Bad Request";
+                case 401: return "Unauthorized";
+                case 403: return "Forbidden";
+                case 404: return "Not Found";
+                case 405: return "Method Not Allowed";
+                case 413: return "Payload Too Large";
+                case 416: return "Range Not Satisfiable";
+                case 500: return "Internal Server Error";
+                case 502: return "Bad Gateway";
+                case 503: return "Service Unavailable";
+                default: return "Unknown";
+            }
+        }
+
+        bool send_response(int fd, const HttpResponse& response, bool keep_alive, bool head_only = false)
+        {
+            int file_fd = -1;
+            off_t file_size = 0;
+            if (!response.file_path.empty())
+            {
+                file_fd = open(response.file_path.c_str(), O_RDONLY | O_CLOEXEC);
+                struct stat st;
+                if (file_fd < 0 || fstat(file_fd, &st) != 0)
+                {
+                    if (file_fd >= 0)
+                    {
+                        close(file_fd);
+                    }
+                    return send_response(fd, HttpResponse::text(404, "Not found\n"), keep_alive, head_only);
+                }
+                file_size = st.st_size;
+            }
+
+            size_t body_size = file_fd >= 0 ? static_cast<size_t>(file_size) : response.body.size();
+            string head = "HTTP/1.1 " + to_string(response.status) + " " + reason(response.status) + "\r\n";
+            head += "Content-Type: " + response.content_type + "\r\n";
+            head += "Content-Length: " + to_string(body_size) + "\r\n";
+            head += keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+            for (const auto& [name, value] : response.headers)
+            {
+                head += name + ": " + value + "\r\n";
+            }
+            head += "\r\n";
+
+            bool ok = send_all(fd, head.data(), head.size());
+            if (ok && !head_only)
+            {
+                if (file_fd >= 0)
+                {
+                    off_t offset = 0;
+                    while (ok && offset < file_size)
+                    {
+                        #ifdef __linux__
+                        ssize_t n = sendfile(fd, file_fd, &offset, static_cast<size_t>(file_size - offset));
+                        ok = n > 0;
+                        if (n < 0 && errno == EPIPE)
+                        {
+                            // Consume the SIGPIPE left pending in this thread
+                            sigset_t pipe_signal;
+                            sigemptyset(&pipe_signal);
+                            sigaddset(&pipe_signal, SIGPIPE);
+                            timespec no_wait = {};
+                            sigtimedwait(&pipe_signal, nullptr, &no_wait);
+                        }
+                        #else
+                        char chunk[65536];
+                        ssize_t n = pread(file_fd, chunk, sizeof(chunk), offset);
+                        ok = n > 0 && send_all(fd, chunk, static_cast<size_t>(n));
+                        offset += n > 0 ? n : 0;
+                        #endif
+                    }
+                }
+                else
+                {
+                    ok = send_all(fd, response.body.data(), response.body.size());
+                }
+            }
+
+            if (file_fd >= 0)
+            {
+                close(file_fd);
+            }
+            return ok;
+        }
+        #endif
+};
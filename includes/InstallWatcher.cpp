@@ -0,0 +1,235 @@
+/*
+ * InstallWatcher - Notices when another process installs an update
+ *
+ * Features:
+ * - Watches the executable, its directory and (for bundles) the directory's parent with inotify
+ * - Compares the installed file with the image this process is running
+ * - Reports the release tag recorded on the new file, without any network request
+ *
+ * Linux only. Installs are detected by inode: commit_update() (and package
+ * managers) put a new file in place rather than writing into the running one.
+ */
+
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <filesystem>
+
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/inotify.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+class InstallWatcher
+{
+    public:
+        // Extended attribute holding the release tag of an installed executable
+        static constexpr const char* tag_attribute = "user.autoupdater.tag";
+
+        /*
+        * @param executable: Installed path of the running executable
+        */
+        explicit InstallWatcher(const string& executable)
+            : executable(executable)
+        {
+        }
+
+        ~InstallWatcher()
+        {
+            stop();
+        }
+
+        /*
+        * Starts watching in a background thread
+        *
+        * @param on_install: Called once with the tag of the newly installed release
+        *                    (empty if unknown) when the executable is replaced
+        */
+        bool start(function<void(const string&)> on_install)
+        {
+            #ifdef __linux__
+            // /proc/self/exe resolves to the running image even after it is replaced
+            struct stat running_image;
+            if (stat("/proc/self/exe", &running_image) != 0)
+            {
+                return false;
+            }
+            running_device = running_image.st_dev;
+            running_inode = running_image.st_ino;
+
+            fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd < 0)
+            {
+                return false;
+            }
+
+            // The directory sees renames and re-creations of the path, the file sees unlinks
+            string directory = fs::path(executable).parent_path().string();
+            uint32_t directory_events = IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE;
+            uint32_t file_events = IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+            if (inotify_add_watch(fd, directory.c_str(), directory_events) < 0 ||
+                inotify_add_watch(fd, executable.c_str(), file_events) < 0)
+            {
+                close(fd);
+                fd = -1;
+                return false;
+            }
+
+            // Bundles replace the whole directory, which only its parent sees
+            string parent = fs::path(directory).parent_path().string();
+            if (!parent.empty() && parent != directory)
+            {
+                parent_watch = inotify_add_watch(fd, parent.c_str(), IN_CREATE | IN_MOVED_TO);
+            }
+
+            callback = on_install;
+            running = true;
+            watch_thread = thread(&InstallWatcher::watch_loop, this);
+            return true;
+            #else
+            (void)on_install;
+            return false;
+            #endif
+        }
+
+        void stop()
+        {
+            running = false;
+            if (watch_thread.joinable())
+            {
+                watch_thread.join();
+            }
+            #ifdef __linux__
+            if (fd >= 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+            #endif
+        }
+
+        // True once the file at the executable path is no longer the running image
+        bool is_stale() const
+        {
+            return stale;
+        }
+
+        // Records the release tag on an installed executable for watchers in other processes
+        static void tag_executable(const string& path, const string& tag)
+        {
+            #ifdef __linux__
+            if (!tag.empty())
+            {
+                setxattr(path.c_str(), tag_attribute, tag.data(), tag.size(), 0);
+            }
+            #else
+            (void)path;
+            (void)tag;
+            #endif
+        }
+
+        // Release tag recorded on an executable, empty if none
+        static string executable_tag(const string& path)
+        {
+            #ifdef __linux__
+            char buffer[256];
+            ssize_t length = getxattr(path.c_str(), tag_attribute, buffer, sizeof(buffer));
+            if (length > 0)
+            {
+                return string(buffer, static_cast<size_t>(length));
+            }
+            #else
+            (void)path;
+            #endif
+            return "";
+        }
+
+    private:
+        static constexpr int poll_slice_ms = 200;
+        static constexpr chrono::milliseconds settle_time{250};
+
+        string executable;
+        int fd = -1;
+        atomic<bool> running{false};
+        atomic<bool> stale{false};
+        thread watch_thread;
+        function<void(const string&)> callback;
+        uint64_t running_device = 0;
+        uint64_t running_inode = 0;
+        int parent_watch = -1;
+
+        #ifdef __linux__
+        void watch_loop()
+        {
+            string name = fs::path(executable).filename().string();
+            string directory_name = fs::path(executable).parent_path().filename().string();
+            alignas(inotify_event) char buffer[4096];
+            bool changed = false;
+            auto last_event = chrono::steady_clock::now();
+
+            while (running && !stale)
+            {
+                pollfd descriptor = { fd, POLLIN, 0 };
+                if (poll(&descriptor, 1, poll_slice_ms) > 0)
+                {
+                    ssize_t length;
+                    while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+                    {
+                        for (char* cursor = buffer; cursor < buffer + length; )
+                        {
+                            inotify_event* event = reinterpret_cast<inotify_event*>(cursor);
+                            // Directory events name the entry, file events have no name
+                            bool directory_replaced = event->wd == parent_watch && directory_name == event->name;
+                            if (directory_replaced || (event->wd != parent_watch && (event->len == 0 || name == event->name)))
+                            {
+                                changed = true;
+                                last_event = chrono::steady_clock::now();
+                            }
+                            cursor += sizeof(inotify_event) + event->len;
+                        }
+                    }
+                }
+
+                // Wait for the installer to finish writing before looking at the file
+                if (!changed || chrono::steady_clock::now() - last_event < settle_time)
+                {
+                    continue;
+                }
+                changed = false;
+
+                if (installed_image_differs())
+                {
+                    stale = true;
+                    callback(executable_tag(executable));
+                }
+            }
+        }
+
+        bool installed_image_differs() const
+        {
+            struct stat installed;
+            if (stat(executable.c_str(), &installed) != 0 || installed.st_size == 0 || !(installed.st_mode & S_IXUSR))
+            {
+                // Removed or still being written, wait for the next event
+                return false;
+            }
+            return installed.st_dev != running_device || installed.st_ino != running_inode;
+        }
+        #else
+        void watch_loop()
+        {
+        }
+        #endif
+};
@@ -0,0 +1,282 @@
+/*
+ * LowImpact - Keeps background updates out of the way of the host application
+ *
+ * Features:
+ * - Idle I/O priority (ioprio_set) and SCHED_IDLE (or nice 19) for updater threads
+ * - Optional cgroup v2 sub-group with a CPU limit for those threads
+ * - Download rate adapted at runtime to an application latency signal (AIMD)
+ *
+ * Priorities are applied per thread, so the application's own threads are
+ * never touched. Linux only, other platforms run at normal priority.
+ */
+
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <algorithm>
+#include <filesystem>
+#include <curl/curl.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/ioprio.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+struct LowImpactOptions
+{
+    // Scheduling of updater threads
+    bool idle_io = true;                    // IOPRIO_CLASS_IDLE
+    bool idle_cpu = true;                   // SCHED_IDLE, nice 19 if unavailable
+
+    // cgroup v2 sub-group created below the process's own cgroup (empty = none).
+    // Needs a delegated cgroup with the cpu controller enabled
+    string cgroup_name;
+    string cgroup_cpu_max;                  // Written to cpu.max, e.g. "10000 100000" for 10% of one CPU
+
+    // Adaptive download rate
+    function<double()> latency_probe;       // Application latency, e.g. p99 in ms
+    double target_latency = 0;              // Back off while the probe is above this
+    curl_off_t min_rate = 64 * 1024;        // Bytes per second never throttled below
+    curl_off_t max_rate = 0;                // Bytes per second, 0 = no fixed cap
+    chrono::milliseconds adjust_interval{1000};
+};
+
+/*
+* Additive-increase / multiplicative-decrease controller for the download rate
+*
+* Halves the rate whenever the application's latency is above target and
+* grows it by a tenth per interval while latency is healthy.
+*/
+class BandwidthController
+{
+    public:
+        explicit BandwidthController(const LowImpactOptions& options)
+            : options(options),
+            rate(options.max_rate)
+        {
+        }
+
+        // Current limit in bytes per second, 0 = unlimited
+        curl_off_t limit() const
+        {
+            return rate;
+        }
+
+        /*
+        * Feeds one sample, called from the transfer progress callback
+        *
+        * @param downloaded: Bytes received so far in this transfer
+        *
+        * Returns true if the limit changed
+        */
+        bool sample(curl_off_t downloaded)
+        {
+            auto now = chrono::steady_clock::now();
+            if (!started)
+            {
+                started = true;
+                last_sample = now;
+                last_downloaded = downloaded;
+                return false;
+            }
+            if (!options.latency_probe || now - last_sample < options.adjust_interval)
+            {
+                return false;
+            }
+
+            double seconds = chrono::duration<double>(now - last_sample).count();
+            curl_off_t throughput = static_cast<curl_off_t>(max<curl_off_t>(0, downloaded - last_downloaded) / seconds);
+            last_sample = now;
+            last_downloaded = downloaded;
+
+            curl_off_t previous = rate;
+            if (options.latency_probe() > options.target_latency)
+            {
+                // Without a limit yet, start from what the transfer actually achieved
+                curl_off_t current = rate > 0 ? rate : max(throughput, options.min_rate);
+                rate = max(options.min_rate, current / 2);
+            }
+            else if (rate > 0)
+            {
+                rate += max(rate / 10, options.min_rate / 4);
+                if (options.max_rate > 0)
+                {
+                    rate = min(rate, options.max_rate);
+                }
+                // Far above what the link delivers: the limit no longer matters
+                else if (throughput > 0 && rate > 4 * throughput)
+                {
+                    rate = 0;
+                }
+            }
+            return rate != previous;
+        }
+
+    private:
+        LowImpactOptions options;
+        curl_off_t rate;
+        bool started = false;
+        chrono::steady_clock::time_point last_sample;
+        curl_off_t last_downloaded = 0;
+};
+
+class LowImpactMode
+{
+    public:
+        explicit LowImpactMode(const LowImpactOptions& options)
+            : options(options)
+        {
+        }
+
+        ~LowImpactMode()
+        {
+            // Only succeeds once no thread is left in the group
+            if (!cgroup_dir.empty())
+            {
+                error_code ec;
+                fs::remove(cgroup_dir, ec);
+            }
+        }
+
+        const LowImpactOptions& settings() const
+        {
+            return options;
+        }
+
+        /*
+        * Lowers the priority of the calling thread
+        *
+        * Meant for a thread dedicated to the update, the change cannot be undone
+        * without privileges. Returns what was applied, for logging
+        */
+        string lower_current_thread()
+        {
+            string applied;
+            #ifdef __linux__
+            if (options.idle_io &&
+                syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) == 0)
+            {
+                applied += "idle io, ";
+            }
+
+            if (options.idle_cpu)
+            {
+                sched_param param = {};
+                if (sched_setscheduler(0, SCHED_IDLE, &param) == 0)
+                {
+                    applied += "SCHED_IDLE, ";
+                }
+                else if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19) == 0)
+                {
+                    applied += "nice 19, ";
+                }
+            }
+
+            if (!options.cgroup_name.empty() && join_cgroup())
+            {
+                applied += "cgroup " + cgroup_dir + ", ";
+            }
+            #endif
+            return applied.empty() ? "none" : applied.substr(0, applied.size() - 2);
+        }
+
+    private:
+        LowImpactOptions options;
+        string cgroup_dir;
+
+        #ifdef __linux__
+        // Mount point of the cgroup v2 hierarchy
+        static string cgroup2_mount()
+        {
+            ifstream mounts("/proc/self/mountinfo");
+            string line;
+            while (getline(mounts, line))
+            {
+                // "... <mount point> <options> - <fs type> <source> ..."
+                size_t separator = line.find(" - ");
+                if (separator == string::npos || line.compare(separator + 3, 8, "cgroup2 ") != 0)
+                {
+                    continue;
+                }
+                istringstream fields(line.substr(0, separator));
+                string field, mount_point;
+                for (int i = 0; i < 5 && fields >> field; i++)
+                {
+                    mount_point = field;
+                }
+                return mount_point;
+            }
+            return "";
+        }
+
+        // Path of this process inside the cgroup v2 hierarchy ("0::/path")
+        static string own_cgroup()
+        {
+            ifstream groups("/proc/self/cgroup");
+            string line;
+            while (getline(groups, line))
+            {
+                if (line.compare(0, 3, "0::") == 0)
+                {
+                    return line.substr(3);
+                }
+            }
+            return "";
+        }
+
+        static bool write_file(const fs::path& path, const string& value)
+        {
+            ofstream file(path);
+            file << value;
+            file.flush();
+            return file.good();
+        }
+
+        /*
+        * Moves the calling thread into a threaded sub-group of the process's cgroup
+        *
+        * Only threaded controllers (cpu, cpuset, pids) work per thread. I/O is
+        * limited through the idle I/O class and the download rate instead
+        */
+        bool join_cgroup()
+        {
+            string mount = cgroup2_mount();
+            string own = own_cgroup();
+            if (mount.empty() || own.empty())
+            {
+                return false;
+            }
+
+            fs::path group = fs::path(mount) / own.substr(1) / options.cgroup_name;
+            error_code ec;
+            fs::create_directory(group, ec);
+            if (ec || !write_file(group / "cgroup.type", "threaded"))
+            {
+                return false;
+            }
+            if (!options.cgroup_cpu_max.empty())
+            {
+                // cpu is a threaded controller, so the parent may enable it despite its own processes
+                write_file(group.parent_path() / "cgroup.subtree_control", "+cpu");
+                write_file(group / "cpu.max", options.cgroup_cpu_max);
+            }
+            if (!write_file(group / "cgroup.threads", to_string(syscall(SYS_gettid))))
+            {
+                return false;
+            }
+            cgroup_dir = group.string();
+            return true;
+        }
+        #endif
+};
@@ -0,0 +1,218 @@
+/*
+ * MemoryStage - Stages a new executable in memory and runs it from there
+ *
+ * Features:
+ * - The download goes into a memfd_create() file, so nothing reaches the disk before the new version has run
+ * - The file is sealed once verified, so what runs is exactly what was checked
+ * - fexecve() starts the new version straight from the descriptor (canaries, read-only root filesystems)
+ * - persist() writes it to disk later with copy_file_range()
+ *
+ * path() names the file through /proc/self/fd, for code that works with
+ * paths (downloads, validators, the apply journal). Linux only; elsewhere
+ * create() fails and updates are staged on disk.
+ */
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#endif
+
+
+using namespace std;
+
+class MemoryStage
+{
+    public:
+        /*
+        * Creates an empty in-memory file
+        *
+        * @param name: Shows up in /proc/<pid>/exe and maps once executed
+        * @param error: Set on failure
+        *
+        * Returns nullptr on failure or where memfd_create() is missing
+        */
+        static unique_ptr<MemoryStage> create(const string& name, string& error)
+        {
+            #ifdef __linux__
+            int fd = memfd_create(name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (fd < 0)
+            {
+                error = string("memfd_create failed: ") + strerror(errno);
+                return nullptr;
+            }
+            unique_ptr<MemoryStage> stage(new MemoryStage());
+            stage->memory_fd = fd;
+            return stage;
+            #else
+            (void)name;
+            error = "in-memory staging needs Linux";
+            return nullptr;
+            #endif
+        }
+
+        ~MemoryStage()
+        {
+            #ifdef __linux__
+            if (memory_fd >= 0)
+            {
+                close(memory_fd);
+            }
+            #endif
+        }
+
+        MemoryStage(const MemoryStage&) = delete;
+        MemoryStage& operator=(const MemoryStage&) = delete;
+
+        int fd() const
+        {
+            return memory_fd;
+        }
+
+        // Opens the same file through procfs, for code that takes paths
+        string path() const
+        {
+            return "/proc/self/fd/" + to_string(memory_fd);
+        }
+
+        /*
+        * Makes the file executable and forbids any further change to it
+        *
+        * Writers must have closed their descriptors (a writable mapping keeps the seal from applying)
+        */
+        bool seal(string& error)
+        {
+            #ifdef __linux__
+            if (is_sealed)
+            {
+                return true;
+            }
+            if (fchmod(memory_fd, 0755) != 0 ||
+                fcntl(memory_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+            {
+                error = string("cannot seal the staged file: ") + strerror(errno);
+                return false;
+            }
+            is_sealed = true;
+            return true;
+            #else
+            error = "in-memory staging needs Linux";
+            return false;
+            #endif
+        }
+
+        bool sealed() const
+        {
+            return is_sealed;
+        }
+
+        /*
+        * Replaces the current process with the staged executable
+        *
+        * @param argv, envp: As for execve()
+        * @param error: Set on failure
+        *
+        * Returns only on failure
+        */
+        bool exec(char* const argv[], char* const envp[], string& error)
+        {
+            #ifdef __linux__
+            if (!seal(error))
+            {
+                return false;
+            }
+            fexecve(memory_fd, argv, envp);
+            error = string("fexecve failed: ") + strerror(errno);
+            #else
+            (void)argv;
+            (void)envp;
+            error = "in-memory staging needs Linux";
+            #endif
+            return false;
+        }
+
+        /*
+        * Copies the staged file to destination and syncs it
+        *
+        * copy_file_range() keeps the copy in the kernel; sendfile() and plain
+        * reads cover kernels that refuse it across filesystems
+        */
+        bool persist(const string& destination, string& error) const
+        {
+            #ifdef __linux__
+            struct stat info;
+            if (fstat(memory_fd, &info) != 0)
+            {
+                error = string("cannot read the staged file: ") + strerror(errno);
+                return false;
+            }
+            int out = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+            if (out < 0)
+            {
+                error = "cannot create " + destination + ": " + strerror(errno);
+                return false;
+            }
+            bool ok = copy_fd(memory_fd, out, static_cast<uint64_t>(info.st_size)) && fsync(out) == 0;
+            if (!ok)
+            {
+                error = "cannot write " + destination + ": " + strerror(errno);
+            }
+            close(out);
+            return ok;
+            #else
+            (void)destination;
+            error = "in-memory staging needs Linux";
+            return false;
+            #endif
+        }
+
+        #ifdef __linux__
+        // Copies length bytes from the start of in to out, in the kernel where possible
+        static bool copy_fd(int in, int out, uint64_t length)
+        {
+            off_t offset = 0;
+            while (static_cast<uint64_t>(offset) < length)
+            {
+                ssize_t n = copy_file_range(in, &offset, out, nullptr, static_cast<size_t>(length - static_cast<uint64_t>(offset)), 0);
+                if (n <= 0)
+                {
+                    break;
+                }
+            }
+            while (static_cast<uint64_t>(offset) < length)
+            {
+                ssize_t n = sendfile(out, in, &offset, static_cast<size_t>(length - static_cast<uint64_t>(offset)));
+                if (n <= 0)
+                {
+                    break;
+                }
+            }
+            char buffer[64 * 1024];
+            while (static_cast<uint64_t>(offset) < length)
+            {
+                ssize_t n = pread(in, buffer, sizeof(buffer), offset);
+                if (n <= 0 || write(out, buffer, static_cast<size_t>(n)) != n)
+                {
+                    return false;
+                }
+                offset += n;
+            }
+            return true;
+        }
+        #endif
+
+    private:
+        MemoryStage() = default;
+
+        int memory_fd = -1;
+        bool is_sealed = false;
+};
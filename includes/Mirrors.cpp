@@ -0,0 +1,302 @@
+/*
+ * Mirrors - Release mirror selection for AutoUpdater
+ *
+ * Features:
+ * - Rewrites GitHub release download URLs onto mirror base URLs
+ * - Probes all mirrors concurrently and measures their round-trip time
+ * - Keeps a per-host throughput EWMA shared by all of the user's updaters on the host
+ * - Ranks mirrors by predicted download time
+ */
+
+#pragma once
+
+#include "StateFiles.cpp"
+#include "TlsSettings.cpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include <curl/curl.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// A download source for one release asset
+struct MirrorCandidate
+{
+    string base;                // Mirror base URL (empty for the origin)
+    string url;                 // Full download URL on this mirror
+    bool healthy = false;       // Answered the probe without an error
+    double rtt_ms = 0;          // Round-trip time of the probe
+    double throughput = 0;      // Historical throughput in bytes/s (0 = unknown)
+    double predicted_ms = 0;    // Predicted time to download the asset
+};
+
+/*
+* Per-host download throughput, kept as an exponentially weighted moving average
+*
+* Stored as "host bytes_per_second" lines in a file in the user's private
+* state directory, so every updater of the user learns from every download.
+*/
+class MirrorStats
+{
+    public:
+        MirrorStats()
+        {
+            stats_path = StateFiles::path("mirror_stats");
+        }
+
+        // Historical throughput of a host in bytes/s (0 if never measured)
+        double throughput(const string& host)
+        {
+            double value = 0;
+            with_stats([&](map<string, double>& stats)
+            {
+                auto it = stats.find(host);
+                if (it != stats.end())
+                {
+                    value = it->second;
+                }
+                return false;
+            });
+            return value;
+        }
+
+        // Folds a new throughput sample into the host's moving average
+        void record(const string& host, double bytes_per_second)
+        {
+            with_stats([&](map<string, double>& stats)
+            {
+                auto it = stats.find(host);
+                if (it == stats.end())
+                {
+                    stats[host] = bytes_per_second;
+                }
+                else
+                {
+                    it->second = ewma_weight * bytes_per_second + (1 - ewma_weight) * it->second;
+                }
+                return true;
+            });
+        }
+
+    private:
+        static constexpr double ewma_weight = 0.3;
+
+        string stats_path;
+
+        // Runs `fn` on the stats while holding the shared lock, saving them if it returns true
+        template <typename Fn>
+        void with_stats(Fn fn)
+        {
+            map<string, double> stats;
+            #ifndef _WIN32
+            // Without a private stats file nothing is learned, but mirrors are still ranked by probe
+            int fd = StateFiles::open(stats_path, O_RDWR | O_CREAT);
+            if (fd < 0)
+            {
+                fn(stats);
+                return;
+            }
+            flock(fd, LOCK_EX);
+            istringstream in(StateFiles::read_all(fd));
+            #else
+            ifstream in(stats_path);
+            #endif
+
+            string host;
+            double value;
+            while (in >> host >> value)
+            {
+                stats[host] = value;
+            }
+
+            if (fn(stats))
+            {
+                ostringstream out;
+                for (const auto& [host, value] : stats)
+                {
+                    out << host << " " << value << "\n";
+                }
+                #ifndef _WIN32
+                StateFiles::replace_all(fd, out.str());
+                #else
+                ofstream(stats_path, ios::trunc) << out.str();
+                #endif
+            }
+
+            #ifndef _WIN32
+            flock(fd, LOCK_UN);
+            close(fd);
+            #endif
+        }
+};
+
+class MirrorSelector
+{
+    public:
+        // Host part of a URL ("https://host:port/path" -> "host:port")
+        static string host_of(const string& url)
+        {
+            size_t start = url.find("://");
+            start = (start == string::npos) ? 0 : start + 3;
+            size_t end = url.find('/', start);
+            return url.substr(start, end == string::npos ? string::npos : end - start);
+        }
+
+        // Path part of a URL including the leading slash
+        static string path_of(const string& url)
+        {
+            size_t start = url.find("://");
+            start = (start == string::npos) ? 0 : start + 3;
+            size_t end = url.find('/', start);
+            return end == string::npos ? "/" : url.substr(end);
+        }
+
+        /*
+        * Maps a GitHub download URL onto a mirror
+        *
+        * "https://github.com/owner/repo/releases/download/tag/asset" with base
+        * "https://mirror.example/gh" becomes
+        * "https://mirror.example/gh/owner/repo/releases/download/tag/asset"
+        */
+        static string rewrite(const string& origin_url, const string& base)
+        {
+            if (base.empty())
+            {
+                return origin_url;
+            }
+            string trimmed = base;
+            while (!trimmed.empty() && trimmed.back() == '/')
+            {
+                trimmed.pop_back();
+            }
+            return trimmed + path_of(origin_url);
+        }
+
+        /*
+        * Probes the origin and all mirrors concurrently and ranks them
+        *
+        * @param origin_url: Download URL on github.com
+        * @param mirrors: Mirror base URLs
+        * @param expected_size: Asset size in bytes, used to weigh RTT against throughput (0 = unknown)
+        * @param timeout: Probe timeout per mirror
+        *
+        * Returns healthy candidates first, fastest predicted download first. The origin is always included
+        */
+        static vector<MirrorCandidate> probe(const string& origin_url,
+                                            const vector<string>& mirrors,
+                                            curl_off_t expected_size,
+                                            chrono::milliseconds timeout)
+        {
+            vector<MirrorCandidate> candidates;
+            for (const string& base : mirrors)
+            {
+                MirrorCandidate candidate;
+                candidate.base = base;
+                candidate.url = rewrite(origin_url, base);
+                candidates.push_back(candidate);
+            }
+            MirrorCandidate origin;
+            origin.url = origin_url;
+            candidates.push_back(origin);
+
+            CURLM* multi = curl_multi_init();
+            vector<CURL*> handles(candidates.size(), nullptr);
+            for (size_t i = 0; i < candidates.size(); i++)
+            {
+                CURL* easy = curl_easy_init();
+                if (!easy)
+                {
+                    continue;
+                }
+                curl_easy_setopt(easy, CURLOPT_URL, candidates[i].url.c_str());
+                curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+                curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, static_cast<long>(timeout.count()));
+                TlsSettings::apply(easy);
+                curl_easy_setopt(easy, CURLOPT_USERAGENT, "AutoUpdater/1.0");
+                curl_easy_setopt(easy, CURLOPT_PRIVATE, &candidates[i]);
+                curl_multi_add_handle(multi, easy);
+                handles[i] = easy;
+            }
+
+            int still_running = 1;
+            while (still_running > 0)
+            {
+                if (curl_multi_perform(multi, &still_running) != CURLM_OK)
+                {
+                    break;
+                }
+                CURLMsg* msg;
+                int queued;
+                while ((msg = curl_multi_info_read(multi, &queued)))
+                {
+                    if (msg->msg != CURLMSG_DONE)
+                    {
+                        continue;
+                    }
+                    MirrorCandidate* candidate = nullptr;
+                    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char**>(&candidate));
+                    long http_code = 0;
+                    curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &http_code);
+                    double total_time = 0;
+                    curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME, &total_time);
+                    candidate->healthy = msg->data.result == CURLE_OK && http_code > 0 && http_code < 400;
+                    candidate->rtt_ms = total_time * 1000;
+                }
+                if (still_running > 0)
+                {
+                    curl_multi_poll(multi, nullptr, 0, 100, nullptr);
+                }
+            }
+
+            for (CURL* easy : handles)
+            {
+                if (easy)
+                {
+                    curl_multi_remove_handle(multi, easy);
+                    curl_easy_cleanup(easy);
+                }
+            }
+            curl_multi_cleanup(multi);
+
+            // Predict the download time from RTT and historical throughput
+            MirrorStats stats;
+            for (MirrorCandidate& candidate : candidates)
+            {
+                candidate.throughput = stats.throughput(host_of(candidate.url));
+                double throughput = candidate.throughput > 0 ? candidate.throughput : default_throughput;
+                candidate.predicted_ms = candidate.rtt_ms;
+                if (expected_size > 0)
+                {
+                    candidate.predicted_ms += expected_size / throughput * 1000;
+                }
+            }
+
+            stable_sort(candidates.begin(), candidates.end(), [](const MirrorCandidate& a, const MirrorCandidate& b)
+            {
+                if (a.healthy != b.healthy)
+                {
+                    return a.healthy;
+                }
+                return a.predicted_ms < b.predicted_ms;
+            });
+            return candidates;
+        }
+
+    private:
+        // Throughput assumed for hosts without history (bytes/s)
+        static constexpr double default_throughput = 10.0 * 1024 * 1024;
+};
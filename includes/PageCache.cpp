@@ -0,0 +1,237 @@
+/*
+ * PageCache - Page-cache management around installing a new executable
+ *
+ * Features:
+ * - Records which parts of the running executable are in the page cache
+ * - Prefetches the same parts of the new executable (posix_fadvise WILLNEED)
+ * - Falls back to the loadable ELF segments without a profile
+ * - Drops the rest of the new file and the staging and backup files (DONTNEED)
+ *
+ * The profile is kept per ELF segment, relative to its start, so it carries
+ * over to a new build whose segments moved. Linux only, elsewhere a no-op.
+ */
+
+#pragma once
+
+#include "ContentValidators.cpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+using namespace std;
+
+// Resident bytes of one ELF segment, relative to the segment's file offset
+struct ResidentRange
+{
+    size_t segment;
+    uint64_t begin;
+    uint64_t end;
+};
+
+class PageCache
+{
+    public:
+        /*
+        * Page-access profile of an executable: the parts of its loadable segments now in the page cache
+        *
+        * Taken from the running binary just before it is replaced, this is what
+        * the process actually touched. Empty if the file is not ELF
+        */
+        static vector<ResidentRange> record_profile(const string& path)
+        {
+            vector<ResidentRange> profile;
+            #ifdef __linux__
+            vector<ElfImage::Segment> segments;
+            if (!ElfImage::segments_of_file(path, segments))
+            {
+                return profile;
+            }
+
+            vector<unsigned char> resident;
+            uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+            if (!residency(path, resident))
+            {
+                return profile;
+            }
+
+            for (size_t i = 0; i < segments.size(); i++)
+            {
+                const ElfImage::Segment& segment = segments[i];
+                if (segment.type != ElfImage::pt_load || segment.filesz == 0)
+                {
+                    continue;
+                }
+                uint64_t first = segment.offset / page;
+                uint64_t last = (segment.offset + segment.filesz - 1) / page;
+                for (uint64_t p = first; p <= last && p < resident.size(); p++)
+                {
+                    if (!(resident[p] & 1))
+                    {
+                        continue;
+                    }
+                    uint64_t begin = max(p * page, segment.offset) - segment.offset;
+                    uint64_t end = min((p + 1) * page, segment.offset + segment.filesz) - segment.offset;
+                    if (!profile.empty() && profile.back().segment == i && profile.back().end == begin)
+                    {
+                        profile.back().end = end;
+                    }
+                    else
+                    {
+                        profile.push_back({ i, begin, end });
+                    }
+                }
+            }
+            #else
+            (void)path;
+            #endif
+            return profile;
+        }
+
+        /*
+        * Prefetches the hot parts of a newly installed executable and drops the rest
+        *
+        * @param path: Installed executable
+        * @param profile: From record_profile() on the previous build, or empty for all loadable segments
+        *
+        * Returns the number of bytes prefetched
+        */
+        static uint64_t warm(const string& path, const vector<ResidentRange>& profile)
+        {
+            uint64_t prefetched = 0;
+            #ifdef __linux__
+            vector<ElfImage::Segment> segments;
+            if (!ElfImage::segments_of_file(path, segments))
+            {
+                return 0;
+            }
+
+            // Hot byte ranges of the file, sorted and merged
+            vector<pair<uint64_t, uint64_t>> hot;
+            for (const ResidentRange& range : profile)
+            {
+                if (range.segment < segments.size() && segments[range.segment].type == ElfImage::pt_load)
+                {
+                    const ElfImage::Segment& segment = segments[range.segment];
+                    uint64_t end = min(range.end, segment.filesz);
+                    if (range.begin < end)
+                    {
+                        hot.push_back({ segment.offset + range.begin, segment.offset + end });
+                    }
+                }
+            }
+            if (hot.empty())
+            {
+                for (const ElfImage::Segment& segment : segments)
+                {
+                    if (segment.type == ElfImage::pt_load && segment.filesz > 0)
+                    {
+                        hot.push_back({ segment.offset, segment.offset + segment.filesz });
+                    }
+                }
+            }
+            sort(hot.begin(), hot.end());
+
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0)
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                return 0;
+            }
+
+            // Dirty pages cannot be dropped, the install has synced the file already
+            uint64_t size = static_cast<uint64_t>(info.st_size);
+            uint64_t cold_from = 0;
+            for (const auto& [begin, end] : hot)
+            {
+                if (begin > cold_from)
+                {
+                    posix_fadvise(fd, static_cast<off_t>(cold_from), static_cast<off_t>(begin - cold_from), POSIX_FADV_DONTNEED);
+                }
+                uint64_t from = max(begin, cold_from);
+                if (end > from)
+                {
+                    posix_fadvise(fd, static_cast<off_t>(from), static_cast<off_t>(end - from), POSIX_FADV_WILLNEED);
+                    prefetched += end - from;
+                }
+                cold_from = max(cold_from, end);
+            }
+            if (size > cold_from)
+            {
+                posix_fadvise(fd, static_cast<off_t>(cold_from), static_cast<off_t>(size - cold_from), POSIX_FADV_DONTNEED);
+            }
+            close(fd);
+            #else
+            (void)path;
+            (void)profile;
+            #endif
+            return prefetched;
+        }
+
+        /*
+        * Writes back and drops a file from the page cache
+        *
+        * For files that are only read again much later, if at all (staged downloads, backups)
+        */
+        static void evict(const string& path)
+        {
+            #ifdef __linux__
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd >= 0)
+            {
+                fdatasync(fd);
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                close(fd);
+            }
+            #else
+            (void)path;
+            #endif
+        }
+
+    private:
+        // One entry per page of the file, bit 0 set if the page is cached (mincore)
+        static bool residency(const string& path, vector<unsigned char>& resident)
+        {
+            #ifdef __linux__
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0)
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                return false;
+            }
+            size_t length = static_cast<size_t>(info.st_size);
+            void* mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED)
+            {
+                return false;
+            }
+            size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            resident.assign((length + page - 1) / page, 0);
+            bool ok = mincore(mapping, length, resident.data()) == 0;
+            munmap(mapping, length);
+            return ok;
+            #else
+            (void)path;
+            (void)resident;
+            return false;
+            #endif
+        }
+};
@@ -0,0 +1,350 @@
+/*
+ * PeerCache - LAN peer-to-peer distribution of release assets
+ *
+ * Features:
+ * - Keeps verified assets in a content-addressed store (named by SHA-256)
+ * - Serves the store to other hosts over a small HTTP endpoint
+ * - Discovers peers from a static list or a shared directory
+ * - Fetches assets from peers first, verifying them by hash
+ *
+ * Several processes on one machine can form a group by using different
+ * ports and the same discovery directory.
+ */
+
+#pragma once
+
+#include "HttpServer.cpp"
+#include "Sha256.cpp"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <random>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <filesystem>
+#include <curl/curl.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+class PeerCache
+{
+    public:
+        /*
+        * @param store_dir: Directory holding verified assets, one file per SHA-256
+        * @param port: Port to serve the store on (0 = any free port)
+        * @param verbose: Enable detailed logging
+        */
+        PeerCache(const string& store_dir, uint16_t port, bool verbose)
+            : store_dir(store_dir),
+            verbose(verbose),
+            server(port, [this](const HttpRequest& request) { return handle(request); })
+        {
+            error_code ec;
+            fs::create_directories(store_dir, ec);
+
+            char hostname[256] = "localhost";
+            #ifndef _WIN32
+            gethostname(hostname, sizeof(hostname) - 1);
+            #endif
+            advertise_host = hostname;
+        }
+
+        ~PeerCache()
+        {
+            stop();
+        }
+
+        // Adds a peer ("host:port") to try before the origin
+        void add_peer(const string& address)
+        {
+            static_peers.push_back(address);
+        }
+
+        // Shared directory where every serving peer registers itself
+        void set_discovery_dir(const string& dir)
+        {
+            discovery_dir = dir;
+        }
+
+        // Host name or address other peers use to reach this one (default: hostname)
+        void set_advertise_host(const string& host)
+        {
+            advertise_host = host;
+        }
+
+        // Starts serving the store and registers in the discovery directory
+        bool start()
+        {
+            if (!server.start())
+            {
+                log("Failed to listen for peers");
+                return false;
+            }
+            self_address = advertise_host + ":" + to_string(server.port());
+            log("Serving cached assets on " + self_address);
+
+            if (!discovery_dir.empty())
+            {
+                error_code ec;
+                fs::create_directories(discovery_dir, ec);
+                registration = (fs::path(discovery_dir) / (advertise_host + "_" + to_string(server.port()) + ".peer")).string();
+                ofstream(registration) << self_address << "\n";
+            }
+            return true;
+        }
+
+        // Stops serving and removes the registration
+        void stop()
+        {
+            server.stop();
+            if (!registration.empty())
+            {
+                error_code ec;
+                fs::remove(registration, ec);
+                registration.clear();
+            }
+        }
+
+        // Port the store is served on
+        uint16_t port() const
+        {
+            return server.port();
+        }
+
+        // Path of an asset in the store
+        string path_for(const string& sha256) const
+        {
+            return (fs::path(store_dir) / sha256).string();
+        }
+
+        bool has(const string& sha256) const
+        {
+            error_code ec;
+            return is_sha256(sha256) && fs::exists(path_for(sha256), ec);
+        }
+
+        /*
+        * Adds a verified file to the store so peers can fetch it
+        *
+        * The file is hashed again and rejected if it does not match sha256
+        */
+        bool publish(const string& file, const string& sha256)
+        {
+            if (!is_sha256(sha256) || sha256_file(file) != sha256)
+            {
+                log("Refusing to publish " + file + ": hash mismatch");
+                return false;
+            }
+            if (has(sha256))
+            {
+                return true;
+            }
+
+            // Stage next to the final name and rename so peers never see partial files
+            string target = path_for(sha256);
+            string staging = target + ".tmp" + to_string(reinterpret_cast<uintptr_t>(this));
+            error_code ec;
+            fs::create_hard_link(file, staging, ec);
+            if (ec)
+            {
+                ec.clear();
+                fs::copy_file(file, staging, fs::copy_options::overwrite_existing, ec);
+            }
+            if (!ec)
+            {
+                fs::rename(staging, target, ec);
+            }
+            if (ec)
+            {
+                fs::remove(staging, ec);
+                log("Failed to publish " + sha256 + " to the peer store");
+                return false;
+            }
+            log("Published " + sha256.substr(0, 12) + " to the peer store");
+            return true;
+        }
+
+        /*
+        * Fetches an asset from the local store or from a peer
+        *
+        * @param sha256: Expected SHA-256 of the asset
+        * @param destination: Where to write the asset
+        *
+        * Returns false if no peer had a copy matching the hash
+        */
+        bool fetch(const string& sha256, const string& destination)
+        {
+            if (!is_sha256(sha256))
+            {
+                return false;
+            }
+
+            error_code ec;
+            if (has(sha256))
+            {
+                fs::copy_file(path_for(sha256), destination, fs::copy_options::overwrite_existing, ec);
+                if (!ec && sha256_file(destination) == sha256)
+                {
+                    log("Using cached copy of " + sha256.substr(0, 12));
+                    return true;
+                }
+            }
+
+            vector<string> peers = discover();
+            for (const string& peer : peers)
+            {
+                string url = "http://" + peer + "/sha256/" + sha256;
+                if (!download(url, destination))
+                {
+                    continue;
+                }
+                if (sha256_file(destination) == sha256)
+                {
+                    log("Fetched " + sha256.substr(0, 12) + " from peer " + peer);
+                    publish(destination, sha256);
+                    return true;
+                }
+                log("Peer " + peer + " sent data with the wrong hash");
+            }
+
+            fs::remove(destination, ec);
+            return false;
+        }
+
+    private:
+        static constexpr long connect_timeout_ms = 1000;
+        static constexpr long stall_speed = 64 * 1024;
+        static constexpr long stall_seconds = 5;
+
+        string store_dir;
+        bool verbose;
+        HttpServer server;
+        vector<string> static_peers;
+        string discovery_dir;
+        string advertise_host;
+        string self_address;
+        string registration;
+
+        static bool is_sha256(const string& value)
+        {
+            return value.size() == 64 && value.find_first_not_of("0123456789abcdef") == string::npos;
+        }
+
+        // Static peers plus everything registered in the discovery directory, in random order
+        vector<string> discover()
+        {
+            vector<string> peers = static_peers;
+            if (!discovery_dir.empty())
+            {
+                error_code ec;
+                for (const auto& entry : fs::directory_iterator(discovery_dir, ec))
+                {
+                    if (entry.path().extension() != ".peer")
+                    {
+                        continue;
+                    }
+                    string address;
+                    ifstream(entry.path()) >> address;
+                    if (!address.empty())
+                    {
+                        peers.push_back(address);
+                    }
+                }
+            }
+
+            peers.erase(remove(peers.begin(), peers.end(), self_address), peers.end());
+            sort(peers.begin(), peers.end());
+            peers.erase(unique(peers.begin(), peers.end()), peers.end());
+
+            // Spread load across peers instead of everyone hitting the first one
+            random_device seed;
+            shuffle(peers.begin(), peers.end(), mt19937(seed()));
+            return peers;
+        }
+
+        bool download(const string& url, const string& destination)
+        {
+            #ifdef _WIN32
+            FILE* fp = nullptr;
+            if (fopen_s(&fp, destination.c_str(), "wb") != 0)
+            {
+                fp = nullptr;
+            }
+            #else
+            FILE* fp = fopen(destination.c_str(), "wb");
+            #endif
+            if (!fp)
+            {
+                return false;
+            }
+
+            CURL* curl = curl_easy_init();
+            if (!curl)
+            {
+                fclose(fp);
+                return false;
+            }
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+            curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connect_timeout_ms);
+            curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, stall_speed);
+            curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, stall_seconds);
+            curl_easy_setopt(curl, CURLOPT_USERAGENT, "AutoUpdater/1.0");
+            CURLcode res = curl_easy_perform(curl);
+            curl_easy_cleanup(curl);
+            fclose(fp);
+            return res == CURLE_OK;
+        }
+
+        HttpResponse handle(const HttpRequest& request)
+        {
+            const string prefix = "/sha256/";
+            if (request.method != "GET" && request.method != "HEAD")
+            {
+                return HttpResponse::text(405, "Method not allowed\n");
+            }
+            if (request.path.compare(0, prefix.size(), prefix) != 0)
+            {
+                return HttpResponse::text(404, "Not found\n");
+            }
+
+            string sha256 = request.path.substr(prefix.size());
+            if (!has(sha256))
+            {
+                return HttpResponse::text(404, "Not found\n");
+            }
+
+            HttpResponse response;
+            response.file_path = path_for(sha256);
+            return response;
+        }
+
+        void log(string log_string)
+        {
+            if (!verbose)
+            {
+                return;
+            }
+
+            auto now = chrono::system_clock::now();
+            auto now_time = chrono::system_clock::to_time_t(now);
+
+            tm local_time;
+            #ifdef _WIN32
+            localtime_s(&local_time, &now_time);
+            #else
+            localtime_r(&now_time, &local_time);
+            #endif
+
+            cout << "PeerCache at " << put_time(&local_time, "%H:%M:%S") << ": " << log_string << endl;
+        }
+};
@@ -0,0 +1,306 @@
+/*
+ * PluginHost - Shared-library plugins replaced inside a running host
+ *
+ * Features:
+ * - Each version is loaded with dlopen() from its own versioned file beside the original
+ * - The plugin's function table is published through an RcuCell, so callers switch atomically
+ * - A state-transfer hook moves state from the old version to the new one before the switch
+ * - The old library is closed only after its last snapshot is gone and a quiescent period passed
+ *
+ * The quiescent period covers code that outlives a snapshot: function
+ * pointers that were handed out, callbacks and threads the plugin started.
+ * After a reload the original path is replaced with the new build, so a
+ * restart loads the same version. Linux/macOS only (dlopen).
+ */
+
+#pragma once
+
+#include "Rcu.cpp"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Libraries no snapshot holds any more, closed once their quiescent period is over
+class PluginGraveyard
+{
+    public:
+        explicit PluginGraveyard(chrono::milliseconds quiescent_period)
+            : quiescent_period(quiescent_period)
+        {
+        }
+
+        /*
+        * @param handle: dlopen() handle to close
+        * @param file: Removed after closing, empty to keep the file
+        */
+        void bury(void* handle, const string& file)
+        {
+            lock_guard<mutex> guard(lock);
+            graves.push_back({ handle, file, chrono::steady_clock::now() + quiescent_period });
+        }
+
+        // Closes the libraries whose quiescent period is over. Returns the number still waiting
+        size_t close_expired()
+        {
+            vector<Grave> expired;
+            size_t waiting;
+            {
+                lock_guard<mutex> guard(lock);
+                auto now = chrono::steady_clock::now();
+                auto due = stable_partition(graves.begin(), graves.end(), [&](const Grave& grave) { return grave.due > now; });
+                expired.assign(due, graves.end());
+                graves.erase(due, graves.end());
+                waiting = graves.size();
+            }
+            #ifndef _WIN32
+            for (const Grave& grave : expired)
+            {
+                dlclose(grave.handle);
+                if (!grave.file.empty())
+                {
+                    unlink(grave.file.c_str());
+                }
+            }
+            #endif
+            return waiting;
+        }
+
+    private:
+        struct Grave
+        {
+            void* handle;
+            string file;
+            chrono::steady_clock::time_point due;
+        };
+
+        chrono::milliseconds quiescent_period;
+        mutex lock;
+        vector<Grave> graves;
+};
+
+// One loaded version of a plugin library
+class PluginVersion
+{
+    public:
+        /*
+        * Loads a library and looks up its function table
+        *
+        * @param path: Library to dlopen()
+        * @param version: Label of this version (digest or release tag)
+        * @param table_symbol: Exported symbol of the function table
+        * @param graveyard: Where the library goes when this version is released
+        * @param owns_file: Remove the file once the library is closed
+        * @param error: Set on failure
+        *
+        * Returns nullptr on failure
+        */
+        static unique_ptr<PluginVersion> load(const string& path, const string& version, const string& table_symbol,
+            shared_ptr<PluginGraveyard> graveyard, bool owns_file, string& error)
+        {
+            #ifdef _WIN32
+            (void)path;
+            (void)version;
+            (void)table_symbol;
+            (void)graveyard;
+            (void)owns_file;
+            error = "plugins are not supported on Windows";
+            return nullptr;
+            #else
+            void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+            if (!handle)
+            {
+                const char* reason = dlerror();
+                error = "cannot load " + path + ": " + (reason ? reason : "unknown error");
+                return nullptr;
+            }
+            void* table = dlsym(handle, table_symbol.c_str());
+            if (!table)
+            {
+                error = path + " does not export " + table_symbol;
+                dlclose(handle);
+                return nullptr;
+            }
+            unique_ptr<PluginVersion> loaded(new PluginVersion());
+            loaded->library = handle;
+            loaded->function_table = table;
+            loaded->library_path = path;
+            loaded->library_version = version;
+            loaded->graveyard = move(graveyard);
+            loaded->owns_file = owns_file;
+            return loaded;
+            #endif
+        }
+
+        ~PluginVersion()
+        {
+            if (library)
+            {
+                graveyard->bury(library, owns_file ? library_path : "");
+            }
+        }
+
+        PluginVersion(const PluginVersion&) = delete;
+        PluginVersion& operator=(const PluginVersion&) = delete;
+
+        // The exported function table, as the type the host and plugin agreed on
+        template <typename Table>
+        const Table* table() const
+        {
+            return static_cast<const Table*>(function_table);
+        }
+
+        // Any other exported symbol, nullptr if missing
+        void* symbol(const string& name) const
+        {
+            #ifdef _WIN32
+            (void)name;
+            return nullptr;
+            #else
+            return dlsym(library, name.c_str());
+            #endif
+        }
+
+        const string& path() const
+        {
+            return library_path;
+        }
+
+        const string& version() const
+        {
+            return library_version;
+        }
+
+    private:
+        PluginVersion() = default;
+
+        void* library = nullptr;
+        void* function_table = nullptr;
+        string library_path;
+        string library_version;
+        shared_ptr<PluginGraveyard> graveyard;
+        bool owns_file = false;
+};
+
+class PluginModule
+{
+    public:
+        using Snapshot = RcuCell<PluginVersion>::Snapshot;
+
+        /*
+        * Called with the running version (nullptr if none) and the loaded new one, before the switch
+        *
+        * Returns false to keep the running version
+        */
+        using StateTransfer = function<bool(const PluginVersion* old_version, const PluginVersion& new_version)>;
+
+        /*
+        * @param name: Release asset name
+        * @param path: Library path, loaded right away if it exists
+        * @param table_symbol: Exported symbol of the plugin's function table
+        * @param quiescent_period: How long a replaced library stays loaded after its last snapshot
+        */
+        PluginModule(const string& name, const string& path, const string& table_symbol, chrono::milliseconds quiescent_period)
+            : module_name(name),
+            module_path(path),
+            table_symbol(table_symbol),
+            graveyard(make_shared<PluginGraveyard>(quiescent_period))
+        {
+            error_code ec;
+            if (fs::exists(path, ec))
+            {
+                string error;
+                load_error = reload(path, "", error) ? "" : error;
+            }
+        }
+
+        const string& name() const
+        {
+            return module_name;
+        }
+
+        const string& path() const
+        {
+            return module_path;
+        }
+
+        // Why the library at path() could not be loaded at startup, empty if it was
+        const string& error() const
+        {
+            return load_error;
+        }
+
+        /*
+        * Current version, empty if none is loaded. Lock-free, for hot paths
+        *
+        * The library stays loaded while the snapshot lives, and for the quiescent period after
+        */
+        Snapshot snapshot() const
+        {
+            return versions.read();
+        }
+
+        void set_state_transfer(StateTransfer hook)
+        {
+            lock_guard<mutex> guard(reload_lock);
+            state_transfer = move(hook);
+        }
+
+        /*
+        * Loads a library file and switches to it
+        *
+        * @param file: Versioned library file, removed when this version is closed (unless it is path())
+        * @param version: Label of the new version
+        * @param error: Set on failure, the running version then stays
+        */
+        bool reload(const string& file, const string& version, string& error)
+        {
+            lock_guard<mutex> guard(reload_lock);
+            unique_ptr<PluginVersion> loaded = PluginVersion::load(file, version, table_symbol, graveyard, file != module_path, error);
+            if (!loaded)
+            {
+                return false;
+            }
+            {
+                Snapshot running = versions.read();
+                if (state_transfer && !state_transfer(running.get(), *loaded))
+                {
+                    error = "state transfer to " + file + " refused";
+                    return false;
+                }
+            }
+            versions.publish(move(loaded));
+            graveyard->close_expired();
+            return true;
+        }
+
+        // Closes replaced libraries whose quiescent period is over. Returns the number still loaded
+        size_t collect()
+        {
+            return graveyard->close_expired();
+        }
+
+    private:
+        string module_name;
+        string module_path;
+        string table_symbol;
+        string load_error;
+        shared_ptr<PluginGraveyard> graveyard;
+        mutex reload_lock;
+        StateTransfer state_transfer;
+        RcuCell<PluginVersion> versions;
+};
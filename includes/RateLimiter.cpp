@@ -0,0 +1,314 @@
+/*
+ * RateLimiter - GitHub API rate-limit accounting shared across processes
+ *
+ * Features:
+ * - Loads API tokens from environment variables or files
+ * - Parses X-RateLimit-* and Retry-After response headers
+ * - Shares one request budget between all updaters of the user on the host
+ * - Paces requests evenly until the rate-limit window resets
+ */
+
+#pragma once
+
+#include "StateFiles.cpp"
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Rate-limit information returned by the GitHub API
+struct RateLimitHeaders
+{
+    long long limit = -1;        // X-RateLimit-Limit
+    long long remaining = -1;    // X-RateLimit-Remaining
+    long long reset = -1;        // X-RateLimit-Reset (unix seconds)
+    long long retry_after = -1;  // Retry-After (seconds)
+
+    void clear()
+    {
+        *this = RateLimitHeaders();
+    }
+
+    // CURLOPT_HEADERFUNCTION callback, userdata must point to a RateLimitHeaders
+    static size_t header_callback(char* buffer, size_t size, size_t nitems, void* userdata)
+    {
+        RateLimitHeaders* headers = static_cast<RateLimitHeaders*>(userdata);
+        size_t total = size * nitems;
+        string line(buffer, total);
+
+        size_t colon = line.find(':');
+        if (colon == string::npos)
+        {
+            return total;
+        }
+
+        string name = line.substr(0, colon);
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        long long value = strtoll(line.c_str() + colon + 1, nullptr, 10);
+
+        if (name == "x-ratelimit-limit") headers->limit = value;
+        else if (name == "x-ratelimit-remaining") headers->remaining = value;
+        else if (name == "x-ratelimit-reset") headers->reset = value;
+        else if (name == "retry-after") headers->retry_after = value;
+
+        return total;
+    }
+};
+
+// Reads an API token from an environment variable. Returns empty string if unset
+inline string load_token_from_env(const string& variable)
+{
+    const char* value = getenv(variable.c_str());
+    return value ? string(value) : string();
+}
+
+// Reads an API token from the first line of a file. Returns empty string on failure
+inline string load_token_from_file(const string& path)
+{
+    ifstream file(path);
+    string token;
+    if (!file || !getline(file, token))
+    {
+        return "";
+    }
+
+    // Trim surrounding whitespace
+    const char* whitespace = " \t\r\n";
+    size_t start = token.find_first_not_of(whitespace);
+    if (start == string::npos)
+    {
+        return "";
+    }
+    size_t end = token.find_last_not_of(whitespace);
+    return token.substr(start, end - start + 1);
+}
+
+/*
+* Token bucket shared by every process on the host that uses the same token
+*
+* The bucket lives in a small file in the user's private state directory
+* and is updated under an exclusive flock, so all updaters of the user see
+* the same remaining budget. Requests are spread evenly over the time left until the reset
+* instead of being sent as soon as possible.
+*/
+class RateLimitBudget
+{
+    public:
+        /*
+        * @param token: API token used for requests (budgets are per token, empty = anonymous)
+        */
+        explicit RateLimitBudget(const string& token)
+        {
+            state_path = StateFiles::path("ratelimit_" + key_for(token));
+        }
+
+        /*
+        * Reserves the next request slot
+        *
+        * @param max_wait: Longest acceptable wait for a slot
+        * @param wait: Set to how long the caller has to wait before sending
+        *
+        * Returns false if no slot is available within max_wait (nothing is reserved)
+        */
+        bool acquire(chrono::milliseconds max_wait, chrono::milliseconds& wait)
+        {
+            bool allowed = false;
+            with_state([&](State& state)
+            {
+                long long now = now_ms();
+                long long slot = now;
+
+                if (state.blocked_until > now)
+                {
+                    slot = state.blocked_until;
+                }
+                else if (state.remaining >= 0 && state.reset * 1000 > now)
+                {
+                    if (state.remaining == 0)
+                    {
+                        slot = state.reset * 1000;
+                    }
+                    else
+                    {
+                        // Spread the remaining requests evenly until the reset
+                        long long interval = (state.reset * 1000 - now) / state.remaining;
+                        slot = max(now, state.next_slot);
+                        if (slot - now <= max_wait.count())
+                        {
+                            state.next_slot = slot + interval;
+                            state.remaining--;
+                        }
+                    }
+                }
+
+                wait = chrono::milliseconds(slot - now);
+                allowed = wait <= max_wait;
+            });
+            return allowed;
+        }
+
+        /*
+        * Records the rate-limit headers of a response
+        *
+        * @param http_code: HTTP status of the response
+        * @param headers: Parsed rate-limit headers
+        */
+        void record(long http_code, const RateLimitHeaders& headers)
+        {
+            with_state([&](State& state)
+            {
+                long long now = now_ms();
+
+                if (headers.remaining >= 0 && headers.reset > 0)
+                {
+                    // A new window starts with a fresh schedule
+                    if (headers.reset != state.reset)
+                    {
+                        state.next_slot = now;
+                    }
+                    state.remaining = headers.remaining;
+                    state.reset = headers.reset;
+                }
+
+                if (http_code == 403 || http_code == 429)
+                {
+                    if (headers.retry_after >= 0)
+                    {
+                        state.blocked_until = now + headers.retry_after * 1000;
+                    }
+                    else if (headers.remaining == 0 && headers.reset > 0)
+                    {
+                        state.blocked_until = headers.reset * 1000;
+                    }
+                    else if (http_code == 429 || headers.remaining >= 0)
+                    {
+                        // Secondary rate limit without a hint: back off for a minute
+                        state.blocked_until = now + 60 * 1000;
+                    }
+                }
+            });
+        }
+
+        // Remaining requests in the current window (-1 if unknown)
+        long long remaining()
+        {
+            long long value = -1;
+            with_state([&](State& state)
+            {
+                if (state.reset * 1000 > now_ms())
+                {
+                    value = state.remaining;
+                }
+            });
+            return value;
+        }
+
+    private:
+        struct State
+        {
+            uint32_t magic;
+            uint32_t version;
+            long long remaining;     // -1 when unknown
+            long long reset;         // unix seconds
+            long long next_slot;     // unix milliseconds
+            long long blocked_until; // unix milliseconds
+        };
+
+        static constexpr uint32_t state_magic = 0x4155524c; // "AURL"
+        static constexpr uint32_t state_version = 1;
+
+        string state_path;
+
+        static long long now_ms()
+        {
+            return chrono::duration_cast<chrono::milliseconds>(
+                chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        // Budgets are keyed by a hash of the token so the token never ends up in a file name
+        static string key_for(const string& token)
+        {
+            if (token.empty())
+            {
+                return "anonymous";
+            }
+
+            uint64_t hash = 1469598103934665603ULL; // FNV-1a
+            for (unsigned char c : token)
+            {
+                hash = (hash ^ c) * 1099511628211ULL;
+            }
+            char buffer[17];
+            snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(hash));
+            return buffer;
+        }
+
+        static void reset_state(State& state)
+        {
+            state.magic = state_magic;
+            state.version = state_version;
+            state.remaining = -1;
+            state.reset = 0;
+            state.next_slot = 0;
+            state.blocked_until = 0;
+        }
+
+        // Runs `fn` on the shared state while holding its lock
+        template <typename Fn>
+        void with_state(Fn fn)
+        {
+            #ifdef _WIN32
+            // No cross-process sharing on Windows, fall back to a per-process budget
+            static mutex process_lock;
+            static map<string, State> process_states;
+            lock_guard<mutex> guard(process_lock);
+            State& state = process_states[state_path];
+            if (state.magic != state_magic)
+            {
+                reset_state(state);
+            }
+            fn(state);
+            #else
+            int fd = StateFiles::open(state_path, O_RDWR | O_CREAT);
+            if (fd < 0)
+            {
+                State state;
+                reset_state(state);
+                fn(state);
+                return;
+            }
+
+            flock(fd, LOCK_EX);
+            State state;
+            if (pread(fd, &state, sizeof(state), 0) != sizeof(state) ||
+                state.magic != state_magic || state.version != state_version)
+            {
+                reset_state(state);
+            }
+            fn(state);
+            if (pwrite(fd, &state, sizeof(state), 0) != sizeof(state))
+            {
+                // Best effort: the budget is advisory
+            }
+            flock(fd, LOCK_UN);
+            close(fd);
+            #endif
+        }
+};
@@ -0,0 +1,305 @@
+/*
+ * Rcu - Lock-free publication of immutable versions to reader threads
+ *
+ * Features:
+ * - RcuCell<T> holds the current version of an object, replaced as a whole by publish()
+ * - Readers take a snapshot without locks and without a shared reference count
+ * - A replaced version is deleted once no snapshot holds it any more
+ *
+ * Readers announce the version they hold in a hazard slot, which writers
+ * scan before deleting a replaced version. Each thread keeps reusing its
+ * own cache-line sized slot, so concurrent readers do not share cache
+ * lines. A reader that lets go of a replaced version frees it if no one
+ * else holds it. Readers never wait for that: if another thread is
+ * freeing versions at the moment, it scans again on their behalf.
+ * Writers serialize on a mutex.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+
+using namespace std;
+
+template <typename T>
+class RcuCell
+{
+    private:
+        struct alignas(64) Slot
+        {
+            atomic<const T*> hazard{nullptr};
+            atomic<bool> used{false};
+            Slot* next = nullptr;
+        };
+
+    public:
+        // A version of the value, valid and unchanged for as long as the snapshot lives
+        class Snapshot
+        {
+            public:
+                Snapshot() = default;
+
+                Snapshot(Snapshot&& other) noexcept
+                    : cell(other.cell), slot(other.slot), value(other.value)
+                {
+                    other.cell = nullptr;
+                    other.slot = nullptr;
+                    other.value = nullptr;
+                }
+
+                Snapshot& operator=(Snapshot&& other) noexcept
+                {
+                    if (this != &other)
+                    {
+                        release();
+                        cell = other.cell;
+                        slot = other.slot;
+                        value = other.value;
+                        other.cell = nullptr;
+                        other.slot = nullptr;
+                        other.value = nullptr;
+                    }
+                    return *this;
+                }
+
+                Snapshot(const Snapshot&) = delete;
+                Snapshot& operator=(const Snapshot&) = delete;
+
+                ~Snapshot()
+                {
+                    release();
+                }
+
+                const T* get() const
+                {
+                    return value;
+                }
+
+                const T& operator*() const
+                {
+                    return *value;
+                }
+
+                const T* operator->() const
+                {
+                    return value;
+                }
+
+                explicit operator bool() const
+                {
+                    return value != nullptr;
+                }
+
+                // Lets go of the version early
+                void release()
+                {
+                    if (slot)
+                    {
+                        slot->hazard.store(nullptr, memory_order_seq_cst);
+                        slot->used.store(false, memory_order_release);
+                        // Only the holders of a replaced version look for something to free
+                        if (value != cell->current.load(memory_order_seq_cst))
+                        {
+                            cell->reclaim();
+                        }
+                    }
+                    cell = nullptr;
+                    slot = nullptr;
+                    value = nullptr;
+                }
+
+            private:
+                friend class RcuCell;
+
+                Snapshot(const RcuCell* cell, Slot* slot, const T* value)
+                    : cell(cell), slot(slot), value(value)
+                {
+                }
+
+                const RcuCell* cell = nullptr;
+                Slot* slot = nullptr;
+                const T* value = nullptr;
+        };
+
+        RcuCell() = default;
+
+        explicit RcuCell(unique_ptr<T> initial)
+            : current(initial.release())
+        {
+        }
+
+        // No snapshot may outlive the cell
+        ~RcuCell()
+        {
+            delete current.load();
+            for (T* old : retired)
+            {
+                delete old;
+            }
+            Slot* slot = slots.load();
+            while (slot)
+            {
+                Slot* next = slot->next;
+                delete slot;
+                slot = next;
+            }
+        }
+
+        RcuCell(const RcuCell&) = delete;
+        RcuCell& operator=(const RcuCell&) = delete;
+
+        // Current version, empty if nothing was published yet. Lock-free
+        Snapshot read() const
+        {
+            Slot* slot = claim_slot();
+            const T* value = current.load(memory_order_seq_cst);
+            bool replaced = false;
+            while (true)
+            {
+                // The version may be replaced and retired between the load and the announcement
+                slot->hazard.store(value, memory_order_seq_cst);
+                const T* again = current.load(memory_order_seq_cst);
+                if (again == value)
+                {
+                    break;
+                }
+                value = again;
+                replaced = true;
+            }
+            // A scan may have seen the stale announcement and kept the old version
+            if (replaced)
+            {
+                reclaim();
+            }
+            return Snapshot(this, slot, value);
+        }
+
+        // Makes value the current version. The previous one is deleted once no snapshot holds it
+        void publish(unique_ptr<T> value)
+        {
+            {
+                lock_guard<mutex> guard(writer);
+                T* old = current.exchange(value.release(), memory_order_seq_cst);
+                if (old)
+                {
+                    retired.push_back(old);
+                }
+                rescan.store(false, memory_order_seq_cst);
+                scan();
+            }
+            if (rescan.load(memory_order_seq_cst))
+            {
+                reclaim();
+            }
+        }
+
+        // Replaced versions still held by a snapshot
+        size_t retired_versions() const
+        {
+            return retired_count.load(memory_order_acquire);
+        }
+
+    private:
+        atomic<T*> current{nullptr};
+        mutable atomic<Slot*> slots{nullptr};
+        mutable mutex writer;
+        mutable vector<T*> retired;
+        mutable atomic<size_t> retired_count{0};
+        mutable atomic<bool> rescan{false};
+        const uint64_t id = next_id.fetch_add(1, memory_order_relaxed);
+
+        inline static atomic<uint64_t> next_id{1};
+
+        // Slot this thread used last, tagged with its cell so that no other cell takes it
+        struct SlotHint
+        {
+            uint64_t cell = 0;
+            Slot* slot = nullptr;
+        };
+
+        Slot* claim_slot() const
+        {
+            static thread_local SlotHint hint;
+            if (hint.cell == id && !hint.slot->used.load(memory_order_relaxed) &&
+                !hint.slot->used.exchange(true, memory_order_acquire))
+            {
+                return hint.slot;
+            }
+
+            Slot* slot = slots.load(memory_order_acquire);
+            for (; slot; slot = slot->next)
+            {
+                if (!slot->used.load(memory_order_relaxed) && !slot->used.exchange(true, memory_order_acquire))
+                {
+                    break;
+                }
+            }
+            if (!slot)
+            {
+                // All slots taken: more concurrent snapshots than ever before
+                slot = new Slot;
+                slot->used.store(true, memory_order_relaxed);
+                Slot* head = slots.load(memory_order_relaxed);
+                do
+                {
+                    slot->next = head;
+                } while (!slots.compare_exchange_weak(head, slot, memory_order_release, memory_order_relaxed));
+            }
+            hint = { id, slot };
+            return slot;
+        }
+
+        /*
+        * Frees what no snapshot holds, without waiting for the lock
+        *
+        * A thread that finds the lock taken leaves the rescan flag set, and the
+        * holder scans again after unlocking
+        */
+        void reclaim() const
+        {
+            rescan.store(true, memory_order_seq_cst);
+            while (rescan.load(memory_order_seq_cst))
+            {
+                unique_lock<mutex> guard(writer, try_to_lock);
+                if (!guard.owns_lock())
+                {
+                    return;
+                }
+                rescan.store(false, memory_order_seq_cst);
+                scan();
+            }
+        }
+
+        // Called with the writer lock held
+        void scan() const
+        {
+            if (retired.empty())
+            {
+                return;
+            }
+            vector<const T*> hazards;
+            for (Slot* slot = slots.load(memory_order_acquire); slot; slot = slot->next)
+            {
+                const T* held = slot->hazard.load(memory_order_seq_cst);
+                if (held)
+                {
+                    hazards.push_back(held);
+                }
+            }
+            sort(hazards.begin(), hazards.end());
+            auto still_held = [&](T* old) { return binary_search(hazards.begin(), hazards.end(), old); };
+            auto freed = stable_partition(retired.begin(), retired.end(), still_held);
+            for (auto it = freed; it != retired.end(); ++it)
+            {
+                delete *it;
+            }
+            retired.erase(freed, retired.end());
+            retired_count.store(retired.size(), memory_order_release);
+        }
+};
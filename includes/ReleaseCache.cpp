@@ -0,0 +1,646 @@
+/*
+ * ReleaseCache - Caching proxy for GitHub release metadata and assets
+ *
+ * Features:
+ * - Polls the latest release of each configured repository upstream
+ * - Uses conditional requests (ETag) and the shared rate-limit budget
+ * - Keeps assets in a content-addressed store (named by SHA-256)
+ * - The store must be private: owned by us and writable by no one else
+ * - Stored objects are hashed again before they are reused or served
+ * - Serves everything with the same URL shape as GitHub, so AutoUpdater
+ *   instances only need their API base pointed at the cache
+ */
+
+#pragma once
+
+#include "HttpServer.cpp"
+#include "RateLimiter.cpp"
+#include "Sha256.cpp"
+#include "StateFiles.cpp"
+#include "TlsSettings.cpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <condition_variable>
+#include <strings.h>
+#include <curl/curl.h>
+#include <json/json.h>
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+class ReleaseCache
+{
+    public:
+        /*
+        * @param store_dir: Directory for cached release JSON and assets, e.g. StateFiles::path("release_cache")
+        * @param port: Port to serve on
+        * @param public_url: Base URL clients use to reach the cache, e.g. "http://127.0.0.1:8080"
+        * @param verbose: Enable detailed logging
+        */
+        ReleaseCache(const string& store_dir, uint16_t port, const string& public_url, bool verbose)
+            : store_dir(store_dir),
+            public_url(public_url),
+            verbose(verbose),
+            listen_port(port),
+            rate_limit(make_unique<RateLimitBudget>(""))
+        {
+            error_code ec;
+            #ifdef _WIN32
+            fs::create_directories(fs::path(store_dir) / "objects", ec);
+            fs::create_directories(fs::path(store_dir) / "releases", ec);
+            #else
+            fs::create_directories(fs::path(store_dir).parent_path(), ec);
+            for (const fs::path& dir : { fs::path(store_dir), fs::path(store_dir) / "objects", fs::path(store_dir) / "releases" })
+            {
+                mkdir(dir.c_str(), 0700);
+            }
+            #endif
+        }
+
+        ~ReleaseCache()
+        {
+            stop();
+        }
+
+        // Adds a repository ("owner/name") to poll
+        void add_repository(const string& owner_and_name)
+        {
+            lock_guard<mutex> guard(lock);
+            repositories[owner_and_name] = Release();
+        }
+
+        // Upstream API base (default https://api.github.com)
+        void set_upstream(const string& api_base)
+        {
+            upstream = api_base;
+        }
+
+        // Address to listen on (default 127.0.0.1)
+        void set_bind_address(const string& address)
+        {
+            bind_address = address;
+        }
+
+        void set_auth_token(const string& token)
+        {
+            auth_token = token;
+            rate_limit = make_unique<RateLimitBudget>(token);
+        }
+
+        // Maximum API requests per second a single client may make (0 = unlimited)
+        void set_client_rate_limit(double requests_per_second)
+        {
+            client_rate = requests_per_second;
+        }
+
+        /*
+        * Whether the store and its subdirectories are ours alone
+        *
+        * Anyone else who can write to the store could plant release JSON or
+        * objects that are then served to every client
+        */
+        bool store_is_private() const
+        {
+            #ifdef _WIN32
+            return true;
+            #else
+            for (const fs::path& dir : { fs::path(store_dir), fs::path(store_dir) / "objects", fs::path(store_dir) / "releases" })
+            {
+                struct stat info;
+                if (lstat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) ||
+                    info.st_uid != geteuid() || (info.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+                {
+                    return false;
+                }
+            }
+            return true;
+            #endif
+        }
+
+        // Polls every `interval` in the background and starts serving. Fails if the store is not private
+        bool start(chrono::seconds interval)
+        {
+            if (!store_is_private())
+            {
+                log("Refusing store " + store_dir + ": not a directory of ours or writable by others");
+                return false;
+            }
+            load_cached();
+            server = make_unique<HttpServer>(listen_port, [this](const HttpRequest& request) { return handle(request); }, bind_address);
+            if (!server->start())
+            {
+                log("Failed to listen");
+                return false;
+            }
+            log("Serving releases on port " + to_string(server->port()));
+
+            running = true;
+            poll_thread = thread([this, interval]()
+            {
+                while (running)
+                {
+                    poll();
+                    unique_lock<mutex> wait_lock(wake_lock);
+                    wake.wait_for(wait_lock, interval, [this]() { return !running; });
+                }
+            });
+            return true;
+        }
+
+        void stop()
+        {
+            if (running)
+            {
+                {
+                    lock_guard<mutex> guard(wake_lock);
+                    running = false;
+                }
+                wake.notify_all();
+                if (poll_thread.joinable())
+                {
+                    poll_thread.join();
+                }
+            }
+            if (server)
+            {
+                server->stop();
+            }
+        }
+
+        uint16_t port() const
+        {
+            return server ? server->port() : listen_port;
+        }
+
+        // Fetches the latest release of every repository once
+        void poll()
+        {
+            vector<string> names;
+            {
+                lock_guard<mutex> guard(lock);
+                for (const auto& entry : repositories)
+                {
+                    names.push_back(entry.first);
+                }
+            }
+            for (const string& name : names)
+            {
+                poll_repository(name);
+            }
+        }
+
+    private:
+        struct Release
+        {
+            string etag;
+            shared_ptr<const string> json;        // Rewritten release JSON served to clients
+            map<string, string> assets;           // "tag/asset" -> sha256
+        };
+
+        struct ClientBucket
+        {
+            double tokens = 0;
+            chrono::time_point<chrono::steady_clock> updated;
+        };
+
+        string store_dir;
+        string public_url;
+        bool verbose;
+        uint16_t listen_port;
+        string bind_address = "127.0.0.1";
+        unique_ptr<HttpServer> server;
+        unique_ptr<RateLimitBudget> rate_limit;
+        string upstream = "https://api.github.com";
+        string auth_token;
+        double client_rate = 0;
+
+        mutex lock;
+        map<string, Release> repositories;
+        map<string, ClientBucket> clients;
+        set<string> verified_objects;             // Objects hashed by this process
+
+        atomic<bool> running{false};
+        thread poll_thread;
+        mutex wake_lock;
+        condition_variable wake;
+
+        string object_path(const string& sha256) const
+        {
+            return (fs::path(store_dir) / "objects" / sha256).string();
+        }
+
+        static bool is_sha256(const string& text)
+        {
+            return text.size() == 64 && text.find_first_not_of("0123456789abcdef") == string::npos;
+        }
+
+        /*
+        * Whether a stored object's contents still hash to its name
+        *
+        * Hashed once per run, then remembered. An object that does not match
+        * is removed so it is downloaded again
+        */
+        bool object_intact(const string& sha256)
+        {
+            {
+                lock_guard<mutex> guard(lock);
+                if (verified_objects.count(sha256))
+                {
+                    return true;
+                }
+            }
+            string path = object_path(sha256);
+            if (sha256_file(path) != sha256)
+            {
+                error_code ec;
+                fs::remove(path, ec);
+                return false;
+            }
+            lock_guard<mutex> guard(lock);
+            verified_objects.insert(sha256);
+            return true;
+        }
+
+        string release_path(const string& name) const
+        {
+            string file = name;
+            replace(file.begin(), file.end(), '/', '_');
+            return (fs::path(store_dir) / "releases" / (file + ".json")).string();
+        }
+
+        static size_t write_string(void* contents, size_t size, size_t nmemb, void* userp)
+        {
+            static_cast<string*>(userp)->append(static_cast<char*>(contents), size * nmemb);
+            return size * nmemb;
+        }
+
+        static size_t header_callback(char* buffer, size_t size, size_t nitems, void* userdata)
+        {
+            auto* state = static_cast<pair<RateLimitHeaders, string>*>(userdata);
+            RateLimitHeaders::header_callback(buffer, size, nitems, &state->first);
+            string line(buffer, size * nitems);
+            if (line.size() > 5 && strncasecmp(line.c_str(), "etag:", 5) == 0)
+            {
+                string value = line.substr(5);
+                value.erase(0, value.find_first_not_of(" \t"));
+                while (!value.empty() && (value.back() == '\r' || value.back() == '\n'))
+                {
+                    value.pop_back();
+                }
+                state->second = value;
+            }
+            return size * nitems;
+        }
+
+        // Restores releases cached by a previous run so clients are served right away
+        void load_cached()
+        {
+            lock_guard<mutex> guard(lock);
+            for (auto& [name, release] : repositories)
+            {
+                ifstream in(release_path(name));
+                Json::Value root;
+                Json::CharReaderBuilder builder;
+                string errors;
+                if (!in || !Json::parseFromStream(builder, in, &root, &errors))
+                {
+                    continue;
+                }
+                release.etag = root.get("etag", "").asString();
+                release.json = make_shared<const string>(root.get("json", "").asString());
+                for (const string& key : root["assets"].getMemberNames())
+                {
+                    string sha256 = root["assets"][key].asString();
+                    if (is_sha256(sha256))
+                    {
+                        release.assets[key] = sha256;
+                    }
+                }
+                log("Loaded cached release of " + name);
+            }
+        }
+
+        void save_cached(const string& name, const Release& release)
+        {
+            Json::Value root;
+            root["etag"] = release.etag;
+            root["json"] = *release.json;
+            for (const auto& [key, sha256] : release.assets)
+            {
+                root["assets"][key] = sha256;
+            }
+            string path = release_path(name);
+            ofstream(path + ".tmp") << Json::writeString(Json::StreamWriterBuilder(), root);
+            error_code ec;
+            fs::rename(path + ".tmp", path, ec);
+        }
+
+        void poll_repository(const string& name)
+        {
+            chrono::milliseconds wait;
+            if (!rate_limit->acquire(chrono::milliseconds(0), wait))
+            {
+                log("Skipping " + name + ", rate limited for " + to_string(wait.count() / 1000) + "s");
+                return;
+            }
+
+            string etag;
+            {
+                lock_guard<mutex> guard(lock);
+                etag = repositories[name].etag;
+            }
+
+            CURL* curl = curl_easy_init();
+            if (!curl)
+            {
+                return;
+            }
+
+            string url = upstream + "/repos/" + name + "/releases/latest";
+            string response;
+            pair<RateLimitHeaders, string> headers;
+            curl_slist* request_headers = curl_slist_append(nullptr, "Accept: application/vnd.github+json");
+            if (!auth_token.empty() && TlsSettings::may_authenticate(url))
+            {
+                request_headers = curl_slist_append(request_headers, ("Authorization: Bearer " + auth_token).c_str());
+            }
+            if (!etag.empty())
+            {
+                // 304 responses do not count against the rate limit
+                request_headers = curl_slist_append(request_headers, ("If-None-Match: " + etag).c_str());
+            }
+
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request_headers);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_string);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
+            TlsSettings::apply(curl);
+            curl_easy_setopt(curl, CURLOPT_USERAGENT, "AutoUpdater/1.0");
+
+            CURLcode res = curl_easy_perform(curl);
+            long http_code = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+            curl_easy_cleanup(curl);
+            curl_slist_free_all(request_headers);
+
+            if (res != CURLE_OK)
+            {
+                log(name + ": curl failed: " + curl_easy_strerror(res));
+                return;
+            }
+            rate_limit->record(http_code, headers.first);
+
+            if (http_code == 304)
+            {
+                log(name + ": not modified");
+                return;
+            }
+            if (http_code != 200)
+            {
+                log(name + ": upstream returned " + to_string(http_code));
+                return;
+            }
+
+            Json::Value root;
+            Json::CharReaderBuilder builder;
+            unique_ptr<Json::CharReader> reader(builder.newCharReader());
+            string errors;
+            if (!reader->parse(response.c_str(), response.c_str() + response.size(), &root, &errors))
+            {
+                log(name + ": failed to parse release JSON: " + errors);
+                return;
+            }
+
+            // Cache every asset and point its download URL at this cache
+            Release release;
+            release.etag = headers.second;
+            string tag = root.get("tag_name", "").asString();
+            for (Json::Value& asset : root["assets"])
+            {
+                string asset_name = asset.get("name", "").asString();
+                string sha256 = cache_asset(asset);
+                if (sha256.empty())
+                {
+                    log(name + ": failed to cache asset " + asset_name + ", will retry next poll");
+                    return;
+                }
+                release.assets[tag + "/" + asset_name] = sha256;
+                asset["browser_download_url"] = public_url + "/" + name + "/releases/download/" + tag + "/" + asset_name;
+            }
+            release.json = make_shared<const string>(Json::writeString(Json::StreamWriterBuilder(), root));
+
+            {
+                lock_guard<mutex> guard(lock);
+                repositories[name] = release;
+            }
+            save_cached(name, release);
+            log(name + ": cached release " + tag + " with " + to_string(release.assets.size()) + " assets");
+        }
+
+        // Downloads an asset into the store unless it is already there intact. Returns its SHA-256
+        string cache_asset(const Json::Value& asset)
+        {
+            string expected = parse_sha256_digest(asset.get("digest", "").asString());
+            error_code ec;
+            if (is_sha256(expected) && fs::exists(object_path(expected), ec) && object_intact(expected))
+            {
+                return expected;
+            }
+
+            string url = asset.get("browser_download_url", "").asString();
+            string temp = (fs::path(store_dir) / "objects" / ("download_" + to_string(reinterpret_cast<uintptr_t>(&asset)))).string();
+
+            #ifdef _WIN32
+            FILE* fp = nullptr;
+            if (fopen_s(&fp, temp.c_str(), "wb") != 0)
+            {
+                fp = nullptr;
+            }
+            #else
+            FILE* fp = fopen(temp.c_str(), "wb");
+            #endif
+            if (!fp)
+            {
+                return "";
+            }
+
+            CURL* curl = curl_easy_init();
+            CURLcode res = CURLE_FAILED_INIT;
+            if (curl)
+            {
+                curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+                curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+                curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+                curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+                TlsSettings::apply(curl);
+                curl_easy_setopt(curl, CURLOPT_USERAGENT, "AutoUpdater/1.0");
+                res = curl_easy_perform(curl);
+                curl_easy_cleanup(curl);
+            }
+            fclose(fp);
+
+            string sha256 = res == CURLE_OK ? sha256_file(temp) : "";
+            if (sha256.empty() || (!expected.empty() && sha256 != expected))
+            {
+                fs::remove(temp, ec);
+                return "";
+            }
+            fs::rename(temp, object_path(sha256), ec);
+            if (ec)
+            {
+                return "";
+            }
+            lock_guard<mutex> guard(lock);
+            verified_objects.insert(sha256);
+            return sha256;
+        }
+
+        // Token bucket per client address
+        bool allow_client(const string& address)
+        {
+            if (client_rate <= 0)
+            {
+                return true;
+            }
+            lock_guard<mutex> guard(lock);
+            auto now = chrono::steady_clock::now();
+            auto it = clients.find(address);
+            if (it == clients.end())
+            {
+                it = clients.emplace(address, ClientBucket{client_rate, now}).first;
+            }
+            ClientBucket& bucket = it->second;
+            double elapsed = chrono::duration<double>(now - bucket.updated).count();
+            bucket.tokens = min(client_rate, bucket.tokens + elapsed * client_rate);
+            bucket.updated = now;
+            if (bucket.tokens < 1)
+            {
+                return false;
+            }
+            bucket.tokens -= 1;
+            return true;
+        }
+
+        static HttpResponse not_found()
+        {
+            HttpResponse response;
+            response.status = 404;
+            response.content_type = "application/json";
+            response.body = "{\"message\":\"Not Found\"}";
+            return response;
+        }
+
+        HttpResponse handle(const HttpRequest& request)
+        {
+            if (request.method != "GET" && request.method != "HEAD")
+            {
+                return HttpResponse::text(405, "Method not allowed\n");
+            }
+
+            // /repos/{owner}/{repo}/releases/latest
+            const string api_prefix = "/repos/";
+            const string latest_suffix = "/releases/latest";
+            if (request.path.compare(0, api_prefix.size(), api_prefix) == 0 &&
+                request.path.size() > api_prefix.size() + latest_suffix.size() &&
+                request.path.compare(request.path.size() - latest_suffix.size(), latest_suffix.size(), latest_suffix) == 0)
+            {
+                if (!allow_client(request.remote_address))
+                {
+                    HttpResponse response = HttpResponse::text(429, "Too many requests\n");
+                    response.headers["Retry-After"] = "1";
+                    return response;
+                }
+
+                string name = request.path.substr(api_prefix.size(),
+                    request.path.size() - api_prefix.size() - latest_suffix.size());
+                shared_ptr<const string> json;
+                {
+                    lock_guard<mutex> guard(lock);
+                    auto it = repositories.find(name);
+                    if (it != repositories.end())
+                    {
+                        json = it->second.json;
+                    }
+                }
+                if (!json)
+                {
+                    return not_found();
+                }
+                HttpResponse response;
+                response.content_type = "application/json";
+                response.body = *json;
+                return response;
+            }
+
+            // /{owner}/{repo}/releases/download/{tag}/{asset}
+            const string download_marker = "/releases/download/";
+            size_t marker = request.path.find(download_marker);
+            if (marker != string::npos && marker > 1)
+            {
+                string name = request.path.substr(1, marker - 1);
+                string key = request.path.substr(marker + download_marker.size());
+                string sha256;
+                {
+                    lock_guard<mutex> guard(lock);
+                    auto it = repositories.find(name);
+                    if (it != repositories.end() && it->second.assets.count(key))
+                    {
+                        sha256 = it->second.assets[key];
+                    }
+                }
+                if (sha256.empty())
+                {
+                    return not_found();
+                }
+                if (!object_intact(sha256))
+                {
+                    // Fetch the whole release again on the next poll instead of a 304
+                    log(name + ": cached " + key + " is damaged, removed it");
+                    lock_guard<mutex> guard(lock);
+                    repositories[name].etag.clear();
+                    return not_found();
+                }
+                HttpResponse response;
+                response.file_path = object_path(sha256);
+                return response;
+            }
+
+            return not_found();
+        }
+
+        void log(string log_string)
+        {
+            if (!verbose)
+            {
+                return;
+            }
+
+            auto now = chrono::system_clock::now();
+            auto now_time = chrono::system_clock::to_time_t(now);
+
+            tm local_time;
+            #ifdef _WIN32
+            localtime_s(&local_time, &now_time);
+            #else
+            localtime_r(&now_time, &local_time);
+            #endif
+
+            cout << "ReleaseCache at " << put_time(&local_time, "%H:%M:%S") << ": " << log_string << endl;
+        }
+};
@@ -0,0 +1,395 @@
+/*
+ * RollingRestart - Restarts identical worker processes a few at a time
+ *
+ * Features:
+ * - Shared-memory roster of the workers in a group, guarded by a lock file
+ * - Roster and lock file are private to the user (mode 0600, checked owner)
+ * - At most k workers restarting (or starting up) at once
+ * - Waits for each new worker to report healthy before the next one goes
+ * - Never lets the number of healthy workers drop below a capacity floor
+ *
+ * Workers restart with execv(), which keeps their pid and therefore their
+ * roster slot. Workers restarted by a supervisor instead take a new slot,
+ * and slots of dead processes are reclaimed. Linux/macOS only.
+ */
+
+#pragma once
+
+#include "StateFiles.cpp"
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+enum class WorkerState : uint32_t
+{
+    Free = 0,
+    Starting,       // Running, not yet healthy
+    Healthy,        // Serving
+    Restarting      // Granted a restart slot, draining or exec'ing
+};
+
+class RestartCoordinator
+{
+    public:
+        /*
+        * @param group: Name shared by all workers of one service on the host
+        * @param max_parallel: How many workers may restart at the same time (k)
+        * @param capacity_floor: Healthy workers that must remain while one restarts
+        */
+        RestartCoordinator(const string& group, int max_parallel, int capacity_floor)
+            : max_parallel(max(1, max_parallel)),
+            capacity_floor(max(0, capacity_floor))
+        {
+            string key;
+            for (char c : group)
+            {
+                key += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+            }
+            #ifndef _WIN32
+            segment_name = "/autoupdater-roster-" + to_string(geteuid()) + "-" + key;
+            #endif
+            lock_path = StateFiles::path("roster_" + key + ".lock");
+        }
+
+        ~RestartCoordinator()
+        {
+            #ifndef _WIN32
+            if (roster)
+            {
+                munmap(roster, sizeof(Roster));
+            }
+            if (lock_fd >= 0)
+            {
+                close(lock_fd);
+            }
+            #endif
+        }
+
+        RestartCoordinator(const RestartCoordinator&) = delete;
+        RestartCoordinator& operator=(const RestartCoordinator&) = delete;
+
+        /*
+        * Registers this process in the roster as starting
+        *
+        * A worker that re-exec'd itself finds its old slot by pid
+        */
+        bool join()
+        {
+            #ifdef _WIN32
+            return false;
+            #else
+            if (!roster && !open_roster())
+            {
+                return false;
+            }
+
+            // The link reads "<path> (deleted)" once the file has been replaced
+            error_code ec;
+            executable = fs::read_symlink("/proc/self/exe", ec).string();
+            const string deleted = " (deleted)";
+            if (executable.size() > deleted.size() &&
+                executable.compare(executable.size() - deleted.size(), deleted.size(), deleted) == 0)
+            {
+                executable.resize(executable.size() - deleted.size());
+            }
+
+            bool joined = false;
+            with_roster([&]()
+            {
+                Slot* slot = find_slot(getpid());
+                if (!slot)
+                {
+                    slot = find_slot(0);
+                }
+                if (slot)
+                {
+                    set_state(*slot, WorkerState::Starting);
+                    slot->pid = getpid();
+                    joined = true;
+                }
+            });
+            return joined;
+            #endif
+        }
+
+        // Marks this worker as serving, which lets the next one restart
+        void report_healthy()
+        {
+            update_own_state(WorkerState::Healthy);
+        }
+
+        // Marks this worker as not serving (e.g. while shutting down)
+        void report_unhealthy()
+        {
+            update_own_state(WorkerState::Starting);
+        }
+
+        // Removes this worker from the roster
+        void leave()
+        {
+            #ifndef _WIN32
+            with_roster([&]()
+            {
+                if (Slot* slot = find_slot(getpid()))
+                {
+                    *slot = Slot();
+                }
+            });
+            #endif
+        }
+
+        /*
+        * Waits until this worker may restart without breaking the limits
+        *
+        * @param timeout: Longest wait, the rollout halts while a new worker never gets healthy
+        *
+        * On success the worker is marked as restarting. Returns false on timeout
+        */
+        bool acquire_restart_slot(chrono::milliseconds timeout = chrono::milliseconds::max())
+        {
+            #ifdef _WIN32
+            return false;
+            #else
+            auto deadline = timeout == chrono::milliseconds::max()
+                ? chrono::steady_clock::time_point::max()
+                : chrono::steady_clock::now() + timeout;
+
+            while (true)
+            {
+                bool granted = false;
+                with_roster([&]()
+                {
+                    int healthy = 0, in_flight = 0;
+                    for (const Slot& slot : roster->slots)
+                    {
+                        if (slot.pid == getpid() || slot.state == static_cast<uint32_t>(WorkerState::Free))
+                        {
+                            continue;
+                        }
+                        if (slot.state == static_cast<uint32_t>(WorkerState::Healthy)) healthy++;
+                        else in_flight++;
+                    }
+
+                    Slot* own = find_slot(getpid());
+                    if (own && in_flight < max_parallel && healthy >= capacity_floor)
+                    {
+                        set_state(*own, WorkerState::Restarting);
+                        granted = true;
+                    }
+                });
+
+                if (granted)
+                {
+                    return true;
+                }
+                if (chrono::steady_clock::now() >= deadline)
+                {
+                    return false;
+                }
+                this_thread::sleep_for(poll_interval);
+            }
+            #endif
+        }
+
+        /*
+        * Waits for a restart slot, drains, and replaces this process with the installed executable
+        *
+        * @param argv: Arguments to restart with (usually main's argv)
+        * @param drain: Called after the slot is granted, to stop accepting work and finish in-flight requests
+        *
+        * Only returns on failure
+        */
+        bool restart(char** argv, function<void()> drain = nullptr)
+        {
+            #ifdef _WIN32
+            return false;
+            #else
+            if (executable.empty() || !acquire_restart_slot())
+            {
+                return false;
+            }
+            if (drain)
+            {
+                drain();
+            }
+            execv(executable.c_str(), argv);
+
+            // Still the old process: give the slot back so the rollout can continue
+            update_own_state(WorkerState::Healthy);
+            return false;
+            #endif
+        }
+
+        struct Worker
+        {
+            int64_t pid;
+            WorkerState state;
+            int64_t state_since_ms;
+        };
+
+        // Live workers of the group, also works without joining
+        vector<Worker> workers()
+        {
+            vector<Worker> result;
+            #ifndef _WIN32
+            with_roster([&]()
+            {
+                for (const Slot& slot : roster->slots)
+                {
+                    if (slot.state != static_cast<uint32_t>(WorkerState::Free))
+                    {
+                        result.push_back({ slot.pid, static_cast<WorkerState>(slot.state), slot.state_since_ms });
+                    }
+                }
+            });
+            #endif
+            return result;
+        }
+
+    private:
+        static constexpr uint32_t roster_magic = 0x41555252;  // "AURR"
+        static constexpr uint32_t roster_version = 1;
+        static constexpr size_t max_workers = 256;
+        static constexpr chrono::milliseconds poll_interval{200};
+
+        struct Slot
+        {
+            int64_t pid = 0;
+            uint32_t state = 0;
+            uint32_t reserved = 0;
+            int64_t state_since_ms = 0;
+        };
+
+        struct Roster
+        {
+            uint32_t magic;
+            uint32_t version;
+            Slot slots[max_workers];
+        };
+
+        int max_parallel;
+        int capacity_floor;
+        string segment_name;
+        string lock_path;
+        string executable;
+        int lock_fd = -1;
+        Roster* roster = nullptr;
+
+        static int64_t now_ms()
+        {
+            return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        static void set_state(Slot& slot, WorkerState state)
+        {
+            slot.state = static_cast<uint32_t>(state);
+            slot.state_since_ms = now_ms();
+        }
+
+        void update_own_state(WorkerState state)
+        {
+            #ifndef _WIN32
+            with_roster([&]()
+            {
+                if (Slot* slot = find_slot(getpid()))
+                {
+                    set_state(*slot, state);
+                }
+            });
+            #else
+            (void)state;
+            #endif
+        }
+
+        #ifndef _WIN32
+        bool open_roster()
+        {
+            lock_fd = StateFiles::open(lock_path, O_RDWR | O_CREAT);
+            if (lock_fd < 0)
+            {
+                return false;
+            }
+
+            // Create and size the segment under the lock so no one maps a short file
+            flock(lock_fd, LOCK_EX);
+            int fd = shm_open(segment_name.c_str(), O_RDWR | O_CREAT, 0600);
+            if (fd >= 0)
+            {
+                // A segment someone else created first is not ours to trust
+                struct stat info;
+                if (fstat(fd, &info) == 0 && info.st_uid == geteuid() &&
+                    (info.st_size >= static_cast<off_t>(sizeof(Roster)) || ftruncate(fd, sizeof(Roster)) == 0))
+                {
+                    void* mapping = mmap(nullptr, sizeof(Roster), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                    if (mapping != MAP_FAILED)
+                    {
+                        roster = static_cast<Roster*>(mapping);
+                    }
+                }
+                close(fd);
+            }
+            if (roster && (roster->magic != roster_magic || roster->version != roster_version))
+            {
+                memset(static_cast<void*>(roster), 0, sizeof(Roster));
+                roster->magic = roster_magic;
+                roster->version = roster_version;
+            }
+            flock(lock_fd, LOCK_UN);
+            return roster != nullptr;
+        }
+
+        // Runs `fn` with the roster locked, after dropping workers that no longer exist
+        template <typename Fn>
+        void with_roster(Fn fn)
+        {
+            if (!roster && !open_roster())
+            {
+                return;
+            }
+            flock(lock_fd, LOCK_EX);
+            for (Slot& slot : roster->slots)
+            {
+                if (slot.pid != 0 && kill(static_cast<pid_t>(slot.pid), 0) != 0 && errno == ESRCH)
+                {
+                    slot = Slot();
+                }
+            }
+            fn();
+            flock(lock_fd, LOCK_UN);
+        }
+
+        Slot* find_slot(int64_t pid)
+        {
+            for (Slot& slot : roster->slots)
+            {
+                if (slot.pid == pid)
+                {
+                    return &slot;
+                }
+            }
+            return nullptr;
+        }
+        #endif
+};
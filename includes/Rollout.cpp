@@ -0,0 +1,139 @@
+/*
+ * Rollout - Deterministic staged rollout of releases across a fleet
+ *
+ * Features:
+ * - Hashes a stable host id with the release tag into a bucket in [0, 100)
+ * - A host takes a release once the rollout percentage covers its bucket
+ * - Coverage can ramp linearly or in waves from the release's publish time
+ * - Deterministic per-host jitter spreads each wave over a time window
+ *
+ * Every host computes its own decision, no coordination service is needed.
+ * A new tag reshuffles the buckets, so the same hosts are not always first.
+ */
+
+#pragma once
+
+#include "Sha256.cpp"
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+struct RolloutPolicy
+{
+    // Share of the fleet that takes the release at most, in percent
+    double percentage = 100;
+
+    // Linear ramp from 0% at publish time to percentage after ramp_duration (0 = no ramp)
+    chrono::seconds ramp_duration{0};
+
+    // Alternatively, coverage steps: waves[i] percent from i * wave_interval after publishing
+    vector<double> waves;
+    chrono::seconds wave_interval{3600};
+
+    // Each host waits an extra, stable share of this before applying the coverage
+    chrono::seconds jitter{0};
+};
+
+class Rollout
+{
+    public:
+        explicit Rollout(const RolloutPolicy& policy)
+            : policy(policy),
+            host_id(default_host_id())
+        {
+        }
+
+        // Overrides the host id (default: /etc/machine-id, or the hostname)
+        void set_host_id(const string& id)
+        {
+            host_id = id;
+        }
+
+        const string& id() const
+        {
+            return host_id;
+        }
+
+        // Position of this host in the rollout of a release, in [0, 100)
+        double bucket(const string& tag) const
+        {
+            return unit_hash("bucket\n" + host_id + "\n" + tag) * 100;
+        }
+
+        // Percentage of the fleet covered at `now` for a release published at `published`
+        double coverage(const string& tag,
+                        chrono::system_clock::time_point published,
+                        chrono::system_clock::time_point now) const
+        {
+            // This host sees the rollout clock run a little behind
+            auto jitter = chrono::duration_cast<chrono::seconds>(policy.jitter * unit_hash("jitter\n" + host_id + "\n" + tag));
+            double elapsed = chrono::duration<double>(now - published - jitter).count();
+
+            double covered = policy.percentage;
+            if (!policy.waves.empty())
+            {
+                if (elapsed < 0)
+                {
+                    return 0;
+                }
+                size_t wave = static_cast<size_t>(elapsed / max<double>(1, static_cast<double>(policy.wave_interval.count())));
+                covered = min(covered, policy.waves[min(wave, policy.waves.size() - 1)]);
+            }
+            else if (policy.ramp_duration.count() > 0)
+            {
+                double progress = clamp(elapsed / static_cast<double>(policy.ramp_duration.count()), 0.0, 1.0);
+                covered *= progress;
+            }
+            return clamp(covered, 0.0, 100.0);
+        }
+
+        // True if this host should take the release now
+        bool covers(const string& tag, chrono::system_clock::time_point published) const
+        {
+            return bucket(tag) < coverage(tag, published, chrono::system_clock::now());
+        }
+
+    private:
+        RolloutPolicy policy;
+        string host_id;
+
+        // Maps a string to [0, 1) using the first 8 bytes of its SHA-256
+        static double unit_hash(const string& value)
+        {
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int length = 0;
+            EVP_Digest(value.data(), value.size(), digest, &length, EVP_sha256(), nullptr);
+            uint64_t number = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                number = (number << 8) | digest[i];
+            }
+            return static_cast<double>(number >> 11) / static_cast<double>(1ULL << 53);
+        }
+
+        static string default_host_id()
+        {
+            string id;
+            ifstream("/etc/machine-id") >> id;
+            if (!id.empty())
+            {
+                return id;
+            }
+
+            char hostname[256] = "localhost";
+            #ifndef _WIN32
+            gethostname(hostname, sizeof(hostname) - 1);
+            #endif
+            return hostname;
+        }
+};
@@ -0,0 +1,432 @@
+/*
+ * SegmentedDownload - Downloads one file from several sources at once
+ *
+ * Features:
+ * - Splits a file into byte ranges fetched concurrently from all sources
+ * - Sizes each range by the measured throughput of its source
+ * - Faster sources steal the remaining work of slower ones
+ * - Failed ranges are retried on the remaining healthy sources
+ */
+
+#pragma once
+
+#include "TlsSettings.cpp"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <curl/curl.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+// One source of a segmented download
+struct SegmentSource
+{
+    string url;
+    double throughput = 0;       // Measured throughput in bytes/s (seeded from history)
+    curl_off_t downloaded = 0;   // Bytes fetched from this source
+    double busy_seconds = 0;     // Time spent transferring from this source
+    int failures = 0;
+    bool active = false;         // Currently fetching a range
+    bool dead = false;           // Gave up on this source
+};
+
+class SegmentedDownloader
+{
+    public:
+        /*
+        * @param sources: Sources serving identical content, with historical throughput if known
+        * @param total_size: Size of the file in bytes
+        */
+        SegmentedDownloader(const vector<SegmentSource>& sources, curl_off_t total_size)
+            : source_list(sources),
+            total_size(total_size)
+        {
+        }
+
+        // Called with (bytes done, total bytes) while downloading
+        void set_progress_callback(function<void(curl_off_t, curl_off_t)> callback)
+        {
+            progress = callback;
+        }
+
+        /*
+        * Downloads the file into file_path
+        *
+        * Returns false and sets error if some range could not be fetched from any source
+        */
+        bool download(const string& file_path, string& error)
+        {
+            #ifdef _WIN32
+            error = "Segmented downloads are not supported on Windows";
+            return false;
+            #else
+            fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                error = "Failed to open file for writing: " + file_path;
+                return false;
+            }
+            if (ftruncate(fd, total_size) != 0)
+            {
+                error = "Failed to allocate " + to_string(total_size) + " bytes";
+                close(fd);
+                return false;
+            }
+
+            CURLM* multi = curl_multi_init();
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+            next_offset = 0;
+            done_bytes = 0;
+            retry.clear();
+            bool ok = true;
+
+            assign_work(multi);
+            while (done_bytes < total_size)
+            {
+                if (active_count() == 0)
+                {
+                    error = "No healthy source left";
+                    ok = false;
+                    break;
+                }
+
+                int still_running = 0;
+                if (curl_multi_perform(multi, &still_running) != CURLM_OK)
+                {
+                    error = "curl_multi_perform failed";
+                    ok = false;
+                    break;
+                }
+
+                CURLMsg* msg;
+                int queued;
+                while ((msg = curl_multi_info_read(multi, &queued)))
+                {
+                    if (msg->msg == CURLMSG_DONE)
+                    {
+                        Segment* segment = nullptr;
+                        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char**>(&segment));
+                        finish_segment(multi, *segment, msg->data.result);
+                    }
+                }
+
+                assign_work(multi);
+                if (progress)
+                {
+                    progress(done_bytes + in_flight_bytes(), total_size);
+                }
+                curl_multi_poll(multi, nullptr, 0, 100, nullptr);
+            }
+
+            for (Segment& segment : segments)
+            {
+                if (segment.easy)
+                {
+                    curl_multi_remove_handle(multi, segment.easy);
+                    curl_easy_cleanup(segment.easy);
+                    segment.easy = nullptr;
+                }
+            }
+            segments.clear();
+            curl_multi_cleanup(multi);
+
+            if (fsync(fd) != 0 && ok)
+            {
+                error = "Failed to flush downloaded file";
+                ok = false;
+            }
+            close(fd);
+            fd = -1;
+            return ok;
+            #endif
+        }
+
+        // Per-source statistics of the last download
+        const vector<SegmentSource>& sources() const
+        {
+            return source_list;
+        }
+
+    private:
+        // A byte range [start, end) being fetched from one source
+        struct Segment
+        {
+            SegmentedDownloader* owner = nullptr;
+            size_t source = 0;
+            curl_off_t start = 0;
+            curl_off_t pos = 0;
+            curl_off_t end = 0;            // May shrink while in flight when work is stolen
+            bool reached_end = false;
+            bool bad_response = false;
+            CURL* easy = nullptr;
+            chrono::time_point<chrono::steady_clock> started;
+            char range[64];
+        };
+
+        static constexpr curl_off_t min_segment = 256 * 1024;
+        static constexpr curl_off_t max_segment = 16 * 1024 * 1024;
+        static constexpr double segment_seconds = 2.0;         // Target duration of one range
+        static constexpr double default_throughput = 1024 * 1024;
+        static constexpr int max_failures = 2;
+        static constexpr long stall_speed = 1024;              // Bytes/s considered stalled
+        static constexpr long stall_seconds = 10;
+
+        vector<SegmentSource> source_list;
+        curl_off_t total_size;
+        function<void(curl_off_t, curl_off_t)> progress;
+
+        int fd = -1;
+        curl_off_t next_offset = 0;
+        curl_off_t done_bytes = 0;
+        vector<pair<curl_off_t, curl_off_t>> retry;  // Ranges returned by failed segments
+        deque<Segment> segments;
+
+        size_t active_count() const
+        {
+            size_t count = 0;
+            for (const Segment& segment : segments)
+            {
+                if (segment.easy)
+                {
+                    count++;
+                }
+            }
+            return count;
+        }
+
+        curl_off_t in_flight_bytes() const
+        {
+            curl_off_t bytes = 0;
+            for (const Segment& segment : segments)
+            {
+                if (segment.easy)
+                {
+                    bytes += segment.pos - segment.start;
+                }
+            }
+            return bytes;
+        }
+
+        double throughput_of(size_t source) const
+        {
+            double throughput = source_list[source].throughput;
+            return throughput > 0 ? throughput : default_throughput;
+        }
+
+        // Throughput of an in-flight segment, falling back to its source's history early on
+        double live_throughput(const Segment& segment) const
+        {
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - segment.started).count();
+            if (elapsed < 0.5 || segment.pos == segment.start)
+            {
+                return throughput_of(segment.source);
+            }
+            return (segment.pos - segment.start) / elapsed;
+        }
+
+        // Writes received data at the segment's offset, stopping at its (possibly shrunk) end
+        static size_t write_callback(void* contents, size_t size, size_t nmemb, void* userp)
+        {
+            Segment* segment = static_cast<Segment*>(userp);
+            size_t total = size * nmemb;
+
+            // A 200 instead of 206 means the source ignored the range
+            if (segment->pos == segment->start)
+            {
+                long http_code = 0;
+                curl_easy_getinfo(segment->easy, CURLINFO_RESPONSE_CODE, &http_code);
+                if (http_code != 206 && !(http_code == 200 && segment->start == 0 && segment->end == segment->owner->total_size))
+                {
+                    segment->bad_response = true;
+                    return 0;
+                }
+            }
+
+            curl_off_t room = segment->end - segment->pos;
+            size_t length = static_cast<size_t>(min(static_cast<curl_off_t>(total), max(room, static_cast<curl_off_t>(0))));
+            const char* data = static_cast<const char*>(contents);
+            size_t written = 0;
+            while (written < length)
+            {
+                ssize_t n = pwrite(segment->owner->fd, data + written, length - written, segment->pos + written);
+                if (n <= 0)
+                {
+                    return 0;
+                }
+                written += static_cast<size_t>(n);
+            }
+            segment->pos += static_cast<curl_off_t>(length);
+
+            if (segment->pos >= segment->end)
+            {
+                segment->reached_end = true;
+                // Stop the transfer if the rest of its range was stolen
+                if (length < total)
+                {
+                    return 0;
+                }
+            }
+            return total;
+        }
+
+        // Picks the next range for an idle source: fresh work, retried work, or stolen work
+        bool next_range(size_t source, curl_off_t& start, curl_off_t& end)
+        {
+            if (!retry.empty())
+            {
+                start = retry.back().first;
+                end = retry.back().second;
+                retry.pop_back();
+                return true;
+            }
+
+            if (next_offset < total_size)
+            {
+                curl_off_t size = static_cast<curl_off_t>(throughput_of(source) * segment_seconds);
+                size = max(min_segment, min(max_segment, size));
+                start = next_offset;
+                end = min(total_size, next_offset + size);
+                next_offset = end;
+                return true;
+            }
+
+            // Steal from the segment that would finish last
+            Segment* victim = nullptr;
+            double victim_eta = 0;
+            for (Segment& segment : segments)
+            {
+                if (!segment.easy || segment.end - segment.pos < 2 * min_segment)
+                {
+                    continue;
+                }
+                double eta = (segment.end - segment.pos) / live_throughput(segment);
+                if (eta > victim_eta)
+                {
+                    victim = &segment;
+                    victim_eta = eta;
+                }
+            }
+            if (!victim)
+            {
+                return false;
+            }
+
+            // Split the remainder in proportion to both sources' throughput
+            double mine = throughput_of(source);
+            double theirs = live_throughput(*victim);
+            if (victim_eta <= min_segment / mine)
+            {
+                return false;
+            }
+            curl_off_t remaining = victim->end - victim->pos;
+            curl_off_t keep = static_cast<curl_off_t>(remaining * theirs / (mine + theirs));
+            keep = max(keep, min_segment);
+            start = victim->pos + keep;
+            end = victim->end;
+            victim->end = start;
+            return true;
+        }
+
+        void assign_work(CURLM* multi)
+        {
+            for (size_t i = 0; i < source_list.size(); i++)
+            {
+                SegmentSource& source = source_list[i];
+                if (source.active || source.dead)
+                {
+                    continue;
+                }
+
+                curl_off_t start, end;
+                if (!next_range(i, start, end))
+                {
+                    return;
+                }
+
+                segments.emplace_back();
+                Segment& segment = segments.back();
+                segment.owner = this;
+                segment.source = i;
+                segment.start = start;
+                segment.pos = start;
+                segment.end = end;
+                segment.started = chrono::steady_clock::now();
+                snprintf(segment.range, sizeof(segment.range), "%lld-%lld",
+                    static_cast<long long>(start), static_cast<long long>(end - 1));
+
+                CURL* easy = curl_easy_init();
+                if (!easy)
+                {
+                    retry.push_back({start, end});
+                    segments.pop_back();
+                    return;
+                }
+                curl_easy_setopt(easy, CURLOPT_URL, source.url.c_str());
+                curl_easy_setopt(easy, CURLOPT_RANGE, segment.range);
+                curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_callback);
+                curl_easy_setopt(easy, CURLOPT_WRITEDATA, &segment);
+                curl_easy_setopt(easy, CURLOPT_PRIVATE, &segment);
+                curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+                curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
+                curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, stall_speed);
+                curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, stall_seconds);
+                TlsSettings::apply(easy);
+                curl_easy_setopt(easy, CURLOPT_USERAGENT, "AutoUpdater/1.0");
+                segment.easy = easy;
+                source.active = true;
+                curl_multi_add_handle(multi, easy);
+            }
+        }
+
+        void finish_segment(CURLM* multi, Segment& segment, CURLcode result)
+        {
+            SegmentSource& source = source_list[segment.source];
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - segment.started).count();
+            curl_off_t fetched = segment.pos - segment.start;
+
+            source.active = false;
+            source.downloaded += fetched;
+            source.busy_seconds += elapsed;
+            if (source.busy_seconds > 0 && source.downloaded > 0)
+            {
+                source.throughput = source.downloaded / source.busy_seconds;
+            }
+            done_bytes += fetched;
+
+            bool complete = segment.reached_end || (result == CURLE_OK && segment.pos >= segment.end);
+            if (!complete)
+            {
+                // Hand the rest of the range to another source
+                if (segment.pos < segment.end)
+                {
+                    retry.push_back({segment.pos, segment.end});
+                }
+                source.failures++;
+                if (segment.bad_response || source.failures >= max_failures)
+                {
+                    source.dead = true;
+                }
+            }
+
+            curl_multi_remove_handle(multi, segment.easy);
+            curl_easy_cleanup(segment.easy);
+            segment.easy = nullptr;
+
+            // Finished segments at the front can be dropped
+            while (!segments.empty() && !segments.front().easy)
+            {
+                segments.pop_front();
+            }
+        }
+};
@@ -0,0 +1,106 @@
+/*
+ * Sha256 - SHA-256 helpers for verifying release assets
+ *
+ * GitHub publishes a "digest" of the form "sha256:<hex>" for every release
+ * asset. These helpers compute the same value for local files, and the
+ * HMAC-SHA256 used to sign webhook payloads.
+ */
+
+#pragma once
+
+#include <string>
+#include <cstdio>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+
+using namespace std;
+
+// Lowercase hex encoding of a binary buffer
+inline string to_hex(const unsigned char* data, size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    hex.reserve(length * 2);
+    for (size_t i = 0; i < length; i++)
+    {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 0x0f];
+    }
+    return hex;
+}
+
+// SHA-256 of a file as lowercase hex. Returns empty string on failure
+inline string sha256_file(const string& path)
+{
+    #ifdef _WIN32
+    FILE* fp = nullptr;
+    if (fopen_s(&fp, path.c_str(), "rb") != 0)
+    {
+        fp = nullptr;
+    }
+    #else
+    FILE* fp = fopen(path.c_str(), "rb");
+    #endif
+    if (!fp)
+    {
+        return "";
+    }
+
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+
+    static const size_t buffer_size = 1 << 20;
+    string buffer(buffer_size, '\0');
+    size_t n;
+    while ((n = fread(&buffer[0], 1, buffer_size, fp)) > 0)
+    {
+        EVP_DigestUpdate(ctx, buffer.data(), n);
+    }
+    bool failed = ferror(fp) != 0;
+    fclose(fp);
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    EVP_DigestFinal_ex(ctx, digest, &digest_length);
+    EVP_MD_CTX_free(ctx);
+
+    return failed ? "" : to_hex(digest, digest_length);
+}
+
+// Extracts the hex part of a GitHub asset digest ("sha256:<hex>"). Returns empty string for other algorithms
+inline string parse_sha256_digest(const string& digest)
+{
+    const string prefix = "sha256:";
+    if (digest.compare(0, prefix.size(), prefix) != 0 || digest.size() != prefix.size() + 64)
+    {
+        return "";
+    }
+    return digest.substr(prefix.size());
+}
+
+// HMAC-SHA256 of a message as lowercase hex
+inline string hmac_sha256_hex(const string& key, const string& message)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+        reinterpret_cast<const unsigned char*>(message.data()), message.size(),
+        digest, &digest_length);
+    return to_hex(digest, digest_length);
+}
+
+// Compares two strings in time independent of where they differ
+inline bool constant_time_equals(const string& a, const string& b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    unsigned char difference = 0;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        difference |= static_cast<unsigned char>(a[i] ^ b[i]);
+    }
+    return difference == 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * StartupApply - Installs a prepared update before the application starts
+ *
+ * Features:
+ * - Call first thing in main(): without a pending update it costs one stat() and one lstat()
+ * - Installs an update that was prepared and verified in an earlier run, then re-executes
+ * - No curl, JSON or iostream: this header only depends on POSIX and zlib
+ *
+ * The marker is the apply journal that ApplyJournal::prepare() leaves beside
+ * the executable. Only a journal whose "prepared" record is intact is
+ * completed here; anything else is left to the AutoUpdater constructor's
+ * recovery. Linux/macOS only, elsewhere a no-op.
+ */
+
+#pragma once
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/auxv.h>
+#elif defined(__APPLE__)
+#include <mach-o/dyld.h>
+#endif
+
+
+using namespace std;
+
+class StartupApply
+{
+    public:
+        /*
+        * Installs a prepared update and re-executes the new executable with the same arguments
+        *
+        * @param argv: main()'s argv
+        *
+        * Returns only if there was nothing to install (or it could not be), after
+        * which the application starts as usual
+        */
+        static bool run(char* argv[])
+        {
+            #ifdef _WIN32
+            (void)argv;
+            return false;
+            #else
+            char executable[PATH_MAX];
+            char journal[PATH_MAX + 64];
+            if (!executable_path(executable) ||
+                !sibling(executable, ".autoupdater-journal", journal, sizeof(journal)))
+            {
+                return false;
+            }
+
+            struct stat info;
+            if (stat(journal, &info) != 0)
+            {
+                // Started through a symlink: the journal is beside the file it points to
+                if (!resolve_symlink(executable) ||
+                    !sibling(executable, ".autoupdater-journal", journal, sizeof(journal)) ||
+                    stat(journal, &info) != 0)
+                {
+                    return false;
+                }
+            }
+            if (!install(executable, journal))
+            {
+                return false;
+            }
+            execv(executable, argv);
+            return false;
+            #endif
+        }
+
+    private:
+        #ifndef _WIN32
+        /*
+        * Path the executable was started by
+        *
+        * On Linux this is the exec path from the auxiliary vector, which costs no
+        * system call; the first readlink() of /proc/self/exe in a process costs
+        * tens of microseconds. The path may be relative or a symlink
+        */
+        static bool executable_path(char (&path)[PATH_MAX])
+        {
+            #ifdef __linux__
+            const char* started = reinterpret_cast<const char*>(getauxval(AT_EXECFN));
+            if (started && strchr(started, '/') && strlen(started) < PATH_MAX)
+            {
+                strcpy(path, started);
+                return true;
+            }
+            ssize_t length = readlink("/proc/self/exe", path, PATH_MAX - 1);
+            if (length <= 0)
+            {
+                return false;
+            }
+            path[length] = '\0';
+            return true;
+            #elif defined(__APPLE__)
+            uint32_t size = PATH_MAX;
+            return _NSGetExecutablePath(path, &size) == 0;
+            #else
+            (void)path;
+            return false;
+            #endif
+        }
+
+        // Replaces path with its canonical form if it is a symlink. Returns false otherwise
+        static bool resolve_symlink(char (&path)[PATH_MAX])
+        {
+            struct stat info;
+            char resolved[PATH_MAX];
+            if (lstat(path, &info) != 0 || !S_ISLNK(info.st_mode) || !realpath(path, resolved))
+            {
+                return false;
+            }
+            strcpy(path, resolved);
+            return true;
+        }
+
+        // "<dir>/.<name><suffix>" for the executable "<dir>/<name>"
+        static bool sibling(const char* executable, const char* suffix, char* result, size_t size)
+        {
+            // No snprintf(): its first call in a process costs more than the stat()
+            const char* slash = strrchr(executable, '/');
+            if (!slash)
+            {
+                return false;
+            }
+            size_t directory = static_cast<size_t>(slash - executable) + 1;
+            size_t name = strlen(slash + 1);
+            size_t extension = strlen(suffix);
+            if (directory + 1 + name + extension >= size)
+            {
+                return false;
+            }
+            memcpy(result, executable, directory);
+            result[directory] = '.';
+            memcpy(result + directory + 1, slash + 1, name);
+            memcpy(result + directory + 1 + name, suffix, extension + 1);
+            return true;
+        }
+
+        /*
+        * Completes a prepared journal: renames the new file over the executable and removes the journal
+        *
+        * Same record format and checks as ApplyJournal::recover(), restricted to
+        * the case where the new file is waiting to be renamed
+        */
+        static bool install(const char* executable, const char* journal)
+        {
+            char incoming[PATH_MAX + 64];
+            char backup[PATH_MAX + 64];
+            if (!sibling(executable, ".autoupdater-new", incoming, sizeof(incoming)) ||
+                !sibling(executable, ".autoupdater-backup", backup, sizeof(backup)))
+            {
+                return false;
+            }
+
+            int fd = open(journal, O_RDWR | O_CLOEXEC);
+            if (fd < 0)
+            {
+                return false;
+            }
+            // Held by the process that prepared it, or by an apply that is still running
+            if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+            {
+                close(fd);
+                return false;
+            }
+
+            string data;
+            char buffer[4096];
+            ssize_t n;
+            while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+            {
+                data.append(buffer, static_cast<size_t>(n));
+            }
+
+            // "<fields>\t<crc32>\n" per record, up to the first torn or corrupt one
+            unsigned long long size = 0;
+            bool begun = false;
+            bool prepared = false;
+            size_t start = 0;
+            size_t end;
+            while ((end = data.find('\n', start)) != string::npos)
+            {
+                string line = data.substr(start, end - start);
+                start = end + 1;
+                size_t tab = line.rfind('\t');
+                if (tab == string::npos)
+                {
+                    break;
+                }
+                char checksum[16];
+                snprintf(checksum, sizeof(checksum), "%08lx",
+                    crc32(0, reinterpret_cast<const Bytef*>(line.data()), static_cast<uInt>(tab)));
+                if (line.compare(tab + 1, string::npos, checksum) != 0)
+                {
+                    break;
+                }
+                string record = line.substr(0, tab);
+                if (record.compare(0, 6, "begin\t") == 0)
+                {
+                    // begin <tag> <digest> <size>
+                    size_t last = record.rfind('\t');
+                    size = strtoull(record.c_str() + last + 1, nullptr, 10);
+                    begun = true;
+                }
+                prepared = prepared || record == "prepared";
+            }
+
+            struct stat info;
+            bool ready = begun && prepared && stat(incoming, &info) == 0 &&
+                static_cast<unsigned long long>(info.st_size) == size &&
+                rename(incoming, executable) == 0;
+            if (ready)
+            {
+                const char* slash = strrchr(executable, '/');
+                string directory(executable, static_cast<size_t>(slash - executable));
+                int directory_fd = open(directory.empty() ? "/" : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (directory_fd >= 0)
+                {
+                    fsync(directory_fd);
+                    close(directory_fd);
+                }
+                unlink(backup);
+                unlink(journal);
+            }
+            close(fd);
+            return ready;
+        }
+        #endif
+};
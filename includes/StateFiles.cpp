@@ -0,0 +1,148 @@
+/*
+ * StateFiles - Private files for the state the updaters of one user share
+ *
+ * Features:
+ * - One directory per user: $XDG_RUNTIME_DIR/autoupdater, or autoupdater-<uid> in the temp directory
+ * - The directory is created with mode 0700 and only used if the user owns it and no one else can write to it
+ * - Files are opened with O_NOFOLLOW and mode 0600, and only if the user owns them
+ * - Contents are read and replaced through the locked descriptor, never by path
+ *
+ * A predictable name in the shared temp directory could be created first by
+ * another user, who then controls its contents, or be a symlink that turns
+ * our writes against another file. Windows already has a temp directory
+ * per user.
+ */
+
+#pragma once
+
+#include <string>
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+class StateFiles
+{
+    public:
+        /*
+        * Path of a state file in the user's private directory
+        *
+        * Returns empty string if there is no directory that is safe to use
+        */
+        static string path(const string& name)
+        {
+            string dir = directory();
+            return dir.empty() ? dir : (fs::path(dir) / name).string();
+        }
+
+        #ifndef _WIN32
+        /*
+        * Opens a state file with mode 0600 (flags as for open(), e.g. O_RDWR | O_CREAT)
+        *
+        * Refuses symlinks and files owned by someone else. Returns -1 on failure
+        */
+        static int open(const string& path, int flags)
+        {
+            if (path.empty())
+            {
+                errno = ENOENT;
+                return -1;
+            }
+            int fd = ::open(path.c_str(), flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+            if (fd < 0)
+            {
+                return -1;
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_uid != geteuid())
+            {
+                close(fd);
+                errno = EPERM;
+                return -1;
+            }
+            return fd;
+        }
+
+        // Whole contents of an open state file
+        static string read_all(int fd)
+        {
+            string contents;
+            char buffer[4096];
+            off_t offset = 0;
+            ssize_t n;
+            while ((n = pread(fd, buffer, sizeof(buffer), offset)) > 0)
+            {
+                contents.append(buffer, static_cast<size_t>(n));
+                offset += n;
+            }
+            return contents;
+        }
+
+        // Replaces the contents of an open state file
+        static bool replace_all(int fd, const string& contents)
+        {
+            if (ftruncate(fd, 0) != 0)
+            {
+                return false;
+            }
+            size_t written = 0;
+            while (written < contents.size())
+            {
+                ssize_t n = pwrite(fd, contents.data() + written, contents.size() - written, static_cast<off_t>(written));
+                if (n <= 0)
+                {
+                    return false;
+                }
+                written += static_cast<size_t>(n);
+            }
+            return true;
+        }
+        #endif
+
+        // The user's private state directory, created if missing. Empty string if none is safe to use
+        static string directory()
+        {
+            error_code ec;
+            #ifdef _WIN32
+            fs::path dir = fs::temp_directory_path(ec) / "autoupdater";
+            fs::create_directories(dir, ec);
+            return ec ? string() : dir.string();
+            #else
+            fs::path dir;
+            const char* runtime = getenv("XDG_RUNTIME_DIR");
+            if (runtime && *runtime == '/')
+            {
+                dir = fs::path(runtime) / "autoupdater";
+            }
+            else
+            {
+                fs::path temp = fs::temp_directory_path(ec);
+                if (ec)
+                {
+                    return "";
+                }
+                dir = temp / ("autoupdater-" + to_string(geteuid()));
+            }
+            if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+            {
+                return "";
+            }
+            struct stat info;
+            if (lstat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) ||
+                info.st_uid != geteuid() || (info.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+            {
+                return "";
+            }
+            return dir.string();
+            #endif
+        }
+};
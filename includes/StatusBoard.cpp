@@ -0,0 +1,414 @@
+/*
+ * StatusBoard - Shared-memory update status for external monitoring
+ *
+ * Features:
+ * - Publishes phase, bytes downloaded, rate, last check, latest tag and
+ *   last error into a small shared-memory segment per updater
+ * - Seqlock protected: the writer never blocks, readers retry on a torn read
+ * - Readers (a CLI or node agent) list every segment on the host without
+ *   talking to the updating process
+ *
+ * Segments are named "/autoupdater-status-<pid>-<n>" and removed when the
+ * updater is destroyed. Segments left behind by crashed processes are
+ * reported as not alive and can be removed with StatusBoard::remove().
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+enum class UpdatePhase : uint32_t
+{
+    Idle = 0,
+    Checking,
+    UpToDate,
+    Available,
+    Downloading,
+    Verifying,
+    Staged,
+    Applying,
+    Applied,
+    Failed,
+    Deferred
+};
+
+inline const char* phase_name(UpdatePhase phase)
+{
+    switch (phase)
+    {
+        case UpdatePhase::Idle: return "idle";
+        case UpdatePhase::Checking: return "checking";
+        case UpdatePhase::UpToDate: return "up-to-date";
+        case UpdatePhase::Available: return "available";
+        case UpdatePhase::Downloading: return "downloading";
+        case UpdatePhase::Verifying: return "verifying";
+        case UpdatePhase::Staged: return "staged";
+        case UpdatePhase::Applying: return "applying";
+        case UpdatePhase::Applied: return "applied";
+        case UpdatePhase::Failed: return "failed";
+        case UpdatePhase::Deferred: return "deferred";
+    }
+    return "unknown";
+}
+
+// Consistent copy of one updater's status
+struct UpdateStatus
+{
+    string segment;               // Shared-memory name, e.g. "/autoupdater-status-1234-0"
+    int64_t pid = 0;
+    bool alive = false;           // Owning process still exists
+    string repository;            // "owner/name"
+    UpdatePhase phase = UpdatePhase::Idle;
+    int64_t bytes_downloaded = 0;
+    int64_t bytes_total = 0;
+    double bytes_per_second = 0;
+    int64_t last_check = 0;       // Unix seconds, 0 = never
+    int64_t updated_at = 0;       // Unix milliseconds of the last change
+    string latest_tag;
+    string last_error;
+};
+
+class StatusBoard
+{
+    public:
+        /*
+        * Creates this updater's segment
+        *
+        * @param repository: Repository ("owner/name") shown to readers
+        */
+        explicit StatusBoard(const string& repository)
+        {
+            #ifndef _WIN32
+            static atomic<int> instance_counter{0};
+            name = segment_prefix + to_string(getpid()) + "-" + to_string(instance_counter++);
+
+            // The name is predictable: a segment left by an earlier process with our pid is
+            // removed once, one someone else created first is not ours to write to
+            int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+            if (fd < 0 && errno == EEXIST)
+            {
+                shm_unlink(name.c_str());
+                fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+            }
+            if (fd < 0)
+            {
+                return;
+            }
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_uid == geteuid() && ftruncate(fd, sizeof(Segment)) == 0)
+            {
+                void* mapping = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (mapping != MAP_FAILED)
+                {
+                    segment = static_cast<Segment*>(mapping);
+                }
+            }
+            close(fd);
+            if (!segment)
+            {
+                shm_unlink(name.c_str());
+                return;
+            }
+
+            // Fresh pages are zeroed, so the sequence starts even (consistent)
+            begin_write();
+            segment->pid = getpid();
+            copy_text(segment->repository, sizeof(segment->repository), repository);
+            segment->magic = segment_magic;
+            segment->version = segment_version;
+            end_write();
+            #endif
+        }
+
+        ~StatusBoard()
+        {
+            #ifndef _WIN32
+            if (segment)
+            {
+                munmap(segment, sizeof(Segment));
+                shm_unlink(name.c_str());
+            }
+            #endif
+        }
+
+        StatusBoard(const StatusBoard&) = delete;
+        StatusBoard& operator=(const StatusBoard&) = delete;
+
+        // False if the segment could not be created (status is then silently dropped)
+        bool ok() const
+        {
+            return segment != nullptr;
+        }
+
+        const string& segment_name() const
+        {
+            return name;
+        }
+
+        void set_phase(UpdatePhase phase)
+        {
+            if (!segment)
+            {
+                return;
+            }
+            begin_write();
+            segment->phase = static_cast<uint32_t>(phase);
+            if (phase == UpdatePhase::Downloading)
+            {
+                segment->bytes_downloaded = 0;
+                segment->bytes_total = 0;
+                segment->bytes_per_second = 0;
+                rate_sample_bytes = 0;
+                rate_sample_time = chrono::steady_clock::now();
+            }
+            end_write();
+        }
+
+        // Download progress, called from the transfer hot path
+        void set_progress(int64_t downloaded, int64_t total)
+        {
+            if (!segment)
+            {
+                return;
+            }
+
+            // Refresh the rate a few times per second, not on every callback
+            auto now = chrono::steady_clock::now();
+            double elapsed = chrono::duration<double>(now - rate_sample_time).count();
+            bool refresh_rate = elapsed >= rate_interval_seconds;
+
+            begin_write();
+            segment->bytes_downloaded = downloaded;
+            segment->bytes_total = total;
+            if (refresh_rate)
+            {
+                double rate = max<int64_t>(0, downloaded - rate_sample_bytes) / elapsed;
+                segment->bytes_per_second = segment->bytes_per_second > 0
+                    ? rate_weight * rate + (1 - rate_weight) * segment->bytes_per_second
+                    : rate;
+            }
+            end_write();
+
+            if (refresh_rate)
+            {
+                rate_sample_bytes = downloaded;
+                rate_sample_time = now;
+            }
+        }
+
+        // Result of a completed release check
+        void set_check(const string& latest_tag, UpdatePhase phase)
+        {
+            if (!segment)
+            {
+                return;
+            }
+            begin_write();
+            segment->last_check = chrono::duration_cast<chrono::seconds>(
+                chrono::system_clock::now().time_since_epoch()).count();
+            copy_text(segment->latest_tag, sizeof(segment->latest_tag), latest_tag);
+            segment->phase = static_cast<uint32_t>(phase);
+            end_write();
+        }
+
+        // Records an error and moves to the failed phase
+        void set_error(const string& message)
+        {
+            if (!segment)
+            {
+                return;
+            }
+            begin_write();
+            copy_text(segment->last_error, sizeof(segment->last_error), message);
+            segment->phase = static_cast<uint32_t>(UpdatePhase::Failed);
+            end_write();
+        }
+
+        /*
+        * Reads every status segment on the host
+        *
+        * Only supported on Linux, where shared memory is listed under /dev/shm
+        */
+        static vector<UpdateStatus> read_all()
+        {
+            vector<UpdateStatus> statuses;
+            #ifdef __linux__
+            error_code ec;
+            for (const auto& entry : fs::directory_iterator("/dev/shm", ec))
+            {
+                string file = entry.path().filename().string();
+                if (file.compare(0, segment_prefix.size() - 1, segment_prefix.substr(1)) != 0)
+                {
+                    continue;
+                }
+                UpdateStatus status;
+                if (read("/" + file, status))
+                {
+                    statuses.push_back(status);
+                }
+            }
+            #endif
+            return statuses;
+        }
+
+        /*
+        * Reads one segment by name
+        *
+        * Returns false if it does not exist, is not a status segment, or kept
+        * changing for the whole retry budget
+        */
+        static bool read(const string& segment_name, UpdateStatus& status)
+        {
+            #ifdef _WIN32
+            return false;
+            #else
+            int fd = shm_open(segment_name.c_str(), O_RDONLY, 0);
+            if (fd < 0)
+            {
+                return false;
+            }
+            struct stat info;
+            void* mapping = MAP_FAILED;
+            if (fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(sizeof(Segment)))
+            {
+                mapping = mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if (mapping == MAP_FAILED)
+            {
+                return false;
+            }
+
+            const Segment* shared = static_cast<const Segment*>(mapping);
+            Segment copy;
+            bool consistent = false;
+            for (int attempt = 0; attempt < max_read_attempts && !consistent; attempt++)
+            {
+                uint32_t before = shared->sequence.load(memory_order_acquire);
+                if (before & 1)
+                {
+                    this_thread_yield();
+                    continue;
+                }
+                memcpy(static_cast<void*>(&copy), static_cast<const void*>(shared), sizeof(Segment));
+                atomic_thread_fence(memory_order_acquire);
+                consistent = shared->sequence.load(memory_order_relaxed) == before;
+            }
+            munmap(mapping, sizeof(Segment));
+
+            if (!consistent || copy.magic != segment_magic || copy.version != segment_version)
+            {
+                return false;
+            }
+
+            status.segment = segment_name;
+            status.pid = copy.pid;
+            status.alive = kill(static_cast<pid_t>(copy.pid), 0) == 0 || errno == EPERM;
+            status.repository = terminated(copy.repository, sizeof(copy.repository));
+            status.phase = static_cast<UpdatePhase>(copy.phase);
+            status.bytes_downloaded = copy.bytes_downloaded;
+            status.bytes_total = copy.bytes_total;
+            status.bytes_per_second = copy.bytes_per_second;
+            status.last_check = copy.last_check;
+            status.updated_at = copy.updated_at;
+            status.latest_tag = terminated(copy.latest_tag, sizeof(copy.latest_tag));
+            status.last_error = terminated(copy.last_error, sizeof(copy.last_error));
+            return true;
+            #endif
+        }
+
+        // Removes a segment, e.g. one left behind by a crashed process
+        static bool remove(const string& segment_name)
+        {
+            #ifdef _WIN32
+            return false;
+            #else
+            return shm_unlink(segment_name.c_str()) == 0;
+            #endif
+        }
+
+    private:
+        static constexpr uint32_t segment_magic = 0x41555354;  // "AUST"
+        static constexpr uint32_t segment_version = 1;
+        static constexpr int max_read_attempts = 1000;
+        static constexpr double rate_interval_seconds = 0.25;
+        static constexpr double rate_weight = 0.5;
+        static inline const string segment_prefix = "/autoupdater-status-";
+
+        // Shared layout. Only fixed-size fields, the same binary reads and writes it
+        struct Segment
+        {
+            atomic<uint32_t> sequence;  // Odd while a write is in progress
+            uint32_t magic;
+            uint32_t version;
+            uint32_t phase;
+            int64_t pid;
+            int64_t bytes_downloaded;
+            int64_t bytes_total;
+            double bytes_per_second;
+            int64_t last_check;
+            int64_t updated_at;
+            char repository[128];
+            char latest_tag[64];
+            char last_error[256];
+        };
+        static_assert(atomic<uint32_t>::is_always_lock_free, "seqlock needs a lock-free counter");
+
+        string name;
+        Segment* segment = nullptr;
+        int64_t rate_sample_bytes = 0;
+        chrono::steady_clock::time_point rate_sample_time = chrono::steady_clock::now();
+
+        static void this_thread_yield()
+        {
+            #ifndef _WIN32
+            sched_yield();
+            #endif
+        }
+
+        static void copy_text(char* destination, size_t capacity, const string& text)
+        {
+            size_t length = min(text.size(), capacity - 1);
+            memcpy(destination, text.data(), length);
+            destination[length] = '\0';
+        }
+
+        static string terminated(const char* text, size_t capacity)
+        {
+            return string(text, strnlen(text, capacity));
+        }
+
+        // Single writer per segment: bump to odd, write fields, bump to even
+        void begin_write()
+        {
+            segment->sequence.store(segment->sequence.load(memory_order_relaxed) + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+        }
+
+        void end_write()
+        {
+            segment->updated_at = chrono::duration_cast<chrono::milliseconds>(
+                chrono::system_clock::now().time_since_epoch()).count();
+            segment->sequence.store(segment->sequence.load(memory_order_relaxed) + 1, memory_order_release);
+        }
+};
@@ -0,0 +1,67 @@
+/*
+ * TlsSettings - Certificate verification for every transfer the updater makes
+ *
+ * Features:
+ * - Peer certificate and host name verification are always on
+ * - A CA bundle (file or directory) can be set for hosts without a usable system store
+ * - Credentials are only attached to requests that go over verified TLS
+ *
+ * The CA bundle is process-wide, so transfers started by helpers (mirror
+ * probes, segment and bundle downloads, the cache daemon) use it as well.
+ */
+
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <filesystem>
+#include <curl/curl.h>
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+class TlsSettings
+{
+    public:
+        /*
+        * Verifies servers against a CA bundle instead of the system store
+        *
+        * @param path: PEM file, or directory of hashed certificates. Empty for the system store
+        */
+        static void set_ca_bundle(const string& path)
+        {
+            lock_guard<mutex> guard(lock);
+            error_code ec;
+            bool directory = !path.empty() && fs::is_directory(path, ec);
+            ca_file = directory ? "" : path;
+            ca_path = directory ? path : "";
+        }
+
+        // Turns on verification for a transfer, with the configured CA bundle
+        static void apply(CURL* easy)
+        {
+            curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 1L);
+            curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 2L);
+            lock_guard<mutex> guard(lock);
+            if (!ca_file.empty())
+            {
+                curl_easy_setopt(easy, CURLOPT_CAINFO, ca_file.c_str());
+            }
+            if (!ca_path.empty())
+            {
+                curl_easy_setopt(easy, CURLOPT_CAPATH, ca_path.c_str());
+            }
+        }
+
+        // Whether a request to url may carry credentials: only https, where apply() verifies the server
+        static bool may_authenticate(const string& url)
+        {
+            return url.compare(0, 8, "https://") == 0;
+        }
+
+    private:
+        inline static mutex lock;
+        inline static string ca_file;
+        inline static string ca_path;
+};
@@ -0,0 +1,239 @@
+/*
+ * UpdatePlanner - Predicts what an update will cost before doing it
+ *
+ * Features:
+ * - Chooses between the full asset, a gzip-compressed variant and a local copy
+ * - Estimates bytes transferred, disk I/O and duration from historical throughput
+ * - Detects same-filesystem staging (install by rename) and reflink support
+ *
+ * Nothing is downloaded: the inputs are the release metadata, the local
+ * caches and the throughput measured by earlier downloads.
+ */
+
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <filesystem>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#elif !defined(_WIN32)
+#include <sys/stat.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+enum class UpdateStrategy
+{
+    None,           // No release to update to
+    Staged,         // Already downloaded and verified, only the install remains
+    Cached,         // Verified copy in the local peer store
+    Compressed,     // Download "<asset>.gz" and decompress
+    Full            // Download the asset
+};
+
+inline const char* strategy_name(UpdateStrategy strategy)
+{
+    switch (strategy)
+    {
+        case UpdateStrategy::None: return "none";
+        case UpdateStrategy::Staged: return "staged";
+        case UpdateStrategy::Cached: return "cached";
+        case UpdateStrategy::Compressed: return "compressed";
+        case UpdateStrategy::Full: return "full";
+    }
+    return "unknown";
+}
+
+struct UpdatePlan
+{
+    UpdateStrategy strategy = UpdateStrategy::None;
+    string release_tag;
+    string source_url;                  // What would be downloaded (empty for staged/cached)
+    int64_t transfer_bytes = 0;         // Network bytes
+    int64_t disk_read_bytes = 0;
+    int64_t disk_write_bytes = 0;
+    double throughput = 0;              // Expected network bytes/s
+    bool throughput_measured = false;   // False if throughput is the default guess
+    bool same_filesystem = false;       // Staging and executable on one filesystem: install by rename
+    bool reflink = false;               // Backups are copy-on-write clones
+    chrono::milliseconds predicted_duration{0};
+};
+
+// Inputs of the cost model, gathered by AutoUpdater::plan()
+struct PlanInputs
+{
+    string release_tag;
+    string asset_url;
+    int64_t asset_size = 0;
+    string compressed_url;              // Empty if the release has no gzip variant
+    int64_t compressed_size = 0;
+    bool staged = false;
+    bool cached = false;
+    int64_t executable_size = 0;
+    double throughput = 0;              // Historical bytes/s, 0 if unknown
+    bool same_filesystem = false;
+    bool reflink = false;
+};
+
+// True if both paths live on the same filesystem
+inline bool same_filesystem(const string& a, const string& b)
+{
+    #ifdef _WIN32
+    return fs::path(a).root_name() == fs::path(b).root_name();
+    #else
+    struct stat first, second;
+    return stat(a.c_str(), &first) == 0 && stat(b.c_str(), &second) == 0 && first.st_dev == second.st_dev;
+    #endif
+}
+
+// Creates destination as a copy-on-write clone of source. Returns false if the filesystem cannot
+inline bool reflink_file(const string& source, const string& destination)
+{
+    #ifdef __linux__
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        return false;
+    }
+    int out = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+    {
+        close(in);
+        return false;
+    }
+    bool cloned = ioctl(out, FICLONE, in) == 0;
+    struct stat info;
+    if (cloned && fstat(in, &info) == 0)
+    {
+        fchmod(out, info.st_mode & 07777);
+    }
+    close(in);
+    close(out);
+    if (!cloned)
+    {
+        unlink(destination.c_str());
+    }
+    return cloned;
+    #else
+    (void)source;
+    (void)destination;
+    return false;
+    #endif
+}
+
+// True if files in directory can be cloned (tested with a small probe file)
+inline bool supports_reflink(const string& directory)
+{
+    string suffix = to_string(chrono::steady_clock::now().time_since_epoch().count());
+    fs::path probe = fs::path(directory) / (".autoupdater_reflink_probe_" + suffix);
+    {
+        FILE* fp = fopen(probe.string().c_str(), "wb");
+        if (!fp)
+        {
+            return false;
+        }
+        fputs("probe", fp);
+        fclose(fp);
+    }
+    string clone = probe.string() + ".clone";
+    bool supported = reflink_file(probe.string(), clone);
+    error_code ec;
+    fs::remove(probe, ec);
+    fs::remove(clone, ec);
+    return supported;
+}
+
+class UpdatePlanner
+{
+    public:
+        // Assumed when no download to the host has been measured yet (same as mirror probing)
+        static constexpr double default_throughput = 10.0 * 1024 * 1024;
+        static constexpr double disk_throughput = 200.0 * 1024 * 1024;
+        static constexpr double gunzip_throughput = 250.0 * 1024 * 1024;
+        static constexpr double request_overhead_seconds = 0.3;
+
+        static UpdatePlan estimate(const PlanInputs& inputs)
+        {
+            UpdatePlan plan;
+            plan.release_tag = inputs.release_tag;
+            plan.same_filesystem = inputs.same_filesystem;
+            plan.reflink = inputs.reflink;
+            plan.throughput_measured = inputs.throughput > 0;
+            plan.throughput = plan.throughput_measured ? inputs.throughput : default_throughput;
+            if (inputs.asset_url.empty())
+            {
+                return plan;
+            }
+
+            int64_t size = inputs.asset_size;
+            double seconds = 0;
+            if (inputs.staged)
+            {
+                plan.strategy = UpdateStrategy::Staged;
+            }
+            else if (inputs.cached)
+            {
+                // Copy out of the store and hash the copy
+                plan.strategy = UpdateStrategy::Cached;
+                plan.disk_read_bytes += 2 * size;
+                plan.disk_write_bytes += size;
+            }
+            else
+            {
+                int64_t compressed = inputs.compressed_size;
+                double full_seconds = request_overhead_seconds + size / plan.throughput + 2.0 * size / disk_throughput;
+                double compressed_seconds = request_overhead_seconds + compressed / plan.throughput +
+                    size / gunzip_throughput + (3.0 * compressed + 2.0 * size) / disk_throughput;
+
+                if (!inputs.compressed_url.empty() && inputs.compressed_size > 0 &&
+                    inputs.compressed_size < size && compressed_seconds < full_seconds)
+                {
+                    // Download, hash, decompress into the asset, hash the result
+                    plan.strategy = UpdateStrategy::Compressed;
+                    plan.source_url = inputs.compressed_url;
+                    plan.transfer_bytes = inputs.compressed_size;
+                    plan.disk_write_bytes += inputs.compressed_size + size;
+                    plan.disk_read_bytes += 2 * inputs.compressed_size + size;
+                    seconds += plan.transfer_bytes / plan.throughput + size / gunzip_throughput + request_overhead_seconds;
+                }
+                else
+                {
+                    // Download and hash
+                    plan.strategy = UpdateStrategy::Full;
+                    plan.source_url = inputs.asset_url;
+                    plan.transfer_bytes = size;
+                    plan.disk_write_bytes += size;
+                    plan.disk_read_bytes += size;
+                    seconds += plan.transfer_bytes / plan.throughput + request_overhead_seconds;
+                }
+            }
+
+            // Backup of the running executable, cloned if the filesystem can
+            if (!inputs.reflink)
+            {
+                plan.disk_read_bytes += inputs.executable_size;
+                plan.disk_write_bytes += inputs.executable_size;
+            }
+
+            // Install: rename on the same filesystem, copy otherwise
+            if (!inputs.same_filesystem)
+            {
+                plan.disk_read_bytes += size;
+                plan.disk_write_bytes += size;
+            }
+
+            seconds += (plan.disk_read_bytes + plan.disk_write_bytes) / disk_throughput;
+            plan.predicted_duration = chrono::milliseconds(static_cast<long long>(seconds * 1000));
+            return plan;
+        }
+};
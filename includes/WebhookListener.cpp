@@ -0,0 +1,217 @@
+/*
+ * WebhookListener - Push-based update notification
+ *
+ * Features:
+ * - Accepts GitHub "release" webhook payloads on an embedded HTTP endpoint
+ * - Verifies the X-Hub-Signature-256 HMAC with the shared secret
+ * - Works with payloads forwarded verbatim by an internal relay
+ * - Runs the update trigger on a worker thread, coalescing bursts
+ */
+
+#pragma once
+
+#include "HttpServer.cpp"
+#include "Sha256.cpp"
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <iomanip>
+#include <iostream>
+#include <functional>
+#include <condition_variable>
+#include <json/json.h>
+
+
+using namespace std;
+
+class WebhookListener
+{
+    public:
+        /*
+        * @param port: Port to listen on
+        * @param secret: Webhook secret configured on GitHub (or the relay)
+        * @param path: URL path webhooks are posted to
+        * @param repository: Repository ("owner/name") whose releases trigger updates
+        * @param verbose: Enable detailed logging
+        */
+        WebhookListener(uint16_t port,
+                        const string& secret,
+                        const string& path,
+                        const string& repository,
+                        bool verbose)
+            : secret(secret),
+            path(path),
+            repository(lowercase(repository)),
+            verbose(verbose),
+            server(port, [this](const HttpRequest& request) { return handle(request); })
+        {
+        }
+
+        ~WebhookListener()
+        {
+            stop();
+        }
+
+        /*
+        * Starts listening
+        *
+        * @param on_release: Called on a worker thread for every verified release event.
+        *                    Events arriving while it runs are coalesced into one more call
+        */
+        bool start(function<void()> on_release)
+        {
+            if (secret.empty())
+            {
+                log("Refusing to start without a webhook secret");
+                return false;
+            }
+
+            trigger = on_release;
+            running = true;
+            worker = thread(&WebhookListener::work, this);
+            if (!server.start())
+            {
+                stop();
+                return false;
+            }
+            log("Listening for release webhooks on port " + to_string(server.port()) + path);
+            return true;
+        }
+
+        void stop()
+        {
+            server.stop();
+            {
+                lock_guard<mutex> guard(lock);
+                running = false;
+            }
+            wake.notify_all();
+            if (worker.joinable())
+            {
+                worker.join();
+            }
+        }
+
+        uint16_t port() const
+        {
+            return server.port();
+        }
+
+    private:
+        string secret;
+        string path;
+        string repository;
+        bool verbose;
+        HttpServer server;
+        function<void()> trigger;
+
+        mutex lock;
+        condition_variable wake;
+        bool pending = false;
+        bool running = false;
+        thread worker;
+
+        static string lowercase(string value)
+        {
+            transform(value.begin(), value.end(), value.begin(), ::tolower);
+            return value;
+        }
+
+        void work()
+        {
+            unique_lock<mutex> guard(lock);
+            while (true)
+            {
+                wake.wait(guard, [this]() { return pending || !running; });
+                if (!running)
+                {
+                    return;
+                }
+                pending = false;
+
+                guard.unlock();
+                log("Release event received, checking for update");
+                trigger();
+                guard.lock();
+            }
+        }
+
+        HttpResponse handle(const HttpRequest& request)
+        {
+            if (request.path != path)
+            {
+                return HttpResponse::text(404, "Not found\n");
+            }
+            if (request.method != "POST")
+            {
+                return HttpResponse::text(405, "Method not allowed\n");
+            }
+
+            // GitHub signs the raw body with the shared secret
+            auto signature = request.headers.find("x-hub-signature-256");
+            string expected = "sha256=" + hmac_sha256_hex(secret, request.body);
+            if (signature == request.headers.end() || !constant_time_equals(signature->second, expected))
+            {
+                log("Rejected webhook from " + request.remote_address + ": bad signature");
+                return HttpResponse::text(401, "Bad signature\n");
+            }
+
+            auto event = request.headers.find("x-github-event");
+            string event_name = event == request.headers.end() ? "" : event->second;
+            if (event_name == "ping")
+            {
+                return HttpResponse::text(200, "pong\n");
+            }
+            if (event_name != "release")
+            {
+                return HttpResponse::text(202, "Ignored\n");
+            }
+
+            Json::Value root;
+            Json::CharReaderBuilder builder;
+            unique_ptr<Json::CharReader> reader(builder.newCharReader());
+            string errors;
+            const string& body = request.body;
+            if (!reader->parse(body.c_str(), body.c_str() + body.size(), &root, &errors))
+            {
+                return HttpResponse::text(400, "Invalid JSON\n");
+            }
+
+            string action = root.get("action", "").asString();
+            string full_name = lowercase(root["repository"].get("full_name", "").asString());
+            if (full_name != repository || (action != "published" && action != "released"))
+            {
+                return HttpResponse::text(202, "Ignored\n");
+            }
+
+            log("Release " + root["release"].get("tag_name", "").asString() + " " + action);
+            {
+                lock_guard<mutex> guard(lock);
+                pending = true;
+            }
+            wake.notify_one();
+            return HttpResponse::text(202, "Accepted\n");
+        }
+
+        void log(string log_string)
+        {
+            if (!verbose)
+            {
+                return;
+            }
+
+            auto now = chrono::system_clock::now();
+            auto now_time = chrono::system_clock::to_time_t(now);
+
+            tm local_time;
+            #ifdef _WIN32
+            localtime_s(&local_time, &now_time);
+            #else
+            localtime_r(&now_time, &local_time);
+            #endif
+
+            cout << "WebhookListener at " << put_time(&local_time, "%H:%M:%S") << ": " << log_string << endl;
+        }
+};
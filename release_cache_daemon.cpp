@@ -0,0 +1,131 @@
+/*
+ * Release cache daemon - one upstream poller per host or rack
+ *
+ * Polls the GitHub release API for the configured repositories, caches the
+ * release JSON and assets locally and serves them with the same URL shape
+ * as GitHub. Point AutoUpdater at it with set_api_base(). The store defaults
+ * to the user's private state directory; a --store must be owned by the
+ * daemon's user and writable by no one else.
+ *
+ * Usage:
+ *   release_cache_daemon --repo owner/name [--repo owner/name ...]
+ *                        [--port 8080] [--bind 127.0.0.1] [--store DIR]
+ *                        [--interval 300] [--public-url http://host:port]
+ *                        [--token-env GITHUB_TOKEN | --token-file PATH]
+ *                        [--client-rate 10] [--upstream https://api.github.com]
+ *                        [--ca-bundle PATH]
+ *                        [--verbose]
+ */
+
+#include "includes/ReleaseCache.cpp"
+
+#include <csignal>
+
+
+static void print_usage()
+{
+    cerr << "Usage: release_cache_daemon --repo owner/name [--repo ...] [--port 8080] [--bind 127.0.0.1]" << endl
+         << "       [--store DIR] [--interval SECONDS] [--public-url URL] [--token-env VAR | --token-file PATH]" << endl
+         << "       [--client-rate REQUESTS_PER_SECOND] [--upstream URL] [--ca-bundle PATH] [--verbose]" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    // Daemon config
+    vector<string> repositories;
+    uint16_t port = 8080;
+    string bind_address = "127.0.0.1";
+    string store_dir;
+    long interval = 300;
+    string public_url;
+    string token;
+    string upstream;
+    double client_rate = 0;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--verbose") verbose = true;
+        else if (arg == "--repo" && has_value) repositories.push_back(argv[++i]);
+        else if (arg == "--port" && has_value) port = static_cast<uint16_t>(stoi(argv[++i]));
+        else if (arg == "--bind" && has_value) bind_address = argv[++i];
+        else if (arg == "--store" && has_value) store_dir = argv[++i];
+        else if (arg == "--interval" && has_value) interval = stol(argv[++i]);
+        else if (arg == "--public-url" && has_value) public_url = argv[++i];
+        else if (arg == "--token-env" && has_value) token = load_token_from_env(argv[++i]);
+        else if (arg == "--token-file" && has_value) token = load_token_from_file(argv[++i]);
+        else if (arg == "--client-rate" && has_value) client_rate = stod(argv[++i]);
+        else if (arg == "--upstream" && has_value) upstream = argv[++i];
+        else if (arg == "--ca-bundle" && has_value) TlsSettings::set_ca_bundle(argv[++i]);
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (repositories.empty())
+    {
+        print_usage();
+        return 1;
+    }
+    if (store_dir.empty())
+    {
+        store_dir = StateFiles::path("release_cache");
+        if (store_dir.empty())
+        {
+            cerr << "No private directory for the store, pass --store DIR" << endl;
+            return 1;
+        }
+    }
+    if (public_url.empty())
+    {
+        public_url = "http://" + bind_address + ":" + to_string(port);
+    }
+
+    // Block termination signals in all threads, the main thread waits for them below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    ReleaseCache cache(store_dir, port, public_url, verbose);
+    cache.set_bind_address(bind_address);
+    cache.set_client_rate_limit(client_rate);
+    if (!token.empty())
+    {
+        cache.set_auth_token(token);
+    }
+    if (!upstream.empty())
+    {
+        cache.set_upstream(upstream);
+    }
+    for (const string& repository : repositories)
+    {
+        cache.add_repository(repository);
+    }
+    if (!cache.store_is_private())
+    {
+        cerr << "Refusing store " << store_dir << ": it must be a directory owned by this user and writable by no one else" << endl;
+        return 1;
+    }
+
+    if (!cache.start(chrono::seconds(interval)))
+    {
+        cerr << "Failed to start on " << bind_address << ":" << port << endl;
+        return 1;
+    }
+    cout << "Serving " << repositories.size() << " repositories at " << public_url << endl;
+
+    int signal_number = 0;
+    sigwait(&signals, &signal_number);
+
+    cache.stop();
+    curl_global_cleanup();
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Check - Minimal helpers shared by the behavior tests
+ *
+ * Features:
+ * - CHECK(condition) reports the failing expression with its line and keeps going
+ * - Scratch directories under the temp directory, removed at exit
+ * - Small file helpers for building fixtures
+ *
+ * Each test is a standalone program that exits non-zero if any check
+ * failed; tests/run_tests.sh builds and runs them all.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+namespace fs = std::filesystem;
+
+inline int& check_failures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            check_failures()++; \
+        } \
+    } while (0)
+
+// Prints the result and returns the process exit code
+inline int finish_checks(const char* test)
+{
+    if (check_failures() > 0)
+    {
+        fprintf(stderr, "%s: %d check(s) failed\n", test, check_failures());
+        return 1;
+    }
+    printf("%s: all checks passed\n", test);
+    return 0;
+}
+
+// Fresh scratch directory, removed when the creating process exits
+inline fs::path scratch_directory(const string& name)
+{
+    fs::path dir = fs::temp_directory_path() / (name + "_" + to_string(getpid()));
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    static vector<fs::path> created;
+    static pid_t owner = getpid();
+    static bool registered = false;
+    created.push_back(dir);
+    if (!registered)
+    {
+        registered = true;
+        atexit([]()
+        {
+            if (getpid() == owner)
+            {
+                error_code ec;
+                for (const fs::path& path : created)
+                {
+                    fs::remove_all(path, ec);
+                }
+            }
+        });
+    }
+    return dir;
+}
+
+inline void write_file(const fs::path& path, const string& contents)
+{
+    fs::create_directories(path.parent_path());
+    ofstream(path, ios::binary | ios::trunc) << contents;
+}
+
+inline string read_file(const fs::path& path)
+{
+    ifstream in(path, ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
@@ -0,0 +1,234 @@
+/*
+ * apply_journal_test - Replacing an executable, with crashes at every step
+ *
+ * Crashes are real: a child process prepares (and possibly renames) and then
+ * dies with _exit(), leaving the journal and files exactly as a power loss
+ * after its last sync would. Recovery in the parent must then roll back
+ * before the "prepared" record and complete after it.
+ */
+
+#include "tests/Check.cpp"
+#include "includes/ApplyJournal.cpp"
+
+#include <sys/wait.h>
+
+
+static const string old_contents = "#!/bin/sh\necho old\n";
+static const string new_contents = "#!/bin/sh\necho new version\n";
+
+struct Install
+{
+    fs::path executable;
+    fs::path staged;
+};
+
+// A fresh installed executable and a staged new version beside it
+static Install fixture(const fs::path& root, const string& name)
+{
+    Install install;
+    install.executable = root / name / "app";
+    install.staged = root / name / "staged";
+    write_file(install.executable, old_contents);
+    write_file(install.staged, new_contents);
+    chmod(install.executable.c_str(), 0755);
+    return install;
+}
+
+// Runs step in a child that then dies without any cleanup. Returns whether step succeeded
+template <typename Step>
+static bool crash_after(Step step)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        _exit(step() ? 0 : 1);
+    }
+    int status = 0;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Only the executable remains in its directory
+static bool no_leftovers(const Install& install)
+{
+    size_t count = 0;
+    for (const auto& entry : fs::directory_iterator(install.executable.parent_path()))
+    {
+        count += entry.path() != install.staged ? 1 : 0;
+    }
+    return count == 1;
+}
+
+static fs::path journal_of(const Install& install)
+{
+    return install.executable.parent_path() / ".app.autoupdater-journal";
+}
+
+int main()
+{
+    fs::path root = scratch_directory("apply_journal_test");
+    string tag, digest, error;
+
+    // Nothing to recover
+    {
+        Install install = fixture(root, "clean");
+        CHECK(ApplyJournal(install.executable.string()).recover(tag, digest) == RecoveryAction::None);
+    }
+
+    // A complete install
+    {
+        Install install = fixture(root, "install");
+        ApplyJournal journal(install.executable.string());
+        CHECK(journal.install(install.staged.string(), "v2", "digest2", error));
+        CHECK(read_file(install.executable) == new_contents);
+        CHECK(access(install.executable.c_str(), X_OK) == 0);
+        CHECK(no_leftovers(install));
+    }
+
+    // Crash after "prepared", before the rename: recovery completes
+    {
+        Install install = fixture(root, "prepared");
+        CHECK(crash_after([&]()
+        {
+            string child_error;
+            return ApplyJournal(install.executable.string()).prepare(install.staged.string(), "v2", "digest2", child_error);
+        }));
+        CHECK(read_file(install.executable) == old_contents);
+        CHECK(ApplyJournal(install.executable.string()).recover(tag, digest) == RecoveryAction::Completed);
+        CHECK(tag == "v2" && digest == "digest2");
+        CHECK(read_file(install.executable) == new_contents);
+        CHECK(no_leftovers(install));
+    }
+
+    // Crash after the rename, before the journal was removed: recovery completes
+    {
+        Install install = fixture(root, "renamed");
+        CHECK(crash_after([&]()
+        {
+            string child_error;
+            ApplyJournal journal(install.executable.string());
+            fs::path incoming = install.executable.parent_path() / ".app.autoupdater-new";
+            return journal.prepare(install.staged.string(), "v2", "digest2", child_error) &&
+                rename(incoming.c_str(), install.executable.c_str()) == 0;
+        }));
+        CHECK(ApplyJournal(install.executable.string()).recover(tag, digest) == RecoveryAction::Completed);
+        CHECK(read_file(install.executable) == new_contents);
+        CHECK(no_leftovers(install));
+    }
+
+    // Crash before "prepared" reached the disk: the record is torn, recovery rolls back
+    {
+        Install install = fixture(root, "torn");
+        CHECK(crash_after([&]()
+        {
+            string child_error;
+            return ApplyJournal(install.executable.string()).prepare(install.staged.string(), "v2", "digest2", child_error);
+        }));
+        string records = read_file(journal_of(install));
+        size_t second = records.find('\n') + 1;
+        CHECK(records.compare(second, 8, "prepared") == 0);
+        write_file(journal_of(install), records.substr(0, second + 5));
+        CHECK(ApplyJournal(install.executable.string()).recover(tag, digest) == RecoveryAction::RolledBack);
+        CHECK(digest.empty());
+        CHECK(read_file(install.executable) == old_contents);
+        CHECK(no_leftovers(install));
+    }
+
+    // Crash before "prepared" with the executable gone: the backup is put back
+    {
+        Install install = fixture(root, "missing");
+        CHECK(crash_after([&]()
+        {
+            string child_error;
+            return ApplyJournal(install.executable.string()).prepare(install.staged.string(), "v2", "digest2", child_error);
+        }));
+        string records = read_file(journal_of(install));
+        write_file(journal_of(install), records.substr(0, records.find('\n') + 1));
+        fs::remove(install.executable);
+        CHECK(ApplyJournal(install.executable.string()).recover(tag, digest) == RecoveryAction::RolledBack);
+        CHECK(read_file(install.executable) == old_contents);
+        CHECK(no_leftovers(install));
+    }
+
+    // A corrupt record counts as missing
+    {
+        Install install = fixture(root, "corrupt");
+        CHECK(crash_after([&]()
+        {
+            string child_error;
+            return ApplyJournal(install.executable.string()).prepare(install.staged.string(), "v2", "digest2", child_error);
+        }));
+        string records = read_file(journal_of(install));
+        records[records.find("prepared")] = 'q';
+        write_file(journal_of(install), records);
+        CHECK(ApplyJournal(install.executable.string()).recover(tag, digest) == RecoveryAction::RolledBack);
+        CHECK(read_file(install.executable) == old_contents);
+    }
+
+    // A journal held by a running apply is left alone, and a second apply is refused
+    {
+        Install install = fixture(root, "running");
+        ApplyJournal running(install.executable.string());
+        CHECK(running.prepare(install.staged.string(), "v2", "digest2", error));
+        CHECK(ApplyJournal(install.executable.string()).recover(tag, digest) == RecoveryAction::None);
+        write_file(root / "running" / "other", new_contents);
+        CHECK(!ApplyJournal(install.executable.string()).install((root / "running" / "other").string(), "v3", "digest3", error));
+        CHECK(running.commit(error));
+        CHECK(read_file(install.executable) == new_contents);
+    }
+
+    // Cancelling a prepared apply keeps the old executable
+    {
+        Install install = fixture(root, "cancel");
+        ApplyJournal journal(install.executable.string());
+        CHECK(journal.prepare(install.staged.string(), "v2", "digest2", error));
+        journal.cancel();
+        CHECK(read_file(install.executable) == old_contents);
+        CHECK(no_leftovers(install));
+        CHECK(ApplyJournal(install.executable.string()).recover(tag, digest) == RecoveryAction::None);
+    }
+
+    // Commit at exit: the rename happens when the process exits normally
+    {
+        Install install = fixture(root, "exit");
+        CHECK(crash_after([&]()
+        {
+            string child_error;
+            auto journal = make_unique<ApplyJournal>(install.executable.string());
+            if (!journal->prepare(install.staged.string(), "v2", "digest2", child_error))
+            {
+                return false;
+            }
+            ApplyJournal::commit_at_exit(move(journal));
+            exit(0);
+            return true;
+        }));
+        CHECK(read_file(install.executable) == new_contents);
+        CHECK(no_leftovers(install));
+    }
+
+    // A child forked after the commit was registered exits without committing it
+    {
+        Install install = fixture(root, "fork");
+        CHECK(crash_after([&]()
+        {
+            string child_error;
+            auto journal = make_unique<ApplyJournal>(install.executable.string());
+            if (!journal->prepare(install.staged.string(), "v2", "digest2", child_error))
+            {
+                return false;
+            }
+            ApplyJournal::commit_at_exit(move(journal));
+            bool untouched = crash_after([]()
+            {
+                exit(0);
+                return true;
+            }) && read_file(install.executable) == old_contents;
+            exit(untouched ? 0 : 1);
+            return true;
+        }));
+        CHECK(read_file(install.executable) == new_contents);
+        CHECK(no_leftovers(install));
+    }
+
+    return finish_checks("apply_journal_test");
+}
@@ -0,0 +1,234 @@
+/*
+ * archive_extract_test - Extracting release archives into a staging tree
+ *
+ * Builds tar archives in memory and streams them through the extractor in
+ * small pieces. A normal archive (files, directories, symlinks, hard links,
+ * files unchanged from the installed tree) must come out complete; archives
+ * that try to write outside the staging tree must fail without touching
+ * anything outside it, including the chained symlink escape
+ * a/l -> .., b/m -> ../a/l/.., b/m/file. Extended headers too large to hold
+ * in memory are refused before their data is read.
+ */
+
+#include "tests/Check.cpp"
+#include "includes/ArchiveStream.cpp"
+
+#include <sys/stat.h>
+
+
+struct TarEntry
+{
+    string name;
+    char type = '0';
+    string data;
+    string link;
+    mode_t mode = 0644;
+    int64_t size = -1;          // Size in the header, -1 for the size of data
+};
+
+static void tar_field(string& header, size_t at, size_t length, uint64_t value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%0*llo", static_cast<int>(length - 1), static_cast<unsigned long long>(value));
+    header.replace(at, length - 1, text);
+}
+
+static string tar_archive(const vector<TarEntry>& entries)
+{
+    string archive;
+    for (const TarEntry& entry : entries)
+    {
+        string header(512, '\0');
+        header.replace(0, entry.name.size(), entry.name);
+        tar_field(header, 100, 8, entry.mode);
+        tar_field(header, 108, 8, 0);
+        tar_field(header, 116, 8, 0);
+        tar_field(header, 124, 12, entry.size < 0 ? entry.data.size() : static_cast<uint64_t>(entry.size));
+        tar_field(header, 136, 12, 0);
+        header[156] = entry.type;
+        header.replace(157, entry.link.size(), entry.link);
+        header.replace(257, 6, string("ustar\0", 6));
+        header.replace(263, 2, "00");
+        header.replace(148, 8, "        ");
+        unsigned sum = 0;
+        for (char c : header)
+        {
+            sum += static_cast<unsigned char>(c);
+        }
+        char checksum[8];
+        snprintf(checksum, sizeof(checksum), "%06o", sum);
+        header.replace(148, 7, string(checksum, 6) + '\0');
+        archive += header + entry.data + string((512 - entry.data.size() % 512) % 512, '\0');
+    }
+    return archive + string(1024, '\0');
+}
+
+static string gzip(const string& data)
+{
+    z_stream stream = {};
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    string out(deflateBound(&stream, data.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+    deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+}
+
+// Streams archive through an extractor in small pieces. Returns false and sets error if it failed
+static bool extract(const string& archive, const fs::path& staging, const fs::path& installed, string& error,
+    ArchiveFormat format = ArchiveFormat::Tar)
+{
+    fs::create_directories(staging);
+    ArchiveExtractor extractor(format, staging.string(), installed.string());
+    bool ok = true;
+    for (size_t at = 0; ok && at < archive.size(); at += 100)
+    {
+        ok = extractor.feed(archive.data() + at, min<size_t>(100, archive.size() - at));
+    }
+    ok = ok && extractor.finish();
+    error = extractor.error();
+    return ok;
+}
+
+static mode_t mode_of(const fs::path& path)
+{
+    struct stat info;
+    return lstat(path.c_str(), &info) == 0 ? (info.st_mode & 07777) : 0;
+}
+
+static bool empty_directory(const fs::path& path)
+{
+    return fs::is_directory(path) && fs::is_empty(path);
+}
+
+int main()
+{
+    fs::path root = scratch_directory("archive_extract_test");
+    string error;
+
+    // A normal archive, compared with an installed tree
+    {
+        fs::path installed = root / "normal" / "installed";
+        fs::path staging = root / "normal" / "staging";
+        write_file(installed / "same.txt", "unchanged");
+        write_file(installed / "mode.txt", "only the mode changes");
+        chmod((installed / "same.txt").c_str(), 0644);
+        chmod((installed / "mode.txt").c_str(), 0644);
+        string archive = tar_archive({
+            { "bin/", '5', "", "", 0755 },
+            { "bin/app", '0', "#!/bin/sh\necho new\n", "", 0755 },
+            { "lib/libengine.so.1", '0', "library", "", 0644 },
+            { "lib/libengine.so", '2', "", "libengine.so.1", 0777 },
+            { "same.txt", '0', "unchanged", "", 0644 },
+            { "alias.txt", '1', "", "same.txt", 0644 },
+            { "mode.txt", '0', "only the mode changes", "", 0600 },
+            { "./data/./nested/file", '0', "nested", "", 0644 },
+        });
+        CHECK(extract(archive, staging, installed, error));
+        CHECK(error.empty());
+        CHECK(read_file(staging / "bin" / "app") == "#!/bin/sh\necho new\n");
+        CHECK(mode_of(staging / "bin" / "app") == 0755);
+        CHECK(fs::is_symlink(staging / "lib" / "libengine.so"));
+        CHECK(fs::read_symlink(staging / "lib" / "libengine.so") == "libengine.so.1");
+        CHECK(read_file(staging / "lib" / "libengine.so") == "library");
+        CHECK(read_file(staging / "alias.txt") == "unchanged");
+        CHECK(read_file(staging / "mode.txt") == "only the mode changes");
+        CHECK(mode_of(staging / "mode.txt") == 0600);
+        CHECK(read_file(staging / "data" / "nested" / "file") == "nested");
+    }
+
+    // The same archive gzipped
+    {
+        string archive = gzip(tar_archive({ { "dir/file", '0', "compressed", "", 0644 } }));
+        fs::path staging = root / "gzip" / "staging";
+        CHECK(extract(archive, staging, "", error, ArchiveFormat::TarGzip));
+        CHECK(read_file(staging / "dir" / "file") == "compressed");
+    }
+
+    // Chained symlinks that climb out of the tree one step at a time
+    {
+        fs::path staging = root / "chain" / "staging";
+        string archive = tar_archive({
+            { "a/", '5', "", "", 0755 },
+            { "a/l", '2', "", "..", 0777 },
+            { "b/", '5', "", "", 0755 },
+            { "b/m", '2', "", "../a/l/..", 0777 },
+            { "b/m/file", '0', "escaped", "", 0644 },
+        });
+        CHECK(!extract(archive, staging, "", error));
+        CHECK(error.find("unsafe symlink target") != string::npos);
+        CHECK(!fs::exists(root / "chain" / "file"));
+        CHECK(!fs::exists(root / "file"));
+    }
+
+    // Entries below a symlink from the archive, even one that stays inside the tree
+    {
+        fs::path staging = root / "through" / "staging";
+        string archive = tar_archive({
+            { "real/", '5', "", "", 0755 },
+            { "l", '2', "", "real", 0777 },
+            { "l/file", '0', "via the link", "", 0644 },
+        });
+        CHECK(!extract(archive, staging, "", error));
+        CHECK(error.find("goes through a symlink") != string::npos);
+        CHECK(empty_directory(staging / "real"));
+    }
+    {
+        fs::path staging = root / "through_dir" / "staging";
+        string archive = tar_archive({
+            { "l", '2', "", "real", 0777 },
+            { "l/", '5', "", "", 0700 },
+        });
+        CHECK(!extract(archive, staging, "", error));
+        CHECK(error.find("goes through a symlink") != string::npos);
+    }
+
+    // A symlink already on disk is never followed
+    {
+        fs::path staging = root / "planted" / "staging";
+        fs::path outside = root / "planted" / "outside";
+        fs::create_directories(staging);
+        fs::create_directories(outside);
+        fs::create_directory_symlink(outside, staging / "x");
+        CHECK(!extract(tar_archive({ { "x/file", '0', "escaped", "", 0644 } }), staging, "", error));
+        CHECK(!extract(tar_archive({ { "x/", '5', "", "", 0777 } }), staging, "", error));
+        CHECK(empty_directory(outside));
+        CHECK(mode_of(outside) != 0777);
+    }
+
+    // An extended header whose size would be held in memory is refused before its data
+    {
+        fs::path staging = root / "oversized" / "staging";
+        for (char type : { 'x', 'L', 'K' })
+        {
+            string archive = tar_archive({ { "././@LongLink", type, string(600, 'a'), "", 0644, int64_t(1) << 32 },
+                { "file", '0', "data", "", 0644 } });
+            CHECK(!extract(archive, staging, "", error));
+            CHECK(error.find("oversized tar extended header") != string::npos);
+        }
+    }
+
+    // Names and link targets that leave the tree
+    const vector<vector<TarEntry>> escapes = {
+        { { "../evil", '0', "escaped", "", 0644 } },
+        { { "dir/../../evil", '0', "escaped", "", 0644 } },
+        { { "/tmp/evil", '0', "escaped", "", 0644 } },
+        { { "abs", '2', "", "/etc", 0777 } },
+        { { "up", '2', "", "dir/../..", 0777 } },
+        { { "sub/up", '2', "", "../sibling", 0777 } },
+        { { "hard", '1', "", "../../evil", 0644 } },
+    };
+    for (size_t i = 0; i < escapes.size(); i++)
+    {
+        fs::path staging = root / ("escape" + to_string(i)) / "staging";
+        CHECK(!extract(tar_archive(escapes[i]), staging, "", error));
+        CHECK(error.find("unsafe") != string::npos);
+        CHECK(!fs::exists(root / ("escape" + to_string(i)) / "evil"));
+    }
+
+    return finish_checks("archive_extract_test");
+}
@@ -0,0 +1,131 @@
+/*
+ * elf_validator_test - The ELF checks against real and forged headers
+ *
+ * A real executable (this test) is accepted. Headers whose offsets and sizes
+ * would wrap around or ask for huge buffers are rejected or skipped without
+ * reading out of bounds, and an exception thrown by a validator becomes a
+ * rejection instead of escaping through the curl write callback.
+ */
+
+#include "tests/Check.cpp"
+#include "includes/AutoUpdater.cpp"
+
+
+// Writes value into image at offset, little endian
+static void put(string& image, size_t at, uint64_t value, size_t bytes)
+{
+    if (image.size() < at + bytes)
+    {
+        image.resize(at + bytes, '\0');
+    }
+    for (size_t i = 0; i < bytes; i++)
+    {
+        image[at + i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+// 64 bit ELF header with the identity of this executable and room for count program headers at 64
+static string elf_header(size_t count)
+{
+    string image = read_file("/proc/self/exe").substr(0, 20);
+    image.resize(64 + 56 * count, '\0');
+    put(image, 32, 64, 8);          // e_phoff
+    put(image, 52, 64, 2);          // e_ehsize
+    put(image, 54, 56, 2);          // e_phentsize
+    put(image, 56, count, 2);       // e_phnum
+    return image;
+}
+
+static void program_header(string& image, size_t index, uint32_t type, uint64_t offset, uint64_t vaddr, uint64_t filesz)
+{
+    size_t at = 64 + 56 * index;
+    put(image, at, type, 4);
+    put(image, at + 8, offset, 8);
+    put(image, at + 16, vaddr, 8);
+    put(image, at + 32, filesz, 8);
+}
+
+// Runs the ELF validator over image as one transfer. Returns the rejection, empty if accepted
+static string verdict(const string& image)
+{
+    ContentSniffer sniffer({ elf_validator() });
+    if (sniffer.feed(image.data(), image.size()) && sniffer.finish())
+    {
+        return "";
+    }
+    return sniffer.rejection().empty() ? "rejected without a reason" : sniffer.rejection();
+}
+
+int main()
+{
+    ElfImage::Identity host;
+    CHECK(ElfImage::identify_file("/proc/self/exe", host));
+    if (host.elf_class != 2 || host.byte_order != 1)
+    {
+        printf("elf_validator_test: forged headers are 64 bit little endian, skipped on this host\n");
+        return 0;
+    }
+
+    // The running executable passes every check
+    ContentSniffer real({ elf_validator() });
+    CHECK(real.check_file("/proc/self/exe"));
+
+    // A program header table far past the end of the file
+    string image = elf_header(1);
+    put(image, 32, UINT64_MAX - 16, 8);
+    CHECK(verdict(image).find("malformed ELF header") != string::npos);
+
+    // An interpreter whose offset plus size wraps around to a small number
+    image = elf_header(1);
+    program_header(image, 0, ElfImage::pt_interp, UINT64_MAX - 10, 0, 20);
+    CHECK(verdict(image).empty());
+
+    // A dynamic section the size of which would be the allocation
+    image = elf_header(1);
+    program_header(image, 0, ElfImage::pt_dynamic, 64, 0, uint64_t(1) << 62);
+    CHECK(verdict(image).find("malformed dynamic section") != string::npos);
+
+    // A dynamic section whose end wraps around
+    image = elf_header(1);
+    program_header(image, 0, ElfImage::pt_dynamic, UINT64_MAX - 8, 0, 32);
+    CHECK(verdict(image).find("malformed dynamic section") != string::npos);
+
+    // A string table whose size wraps around: the library check is skipped, nothing is read
+    image = elf_header(2);
+    size_t dynamic = image.size();
+    program_header(image, 0, ElfImage::pt_load, 0, 0, 4096);
+    program_header(image, 1, ElfImage::pt_dynamic, dynamic, dynamic, 64);
+    put(image, dynamic, ElfImage::dt_needed, 8);
+    put(image, dynamic + 8, 0, 8);
+    put(image, dynamic + 16, ElfImage::dt_strtab, 8);
+    put(image, dynamic + 24, 16, 8);
+    put(image, dynamic + 32, ElfImage::dt_strsz, 8);
+    put(image, dynamic + 40, UINT64_MAX - 8, 8);
+    put(image, dynamic + 48, ElfImage::dt_null, 8);
+    put(image, dynamic + 56, 0, 8);
+    CHECK(verdict(image).empty());
+
+    // A validator that throws rejects the file, and the write callback aborts the transfer
+    ContentValidator throwing;
+    throwing.name = "throwing";
+    throwing.inspect = [](const ContentChunk&, string&) -> Verdict
+    {
+        throw out_of_range("forged offset");
+    };
+    ContentSniffer sniffer({ throwing });
+    CHECK(!sniffer.feed("data", 4));
+    CHECK(sniffer.rejection().find("forged offset") != string::npos);
+
+    fs::path root = scratch_directory("elf_validator_test");
+    sniffer.reset();
+    DownloadSink sink;
+    sink.fp = fopen((root / "download").c_str(), "wb");
+    sink.curl = curl_easy_init();
+    sink.sniffer = &sniffer;
+    char data[] = "data";
+    CHECK(DownloadCallback(data, 1, 4, &sink) == 0);
+    curl_easy_cleanup(sink.curl);
+    fclose(sink.fp);
+
+    return finish_checks("elf_validator_test");
+}
@@ -0,0 +1,175 @@
+/*
+ * peer_cache_test - A LAN peer group formed by several processes on one machine
+ *
+ * A seed process publishes an asset; client processes started at the same
+ * time find it through the shared discovery directory and fetch it. Also
+ * checks that a peer sending the wrong bytes is rejected, and that a client
+ * hanging up mid-transfer neither kills the seed nor changes the host
+ * process's SIGPIPE disposition.
+ */
+
+#include "tests/Check.cpp"
+#include "includes/PeerCache.cpp"
+
+#include <csignal>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+static const int client_count = 3;
+
+// Starts a serving peer in a child process that runs until `stop` is closed. Returns its port
+static uint16_t spawn_peer(const fs::path& store, const fs::path& discovery, const fs::path& publish,
+    const string& digest, pid_t& pid, int& stop)
+{
+    int ready[2];
+    int hold[2];
+    if (pipe(ready) != 0 || pipe(hold) != 0)
+    {
+        return 0;
+    }
+    pid = fork();
+    if (pid == 0)
+    {
+        close(ready[0]);
+        close(hold[1]);
+        PeerCache peer(store.string(), 0, false);
+        peer.set_discovery_dir(discovery.string());
+        peer.set_advertise_host("127.0.0.1");
+        uint16_t port = 0;
+        if (peer.start() && (publish.empty() || peer.publish(publish.string(), digest)))
+        {
+            port = peer.port();
+        }
+        if (write(ready[1], &port, sizeof(port)) != sizeof(port) || port == 0)
+        {
+            _exit(2);
+        }
+        char byte;
+        while (read(hold[0], &byte, 1) > 0)
+        {
+        }
+        peer.stop();
+        _exit(0);
+    }
+    close(ready[1]);
+    close(hold[0]);
+    uint16_t port = 0;
+    if (read(ready[0], &port, sizeof(port)) != sizeof(port))
+    {
+        port = 0;
+    }
+    close(ready[0]);
+    stop = hold[1];
+    return port;
+}
+
+// Requests the asset and closes the connection after the first bytes
+static bool hang_up_mid_transfer(uint16_t port, const string& digest)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    string request = "GET /sha256/" + digest + " HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n";
+    bool sent = send(fd, request.data(), request.size(), 0) == static_cast<ssize_t>(request.size());
+    char buffer[1024];
+    bool received = recv(fd, buffer, sizeof(buffer), 0) > 0;
+    // Unread data makes the close a reset, so the seed's next write fails with EPIPE
+    close(fd);
+    return sent && received;
+}
+
+static bool exited_cleanly(pid_t pid)
+{
+    int status = 0;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main()
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    fs::path root = scratch_directory("peer_cache_test");
+
+    // 16MB, so the seed is still inside sendfile() when a client hangs up
+    string asset(16 * 1024 * 1024, '\0');
+    for (size_t i = 0; i < asset.size(); i++)
+    {
+        asset[i] = static_cast<char>((i * 2654435761u) >> 13);
+    }
+    write_file(root / "asset", asset);
+    string digest = sha256_file((root / "asset").string());
+
+    pid_t seed_pid;
+    int seed_stop;
+    uint16_t seed_port = spawn_peer(root / "seed", root / "peers", root / "asset", digest, seed_pid, seed_stop);
+    CHECK(seed_port != 0);
+
+    // Serving in this process must not touch its signal dispositions
+    {
+        PeerCache local((root / "local").string(), 0, false);
+        CHECK(local.start());
+        struct sigaction current;
+        CHECK(sigaction(SIGPIPE, nullptr, &current) == 0 && current.sa_handler == SIG_DFL);
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        CHECK(hang_up_mid_transfer(seed_port, digest));
+    }
+
+    // Clients started together all get the asset through discovery
+    vector<pid_t> clients;
+    for (int i = 0; i < client_count; i++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            PeerCache client((root / ("client" + to_string(i))).string(), 0, false);
+            client.set_discovery_dir((root / "peers").string());
+            client.set_advertise_host("127.0.0.1");
+            fs::path destination = root / ("fetched" + to_string(i));
+            bool ok = client.start() && client.fetch(digest, destination.string()) &&
+                read_file(destination) == asset && client.has(digest);
+            client.stop();
+            _exit(ok ? 0 : 1);
+        }
+        clients.push_back(pid);
+    }
+    for (pid_t pid : clients)
+    {
+        CHECK(exited_cleanly(pid));
+    }
+
+    // A peer whose store holds other bytes under the digest is rejected
+    write_file(root / "liar" / digest, "not the asset");
+    pid_t liar_pid;
+    int liar_stop;
+    uint16_t liar_port = spawn_peer(root / "liar", root / "liar_peers", "", digest, liar_pid, liar_stop);
+    CHECK(liar_port != 0);
+    {
+        PeerCache victim((root / "victim").string(), 0, false);
+        victim.add_peer("127.0.0.1:" + to_string(liar_port));
+        fs::path destination = root / "victim_download";
+        CHECK(!victim.fetch(digest, destination.string()));
+        CHECK(!fs::exists(destination));
+        CHECK(!victim.has(digest));
+    }
+    close(liar_stop);
+    CHECK(exited_cleanly(liar_pid));
+
+    // The seed survived the clients that hung up
+    close(seed_stop);
+    CHECK(exited_cleanly(seed_pid));
+
+    curl_global_cleanup();
+    return finish_checks("peer_cache_test");
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Builds and runs every behavior test. Run from anywhere; extra arguments go to the compiler.
+# Needs the same libraries as the updater (libcurl, jsoncpp, libcrypto, zlib).
+
+cd "$(dirname "$0")/.." || exit 1
+build_dir="${BUILD_DIR:-${TMPDIR:-/tmp}/autoupdater_tests}"
+mkdir -p "$build_dir"
+
+flags="-std=c++17 -O1 -g -Wall -I. $(pkg-config --cflags jsoncpp 2>/dev/null)"
+libs="$(pkg-config --libs libcurl jsoncpp libcrypto zlib 2>/dev/null || echo -lcurl -ljsoncpp -lcrypto -lz) -pthread -ldl"
+
+failed=0
+for source in tests/*_test.cpp; do
+    name=$(basename "$source" .cpp)
+    if ! ${CXX:-g++} $flags "$@" "$source" -o "$build_dir/$name" $libs; then
+        echo "$name: build failed"
+        failed=1
+        continue
+    fi
+    if ! "$build_dir/$name"; then
+        failed=1
+    fi
+done
+exit $failed